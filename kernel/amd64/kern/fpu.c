@@ -0,0 +1,236 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file fpu.c
+ * @brief FPU/SIMD state management.
+ *
+ * User threads' extended state is kept in an area hanging off the PCB, sized
+ * at boot for the state components we enable in XCR0 (x87, SSE, and AVX and
+ * AVX-512 where present.) Without XSAVE we fall back to FXSAVE's 512 bytes.
+ *
+ * State is saved whenever a user thread is switched out. With XSAVEOPT that's
+ * cheap if the thread hasn't touched a component since it was restored,
+ * since the CPU skips unmodified components. Restoring is lazy: each CPU
+ * remembers whose state its registers hold, and a thread switched back in on
+ * the CPU it last ran on, with no other user thread having run there in
+ * between, finds its state still loaded. The kernel doesn't use the FPU, so
+ * kernel threads running in between don't disturb it.
+ */
+
+#include <sys/k_cpu.h>
+#include <sys/k_intr.h>
+#include <sys/k_log.h>
+#include <sys/k_thread.h>
+#include <sys/kmem.h>
+#include <sys/libkern.h>
+#include <sys/pcb.h>
+#include <sys/x86.h>
+
+#include <inttypes.h>
+
+enum fpu_mode {
+	kFPUFxsave,
+	kFPUXsave,
+	kFPUXsaveopt,
+};
+
+enum {
+	XCR0_X87 = 1 << 0,
+	XCR0_SSE = 1 << 1,
+	XCR0_AVX = 1 << 2,
+	XCR0_OPMASK = 1 << 5,
+	XCR0_ZMM_HI256 = 1 << 6,
+	XCR0_HI16_ZMM = 1 << 7,
+	XCR0_AVX512 = XCR0_OPMASK | XCR0_ZMM_HI256 | XCR0_HI16_ZMM,
+};
+
+#define CPUID_1_ECX_XSAVE (1 << 26)
+#define CPUID_D_1_EAX_XSAVEOPT (1 << 0)
+#define CR4_OSXSAVE (1 << 18)
+
+#define FXSAVE_SIZE 512
+#define XSAVE_HEADER_SIZE 64
+
+static enum fpu_mode fpu_mode = kFPUFxsave;
+static uint64_t fpu_xcr0;
+static size_t fpu_area_size = FXSAVE_SIZE;
+
+/*!
+ * @brief Work out which state components to enable and how big the save
+ * area must be. Called once, on the BSP, before any threads are created.
+ */
+void
+fpu_early_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if ((ecx & CPUID_1_ECX_XSAVE) == 0) {
+		kdprintf("fpu: FXSAVE, %zu byte areas\n", fpu_area_size);
+		return;
+	}
+
+	cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+	fpu_xcr0 = eax & (XCR0_X87 | XCR0_SSE | XCR0_AVX | XCR0_AVX512);
+	/* AVX-512 components are all or nothing, and depend on AVX */
+	if ((fpu_xcr0 & XCR0_AVX512) != XCR0_AVX512 ||
+	    (fpu_xcr0 & XCR0_AVX) == 0)
+		fpu_xcr0 &= ~(uint64_t)XCR0_AVX512;
+
+	/* standard format: each component at a fixed offset */
+	fpu_area_size = FXSAVE_SIZE + XSAVE_HEADER_SIZE;
+	for (unsigned int i = 2; i < 64; i++) {
+		if ((fpu_xcr0 & ((uint64_t)1 << i)) == 0)
+			continue;
+		cpuid(0xd, i, &eax, &ebx, &ecx, &edx);
+		fpu_area_size = MAX2(fpu_area_size, (size_t)ebx + eax);
+	}
+
+	cpuid(0xd, 1, &eax, &ebx, &ecx, &edx);
+	fpu_mode = (eax & CPUID_D_1_EAX_XSAVEOPT) ? kFPUXsaveopt : kFPUXsave;
+
+	kdprintf("fpu: %s, XCR0 0x%" PRIx64 ", %zu byte areas\n",
+	    fpu_mode == kFPUXsaveopt ? "XSAVEOPT" : "XSAVE", fpu_xcr0,
+	    fpu_area_size);
+}
+
+/*!
+ * @brief Enable XSAVE and the chosen state components on the current CPU.
+ */
+void
+fpu_cpu_init(void)
+{
+	CPU_LOCAL_STORE(arch.fpu_owner, NULL);
+
+	if (fpu_mode == kFPUFxsave)
+		return;
+
+	write_cr4(read_cr4() | CR4_OSXSAVE);
+	asm volatile("xsetbv"
+		     :
+		     : "c"(0), "a"((uint32_t)fpu_xcr0),
+		     "d"((uint32_t)(fpu_xcr0 >> 32)));
+}
+
+/*!
+ * @brief Allocate a thread's save area, set to the initial FPU state.
+ *
+ * kmem_alloc() aligns allocations of this size to at least 64 bytes, as
+ * XSAVE requires.
+ */
+uint8_t *
+fpu_area_alloc(void)
+{
+	uint8_t *area = kmem_xzalloc(fpu_area_size, VM_SLEEP);
+
+	kassert(((uintptr_t)area & 63) == 0);
+
+	/*
+	 * FCW and MXCSR. The XSAVE header is left zeroed, so XRSTOR puts all
+	 * components in their initial state, but MXCSR is always loaded.
+	 */
+	*(uint16_t *)(area + 0) = 0x037f;
+	*(uint32_t *)(area + 24) = 0x1f80;
+
+	return area;
+}
+
+static void
+area_save(uint8_t *area, bool opt)
+{
+	switch (fpu_mode) {
+	case kFPUFxsave:
+		asm volatile("fxsave %0" : "+m"(*area) : : "memory");
+		break;
+
+	case kFPUXsaveopt:
+		if (opt) {
+			asm volatile("xsaveopt64 %0"
+				     : "+m"(*area)
+				     : "a"(UINT32_MAX), "d"(UINT32_MAX)
+				     : "memory");
+			break;
+		}
+		/* fall through */
+	case kFPUXsave:
+		asm volatile("xsave64 %0"
+			     : "+m"(*area)
+			     : "a"(UINT32_MAX), "d"(UINT32_MAX)
+			     : "memory");
+		break;
+	}
+}
+
+static void
+area_restore(uint8_t *area)
+{
+	if (fpu_mode == kFPUFxsave)
+		asm volatile("fxrstor %0" : : "m"(*area) : "memory");
+	else
+		asm volatile("xrstor64 %0"
+			     :
+			     : "m"(*area), "a"(UINT32_MAX), "d"(UINT32_MAX)
+			     : "memory");
+}
+
+/*!
+ * @brief Save a user thread's state on switching it out.
+ *
+ * The registers still hold that state afterwards. The thread is usually the
+ * owner already, but not if it became a user thread while running.
+ */
+void
+fpu_save(kthread_t *thread)
+{
+	area_save(thread->pcb.fpu, true);
+	thread->pcb.fpu_cpu = CPU_LOCAL_LOAD(cpu_num);
+	CPU_LOCAL_STORE(arch.fpu_owner, thread);
+}
+
+/*!
+ * @brief Load a user thread's state on switching it in, unless it's still
+ * loaded.
+ */
+void
+fpu_restore(kthread_t *thread)
+{
+	kcpunum_t self = CPU_LOCAL_LOAD(cpu_num);
+
+	if (CPU_LOCAL_LOAD(arch.fpu_owner) == thread &&
+	    thread->pcb.fpu_cpu == self) {
+		CPU_LOCAL_STORE(arch.fpu_restores_avoided,
+		    CPU_LOCAL_LOAD(arch.fpu_restores_avoided) + 1);
+		return;
+	}
+
+	area_restore(thread->pcb.fpu);
+	thread->pcb.fpu_cpu = self;
+	CPU_LOCAL_STORE(arch.fpu_owner, thread);
+	CPU_LOCAL_STORE(arch.fpu_restores, CPU_LOCAL_LOAD(arch.fpu_restores) +
+	    1);
+}
+
+/*!
+ * @brief Copy the current thread's state into another thread's area.
+ */
+void
+fpu_copy(kthread_t *dst)
+{
+	/* not XSAVEOPT: its optimisation assumes the area is our own */
+	area_save(dst->pcb.fpu, false);
+	dst->pcb.fpu_cpu = KCPUNUM_NULL;
+}
+
+void
+dbg_fpu_dump(void)
+{
+	for (size_t i = 0; i < ke_ncpu; i++) {
+		struct karch_cpu_data *arch = &ke_cpu_data[i]->arch;
+
+		kdprintf("cpu %zu: %" PRIu64 " FPU restores, %" PRIu64
+			 " avoided\n",
+		    i, arch->fpu_restores, arch->fpu_restores_avoided);
+	}
+}
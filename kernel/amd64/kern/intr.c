@@ -278,17 +278,10 @@ ke_amd64_idt_alloc(struct kirq_source *source, kirq_t *entry,
 void kep_amd64_asm_switch(struct karch_pcb *old, struct karch_pcb *new);
 void kep_amd64_asm_thread_trampoline(void);
 
-void
-fxsave(uint8_t *state)
-{
-	asm volatile("fxsave %0" : "+m"(*state) : : "memory");
-}
-
-void
-fxrstor(uint8_t *state)
-{
-	asm volatile("fxrstor %0" : : "m"(*state) : "memory");
-}
+/* fpu.c */
+uint8_t *fpu_area_alloc(void);
+void fpu_save(kthread_t *thread);
+void fpu_restore(kthread_t *thread);
 
 void
 kep_arch_switch(struct kthread *old, struct kthread *next)
@@ -297,9 +290,9 @@ kep_arch_switch(struct kthread *old, struct kthread *next)
 	CPU_LOCAL_LOAD(arch.tss)->rsp0 = (uintptr_t)next->kstack_base +
 	    KSTACK_SIZE;
 	if (old->user)
-		fxsave(old->pcb.fpu);
+		fpu_save(old);
 	if (next->user)
-		fxrstor(next->pcb.fpu);
+		fpu_restore(next);
 	kep_amd64_asm_switch(&old->pcb, &next->pcb);
 }
 
@@ -310,6 +303,8 @@ kep_arch_thread_init(kthread_t *thread, void *stack_base,
 	uint64_t *sp;
 
 	memset(&thread->pcb, 0x0, sizeof(thread->pcb));
+	thread->pcb.fpu = fpu_area_alloc();
+	thread->pcb.fpu_cpu = KCPUNUM_NULL;
 
 	if (forkframe == NULL) {
 		sp = thread->kstack_base + KSTACK_SIZE;
@@ -5,6 +5,11 @@
 /*!
  * @file lapic.c
  * @brief Local APIC functionality.
+ *
+ * The timer runs one-shot, driven by the tickless clock (see kern/clock.c.)
+ * Where the CPU supports it we use TSC-deadline mode, which takes an absolute
+ * TSC value and so needs no conversion to LAPIC ticks nor any worry about the
+ * 32-bit count running out.
  */
 
 #include <sys/k_cpu.h>
@@ -33,8 +38,18 @@ enum {
 	kLAPICTimerTSCDeadline = 0x40000,
 };
 
+#define IA32_TSC_DEADLINE_MSR 0x6e0
+
+void kep_clock_start_tickless(void);
+void pmap_cpu_init(void);
+
+/* fpu.c */
+void fpu_early_init(void);
+void fpu_cpu_init(void);
+
 uint64_t timebase;
 vaddr_t lapic_vbase;
+static bool lapic_tsc_deadline;
 
 void
 ke_arch_pause(void)
@@ -93,6 +108,7 @@ void
 lapic_early_init(void)
 {
 	uint64_t tsc_start, tsc_end;
+	uint32_t eax, ebx, ecx, edx;
 
 	pit_init_oneshot(25);
 	tsc_start = __builtin_ia32_rdtsc();
@@ -102,6 +118,8 @@ lapic_early_init(void)
 	timebase = ((tsc_end - tsc_start) * 25);
 
 	lapic_vbase = p2v(rdmsr(IA32_APIC_BASE_MSR) & 0xfffff000);
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	lapic_tsc_deadline = (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
 }
 
 uint32_t
@@ -144,15 +162,62 @@ lapic_eoi(void)
 void
 lapic_timer_start(void)
 {
-	lapic_write(LAPIC_REG_TIMER, kLAPICTimerPeriodic | 224);
+	if (lapic_tsc_deadline) {
+		lapic_write(LAPIC_REG_TIMER, kLAPICTimerTSCDeadline | 224);
+		/* SDM: order the LVT write before any TSC_DEADLINE write */
+		asm volatile("mfence" ::: "memory");
+	} else {
+		lapic_write(LAPIC_REG_TIMER, 224);
+	}
+
+	kep_clock_start_tickless();
+}
+
+static uint64_t
+ns_to_tsc(kabstime_t ns)
+{
+	return (ns / NS_PER_S) * timebase +
+	    (ns % NS_PER_S) * timebase / NS_PER_S;
+}
+
+/*!
+ * @brief Program the timer to interrupt at \p deadline, or never if
+ * ABSTIME_NEVER. Called with interrupts disabled.
+ */
+void
+kep_arch_timer_oneshot(kabstime_t deadline)
+{
+	kabstime_t now, delta;
+	uint64_t count;
+
+	if (lapic_tsc_deadline) {
+		/* a deadline already past fires at once; 0 disarms */
+		wrmsr(IA32_TSC_DEADLINE_MSR, deadline == ABSTIME_NEVER ?
+		    0 : MAX2(ns_to_tsc(deadline), 1));
+		return;
+	}
+
+	if (deadline == ABSTIME_NEVER) {
+		lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+		return;
+	}
+
+	/*
+	 * The count is only 32 bits, so far-off deadlines are cut to a second;
+	 * the clock will just reprogram us when that elapses.
+	 */
+	now = ke_time();
+	delta = deadline > now ? MIN2(deadline - now, NS_PER_S) : 0;
+	count = delta * CPU_LOCAL_LOAD(arch.lapic_tps) / NS_PER_S;
 	lapic_write(LAPIC_REG_TIMER_INITIAL,
-	    CPU_LOCAL_LOAD(arch.lapic_tps) / KERN_HZ);
+	    (uint32_t)MIN2(MAX2(count, 1), UINT32_MAX));
 }
 
 void
 ke_platform_early_init(void)
 {
 	lapic_early_init();
+	fpu_early_init();
 }
 
 
@@ -242,6 +307,8 @@ ke_platform_start_dispatching(void)
 	cr4 |= (uint64_t)3 << 9;
 	write_cr4(cr4);
 
+	pmap_cpu_init();
+	fpu_cpu_init();
 	setup_cpu_gdt();
 	lapic_cpu_init();
 
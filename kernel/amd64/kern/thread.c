@@ -15,8 +15,8 @@
 #include <sys/pcb.h>
 #include <sys/x86.h>
 
-void fxsave(uint8_t *state);
-void fxrstor(uint8_t *state);
+/* fpu.c */
+void fpu_copy(kthread_t *dst);
 
 void
 kep_arch_set_tp(void *addr)
@@ -62,8 +62,6 @@ void
 ke_thread_copy_fpu_state(kthread_t *dst)
 {
 	ipl_t ipl = spldisp();
-	fxsave(dst->pcb.fpu);
-	(*(uint16_t *)(dst->pcb.fpu + 0)) = 0x037f;
-	(*(uint32_t *)(dst->pcb.fpu + 24)) = 0x1f80;
+	fpu_copy(dst);
 	splx(ipl);
 }
@@ -10,6 +10,7 @@
 #ifndef ECX_AMD64_KERN_CPULOCAL_H
 #define ECX_AMD64_KERN_CPULOCAL_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <libkern/queue.h>
@@ -19,11 +20,30 @@ struct kirq;
 
 LIST_HEAD(kirq_list, kirq);
 
+/* PCIDs 1 to PCID_SLOTS are handed out per CPU; see vm/pmap.c */
+#define PCID_SLOTS 8
+
+struct karch_pcid_slot {
+	uint64_t ctx;		/* vm_map pcid_ctx using this PCID, or 0 */
+	uint64_t tlb_gen;	/* the map's tlb_gen when last flushed */
+};
+
 struct karch_cpu_data {
 	uint32_t lapic_id;
 #define arch_cpu_id lapic_id
 	uint64_t lapic_tps;
 	struct tss *tss;
+
+	bool pcid_enabled;
+	uint8_t pcid_next;	/* next slot to recycle */
+	struct karch_pcid_slot pcid[PCID_SLOTS];
+	uint64_t pcid_hits;	/* switches keeping the TLB */
+	uint64_t pcid_flushes;	/* switches flushing a stale PCID */
+	uint64_t pcid_recycles;	/* switches taking over another map's PCID */
+
+	struct kthread *fpu_owner; /* user thread whose FPU state is loaded */
+	uint64_t fpu_restores;
+	uint64_t fpu_restores_avoided;
 };
 
 #define CPU_LOCAL_OFFSET(FIELD) __builtin_offsetof(struct kcpu_data, FIELD)
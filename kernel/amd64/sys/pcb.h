@@ -14,9 +14,10 @@
 
 typedef struct __attribute__((packed)) karch_pcb {
 	uint64_t rbp, rbx, r12, r13, r14, r15, rdi, rsi, rsp;
-	uint64_t align;
-	uint8_t fpu[512];
-	uintptr_t unused;
+	/* FPU/SIMD save area, sized at boot; see fpu.c */
+	uint8_t *fpu;
+	/* CPU whose registers were last loaded from fpu */
+	uint32_t fpu_cpu;
 } karch_pcb_t;
 
 typedef struct __attribute__((packed)) karch_trapframe {
@@ -22,6 +22,12 @@
 #define PMAP_L1_SKIP 512
 #define PMAP_L0_SKIP 512
 
+/* 2 MiB leaf PTEs in L1 tables; see vm/pmap.c */
+#define PMAP_SUPERPAGE_LEVEL PMAP_L1
+#define PMAP_SUPERPAGE_ORDER 9
+#define PMAP_SUPERPAGE_PAGES (1 << PMAP_SUPERPAGE_ORDER)
+#define PMAP_SUPERPAGE_SIZE PGSIZE_L1
+
 typedef enum pmap_level {
 	PMAP_L0,
 	PMAP_L1,
@@ -178,10 +184,27 @@ pmap_pte_hwleaf_clear_writeable(pte_t *ppte)
 	pmap_store_pte(ppte, pte);
 }
 
+static inline bool
+pmap_pte_hwleaf_accessed(pte_t pte)
+{
+	return pte.hw.accessed;
+}
+
+/* the caller must flush the TLB entry for the CPU to set the bit again */
+static inline void
+pmap_pte_hwleaf_clear_accessed(pte_t *ppte)
+{
+	union pte pte = pmap_load_pte(ppte);
+	pte.hw.accessed = 0;
+	pmap_store_pte(ppte, pte);
+}
+
 static inline paddr_t
 pmap_pte_hwleaf_paddr(pte_t pte, pmap_level_t level)
 {
-	return (level == PMAP_L0 ? pte.hw.pfn : pte.hw_large.pfn) << PGSHIFT;
+	/* the large PFN field starts a bit later, after the PAT bit */
+	return level == PMAP_L0 ? pte.hw.pfn << PGSHIFT :
+	    (paddr_t)pte.hw_large.pfn << (PGSHIFT + 1);
 }
 
 static inline void
@@ -19,6 +19,18 @@ enum {
 	AMD64_FSBASE_MSR = 0xc0000100
 };
 
+enum {
+	CPUID_1_ECX_PCID = 1 << 17,
+	CPUID_1_ECX_TSC_DEADLINE = 1 << 24,
+};
+
+enum {
+	CR4_PGE = 1 << 7,
+	CR4_PCIDE = 1 << 17,
+};
+
+#define CR3_NOFLUSH ((uint64_t)1 << 63)
+
 #define REG_FUNCS(type, regname)				\
 static inline type						\
 read_##regname()						\
@@ -56,5 +68,13 @@ wrmsr(uint32_t msr, uint64_t value)
 	asm volatile("wrmsr" ::"c"(msr), "d"(high), "a"(low));
 }
 
+static inline void
+cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx,
+    uint32_t *ecx, uint32_t *edx)
+{
+	asm volatile("cpuid"
+		     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		     : "a"(leaf), "c"(subleaf));
+}
 
 #endif /* ECX_KEYRONEX_X86_H */
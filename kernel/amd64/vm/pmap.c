@@ -5,19 +5,139 @@
 /*!
  * @file pmap.c
  * @brief Physical mapping for amd64
+ *
+ * Where the CPU supports PCIDs, switching address spaces needn't flush the
+ * TLB. Each CPU has PCID_SLOTS PCIDs, which it hands out to the maps it runs
+ * and recycles round-robin; a slot records the map by its pcid_ctx, which is
+ * never reused, so a freed map's slot can't be mistaken for a new map's.
+ *
+ * A map's TLB entries so outlive its being loaded. Shootdowns only interrupt
+ * the CPUs with the map loaded, and bump the map's tlb_gen; any other CPU
+ * which has cached the map's entries notices when it next loads the map that
+ * the generation moved on, and flushes its PCID then. A recycled PCID is
+ * likewise flushed when loaded for its new map.
+ *
+ * kernel_map has only global (kernel) mappings, so it shares PCID 0.
  */
 
+#include <sys/k_cpu.h>
+#include <sys/k_intr.h>
+#include <sys/k_log.h>
 #include <sys/pmap.h>
 #include <sys/proc.h>
 #include <sys/vm.h>
+#include <sys/x86.h>
 
 #include <libkern/lib.h>
 #include <vm/map.h>
 
+#include <inttypes.h>
+
+static _Atomic(uint64_t) pcid_ctx_next = 1;
+
+uint64_t
+pmap_new_pcid_ctx(void)
+{
+	return atomic_fetch_add_explicit(&pcid_ctx_next, 1,
+	    memory_order_relaxed);
+}
+
+/*!
+ * @brief Enable global pages, and PCIDs if supported, on the current CPU.
+ */
+void
+pmap_cpu_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t cr4 = read_cr4();
+
+	/*
+	 * Kernel mappings must be global when PCIDs are in use, or else
+	 * invlpg would only shoot them down in the current PCID.
+	 */
+	cr4 |= CR4_PGE;
+
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if (ecx & CPUID_1_ECX_PCID) {
+		/* PCIDE may only be set while CR3's PCID is 0 */
+		kassert((read_cr3() & 0xfff) == 0);
+		cr4 |= CR4_PCIDE;
+	}
+
+	write_cr4(cr4);
+
+	memset(CPU_LOCAL_ADDROF(arch.pcid), 0, sizeof(struct karch_pcid_slot) *
+	    PCID_SLOTS);
+	CPU_LOCAL_STORE(arch.pcid_next, 0);
+	CPU_LOCAL_STORE(arch.pcid_enabled, (cr4 & CR4_PCIDE) != 0);
+}
+
 void
 pmap_activate(vm_map_t *map)
 {
-	asm volatile("mov %0, %%cr3" ::"r"(map->pgtable) : "memory");
+	struct karch_cpu_data *arch;
+	uint64_t cr3 = map->pgtable, gen;
+	unsigned int i;
+	bool flush, intx;
+
+	/*
+	 * Not just spldisp(): a shootdown IPI landing between reading tlb_gen
+	 * and loading CR3 would flush the outgoing PCID and leave the stale
+	 * generation recorded against the incoming one.
+	 */
+	intx = ke_arch_disable();
+	arch = CPU_LOCAL_ADDROF(arch);
+
+	if (!arch->pcid_enabled) {
+		write_cr3(cr3);
+		ke_arch_enable(intx);
+		return;
+	}
+
+	if (map->pcid_ctx == 0) {
+		write_cr3(cr3 | CR3_NOFLUSH);
+		ke_arch_enable(intx);
+		return;
+	}
+
+	/* pairs with the shootdown's bump; we're in active_cpus already */
+	gen = atomic_load_explicit(&map->tlb_gen, memory_order_seq_cst);
+
+	for (i = 0; i < PCID_SLOTS; i++)
+		if (arch->pcid[i].ctx == map->pcid_ctx)
+			break;
+
+	if (i == PCID_SLOTS) {
+		i = arch->pcid_next;
+		arch->pcid_next = (i + 1) % PCID_SLOTS;
+		arch->pcid[i].ctx = map->pcid_ctx;
+		arch->pcid_recycles++;
+		flush = true;
+	} else if (arch->pcid[i].tlb_gen != gen) {
+		arch->pcid_flushes++;
+		flush = true;
+	} else {
+		arch->pcid_hits++;
+		flush = false;
+	}
+
+	/* without NOFLUSH, loading CR3 flushes the PCID's entries */
+	arch->pcid[i].tlb_gen = gen;
+	write_cr3(cr3 | (i + 1) | (flush ? 0 : CR3_NOFLUSH));
+	ke_arch_enable(intx);
+}
+
+void
+dbg_pmap_pcid_dump(void)
+{
+	for (size_t i = 0; i < ke_ncpu; i++) {
+		struct karch_cpu_data *arch = &ke_cpu_data[i]->arch;
+
+		kdprintf("cpu %zu: PCIDs %s, %" PRIu64 " hits, %" PRIu64
+			 " flushes, %" PRIu64 " recycles\n",
+		    i, arch->pcid_enabled ? "on" : "off", arch->pcid_hits,
+		    arch->pcid_flushes, arch->pcid_recycles);
+	}
 }
 
 paddr_t
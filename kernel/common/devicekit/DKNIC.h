@@ -24,6 +24,7 @@
 
 @interface DKNIC : DKDevice {
 	uint8_t m_mac_address[ETH_ALEN];
+	uint32_t m_offloads; /* DL_OFFLOAD_*, set before -setupNIC */
 
 	void (*m_put)(void *arg, struct msgb *mp);
 	void *m_data;
@@ -112,6 +112,7 @@ nic_wput_data(void *data, mblk_t *mp)
 	ba->pput = &m_put;
 	ba->nic_data = (void*)self;
 	ba->nic_wput = nic_wput_data;
+	ba->dl_offloads = m_offloads;
 
 	memcpy(&ba->dl_mac, self->m_mac_address, ETH_ALEN);
 	bamp->wptr += sizeof(dl_keyronex_bind_ack_t);
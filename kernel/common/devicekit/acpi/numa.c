@@ -0,0 +1,202 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file numa.c
+ * @brief NUMA topology from the ACPI SRAT and SLIT.
+ *
+ * This runs from vm_phys_init(), before physical memory is added, so that
+ * each page goes into its proper domain from the outset. uACPI isn't
+ * initialised yet, so we use its early table access; uacpi_initialize() later
+ * takes over the table list.
+ *
+ * Proximity domains are renumbered densely as vm_domid_ts, in order of first
+ * appearance, with the memory affinities visited first. Domains that have
+ * memory so get the lowest numbers, and a CPU in a memoryless domain gets a
+ * number above highest_domid (so vm_phys_cpu_domain() gives it domain 0.)
+ */
+
+#include <sys/k_log.h>
+#include <sys/limine.h>
+#include <sys/vm.h>
+
+#include <libkern/lib.h>
+
+#include <uacpi/acpi.h>
+#include <uacpi/tables.h>
+#include <uacpi/uacpi.h>
+
+#include <inttypes.h>
+
+extern __attribute__((section(".requests")))
+volatile struct limine_rsdp_request rsdp_request;
+
+/* holds the table list until uacpi_initialize() */
+static uint8_t early_table_buf[4096];
+
+static uint32_t pxms[VM_MAX_DOMAINS];
+static size_t npxms;
+
+static bool
+pxm_lookup(uint32_t pxm, vm_domid_t *out)
+{
+	for (size_t i = 0; i < npxms; i++) {
+		if (pxms[i] == pxm) {
+			*out = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static vm_domid_t
+pxm_to_domid(uint32_t pxm)
+{
+	vm_domid_t domid;
+
+	if (pxm_lookup(pxm, &domid))
+		return domid;
+
+	if (npxms == VM_MAX_DOMAINS) {
+		kdprintf("acpi_numa: too many proximity domains, "
+			 "treating %u as domain 0\n", pxm);
+		return 0;
+	}
+
+	pxms[npxms] = pxm;
+	return npxms++;
+}
+
+static void
+srat_entry(struct acpi_entry_hdr *entry, bool memory)
+{
+	switch (entry->type) {
+	case ACPI_SRAT_ENTRY_TYPE_MEMORY_AFFINITY: {
+		struct acpi_srat_memory_affinity *mem =
+		    (struct acpi_srat_memory_affinity *)entry;
+		vm_domid_t domid;
+
+		if (!memory || !(mem->flags & ACPI_SRAT_MEMORY_ENABLED) ||
+		    mem->length == 0)
+			break;
+
+		domid = pxm_to_domid(mem->proximity_domain);
+		kdprintf("acpi_numa: memory 0x%" PRIx64 "-0x%" PRIx64
+			 " in domain %u (pxm %u)\n", mem->address,
+		    mem->address + mem->length, domid, mem->proximity_domain);
+		vm_phys_affinity_add(mem->address, mem->address + mem->length,
+		    domid);
+		break;
+	}
+
+	case ACPI_SRAT_ENTRY_TYPE_PROCESSOR_AFFINITY: {
+		struct acpi_srat_processor_affinity *cpu =
+		    (struct acpi_srat_processor_affinity *)entry;
+		uint32_t pxm;
+
+		if (memory || !(cpu->flags & ACPI_SRAT_PROCESSOR_ENABLED))
+			break;
+
+		pxm = cpu->proximity_domain_low |
+		    (uint32_t)cpu->proximity_domain_high[0] << 8 |
+		    (uint32_t)cpu->proximity_domain_high[1] << 16 |
+		    (uint32_t)cpu->proximity_domain_high[2] << 24;
+		vm_phys_cpu_affinity_add(cpu->id, pxm_to_domid(pxm));
+		break;
+	}
+
+	case ACPI_SRAT_ENTRY_TYPE_X2APIC_AFFINITY: {
+		struct acpi_srat_x2apic_affinity *cpu =
+		    (struct acpi_srat_x2apic_affinity *)entry;
+
+		if (memory || !(cpu->flags & ACPI_SRAT_X2APIC_ENABLED))
+			break;
+
+		vm_phys_cpu_affinity_add(cpu->id,
+		    pxm_to_domid(cpu->proximity_domain));
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+static void
+srat_walk(struct acpi_srat *srat, bool memory)
+{
+	struct acpi_entry_hdr *entry;
+	uint8_t *srat_lim = (uint8_t *)srat + srat->hdr.length;
+
+	for (uint8_t *elem = (uint8_t *)srat->entries; elem < srat_lim;
+	    elem += entry->length) {
+		entry = (struct acpi_entry_hdr *)elem;
+		if (entry->length == 0)
+			break;
+		srat_entry(entry, memory);
+	}
+}
+
+static void
+slit_parse(struct acpi_slit *slit)
+{
+	uint64_t n = slit->num_localities;
+
+	for (uint64_t from = 0; from < n; from++) {
+		vm_domid_t from_domid;
+
+		if (!pxm_lookup(from, &from_domid))
+			continue;
+
+		for (uint64_t to = 0; to < n; to++) {
+			vm_domid_t to_domid;
+
+			if (!pxm_lookup(to, &to_domid))
+				continue;
+
+			vm_phys_distance_set(from_domid, to_domid,
+			    slit->matrix[from * n + to]);
+		}
+	}
+}
+
+/*!
+ * @brief Tell the physical memory manager which domain each range of memory
+ * and each CPU is in, and how far apart the domains are.
+ *
+ * Without an SRAT, everything stays in domain 0.
+ */
+void
+dk_acpi_numa_init(void)
+{
+	uacpi_table table;
+	int r;
+
+	if (rsdp_request.response == NULL)
+		return;
+
+	r = uacpi_setup_early_table_access(early_table_buf,
+	    sizeof(early_table_buf));
+	if (r != UACPI_STATUS_OK) {
+		kdprintf("acpi_numa: no early table access: %d\n", r);
+		return;
+	}
+
+	r = uacpi_table_find_by_signature(ACPI_SRAT_SIGNATURE, &table);
+	if (r != UACPI_STATUS_OK)
+		return;
+
+	srat_walk(table.ptr, true);
+	srat_walk(table.ptr, false);
+	uacpi_table_unref(&table);
+
+	r = uacpi_table_find_by_signature(ACPI_SLIT_SIGNATURE, &table);
+	if (r == UACPI_STATUS_OK) {
+		slit_parse(table.ptr);
+		uacpi_table_unref(&table);
+	}
+
+	kdprintf("acpi_numa: %zu proximity domains\n", npxms);
+}
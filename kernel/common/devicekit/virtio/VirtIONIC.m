@@ -11,6 +11,7 @@
  * @brief VirtIO NIC driver.
  */
 
+#include <sys/dlpi.h>
 #include <sys/errno.h>
 #include <sys/k_log.h>
 #include <sys/kmem.h>
@@ -20,6 +21,8 @@
 #include <devicekit/virtio/VirtIONIC.h>
 #include <devicekit/virtio/virtio_net.h>
 #include <devicekit/virtio/virtioreg.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
 #include <stdint.h>
 
 #define VIRTIO_NET_Q_RX 0
@@ -28,8 +31,16 @@
 /*! maximum packet size, inclusive of virtio header */
 #define VIONIC_RX_BUF_SIZE 2048
 
-/*! maximum number of physical breaks in a single TX */
-#define VIONIC_MAX_TX_BREAKS 16
+/*!
+ * maximum number of physical breaks in a single TX; a 64KiB TSO frame spans
+ * up to 17 pages, and the link header may be separate
+ */
+#define VIONIC_MAX_TX_BREAKS 24
+
+/*! offloads we ask the device for */
+#define VIONIC_FEATURES                                                \
+	(__BIT(VIRTIO_NET_F_CSUM) | __BIT(VIRTIO_NET_F_GUEST_CSUM) |     \
+	    __BIT(VIRTIO_NET_F_HOST_TSO4) | __BIT(VIRTIO_NET_F_HOST_TSO6))
 
 /* RX request structure - a receive buffer */
 struct vionic_rx_req {
@@ -51,6 +62,8 @@ struct vionic_tx_req {
 	uint16_t first_desc_id;
 	/* Number of descriptors used */
 	uint16_t ndescs;
+	/* Frame being sent, freed on completion */
+	mblk_t *mp;
 	/* TX header (must persist until completion) */
 	struct virtio_net_hdr_v1 hdr;
 };
@@ -61,7 +74,9 @@ struct vionic_tx_req {
 
 #define m_cfg ((volatile struct virtio_net_config *)m_transport.deviceConfig)
 
-- (void)handleReceivedPacket:(const uint8_t *)data length:(size_t)len
+- (void)handleReceivedPacket:(const uint8_t *)data
+		       length:(size_t)len
+			flags:(uint8_t)flags
 {
 	mblk_t *mp = str_allocb(len);
 	if (mp == NULL)
@@ -70,6 +85,13 @@ struct vionic_tx_req {
 	memcpy(mp->wptr, data, len);
 	mp->wptr += len;
 
+	/*
+	 * Either the device checked it, or it never left the host and the
+	 * checksum was never computed.
+	 */
+	if (flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		mp->db->cksum_flags |= DB_CKSUM_VALID;
+
 	[self didReceivePacket:mp];
 }
 
@@ -111,6 +133,7 @@ struct vionic_tx_req {
 - (instancetype)initWithTransport:(DKVirtIOTransport*) transport
 {
 	volatile struct virtio_net_config *cfg;
+	uint64_t features = VIONIC_FEATURES;
 	ipl_t ipl;
 
 	[super start];
@@ -119,11 +142,23 @@ struct vionic_tx_req {
 	[m_transport resetDevice];
 
 	if (![m_transport exchangeFeaturesMandatory:VIRTIO_F_VERSION_1
-					   optional:NULL]) {
+					   optional:&features]) {
 		DKDevLog(self, "Failed to negotiate features\n");
 		return nil;
 	}
 
+	/* the device can only segment what it can checksum */
+	m_offloads = 0;
+	if (features & __BIT(VIRTIO_NET_F_CSUM)) {
+		m_offloads |= DL_OFFLOAD_TX_CSUM;
+		if (features & __BIT(VIRTIO_NET_F_HOST_TSO4))
+			m_offloads |= DL_OFFLOAD_TSO4;
+		if (features & __BIT(VIRTIO_NET_F_HOST_TSO6))
+			m_offloads |= DL_OFFLOAD_TSO6;
+	}
+	if (features & __BIT(VIRTIO_NET_F_GUEST_CSUM))
+		m_offloads |= DL_OFFLOAD_RX_CSUM;
+
 	cfg = m_cfg;
 
 	for (int i = 0; i < 6; i++)
@@ -190,14 +225,73 @@ struct vionic_tx_req {
 	[self replenishRxQueue];
 	ke_spinlock_exit(&m_rx_vq.spinlock, ipl);
 
-	DKDevLog(self, "Started with %zu RX buffers, %zu TX slots\n",
-	    m_rx_bufs_n, m_tx_reqs_n);
+	DKDevLog(self, "Started with %zu RX buffers, %zu TX slots; "
+		       "offloads:%s%s%s%s\n",
+	    m_rx_bufs_n, m_tx_reqs_n,
+	    (m_offloads & DL_OFFLOAD_TX_CSUM) ? " tx-csum" : "",
+	    (m_offloads & DL_OFFLOAD_RX_CSUM) ? " rx-csum" : "",
+	    (m_offloads & DL_OFFLOAD_TSO4) ? " tso4" : "",
+	    (m_offloads & DL_OFFLOAD_TSO6) ? " tso6" : "");
 
 	[super setupNIC];
 
 	return self;
 }
 
+/* number of page-contiguous pieces an mblk's data is in */
+static size_t
+mblk_npieces(mblk_t *m)
+{
+	uintptr_t start = (uintptr_t)m->rptr, end = (uintptr_t)m->wptr;
+
+	if (end <= start)
+		return 0;
+	return (end - 1) / PGSIZE - start / PGSIZE + 1;
+}
+
+/* byte at off within a message */
+static uint8_t
+msg_byte(mblk_t *m, size_t off)
+{
+	for (; m != NULL; m = m->cont) {
+		size_t len = m->wptr - m->rptr;
+		if (off < len)
+			return (uint8_t)m->rptr[off];
+		off -= len;
+	}
+	return 0;
+}
+
+/* fill in the virtio-net header from the offload requests on the frame */
+static void
+vionic_fill_hdr(struct virtio_net_hdr_v1 *hdr, mblk_t *mp)
+{
+	dblk_t *db = mp->db;
+	struct ether_header *eh = (struct ether_header *)mp->rptr;
+	size_t th_off;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+	if (!(db->cksum_flags & DB_CKSUM_PARTIAL))
+		return;
+
+	hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	hdr->csum_start = to_leu16(db->cksum_start);
+	hdr->csum_offset = to_leu16(db->cksum_stuff - db->cksum_start);
+
+	if (db->lso_mss == 0)
+		return;
+
+	/* TCP data offset is the high nibble of byte 12 of its header */
+	th_off = (msg_byte(mp, db->cksum_start + 12) >> 4) * 4;
+	hdr->gso_type = ntohs(eh->ether_type) == ETHERTYPE_IPV6 ?
+	    VIRTIO_NET_HDR_GSO_TCPV6 :
+	    VIRTIO_NET_HDR_GSO_TCPV4;
+	hdr->gso_size = to_leu16(db->lso_mss);
+	hdr->hdr_len = to_leu16(db->cksum_start + th_off);
+}
+
 - (int)transmitPacket:(mblk_t *)mp
 {
 	struct vionic_tx_req *req;
@@ -207,36 +301,33 @@ struct vionic_tx_req {
 	size_t i;
 	ipl_t ipl;
 
-	/* count segments; TODO: some helper function in STREAMS */
-	for (m = mp; m != NULL; m = m->cont) {
-		size_t seg_len = m->wptr - m->rptr;
-		if (seg_len > 0)
-			nsegs++;
-	}
+	/* count page-contiguous segments */
+	for (m = mp; m != NULL; m = m->cont)
+		nsegs += mblk_npieces(m);
 
-	if (nsegs == 0)
+	if (nsegs == 0) {
+		str_freemsg(mp);
 		return 0; /* nothing to send */
+	}
 
 	if (nsegs > VIONIC_MAX_TX_BREAKS) {
 		DKDevLog(self, "TX: too many segments (%zu > %d)\n", nsegs,
 		    VIONIC_MAX_TX_BREAKS);
+		str_freemsg(mp);
 		return -EMSGSIZE;
 	}
 
 	ipl = ke_spinlock_enter(&m_tx_vq.spinlock);
 
-	/* do we have a free TX request? */
+	/*
+	 * Do we have a free TX request, and enough descriptors (1 for header
+	 * + nsegs for data)? If not, the ring is full; drop it and let the
+	 * upper layers retransmit.
+	 */
 	req = TAILQ_FIRST(&m_tx_free_reqs);
-	if (req == NULL) {
-		// kfatal("out of tx requests\n");
-		ke_spinlock_exit(&m_tx_vq.spinlock, ipl);
-		return -EAGAIN;
-	}
-
-	/* do we have enough descriptors? (1 for header + nsegs for data) */
-	if (m_tx_vq.nfree_descs < nsegs + 1) {
-		kfatal("out of descriptors\n");
+	if (req == NULL || m_tx_vq.nfree_descs < nsegs + 1) {
 		ke_spinlock_exit(&m_tx_vq.spinlock, ipl);
+		str_freemsg(mp);
 		return -EAGAIN;
 	}
 
@@ -245,12 +336,11 @@ struct vionic_tx_req {
 	for (size_t i = 0; i < nsegs + 1; i++)
 		descs[i] = [m_transport allocateDescNumOnQueue:&m_tx_vq];
 
-	memset(&req->hdr, 0, sizeof(req->hdr));
-	req->hdr.flags = 0;
-	req->hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+	vionic_fill_hdr(&req->hdr, mp);
 
 	req->first_desc_id = descs[0];
 	req->ndescs = nsegs + 1;
+	req->mp = mp;
 
 	/* first descriptor: virtio-net header */
 	m_tx_vq.desc[descs[0]].addr = to_leu64(v2p((vaddr_t)&req->hdr));
@@ -258,50 +348,49 @@ struct vionic_tx_req {
 	m_tx_vq.desc[descs[0]].flags = to_leu16(VRING_DESC_F_NEXT);
 	m_tx_vq.desc[descs[0]].next = to_leu16(descs[1]);
 
-	/* subsequent descriptors: data from mblk chain */
+	/*
+	 * subsequent descriptors: data from mblk chain, split at page
+	 * boundaries, as the pinned heap is only virtually contiguous
+	 */
 	i = 1;
 	for (m = mp; m != NULL; m = m->cont) {
-		size_t seg_len = m->wptr - m->rptr;
-		volatile struct vring_desc *desc;
-		paddr_t paddr;
-
-		if (seg_len == 0)
-			continue;
-
-		desc = &m_tx_vq.desc[descs[i]];
-
-		if(mp->wptr <= m->rptr) {
-			DKDevLog(self, "bad mblk (wptr <= rptr)\n");
-			ke_spinlock_exit(&m_tx_vq.spinlock, ipl);
-			return -EINVAL;
+		char *p = m->rptr;
+
+		while (p < m->wptr) {
+			volatile struct vring_desc *desc;
+			size_t seg_len;
+			paddr_t paddr;
+
+			seg_len = MIN2((size_t)(m->wptr - p),
+			    PGSIZE - (uintptr_t)p % PGSIZE);
+			desc = &m_tx_vq.desc[descs[i]];
+
+			if ((uintptr_t)p >= HHDM_BASE &&
+			    (uintptr_t)p < HHDM_BASE + HHDM_SIZE) {
+				paddr = v2p((vaddr_t)p);
+			} else if ((uintptr_t)p >= PIN_HEAP_BASE &&
+			    (uintptr_t)p < PIN_HEAP_BASE + PIN_HEAP_SIZE) {
+				paddr = vm_translate((vaddr_t)p);
+			} else {
+				kfatal("TX buffer not in pinned heap "
+				       "nor HHDM\n");
+			}
+
+			desc->addr = to_leu64(paddr);
+			desc->len = to_leu32(seg_len);
+
+			if (i < nsegs) {
+				/* further segments follow */
+				desc->flags = to_leu16(VRING_DESC_F_NEXT);
+				desc->next = to_leu16(descs[i + 1]);
+			} else {
+				/* final segment */
+				desc->flags = to_leu16(0);
+			}
+
+			p += seg_len;
+			i++;
 		}
-
-		kassert((uintptr_t)m->rptr / PGSIZE ==
-		    (uintptr_t)(m->rptr + seg_len - 1) / PGSIZE);
-
-		if ((uintptr_t)m->rptr >= HHDM_BASE &&
-		    (uintptr_t)m->rptr < HHDM_BASE + HHDM_SIZE) {
-			paddr = v2p((vaddr_t)m->rptr);
-		} else if ((uintptr_t)m->rptr >= PIN_HEAP_BASE &&
-		    (uintptr_t)m->rptr < PIN_HEAP_BASE + PIN_HEAP_SIZE) {
-			paddr = vm_translate((vaddr_t)m->rptr);
-		} else {
-			kfatal("TX buffer not in pinned heap nor HHDM\n");
-		}
-
-		desc->addr = to_leu64(paddr);
-		desc->len = to_leu32(seg_len);
-
-		if (i < nsegs) {
-			/* further segments follow */
-			desc->flags = to_leu16(VRING_DESC_F_NEXT);
-			desc->next = to_leu16(descs[i + 1]);
-		} else {
-			/* final segment */
-			desc->flags = to_leu16(0);
-		}
-
-		i++;
 	}
 
 	TAILQ_INSERT_TAIL(&m_tx_inflight_reqs, req, queue_entry);
@@ -323,6 +412,7 @@ struct vionic_tx_req {
 	if (queue == &m_rx_vq) {
 		/* RX completion */
 		struct vionic_rx_req *req;
+		struct virtio_net_hdr_v1 *hdr;
 
 		TAILQ_FOREACH(req, &m_rx_inflight_reqs, queue_entry) {
 			if (req->first_desc_id == desc_id)
@@ -340,13 +430,16 @@ struct vionic_tx_req {
 		/* free the descriptor */
 		[m_transport freeDescNum:desc_id onQueue:&m_rx_vq];
 
+		hdr = (struct virtio_net_hdr_v1 *)req->buffer;
+
 		if (len < sizeof(struct virtio_net_hdr_v1))
 			kdprintf("virtio-nic: empty RX packet?\n");
 		else
 			[self handleReceivedPacket:req->buffer +
 			    sizeof(struct virtio_net_hdr_v1)
 					    length:len -
-			    sizeof(struct virtio_net_hdr_v1)];
+			    sizeof(struct virtio_net_hdr_v1)
+					     flags:hdr->flags];
 
 		/* buffer can go back to freelist */
 		TAILQ_INSERT_TAIL(&m_rx_free_reqs, req, queue_entry);
@@ -387,6 +480,9 @@ struct vionic_tx_req {
 		    req->ndescs);
 #endif
 
+		str_freemsg(req->mp);
+		req->mp = NULL;
+
 		/* return request to freelist */
 		TAILQ_INSERT_TAIL(&m_tx_free_reqs, req, queue_entry);
 	}
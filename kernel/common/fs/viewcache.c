@@ -17,10 +17,24 @@
  * and have a TAILQ_HEAD(view_waiter_list, view_waiter) waiters; in struct view.
  * and then when the view is written back, chase that list and wake up the
  * waiters who tied themselves to the chain.
+ *
+ * each vnode's views are looked up under its own lock, so readers of different
+ * files don't contend. only taking a view for reuse, or a view changing state
+ * between idle, dirty, and in use, takes the global vc_queues_lock. when none
+ * can be had, view_get() kicks the writeback thread and waits.
+ *
+ * lookups aren't done under RCU. the view tree is a red-black tree, which
+ * rotates nodes in place on insertion and removal, so can't be walked by
+ * readers not holding its lock; and a view found must be retained against
+ * view_steal() before it's used, which takes the vnode lock (refcnt is
+ * (v)-protected) anyway. an RCU lookup would need both a different index
+ * and atomic view refcounts with a steal-side recheck; the per-vnode lock
+ * is uncontended except between users of the same file.
  */
 
 #include <sys/vm.h>
 #include <libkern/lib.h>
+#include <sys/k_log.h>
 #include <sys/tree.h>
 #include <sys/vnode.h>
 #include <sys/k_wait.h>
@@ -33,47 +47,77 @@
 #include "sys/proc.h"
 
 #define VIEW_SIZE (64 * 1024) /* 64 KiB views */
+/* views dirty this long are written back */
+#define VIEW_DIRTY_DELAY NS_PER_S
+/* how long view_get() waits before looking again when there are no views */
+#define VIEW_WAIT_TIMEOUT (NS_PER_S / 10)
 
 struct view_waiter {
 	TAILQ_ENTRY(view_waiter) tqentry;
 	kevent_t ev;
 };
 
+/*
+ * Locking:
+ * - v: the vnode's vc_state lock.
+ * - q: vc_queues_lock.
+ * A view's vnode and offset are stable while it has a reference, or is in
+ * VIEW_DIRTY or VIEW_WRITEBACK state.
+ */
 struct view {
-	size_t refcnt;
+	size_t refcnt;	 /* (v) */
 	uint64_t offset; /* byte offset in file */
 	vnode_t *vnode;	 /* associated vnode; */
 
-	RB_ENTRY(view) rb_entry;       /* link in tree of views for vnode */
-	TAILQ_ENTRY(view) queue_entry; /* link in lru, dirty, or free list */
+	RB_ENTRY(view) rb_entry;       /* (v) link in tree of views for vnode */
+	TAILQ_ENTRY(view) queue_entry; /* (q) link in lru, dirty or free list */
 
+	/* (v+q to write, either to read) */
 	enum view_dirtiness { VIEW_CLEAN, VIEW_DIRTY, VIEW_WRITEBACK } dirty;
+	bool on_lru;
+	/* (v) */
+	bool referenced; /* used since it went on the lru_queue */
 	kabstime_t dirty_time; /* time when marked dirty after being clean */
 
-	TAILQ_HEAD(, view_waiter) waiters;
+	TAILQ_HEAD(, view_waiter) waiters; /* (v) */
 };
 
 TAILQ_HEAD(view_tq, view);
 RB_HEAD(view_tree, view);
 
 struct vn_vc_state {
-	struct view_tree view_tree; /* views of this vnode; vc_lock guards it */
+	kspinlock_t lock;
+	struct view_tree view_tree; /* views of this vnode (lock) */
 };
 
 static size_t view_count;
 static struct view *views;
-static kspinlock_t vc_lock = KSPINLOCK_INITIALISER;
 
 /*
  * free_queue stores views that are not currently in use.
- * lru_queue stores clean views whose refcnt is at 0.
+ * lru_queue stores clean views whose refcnt was 0 when they were put on it.
+ * Views are left on it when they're retained again, and taken off lazily by
+ * view_steal(), so that looking up a cached view takes only the vnode's lock.
  * dirty_queue stores dirty views, ordered by time they were marked dirty; their
  * refcnt can be 0 or greater.
+ *
+ * A vnode's lock is taken before vc_queues_lock. view_steal() and the
+ * writeback thread, which find views on the queues and then need their vnodes'
+ * locks, only try for them.
  */
-
+static kspinlock_t vc_queues_lock = KSPINLOCK_INITIALISER;
 static struct view_tq free_queue = TAILQ_HEAD_INITIALIZER(free_queue),
 		      lru_queue = TAILQ_HEAD_INITIALIZER(lru_queue),
 		      dirty_queue = TAILQ_HEAD_INITIALIZER(dirty_queue);
+static size_t lru_n;		/* (q) */
+static size_t view_waiters;	/* (q) threads in view_wait_avail() */
+static kevent_t view_avail_ev;	/* (q) a view went on free or lru queue */
+static kevent_t writeback_ev;	/* wakes the writeback thread */
+static bool writeback_kicked;	/* write back all dirty views, not just old */
+
+static struct viewcache_stats {
+	size_t hits, misses, steals, waits, writebacks;
+} stats;
 
 static inline int
 view_cmp(struct view *x, struct view *y)
@@ -100,59 +144,142 @@ addr_to_view(vaddr_t addr)
 	return &views[(addr - FILE_MAP_BASE) / VIEW_SIZE];
 }
 
+static inline kspinlock_t *
+view_lock(struct view *view)
+{
+	return &view->vnode->file.vc_state->lock;
+}
+
+/* vc_queues_lock held */
 static void
-viewcache_writeback_thread(void *)
+view_avail_signal(void)
 {
-	kevent_t ev;
-	ke_event_init(&ev, false);
+	if (view_waiters > 0)
+		ke_event_set_signalled(&view_avail_ev, true);
+}
 
-	while (true) {
-		ipl_t ipl;
-		struct view *view;
-		struct view_waiter *waiter;
+/* vnode lock and vc_queues_lock held */
+static void
+view_lru_insert(struct view *view)
+{
+	kassert(view->dirty == VIEW_CLEAN && !view->on_lru);
+	view->on_lru = true;
+	view->referenced = false;
+	TAILQ_INSERT_TAIL(&lru_queue, view, queue_entry);
+	lru_n++;
+	view_avail_signal();
+}
 
-		ke_wait1(&ev, "viewcache_writeback_thread", false,
-		    ke_time() + NS_PER_S);
+/* vnode lock and vc_queues_lock held */
+static void
+view_lru_remove(struct view *view)
+{
+	kassert(view->on_lru);
+	view->on_lru = false;
+	TAILQ_REMOVE(&lru_queue, view, queue_entry);
+	lru_n--;
+}
 
-		ipl = ke_spinlock_enter(&vc_lock);
-		view = TAILQ_FIRST(&dirty_queue);
-		if (view == NULL) {
-			ke_spinlock_exit(&vc_lock, ipl);
-			continue;
-		}
+/* vc_queues_lock held; vnode lock held unless the view is unused. */
+static void
+view_free(struct view *view)
+{
+	view->vnode = NULL;
+	view->offset = 0;
+	view->on_lru = false;
+	TAILQ_INIT(&view->waiters);
+	TAILQ_INSERT_TAIL(&free_queue, view, queue_entry);
+	view_avail_signal();
+}
+
+/*
+ * Write back the oldest dirty view, if it was dirtied no later than limit.
+ * Returns false if there was none.
+ */
+static bool
+view_writeback_one(kabstime_t limit)
+{
+	struct view *view;
+	struct view_waiter *waiter;
+	kspinlock_t *lock;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_enter(&vc_queues_lock);
+	view = TAILQ_FIRST(&dirty_queue);
+	if (view == NULL || view->dirty_time > limit) {
+		ke_spinlock_exit(&vc_queues_lock, ipl);
+		return false;
+	}
+
+	/* a dirty view can't be stolen, so its vnode stays put */
+	lock = view_lock(view);
+	if (!ke_spinlock_tryenter_nospl(lock)) {
+		/* the lock order is the other way round; try again */
+		ke_spinlock_exit(&vc_queues_lock, ipl);
+		return true;
+	}
 
 #if 0
-		kprintf("viewcache_writeback_thread: writing back view "
-		    "offset 0x%zx of vnode %p\n",
-		    view->offset, view->vnode);
+	kprintf("viewcache_writeback_thread: writing back view "
+	    "offset 0x%zx of vnode %p\n",
+	    view->offset, view->vnode);
 #endif
 
-		view->dirty = VIEW_WRITEBACK;
-		view->dirty_time = ABSTIME_NEVER;
-		TAILQ_REMOVE(&dirty_queue, view, queue_entry);
-		ke_spinlock_exit(&vc_lock, ipl);
+	view->dirty = VIEW_WRITEBACK;
+	view->dirty_time = ABSTIME_NEVER;
+	TAILQ_REMOVE(&dirty_queue, view, queue_entry);
+	ke_spinlock_exit_nospl(&vc_queues_lock);
+	ke_spinlock_exit(lock, ipl);
 
-		vm_vc_clean(view->vnode->file.vmobj, view->offset,
-		    view_addr(view), VIEW_SIZE);
+	vm_vc_clean(view->vnode->file.vmobj, view->offset,
+	    view_addr(view), VIEW_SIZE);
 
-		ipl = ke_spinlock_enter(&vc_lock);
-		kassert(view->dirty == VIEW_WRITEBACK);
-		if (view->dirty_time != ABSTIME_NEVER) {
-			/* dirtied again while writeback was ongoing */
-			view->dirty = VIEW_DIRTY;
-			TAILQ_INSERT_TAIL(&dirty_queue, view, queue_entry);
-		} else {
-			/* now clean */
-			view->dirty = VIEW_CLEAN;
-			TAILQ_INSERT_TAIL(&lru_queue, view, queue_entry);
-		}
+	ipl = ke_spinlock_enter(lock);
+	ke_spinlock_enter_nospl(&vc_queues_lock);
+	kassert(view->dirty == VIEW_WRITEBACK);
+	if (view->dirty_time != ABSTIME_NEVER) {
+		/* dirtied again while writeback was ongoing */
+		view->dirty = VIEW_DIRTY;
+		TAILQ_INSERT_TAIL(&dirty_queue, view, queue_entry);
+	} else {
+		/* now clean */
+		view->dirty = VIEW_CLEAN;
+		if (view->refcnt == 0)
+			view_lru_insert(view);
+	}
+	ke_spinlock_exit_nospl(&vc_queues_lock);
 
-		while ((waiter = TAILQ_FIRST(&view->waiters)) != NULL) {
-			TAILQ_REMOVE(&view->waiters, waiter, tqentry);
-			ke_event_set_signalled(&waiter->ev, true);
-		}
+	while ((waiter = TAILQ_FIRST(&view->waiters)) != NULL) {
+		TAILQ_REMOVE(&view->waiters, waiter, tqentry);
+		ke_event_set_signalled(&waiter->ev, true);
+	}
+
+	ke_spinlock_exit(lock, ipl);
+
+	__atomic_fetch_add(&stats.writebacks, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+static void
+viewcache_writeback_thread(void *)
+{
+	while (true) {
+		kabstime_t limit;
+
+		ke_wait1(&writeback_ev, "viewcache_writeback_thread", false,
+		    ke_time() + NS_PER_S);
+		ke_event_set_signalled(&writeback_ev, false);
+
+		/* when kicked for want of views, write back everything */
+		if (__atomic_exchange_n(&writeback_kicked, false,
+		    __ATOMIC_RELAXED))
+			limit = ke_time();
+		else
+			limit = ke_time() - VIEW_DIRTY_DELAY;
 
-		ke_spinlock_exit(&vc_lock, ipl);
+		while (view_writeback_one(limit))
+			;
 	}
 }
 
@@ -165,10 +292,14 @@ viewcache_init(void)
 
 	for (size_t i = 0; i < view_count; i++) {
 		struct view *v = &views[i];
+		v->on_lru = false;
 		TAILQ_INSERT_TAIL(&free_queue, v, queue_entry);
 		TAILQ_INIT(&v->waiters);
 	}
 
+	ke_event_init(&view_avail_ev, false);
+	ke_event_init(&writeback_ev, false);
+
 	thread_t *thread = proc_new_system_thread(viewcache_writeback_thread, NULL);
 	ke_thread_resume(&thread->kthread, false);
 }
@@ -178,59 +309,128 @@ viewcache_alloc_vnode_state(vnode_t *vn)
 {
 	struct vn_vc_state *state;
 	state = kmem_alloc(sizeof(*state));
+	ke_spinlock_init(&state->lock);
 	RB_INIT(&state->view_tree);
 	return state;
 }
 
-static void
-view_retain_locked(struct view *view)
-{
-	kassert(ke_spinlock_held(&vc_lock));
-	view->refcnt++;
-	if (view->refcnt == 1 && view->dirty == VIEW_CLEAN)
-		TAILQ_REMOVE(&lru_queue, view, queue_entry);
-}
-
 static void
 view_release(struct view *view)
 {
-	ipl_t ipl = ke_spinlock_enter(&vc_lock);
+	kspinlock_t *lock = view_lock(view);
+	ipl_t ipl = ke_spinlock_enter(lock);
+
 	kassert(view->refcnt > 0);
-	view->refcnt--;
-	if (view->refcnt == 0 && view->dirty == VIEW_CLEAN)
-		TAILQ_INSERT_TAIL(&lru_queue, view, queue_entry);
-	ke_spinlock_exit(&vc_lock, ipl);
+	if (--view->refcnt == 0 && view->dirty == VIEW_CLEAN) {
+		if (view->on_lru) {
+			/* still there from before; give it a second chance */
+			view->referenced = true;
+		} else {
+			ke_spinlock_enter_nospl(&vc_queues_lock);
+			view_lru_insert(view);
+			ke_spinlock_exit_nospl(&vc_queues_lock);
+		}
+	}
+	ke_spinlock_exit(lock, ipl);
 }
 
 static void
 view_dirty_and_release(struct view *view)
 {
-	ipl_t ipl = ke_spinlock_enter(&vc_lock);
+	kspinlock_t *lock = view_lock(view);
+	ipl_t ipl = ke_spinlock_enter(lock);
 
 	if (view->dirty == VIEW_CLEAN) {
+		ke_spinlock_enter_nospl(&vc_queues_lock);
+		if (view->on_lru)
+			view_lru_remove(view);
 		view->dirty_time = ke_time();
 		view->dirty = VIEW_DIRTY;
 		TAILQ_INSERT_TAIL(&dirty_queue, view, queue_entry);
+		ke_spinlock_exit_nospl(&vc_queues_lock);
 	} else if (view->dirty == VIEW_WRITEBACK) {
 		/* this lets the writeback thread know it's dirty again */
 		view->dirty_time = ke_time();
 	}
 
+	kassert(view->refcnt > 0);
 	view->refcnt--;
-	if (view->refcnt == 0 && view->dirty == VIEW_CLEAN)
-		TAILQ_INSERT_TAIL(&lru_queue, view, queue_entry);
 
-	ke_spinlock_exit(&vc_lock, ipl);
+	ke_spinlock_exit(lock, ipl);
 }
 
+/*
+ * Take a view for reuse from the lru_queue, unmapping it from its vnode.
+ * Views found to be in use again are taken off the queue; those used since
+ * they went on it are moved to the back.
+ *
+ * vc_queues_lock held.
+ */
+static struct view *
+view_steal(void)
+{
+	struct view *view;
+	size_t scan = lru_n * 2;
+
+	while (scan-- > 0 && (view = TAILQ_FIRST(&lru_queue)) != NULL) {
+		kspinlock_t *lock = view_lock(view);
+
+		if (!ke_spinlock_tryenter_nospl(lock)) {
+			TAILQ_REMOVE(&lru_queue, view, queue_entry);
+			TAILQ_INSERT_TAIL(&lru_queue, view, queue_entry);
+			continue;
+		}
+
+		kassert(view->dirty == VIEW_CLEAN);
+
+		if (view->refcnt > 0) {
+			/* it'll go back on when it's released */
+			view_lru_remove(view);
+		} else if (view->referenced) {
+			view->referenced = false;
+			TAILQ_REMOVE(&lru_queue, view, queue_entry);
+			TAILQ_INSERT_TAIL(&lru_queue, view, queue_entry);
+		} else {
+			view_lru_remove(view);
+			RB_REMOVE(view_tree,
+			    &view->vnode->file.vc_state->view_tree, view);
+			vm_vc_unmap(view_addr(view), VIEW_SIZE);
+			ke_spinlock_exit_nospl(lock);
+			view->vnode = NULL;
+			view->offset = 0;
+			stats.steals++;
+			return view;
+		}
+
+		ke_spinlock_exit_nospl(lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Wait until a view may be free, having kicked the writeback thread to clean
+ * the dirty ones. Times out in case one was freed as we began to wait.
+ */
 static void
-view_replace(struct view *view)
+view_wait_avail(void)
 {
-	kassert(view->dirty == VIEW_CLEAN);
+	ipl_t ipl = ke_spinlock_enter(&vc_queues_lock);
 
-	RB_REMOVE(view_tree, &view->vnode->file.vc_state->view_tree, view);
+	if (view_waiters++ == 0)
+		ke_event_set_signalled(&view_avail_ev, false);
+	stats.waits++;
+	ke_spinlock_exit(&vc_queues_lock, ipl);
 
-	vm_vc_unmap(view_addr(view), VIEW_SIZE);
+	__atomic_store_n(&writeback_kicked, true, __ATOMIC_RELAXED);
+	ke_event_set_signalled(&writeback_ev, true);
+
+	ke_wait1(&view_avail_ev, "view_wait_avail", false,
+	    ke_time() + VIEW_WAIT_TIMEOUT);
+
+	ipl = ke_spinlock_enter(&vc_queues_lock);
+	view_waiters--;
+	ke_spinlock_exit(&vc_queues_lock, ipl);
 }
 
 static struct view *
@@ -238,53 +438,61 @@ view_get(vnode_t *vn, uint64_t offset)
 {
 	struct vn_vc_state *vc_state = vn->file.vc_state;
 	struct view key;
-	struct view *view;
+	struct view *view, *existing;
 	ipl_t ipl;
 
 	key.vnode = vn;
 	key.offset = offset;
 
-	ipl = ke_spinlock_enter(&vc_lock);
-
-retry:
+	ipl = ke_spinlock_enter(&vc_state->lock);
 	view = RB_FIND(view_tree, &vc_state->view_tree, &key);
 	if (view != NULL) {
-		view_retain_locked(view);
-		ke_spinlock_exit(&vc_lock, ipl);
+		view->refcnt++;
+		ke_spinlock_exit(&vc_state->lock, ipl);
+		__atomic_fetch_add(&stats.hits, 1, __ATOMIC_RELAXED);
 		return view;
 	}
+	ke_spinlock_exit(&vc_state->lock, ipl);
 
-	view = TAILQ_FIRST(&free_queue);
-	if (view != NULL) {
-		TAILQ_REMOVE(&free_queue, view, queue_entry);
-		/* factor (1) */
-		view->refcnt = 1;
-		view->vnode = vn;
-		view->offset = offset;
-		view->dirty = VIEW_CLEAN;
-		RB_INSERT(view_tree, &vc_state->view_tree, view);
-		ke_spinlock_exit(&vc_lock, ipl);
-		return view;
-	}
+	__atomic_fetch_add(&stats.misses, 1, __ATOMIC_RELAXED);
 
-	view = TAILQ_FIRST(&lru_queue);
-	if (view != NULL) {
-		TAILQ_REMOVE(&lru_queue, view, queue_entry);
-		view_replace(view);
-		/* factor (1) */
-		view->refcnt = 1;
-		view->vnode = vn;
-		view->offset = offset;
-		view->dirty = VIEW_CLEAN;
-		RB_INSERT(view_tree, &vc_state->view_tree, view);
-		ke_spinlock_exit(&vc_lock, ipl);
-		return view;
+	while (true) {
+		ipl = ke_spinlock_enter(&vc_queues_lock);
+		view = TAILQ_FIRST(&free_queue);
+		if (view != NULL)
+			TAILQ_REMOVE(&free_queue, view, queue_entry);
+		else
+			view = view_steal();
+		ke_spinlock_exit(&vc_queues_lock, ipl);
+
+		if (view != NULL)
+			break;
+
+		/* all in use or dirty */
+		view_wait_avail();
 	}
 
-	/* kick the writeback thread and wait for a free or lru view? */
-	kfatal("implement me: no views\n");
+	/* factor (1) */
+	view->refcnt = 1;
+	view->vnode = vn;
+	view->offset = offset;
+	view->dirty = VIEW_CLEAN;
+	view->on_lru = false;
+	view->referenced = false;
+
+	ipl = ke_spinlock_enter(&vc_state->lock);
+	existing = RB_INSERT(view_tree, &vc_state->view_tree, view);
+	if (existing != NULL) {
+		/* someone else made one while we looked for a view */
+		existing->refcnt++;
+		ke_spinlock_enter_nospl(&vc_queues_lock);
+		view_free(view);
+		ke_spinlock_exit_nospl(&vc_queues_lock);
+		view = existing;
+	}
+	ke_spinlock_exit(&vc_state->lock, ipl);
 
-	goto retry;
+	return view;
 }
 
 int
@@ -353,23 +561,48 @@ viewcache_vmm_get_fault_info(vaddr_t addr, struct vm_object **out_object,
 
 /*
  * Wait for a view to leave VIEW_WRITEBACK state.
- * Requires vc_lock held (drops & reacquires it).
+ * Requires its vnode's lock held (drops & reacquires it).
  */
 static void
 view_wait_writeback(struct view *view)
 {
 	struct view_waiter waiter;
+	kspinlock_t *lock = view_lock(view);
 
-	kassert(ke_spinlock_held(&vc_lock));
+	kassert(ke_spinlock_held(lock));
 	kassert(view->dirty == VIEW_WRITEBACK);
 
 	ke_event_init(&waiter.ev, false);
 	TAILQ_INSERT_TAIL(&view->waiters, &waiter, tqentry);
-	ke_spinlock_exit(&vc_lock, IPL_0);
+	ke_spinlock_exit(lock, IPL_0);
 
 	ke_wait1(&waiter.ev, "view_wait_writeback", false, ABSTIME_FOREVER);
 
-	ke_spinlock_enter(&vc_lock);
+	ke_spinlock_enter(lock);
+}
+
+/*
+ * Take an idle view of a vnode off whichever queue it's on, unmap it, and
+ * free it. Vnode lock held.
+ */
+static void
+view_discard(struct vn_vc_state *vc_state, struct view *view)
+{
+	kassert(view->refcnt == 0);
+	kassert(view->dirty != VIEW_WRITEBACK);
+
+	ke_spinlock_enter_nospl(&vc_queues_lock);
+	if (view->dirty == VIEW_DIRTY)
+		TAILQ_REMOVE(&dirty_queue, view, queue_entry);
+	else if (view->on_lru)
+		view_lru_remove(view);
+
+	RB_REMOVE(view_tree, &vc_state->view_tree, view);
+
+	vm_vc_unmap(view_addr(view), VIEW_SIZE);
+
+	view_free(view);
+	ke_spinlock_exit_nospl(&vc_queues_lock);
 }
 
 /*
@@ -395,13 +628,14 @@ viewcache_truncate(vnode_t *vn, uint64_t newsize)
 		key.offset = partial_view_off;
 
 retry:
-		ipl = ke_spinlock_enter(&vc_lock);
+		ipl = ke_spinlock_enter(&vc_state->lock);
 		view = RB_FIND(view_tree, &vc_state->view_tree, &key);
 		if (view != NULL) {
 			vaddr_t from, len;
 
 			if (view->dirty == VIEW_WRITEBACK) {
 				view_wait_writeback(view);
+				ke_spinlock_exit(&vc_state->lock, ipl);
 				goto retry;
 			}
 
@@ -412,12 +646,12 @@ retry:
 
 			vm_vc_unmap(from, len);
 		}
-		ke_spinlock_exit(&vc_lock, ipl);
+		ke_spinlock_exit(&vc_state->lock, ipl);
 	}
 
 	key.offset = first_discard_off;
 
-	ipl = ke_spinlock_enter(&vc_lock);
+	ipl = ke_spinlock_enter(&vc_state->lock);
 
 retry_2:
 	/*
@@ -436,24 +670,36 @@ retry_2:
 			goto retry_2;
 		}
 
-		if (view->dirty == VIEW_DIRTY)
-			TAILQ_REMOVE(&dirty_queue, view, queue_entry);
-		else
-			TAILQ_REMOVE(&lru_queue, view, queue_entry);
+		view_discard(vc_state, view);
 
-		RB_REMOVE(view_tree, &vc_state->view_tree, view);
+		view = next;
+	}
 
-		vm_vc_unmap(view_addr(view), VIEW_SIZE);
+	ke_spinlock_exit(&vc_state->lock, ipl);
+}
 
-		view->vnode = NULL;
-		view->offset = 0;
-		TAILQ_INIT(&view->waiters);
-		TAILQ_INSERT_TAIL(&free_queue, view, queue_entry);
+/*
+ * Unmap up to n idle, clean views, so that their pages can go to standby and
+ * be reclaimed. Called by the balance set manager when memory is short.
+ * Returns the number of views unmapped.
+ */
+size_t
+viewcache_trim(size_t n)
+{
+	struct view *view;
+	size_t trimmed = 0;
+	ipl_t ipl;
 
-		view = next;
+	ipl = ke_spinlock_enter(&vc_queues_lock);
+
+	while (trimmed < n && (view = view_steal()) != NULL) {
+		view_free(view);
+		trimmed++;
 	}
 
-	ke_spinlock_exit(&vc_lock, ipl);
+	ke_spinlock_exit(&vc_queues_lock, ipl);
+
+	return trimmed;
 }
 
 void
@@ -476,27 +722,38 @@ viewcache_purge_vnode(vnode_t *vn)
 	 * pages.
 	 */
 
-	ipl = ke_spinlock_enter(&vc_lock);
+	ipl = ke_spinlock_enter(&vc_state->lock);
 
 	while ((view = RB_MIN(view_tree, &vc_state->view_tree)) != NULL) {
-		kassert(view->refcnt == 0);
-
-	waited:
 		if (view->dirty == VIEW_WRITEBACK) {
-			kfatal("wait for writeback...");
-			goto waited;
-		} else if (view->dirty == VIEW_DIRTY) {
-			TAILQ_REMOVE(&dirty_queue, view, queue_entry);
-		} else {
-			TAILQ_REMOVE(&lru_queue, view, queue_entry);
+			view_wait_writeback(view);
+			continue;
 		}
 
-		RB_REMOVE(view_tree, &vc_state->view_tree, view);
+		view_discard(vc_state, view);
+	}
 
-		vm_vc_unmap(view_addr(view), VIEW_SIZE);
+	ke_spinlock_exit(&vc_state->lock, ipl);
+}
 
-		TAILQ_INSERT_TAIL(&free_queue, view, queue_entry);
-	}
+void
+dbg_viewcache_dump(void)
+{
+	size_t nfree = 0, ndirty = 0;
+	struct view *view;
+	ipl_t ipl;
 
-	ke_spinlock_exit(&vc_lock, ipl);
+	ipl = ke_spinlock_enter(&vc_queues_lock);
+	TAILQ_FOREACH(view, &free_queue, queue_entry)
+		nfree++;
+	TAILQ_FOREACH(view, &dirty_queue, queue_entry)
+		ndirty++;
+	kdprintf("viewcache: %zu views: %zu free, %zu on lru, %zu dirty\n",
+	    view_count, nfree, lru_n, ndirty);
+	ke_spinlock_exit(&vc_queues_lock, ipl);
+
+	kdprintf("%zu hits, %zu misses, %zu steals, %zu waits, "
+		 "%zu writebacks\n",
+	    stats.hits, stats.misses, stats.steals, stats.waits,
+	    stats.writebacks);
 }
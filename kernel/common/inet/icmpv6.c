@@ -39,8 +39,8 @@ icmpv6_input_echo_request(ip_if_t *ifp, mblk_t *mp, ip_rxattr_t *attr)
 	icmp6->icmp6_code = 0;
 
 	icmp6->icmp6_cksum = 0;
-	icmp6->icmp6_cksum = htons(ip_icmp6_checksum(&ip6->ip6_src,
-	    &ip6->ip6_dst, icmp6, mp->wptr - mp->rptr));
+	icmp6->icmp6_cksum = ip_icmp6_checksum(&ip6->ip6_src, &ip6->ip6_dst,
+	    icmp6, mp->wptr - mp->rptr);
 
 	mp->rptr = (char *)ip6;
 	ipv6_output(mp);
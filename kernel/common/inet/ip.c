@@ -269,6 +269,7 @@ ip_lropen(queue_t *rq, void *)
 
 	ifp->nic_data = ack->nic_data;
 	ifp->nic_wput = ack->nic_wput;
+	ifp->offloads = ack->dl_offloads;
 
 	return 0;
 }
@@ -311,7 +312,5 @@ ip_init(void)
 	route_init();
 	rtnetlink_init();
 	devfs_create_node(DEV_KIND_STREAM, &ip_devops, NULL, "ip");
-#if 0
 	tcp_init();
-#endif
 }
@@ -87,6 +87,7 @@ typedef struct ip_if {
 
 	void *nic_data;
 	int (*nic_wput)(void *, struct msgb *);
+	uint32_t offloads; /* DL_OFFLOAD_* */
 } ip_if_t;
 
 enum route_match {
@@ -157,6 +158,15 @@ int ip_if_bpf_attach(ip_if_t *, bpf_listener_t *);
 int ip_if_output(ip_if_t *, struct msgb *, uint16_t ethertype,
     const struct ether_addr *);
 
+uint64_t ip_cksum_msg(const struct msgb *, size_t off, uint64_t sum);
+uint64_t ip_cksum_pseudo4(struct in_addr src, struct in_addr dst,
+    uint8_t proto, size_t len);
+uint64_t ip_cksum_pseudo6(const struct in6_addr *src,
+    const struct in6_addr *dst, uint8_t nxt, size_t len);
+void ip_cksum_finish(struct msgb *);
+int ip_gso_output(ip_if_t *, struct msgb *, uint16_t ethertype,
+    const struct ether_addr *);
+
 neighbour_cache_t *neighbour_cache_new(ip_if_t *, sa_family_t);
 void neighbour_cache_learn(neighbour_cache_t *, const union in_addr_union *,
     const struct ether_addr *, bool solicited);
@@ -211,6 +221,9 @@ void ip_uwput_ioctl_sgif(struct queue *, struct msgb *);
 void tcp_ipv4_input(ip_if_t *, struct msgb *, ip_rxattr_t *);
 void udp_ipv4_input(ip_if_t *, struct msgb *, ip_rxattr_t *);
 
+void dbg_tcp_dump(void);
+void dbg_udp_dump(void);
+
 /* currently missing from mlibc */
 #define ip6_flow	ip6_ctlun.ip6_un1.ip6_un1_flow
 #define ip6_plen	ip6_ctlun.ip6_un1.ip6_un1_plen
@@ -11,6 +11,7 @@
  * @brief IP interface management.
  */
 
+#include <sys/dlpi.h>
 #include <sys/errno.h>
 #include <sys/k_intr.h>
 #include <sys/k_log.h>
@@ -35,6 +36,8 @@ ip_if_new(uint8_t *mac)
 
 	RCULIST_INIT(&ifp->bpf_listeners);
 
+	ifp->offloads = 0;
+
 	ifp->neighbours_ipv4 = neighbour_cache_new(ifp, AF_INET);
 	ifp->neighbours_ipv6 = neighbour_cache_new(ifp, AF_INET6);
 
@@ -113,6 +116,15 @@ ip_if_output(ip_if_t *ifp, mblk_t *mp, uint16_t ethertype,
 {
 	mblk_t *ehmp = mp;
 	struct ether_header *eh;
+	uint32_t tso = ethertype == ETHERTYPE_IP ? DL_OFFLOAD_TSO4 :
+	    ethertype == ETHERTYPE_IPV6 ? DL_OFFLOAD_TSO6 : 0;
+
+	/* do in software what the NIC can't */
+	if (mp->db->lso_mss != 0 && (ifp->offloads & tso) == 0)
+		return ip_gso_output(ifp, mp, ethertype, l2addr);
+	if ((mp->db->cksum_flags & DB_CKSUM_PARTIAL) &&
+	    (ifp->offloads & DL_OFFLOAD_TX_CSUM) == 0)
+		ip_cksum_finish(mp);
 
 	if (STR_MBLKHEAD(ehmp) >= sizeof(struct ether_header) &&
 	    ehmp->db->refcnt == 1) {
@@ -125,6 +137,16 @@ ip_if_output(ip_if_t *ifp, mblk_t *mp, uint16_t ethertype,
 		}
 		ehmp->wptr += sizeof(struct ether_header);
 		ehmp->cont = mp;
+		ehmp->db->cksum_flags = mp->db->cksum_flags;
+		ehmp->db->cksum_start = mp->db->cksum_start;
+		ehmp->db->cksum_stuff = mp->db->cksum_stuff;
+		ehmp->db->lso_mss = mp->db->lso_mss;
+	}
+
+	/* offload offsets are from the start of the frame now */
+	if (ehmp->db->cksum_flags & DB_CKSUM_PARTIAL) {
+		ehmp->db->cksum_start += sizeof(struct ether_header);
+		ehmp->db->cksum_stuff += sizeof(struct ether_header);
 	}
 
 	eh = (typeof(eh))ehmp->rptr;
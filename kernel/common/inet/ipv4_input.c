@@ -14,6 +14,7 @@
 #include <sys/libkern.h>
 #include <sys/stream.h>
 
+#include <libkern/in_cksum.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
@@ -108,7 +109,7 @@ ipv4_input(ip_if_t *ifp, mblk_t *mp)
 		return;
 	}
 
-	if (ip_checksum((void *)iph, hlen) != 0) {
+	if (in_cksum(iph, hlen) != 0) {
 		kdprintf("ipv4_input: bad IP checksum\n");
 		str_freemsg(mp);
 		return;
@@ -15,6 +15,7 @@
 #include <sys/libkern.h>
 #include <sys/stream.h>
 
+#include <libkern/in_cksum.h>
 #include <netinet/ip.h>
 
 #include <inet/ip.h>
@@ -40,7 +41,7 @@ ipv4_output(mblk_t *mp)
 	iph = (struct ip *)mp->rptr;
 
 	iph->ip_sum = 0;
-	iph->ip_sum = ip_checksum(iph, (size_t)iph->ip_hl * 4);
+	iph->ip_sum = in_cksum(iph, (size_t)iph->ip_hl * 4);
 
 	dst.in.sin_family = AF_INET;
 	dst.in.sin_addr = iph->ip_dst;
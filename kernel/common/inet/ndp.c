@@ -15,6 +15,7 @@
 #include <sys/libkern.h>
 #include <sys/stream.h>
 
+#include <libkern/in_cksum.h>
 #include <netinet/icmp6.h>
 #include <netinet/ip6.h>
 
@@ -60,60 +61,19 @@ ip_if_lookup_v6addr_noretain(ip_if_t *ifp, const struct in6_addr *addr)
 }
 
 /*
- * TODO: do like FreeBSD for checksums: require an mblk to be passed in with rptr at start of
- * IPv6 header, offset of L4/ICMPv6 header, and write an str_mapply() to deal
- * with chains.
+ * TODO: do like FreeBSD for checksums: take the mblk, with the offset of the
+ * ICMPv6 header, and sum it with ip_cksum_msg() so that chains work.
  */
 
-static uint16_t
-checksum_fold(uint32_t sum)
-{
-	while ((sum >> 16) != 0)
-		sum = (sum & 0xffffU) + (sum >> 16);
-	return (uint16_t)~sum;
-}
-
-uint16_t
-ip_checksum_bytes(const void *buf, size_t len)
-{
-	const uint8_t *bytes = buf;
-	uint32_t sum = 0;
-	size_t i;
-
-	for (i = 0; i + 1 < len; i += 2)
-		sum += ((uint32_t)bytes[i] << 8) | bytes[i + 1];
-	if ((len & 1U) != 0)
-		sum += (uint32_t)bytes[len - 1] << 8;
-	return checksum_fold(sum);
-}
-
+/* the checksum, in network byte order; 0 if verifying a correct one */
 uint16_t
 ip_icmp6_checksum(const struct in6_addr *src, const struct in6_addr *dst,
     const void *payload, size_t payload_len)
 {
-	uint32_t sum = 0;
-	const uint8_t *bytes = payload;
-	uint32_t upper_len = htonl((uint32_t)payload_len);
-	uint32_t nxt = htonl(IPPROTO_ICMPV6);
-	size_t i;
-
-	for (i = 0; i < sizeof(*src); i += 2)
-		sum += ((const uint8_t *)src)[i] << 8 |
-		    ((const uint8_t *)src)[i + 1];
-	for (i = 0; i < sizeof(*dst); i += 2)
-		sum += ((const uint8_t *)dst)[i] << 8 |
-		    ((const uint8_t *)dst)[i + 1];
-	for (i = 0; i < sizeof(upper_len); i += 2)
-		sum += ((const uint8_t *)&upper_len)[i] << 8 |
-		    ((const uint8_t *)&upper_len)[i + 1];
-	for (i = 0; i < sizeof(nxt); i += 2)
-		sum += ((const uint8_t *)&nxt)[i] << 8 |
-		    ((const uint8_t *)&nxt)[i + 1];
-	for (i = 0; i + 1 < payload_len; i += 2)
-		sum += ((uint32_t)bytes[i] << 8) | bytes[i + 1];
-	if ((payload_len & 1U) != 0)
-		sum += (uint32_t)bytes[payload_len - 1] << 8;
-	return checksum_fold(sum);
+	uint64_t sum;
+
+	sum = ip_cksum_pseudo6(src, dst, IPPROTO_ICMPV6, payload_len);
+	return ~in_cksum_fold(in_cksum_partial(payload, payload_len, sum));
 }
 
 void
@@ -140,8 +100,8 @@ ndp_solicit_dad(ip_if_t *ifp, const struct in6_addr *tentative)
 	/* no src assignment, stays 0s [::] */
 	pkt.ns.nd_ns_type = ND_NEIGHBOR_SOLICIT;
 	pkt.ns.nd_ns_target = *tentative;
-	pkt.ns.nd_ns_hdr.icmp6_cksum = htons(ip_icmp6_checksum(&pkt.ip6.ip6_src,
-	    &pkt.ip6.ip6_dst, &pkt.ns, sizeof(pkt.ns)));
+	pkt.ns.nd_ns_hdr.icmp6_cksum = ip_icmp6_checksum(&pkt.ip6.ip6_src,
+	    &pkt.ip6.ip6_dst, &pkt.ns, sizeof(pkt.ns));
 
 	memcpy(mp->rptr, &pkt, sizeof(pkt));
 
@@ -188,8 +148,8 @@ ndp_solicit_unicast(ip_if_t *ifp, const struct in6_addr *target,
 	pkt.opt.hdr.nd_opt_type = ND_OPT_SOURCE_LINKADDR;
 	pkt.opt.hdr.nd_opt_len = 1; /* 8-byte units */
 	memcpy(&pkt.opt.lladdr, ifp->mac, sizeof(struct ether_addr));
-	pkt.ns.nd_ns_hdr.icmp6_cksum = htons(ip_icmp6_checksum(&pkt.ip6.ip6_src,
-	    &pkt.ip6.ip6_dst, &pkt.ns, sizeof(pkt.ns) + sizeof(pkt.opt)));
+	pkt.ns.nd_ns_hdr.icmp6_cksum = ip_icmp6_checksum(&pkt.ip6.ip6_src,
+	    &pkt.ip6.ip6_dst, &pkt.ns, sizeof(pkt.ns) + sizeof(pkt.opt));
 
 	memcpy(mp->rptr, &pkt, sizeof(pkt));
 
@@ -237,8 +197,8 @@ ndp_solicit(ip_if_t *ifp, const struct in6_addr *target)
 	pkt.opt.hdr.nd_opt_type = ND_OPT_SOURCE_LINKADDR;
 	pkt.opt.hdr.nd_opt_len = 1; /* 8-byte units */
 	memcpy(&pkt.opt.lladdr, ifp->mac, sizeof(struct ether_addr));
-	pkt.ns.nd_ns_hdr.icmp6_cksum = htons(ip_icmp6_checksum(&pkt.ip6.ip6_src,
-	    &pkt.ip6.ip6_dst, &pkt.ns, sizeof(pkt.ns) + sizeof(pkt.opt)));
+	pkt.ns.nd_ns_hdr.icmp6_cksum = ip_icmp6_checksum(&pkt.ip6.ip6_src,
+	    &pkt.ip6.ip6_dst, &pkt.ns, sizeof(pkt.ns) + sizeof(pkt.opt));
 
 	memcpy(mp->rptr, &pkt, sizeof(pkt));
 
@@ -301,9 +261,8 @@ ndp_advertise(ip_if_t *ifp, mblk_t *mp, const struct in6_addr *target,
 	pkt.opt.hdr.nd_opt_len = 1; /* units of 8 bytes */
 	memcpy(&pkt.opt.lladdr, ifp->mac, sizeof(struct ether_addr));
 
-	pkt.na.nd_na_hdr.icmp6_cksum = htons(ip_icmp6_checksum(
-	    &pkt.ip6.ip6_src, &pkt.ip6.ip6_dst,
-	    &pkt.na, sizeof(pkt.na) + sizeof(pkt.opt)));
+	pkt.na.nd_na_hdr.icmp6_cksum = ip_icmp6_checksum(&pkt.ip6.ip6_src,
+	    &pkt.ip6.ip6_dst, &pkt.na, sizeof(pkt.na) + sizeof(pkt.opt));
 
 	memcpy(mp->rptr, &pkt, sizeof(pkt));
 
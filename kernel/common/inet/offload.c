@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2026 Cloudarox Solutions.
+ * Created on Sat Oct 17 2026.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*!
+ * @file offload.c
+ * @brief Software checksum and segmentation, for NICs without the offloads.
+ *
+ * TCP hands down segments with only the pseudo-header sum in the checksum
+ * field (DB_CKSUM_PARTIAL), and, when it has more than a segment's worth to
+ * send, super-segments of up to 64KiB to be cut into lso_mss-sized segments.
+ * ip_if_output() passes these to NICs that can finish them; for the rest, it
+ * comes here first.
+ *
+ * Segmentation copies only the headers: each segment's payload is a set of
+ * mblks sharing the super-segment's data blocks.
+ *
+ * Also here are the parts of the checksum routines specific to IP:
+ * pseudo-headers and sums over messages.
+ */
+
+#include <sys/errno.h>
+#include <sys/kmem.h>
+#include <sys/libkern.h>
+#include <sys/stream.h>
+
+#include <libkern/in_cksum.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <inet/ip.h>
+#include <inet/tcphdr.h>
+
+/*!
+ * @brief Add the 16-bit words of a message from off to its end into a
+ * partial sum (see libkern/in_cksum.h.)
+ */
+uint64_t
+ip_cksum_msg(const mblk_t *mp, size_t off, uint64_t sum)
+{
+	bool odd = false;
+
+	for (; mp != NULL; mp = mp->cont) {
+		size_t len = STR_MBLKL(mp);
+		uint64_t part;
+
+		if (off >= len) {
+			off -= len;
+			continue;
+		}
+
+		part = in_cksum_partial(mp->rptr + off, len - off, 0);
+		sum += odd ? in_cksum_swap(part) : part;
+		odd ^= (len - off) & 1;
+		off = 0;
+	}
+
+	return sum;
+}
+
+/*! @brief Partial sum of the IPv4 pseudo-header for TCP or UDP. */
+uint64_t
+ip_cksum_pseudo4(struct in_addr src, struct in_addr dst, uint8_t proto,
+    size_t len)
+{
+	return (uint64_t)src.s_addr + dst.s_addr + htons(proto) + htons(len);
+}
+
+/*! @brief Partial sum of the IPv6 pseudo-header (RFC 8200 section 8.1). */
+uint64_t
+ip_cksum_pseudo6(const struct in6_addr *src, const struct in6_addr *dst,
+    uint8_t nxt, size_t len)
+{
+	uint64_t sum;
+
+	sum = in_cksum_partial(src, sizeof(*src), 0);
+	sum = in_cksum_partial(dst, sizeof(*dst), sum);
+	return sum + htonl(len) + htonl(nxt);
+}
+
+/*!
+ * @brief Complete a DB_CKSUM_PARTIAL checksum.
+ *
+ * The checksum field is within the first mblk.
+ */
+void
+ip_cksum_finish(mblk_t *mp)
+{
+	dblk_t *db = mp->db;
+	uint16_t sum;
+
+	kassert(db->cksum_flags & DB_CKSUM_PARTIAL);
+	kassert((size_t)db->cksum_stuff + 2 <= (size_t)STR_MBLKL(mp));
+
+	sum = ~in_cksum_fold(ip_cksum_msg(mp, db->cksum_start, 0));
+	memcpy(mp->rptr + db->cksum_stuff, &sum, sizeof(sum));
+
+	db->cksum_flags &= ~DB_CKSUM_PARTIAL;
+}
+
+/* mblks sharing the data of len bytes of mp from off */
+static mblk_t *
+msg_dup_range(mblk_t *mp, size_t off, size_t len)
+{
+	mblk_t *head = NULL, **tailp = &head;
+
+	for (; mp != NULL && len != 0; mp = mp->cont) {
+		size_t blen = STR_MBLKL(mp);
+		mblk_t *nmp;
+
+		if (off >= blen) {
+			off -= blen;
+			continue;
+		}
+
+		nmp = str_dupb(mp);
+		if (nmp == NULL) {
+			str_freemsg(head);
+			return NULL;
+		}
+
+		nmp->rptr += off;
+		nmp->wptr = nmp->rptr + MIN2(blen - off, len);
+		len -= STR_MBLKL(nmp);
+		off = 0;
+
+		*tailp = nmp;
+		tailp = &nmp->cont;
+	}
+
+	kassert(len == 0);
+	return head;
+}
+
+/*!
+ * @brief Cut a TCP/IPv4 super-segment into lso_mss-sized segments and send
+ * each through ip_if_output(). Consumes mp.
+ *
+ * The IP and TCP headers are within the first mblk.
+ */
+int
+ip_gso_output(ip_if_t *ifp, mblk_t *mp, uint16_t ethertype,
+    const struct ether_addr *l2addr)
+{
+	struct ip *ip = (struct ip *)mp->rptr;
+	struct tcphdr *th;
+	size_t hlen, hdrlen, total, mss;
+	tcp_seq seq;
+	uint16_t id;
+	uint8_t flags;
+
+	hlen = (size_t)ip->ip_hl * 4;
+	th = (struct tcphdr *)(mp->rptr + hlen);
+	hdrlen = hlen + (size_t)th->th_off * 4;
+
+	if (ethertype != ETHERTYPE_IP || ip->ip_p != IPPROTO_TCP ||
+	    (size_t)STR_MBLKL(mp) < hdrlen) {
+		kdprintf("ip_gso_output: can't segment this\n");
+		str_freemsg(mp);
+		return -EINVAL;
+	}
+
+	mss = mp->db->lso_mss;
+	total = str_msgsize(mp) - hdrlen;
+	seq = ntohl(th->th_seq);
+	id = ntohs(ip->ip_id);
+	flags = th->th_flags;
+
+	for (size_t done = 0, i = 0; done < total; i++) {
+		size_t seglen = MIN2(mss, total - done);
+		struct ip *sip;
+		struct tcphdr *sth;
+		mblk_t *seg;
+		int r;
+
+		seg = str_allocb(sizeof(struct ether_header) + hdrlen);
+		if (seg == NULL) {
+			str_freemsg(mp);
+			return -ENOMEM;
+		}
+		seg->rptr += sizeof(struct ether_header);
+		memcpy(seg->rptr, mp->rptr, hdrlen);
+		seg->wptr = seg->rptr + hdrlen;
+
+		seg->cont = msg_dup_range(mp, hdrlen + done, seglen);
+		if (seg->cont == NULL) {
+			str_freeb(seg);
+			str_freemsg(mp);
+			return -ENOMEM;
+		}
+
+		sip = (struct ip *)seg->rptr;
+		sip->ip_len = htons(hdrlen + seglen);
+		sip->ip_id = htons(id + i);
+		sip->ip_sum = 0;
+		sip->ip_sum = in_cksum(sip, hlen);
+
+		sth = (struct tcphdr *)(seg->rptr + hlen);
+		sth->th_seq = htonl(seq + done);
+		/* FIN and PSH belong to the last segment only */
+		if (done + seglen < total)
+			sth->th_flags = flags & ~(TH_FIN | TH_PUSH);
+		sth->th_sum = in_cksum_fold(ip_cksum_pseudo4(sip->ip_src,
+		    sip->ip_dst, IPPROTO_TCP, hdrlen - hlen + seglen));
+
+		seg->db->cksum_flags = DB_CKSUM_PARTIAL;
+		seg->db->cksum_start = hlen;
+		seg->db->cksum_stuff = hlen + offsetof(struct tcphdr, th_sum);
+
+		r = ip_if_output(ifp, seg, ethertype, l2addr);
+		if (r != 0) {
+			str_freemsg(mp);
+			return r;
+		}
+
+		done += seglen;
+	}
+
+	str_freemsg(mp);
+	return 0;
+}
@@ -14,7 +14,7 @@
  * -------
  *
  * Each TCB has a spinlock (tcp_t::lock) that protects all its state.
- * The connection table is protected by tcp_conntab_lock.
+ * The lookup tables are protected by tcp_conntab_lock.
  * Lock ordering when acquiring multiple TCB locks: by ascending pointer value.
  *
  * DPC context (tcp_ipv4_input, timer DPCs) runs at IPL_DISP.  The TCB
@@ -34,12 +34,28 @@
  * internal spinlock) and is used for T_CONN_IND / T_DISCON_IND to a
  * listener.
  *
+ * Lookup tables
+ * -------------
+ *
+ * TCBs holding a local port are in tcp_porthash, keyed on that port; it
+ * serves only to find which ports are in use.  Those with a foreign address
+ * are also in tcp_connhash, keyed on the 4-tuple, and listeners are also in
+ * tcp_listenhash, keyed on the local port.
+ *
+ * Input segments are demultiplexed without taking tcp_conntab_lock: the
+ * connection and listener hashes are walked under RCU.  The connection hash
+ * doubles in size when it averages more than two TCBs per bucket.  Entries
+ * are moved between chains while it's resized, which readers can't follow;
+ * tcp_connhash_seq tells a reader that failed to find a connection whether
+ * this may be why, and it then looks again with tcp_conntab_lock held.
+ *
  * Existence guarantees
  * --------------------
  *
- * The connection table holds one reference per entry.  RCU (via
+ * A TCB stays in the lookup tables only while its connection state exists,
+ * and a reference to it is held by whoever keeps that state alive.  RCU (via
  * ke_rcu_call) defers the actual free until all in-flight DPCs that may
- * have obtained a pointer to the TCB are done.
+ * have obtained a pointer to the TCB are done; they must tcp_tryretain() it.
  */
 
 #include <sys/errno.h>
@@ -47,14 +63,17 @@
 #include <sys/k_rcu.h>
 #include <sys/libkern.h>
 #include <sys/queue.h>
+#include <sys/rcu_queue.h>
 #include <sys/stream.h>
 #include <sys/strsubr.h>
 #include <sys/tihdr.h>
 
+#include <libkern/in_cksum.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
 #include <inet/ip.h>
+#include <inet/tcp_cc.h>
 #include <inet/tcphdr.h>
 #include <inet/util.h>
 
@@ -68,6 +87,15 @@
 #define TCP_MIN_RTO_MS	 200	/* 200 milliseconds (deliberately not RFC) */
 #define TCP_2MSL_MS	 60000	/* 60 seconds */
 #define TCP_KEEPALIVE_MS 7200000 /* 2 hours */
+#define TCP_PAWS_IDLE_MS (24ULL * 24 * 60 * 60 * 1000) /* 24 days */
+
+#define TCP_RCVBUF_INIT	 65536	/* tcp_rinit.hiwat */
+#define TCP_RCVBUF_MAX	 (4 * 1024 * 1024)
+
+#define TCP_GSO_MAX	 65535	/* largest super-segment, IP header and all */
+
+#define TCP_SACK_MAXBLOCKS 4	/* SACK blocks in one segment */
+#define TCP_SACK_SCOREBOARD 8	/* SACKed ranges remembered when sending */
 
 /* state machine & types*/
 
@@ -77,6 +105,13 @@ typedef tcp_seq tcp_seq_t;
 #define SEQ_GT(a, b)	((int32_t)((a) - (b)) > 0)
 #define SEQ_GEQ(a, b)	((int32_t)((a) - (b)) >= 0)
 
+/*
+ * Reuse header fields for our own bookkeeping within tcp_conn_input, and for
+ * segments on the reassembly queue.
+ */
+#define th_1stdata th_sport
+#define th_datalen th_dport
+
 enum tcp_state {
 	TCPS_CLOSED = 0,	/* closed */
 	TCPS_BOUND,		/* (not rfc) bound, ready to connect/listen */
@@ -100,6 +135,23 @@ enum tcp_timer_type {
 	TCP_TIMER_MAX
 };
 
+struct tcp_sack_block {
+	tcp_seq_t	start;
+	tcp_seq_t	end;
+};
+
+/* options of a received segment */
+struct tcp_opts {
+	uint16_t	mss;		/* 0 if absent */
+	int8_t		wscale;		/* -1 if absent */
+	bool		sack_permitted;
+	bool		ts;		/* timestamps present? */
+	uint32_t	tsval;
+	uint32_t	tsecr;
+	uint8_t		nsack;
+	struct tcp_sack_block sack[TCP_SACK_MAXBLOCKS];
+};
+
 typedef struct tcp {
 	kspinlock_t	lock;
 	atomic_uint	refcnt;
@@ -123,7 +175,12 @@ typedef struct tcp {
 	bool	connind_sent;		/* T_CONN_IND already sent upward */
 
 	enum tcp_state state;	/* state of TCB */
-	int conn_id;		/* ID in the connections/binds table */
+
+	/* membership of the lookup tables (tcp_conntab_lock) */
+	bool	in_porthash, in_connhash, in_listenhash;
+	LIST_ENTRY(tcp) porthash_entry;
+	RCULIST_ENTRY(tcp) connhash_entry;
+	RCULIST_ENTRY(tcp) listenhash_entry;
 
 	struct sockaddr_in laddr;	/* local address */
 	struct sockaddr_in faddr;	/* foreign address */
@@ -143,9 +200,22 @@ typedef struct tcp {
 		/* upstream deliveries deferred to tcp_rsrv*/
 		pending_conn_con:	1,
 		pending_ordrel:		1,
-		pending_discon:		1;
+		pending_discon:		1,
+		pending_setopts:	1; /* rcv_wnd_max grew */
 	int pending_discon_reason;
 
+	/*
+	 * Options offered in our SYN; once the handshake's done, those agreed.
+	 */
+	bool	ws_ok:		1, /* window scaling (RFC 7323) */
+		ts_ok:		1, /* timestamps (RFC 7323) */
+		sack_ok:	1; /* selective acknowledgements (RFC 2018) */
+	uint8_t		snd_wscale;	/* peer's window shift */
+	uint8_t		rcv_wscale;	/* our window shift */
+	uint32_t	ts_recent;	/* peer's TSval to echo */
+	kabstime_t	ts_recent_age;	/* when ts_recent was set, or 0 */
+	tcp_seq_t	last_ack_sent;	/* rcv_nxt in the last segment sent */
+
 	uint16_t	mss;
 
 	tcp_seq_t	iss;		/* initial send sequence number */
@@ -161,7 +231,12 @@ typedef struct tcp {
 	tcp_seq_t	rcv_nxt;	/* receive next */
 	uint32_t	rcv_wnd;	/* receive window */
 	tcp_seq_t	rcv_up;		/* receive urgent pointer */
-	uint32_t	rcv_wnd_max;	/* maximum receive window */
+	uint32_t	rcv_wnd_max;	/* max receive window (buffer size) */
+	tcp_seq_t	rcv_lastsack;	/* latest out-of-order segment's seq */
+
+	/* receive buffer autotuning */
+	tcp_seq_t	rcvbuf_seq;	/* rcv_nxt at start of measurement */
+	kabstime_t	rcvbuf_time;	/* when measurement began, or 0 */
 
 	bool	timing_rtt;	/* is RTT being timed for a transmitted seg? */
 	tcp_seq_t	rtseq;		/* seq of segment being timed for RTT */
@@ -174,14 +249,19 @@ typedef struct tcp {
 
 	mblk_q_t	reass_queue;	/* sergment reassembly queue */
 
-	uint32_t	snd_cwnd;	/* congestion window */
-	uint32_t	snd_ssthresh;	/* slow start threshold */
-	uint32_t	bytes_acked;	/* bytes acknowledged */
+	struct tcp_cc	cc;		/* congestion window and algorithm */
 
 	uint8_t		dupacks;	/* duplicate acknowledgments */
 	tcp_seq_t	snd_recover;	/* sequence number to recover from */
 	bool		fast_recovery;	/* in fast recovery? */
 
+	/* SACK scoreboard: ranges above snd_una, ascending */
+	struct tcp_sack_block sack_blocks[TCP_SACK_SCOREBOARD];
+	uint8_t		nsack_blocks;
+	uint32_t	sacked_bytes;	/* total length of sack_blocks */
+	tcp_seq_t	sack_rxt_next;	/* next seq to retransmit (HighRxt) */
+	uint32_t	sack_bytes_rexmit; /* retransmitted in this recovery */
+
 	mblk_t	*conn_con_m;	/* pre-allocated T_CONN_CON */
 	mblk_t	*ordrel_ind_m;	/* pre-allocated T_ORDREL_IND */
 	mblk_t	*discon_ind_m;	/* pre-allocated T_DISCON_IND */
@@ -197,6 +277,7 @@ static void tcp_wsrv(queue_t *);
 static void tcp_rsrv(queue_t *);
 
 static int tcp_output(tcp_t *);
+static void tcp_unhash_locked(tcp_t *);
 
 static void tcp_ordrel_ind(tcp_t *);
 void tcp_conn_input(tcp_t **tpp, mblk_t *, const ip_rxattr_t *attr);
@@ -215,6 +296,7 @@ struct qinit tcp_rinit = {
 	.qopen = tcp_open,
 	.qclose = tcp_close,
 	.srvp = tcp_rsrv,
+	.hiwat = TCP_RCVBUF_INIT,
 };
 
 static struct qinit tcp_winit = {
@@ -242,9 +324,29 @@ static const char *tcp_state_names[] = {
 	[TCPS_TIME_WAIT] = "TIME-WAIT",
 };
 
-#define TCP_CONN_TABLE_SIZE 256
-static tcp_t *tcp_conn_table[TCP_CONN_TABLE_SIZE];
+/* connection hash sizes, in buckets; it grows as connections are added */
+#define TCP_CONNHASH_MIN  64
+#define TCP_CONNHASH_MAX  65536
+#define TCP_PORTHASH_SIZE 256
+#define TCP_LISTENHASH_SIZE 64
+
+struct tcp_connhash {
+	krcu_entry_t	rcu;
+	size_t		nbuckets;	/* a power of 2 */
+	RCULIST_HEAD(, tcp) buckets[];
+};
+
 static kspinlock_t tcp_conntab_lock;
+/* (RCU) connections by 4-tuple */
+static struct tcp_connhash KRX_RCU *tcp_connhash;
+/* odd while tcp_connhash is being resized */
+static unsigned int tcp_connhash_seq;
+static size_t tcp_connhash_count;
+/* (RCU) listeners by local port */
+static RCULIST_HEAD(, tcp) tcp_listenhash[TCP_LISTENHASH_SIZE];
+/* all TCBs holding a local port, by local port */
+static LIST_HEAD(, tcp) tcp_porthash[TCP_PORTHASH_SIZE];
+static uint32_t tcp_hash_seed;
 
 #define TCP_EPHEMERAL_LOW  49152
 #define TCP_EPHEMERAL_HIGH 65535
@@ -272,9 +374,12 @@ tcp_new(queue_t *rq)
 	tp->pending_ordrel = false;
 	tp->pending_discon = false;
 	tp->pending_discon_reason = 0;
+	tp->pending_setopts = true;
 
 	tp->state = TCPS_CLOSED;
-	tp->conn_id = -1;
+	tp->in_porthash = false;
+	tp->in_connhash = false;
+	tp->in_listenhash = false;
 
 	tp->closing = false;
 	LIST_INIT(&tp->conninds);
@@ -284,6 +389,7 @@ tcp_new(queue_t *rq)
 	tp->connind_sent = false;
 
 	tp->mss = TCP_MSS;
+	tp->cc.algo = tcp_cc_get_default();
 
 	tp->iss = 0;
 	tp->snd_una = 0;
@@ -293,8 +399,26 @@ tcp_new(queue_t *rq)
 
 	tp->irs = 0;
 	tp->rcv_nxt = 0;
-	tp->rcv_wnd = TCP_WINDOW;
-	tp->rcv_wnd_max = TCP_WINDOW;
+	/* the receive buffer starts at the stream's high watermark */
+	tp->rcv_wnd_max = rq != NULL ? rq->hiwat : tcp_rinit.hiwat;
+	tp->rcv_wnd = tp->rcv_wnd_max;
+	tp->rcv_lastsack = 0;
+	tp->rcvbuf_seq = 0;
+	tp->rcvbuf_time = 0;
+
+	tp->ws_ok = false;
+	tp->ts_ok = false;
+	tp->sack_ok = false;
+	tp->snd_wscale = 0;
+	tp->rcv_wscale = 0;
+	tp->ts_recent = 0;
+	tp->ts_recent_age = 0;
+	tp->last_ack_sent = 0;
+
+	tp->nsack_blocks = 0;
+	tp->sacked_bytes = 0;
+	tp->sack_rxt_next = 0;
+	tp->sack_bytes_rexmit = 0;
 
 	tp->timing_rtt = false;
 	tp->srtt = 0;
@@ -446,12 +570,10 @@ tcb_free_connstate(tcp_t *tp)
 
 	tcp_cancel_all_timers(tp);
 
-	if (tp->conn_id != -1) {
+	if (tp->in_porthash) {
 		ipl_t ipl = ke_spinlock_enter(&tcp_conntab_lock);
-		kassert(tcp_conn_table[tp->conn_id] == tp);
-		tcp_conn_table[tp->conn_id] = NULL;
+		tcp_unhash_locked(tp);
 		ke_spinlock_exit(&tcp_conntab_lock, ipl);
-		tp->conn_id = -1;
 	}
 
 	str_mblk_q_free(&tp->reass_queue);
@@ -578,12 +700,10 @@ tcp_close(queue_t *rq)
 		for (;;) {
 			tcp_t *child;
 
-			if (tp->conn_id != -1) {
+			if (tp->in_porthash) {
 				ke_spinlock_enter_nospl(&tcp_conntab_lock);
-				if (tcp_conn_table[tp->conn_id] == tp)
-					tcp_conn_table[tp->conn_id] = NULL;
+				tcp_unhash_locked(tp);
 				ke_spinlock_exit_nospl(&tcp_conntab_lock);
-				tp->conn_id = -1;
 			}
 
 			tp->closing = true;
@@ -676,13 +796,184 @@ tcp_snd_q_count(tcp_t *tp)
  * connection/binding management
  */
 
+static uint32_t
+tcp_hash(in_addr_t laddr, in_port_t lport, in_addr_t faddr, in_port_t fport)
+{
+	uint32_t h = tcp_hash_seed;
+
+	h = (h ^ laddr) * 0x9e3779b1;
+	h = (h ^ faddr) * 0x9e3779b1;
+	h = (h ^ ((uint32_t)lport << 16 | fport)) * 0x9e3779b1;
+	return h ^ (h >> 16);
+}
+
+static uint32_t
+tcp_port_hash(in_port_t lport)
+{
+	uint32_t h = (lport ^ tcp_hash_seed) * 0x9e3779b1;
+	return h ^ (h >> 16);
+}
+
+static struct tcp_connhash *
+tcp_connhash_alloc(size_t nbuckets)
+{
+	struct tcp_connhash *ch;
+
+	ch = kmem_alloc(sizeof(*ch) + nbuckets * sizeof(ch->buckets[0]));
+	if (ch == NULL)
+		return NULL;
+
+	ch->nbuckets = nbuckets;
+	for (size_t i = 0; i < nbuckets; i++)
+		RCULIST_INIT(&ch->buckets[i]);
+
+	return ch;
+}
+
+static void
+tcp_connhash_free_rcu(void *arg)
+{
+	struct tcp_connhash *ch = arg;
+	kmem_free(ch, sizeof(*ch) + ch->nbuckets * sizeof(ch->buckets[0]));
+}
+
+static size_t
+tcp_connhash_bucket(struct tcp_connhash *ch, tcp_t *tp)
+{
+	return tcp_hash(tp->laddr.sin_addr.s_addr, tp->laddr.sin_port,
+		   tp->faddr.sin_addr.s_addr, tp->faddr.sin_port) &
+	    (ch->nbuckets - 1);
+}
+
+/*
+ * Double the size of the connection hash if it's become too full. Called
+ * without tcp_conntab_lock held, so that the new table can be allocated.
+ */
+static void
+tcp_connhash_grow(void)
+{
+	struct tcp_connhash *old, *new;
+	size_t nbuckets;
+	ipl_t ipl;
+
+	nbuckets = __atomic_load_n(&tcp_connhash, __ATOMIC_RELAXED)->nbuckets;
+	if (nbuckets >= TCP_CONNHASH_MAX ||
+	    __atomic_load_n(&tcp_connhash_count, __ATOMIC_RELAXED) <=
+		nbuckets * 2)
+		return;
+
+	new = tcp_connhash_alloc(nbuckets * 2);
+	if (new == NULL)
+		return; /* chains just get longer */
+
+	ipl = ke_spinlock_enter(&tcp_conntab_lock);
+	old = tcp_connhash;
+	if (old->nbuckets != nbuckets) {
+		/* someone else beat us to it */
+		ke_spinlock_exit(&tcp_conntab_lock, ipl);
+		tcp_connhash_free_rcu(new);
+		return;
+	}
+
+	__atomic_store_n(&tcp_connhash_seq, tcp_connhash_seq + 1,
+	    __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (size_t i = 0; i < old->nbuckets; i++) {
+		tcp_t *tp;
+
+		while ((tp = RCULIST_FIRST(&old->buckets[i])) != NULL) {
+			RCULIST_REMOVE(tp, connhash_entry);
+			RCULIST_INSERT_HEAD(
+			    &new->buckets[tcp_connhash_bucket(new, tp)], tp,
+			    connhash_entry);
+		}
+	}
+
+	ke_rcu_assign_pointer(&tcp_connhash, new);
+	__atomic_store_n(&tcp_connhash_seq, tcp_connhash_seq + 1,
+	    __ATOMIC_RELEASE);
+
+	ke_spinlock_exit(&tcp_conntab_lock, ipl);
+
+	ke_rcu_call(&old->rcu, tcp_connhash_free_rcu, old);
+}
+
+/* Enter a TCB into the port hash, having assigned its local port. */
+static void
+tcp_porthash_insert_locked(tcp_t *tp)
+{
+	kassert(ke_spinlock_held(&tcp_conntab_lock));
+	kassert(!tp->in_porthash);
+
+	LIST_INSERT_HEAD(&tcp_porthash[tcp_port_hash(tp->laddr.sin_port) %
+	    TCP_PORTHASH_SIZE], tp, porthash_entry);
+	tp->in_porthash = true;
+}
+
+/*
+ * Enter a TCB into the connection hash, having set its foreign address.
+ * Returns whether the hash should now be grown with tcp_connhash_grow().
+ */
+static bool
+tcp_connhash_insert_locked(tcp_t *tp)
+{
+	struct tcp_connhash *ch = tcp_connhash;
+
+	kassert(ke_spinlock_held(&tcp_conntab_lock));
+	kassert(tp->in_porthash && !tp->in_connhash);
+
+	RCULIST_INSERT_HEAD(&ch->buckets[tcp_connhash_bucket(ch, tp)], tp,
+	    connhash_entry);
+	tp->in_connhash = true;
+	tcp_connhash_count++;
+
+	return tcp_connhash_count > ch->nbuckets * 2 &&
+	    ch->nbuckets < TCP_CONNHASH_MAX;
+}
+
+static void
+tcp_listenhash_insert_locked(tcp_t *tp)
+{
+	kassert(ke_spinlock_held(&tcp_conntab_lock));
+	kassert(tp->in_porthash && !tp->in_listenhash);
+
+	RCULIST_INSERT_HEAD(&tcp_listenhash[tcp_port_hash(tp->laddr.sin_port) %
+	    TCP_LISTENHASH_SIZE], tp, listenhash_entry);
+	tp->in_listenhash = true;
+}
+
+/* Remove a TCB from all the lookup tables. */
+static void
+tcp_unhash_locked(tcp_t *tp)
+{
+	kassert(ke_spinlock_held(&tcp_conntab_lock));
+
+	if (tp->in_connhash) {
+		RCULIST_REMOVE(tp, connhash_entry);
+		tp->in_connhash = false;
+		tcp_connhash_count--;
+	}
+	if (tp->in_listenhash) {
+		RCULIST_REMOVE(tp, listenhash_entry);
+		tp->in_listenhash = false;
+	}
+	if (tp->in_porthash) {
+		LIST_REMOVE(tp, porthash_entry);
+		tp->in_porthash = false;
+	}
+}
+
 static bool
 tcp_port_in_use(uint16_t port, in_addr_t addr)
 {
+	tcp_t *t;
+
 	kassert(ke_spinlock_held(&tcp_conntab_lock));
-	for (int i = 0; i < TCP_CONN_TABLE_SIZE; i++) {
-		tcp_t *t = tcp_conn_table[i];
-		if (t != NULL && t->laddr.sin_port == port &&
+
+	LIST_FOREACH(t, &tcp_porthash[tcp_port_hash(port) % TCP_PORTHASH_SIZE],
+	    porthash_entry) {
+		if (t->laddr.sin_port == port &&
 		    (t->laddr.sin_addr.s_addr == INADDR_ANY ||
 			addr == INADDR_ANY ||
 			t->laddr.sin_addr.s_addr == addr))
@@ -711,54 +1002,83 @@ tcp_alloc_ephemeral(in_addr_t addr)
 	return 0;
 }
 
-static int
-tcp_conn_table_insert_locked(tcp_t *tp)
+/* RCU read lock or tcp_conntab_lock held. */
+static tcp_t *
+tcp_connhash_lookup(struct in_addr src, uint16_t sport, struct in_addr dst,
+    uint16_t dport)
 {
-	kassert(ke_spinlock_held(&tcp_conntab_lock));
+	struct tcp_connhash *ch = ke_rcu_dereference(&tcp_connhash);
+	size_t bucket;
+	tcp_t *t;
 
-	for (int i = 0; i < TCP_CONN_TABLE_SIZE; i++) {
-		if (tcp_conn_table[i] == NULL) {
-			tcp_conn_table[i] = tp;
-			tp->conn_id = i;
-			return 0;
-		}
+	bucket = tcp_hash(dst.s_addr, dport, src.s_addr, sport) &
+	    (ch->nbuckets - 1);
+
+	RCULIST_FOREACH(t, &ch->buckets[bucket], connhash_entry) {
+		if (t->laddr.sin_addr.s_addr == dst.s_addr &&
+		    t->laddr.sin_port == dport &&
+		    t->faddr.sin_addr.s_addr == src.s_addr &&
+		    t->faddr.sin_port == sport)
+			return t;
 	}
-	return -ENOSPC;
+
+	return NULL;
 }
 
+/* RCU read lock held. Prefers a listener bound to dst over a wildcard one. */
 static tcp_t *
-tcp_conn_lookup_locked(struct in_addr src, uint16_t sport,
-    struct in_addr dst, uint16_t dport)
+tcp_listenhash_lookup(struct in_addr dst, uint16_t dport)
 {
-	kassert(ke_spinlock_held(&tcp_conntab_lock));
+	tcp_t *t, *wild = NULL;
 
-	for (int i = 0; i < TCP_CONN_TABLE_SIZE; i++) {
-		tcp_t *t = tcp_conn_table[i];
-		if (t != NULL &&
-		    t->laddr.sin_addr.s_addr == dst.s_addr &&
-		    t->laddr.sin_port == dport &&
-		    t->faddr.sin_addr.s_addr == src.s_addr &&
-		    t->faddr.sin_port == sport)
+	RCULIST_FOREACH(t, &tcp_listenhash[tcp_port_hash(dport) %
+	    TCP_LISTENHASH_SIZE], listenhash_entry) {
+		if (t->laddr.sin_port != dport)
+			continue;
+		if (t->laddr.sin_addr.s_addr == dst.s_addr)
 			return t;
+		if (t->laddr.sin_addr.s_addr == INADDR_ANY && wild == NULL)
+			wild = t;
 	}
 
-	for (int i = 0; i < TCP_CONN_TABLE_SIZE; i++) {
-		tcp_t *t = tcp_conn_table[i];
-		if (t != NULL && t->state == TCPS_LISTEN &&
-		    t->laddr.sin_port == dport &&
-		    (t->laddr.sin_addr.s_addr == INADDR_ANY ||
-			t->laddr.sin_addr.s_addr == dst.s_addr))
+	return wild;
+}
+
+/*
+ * Find the TCB to deliver a segment to: its connection, else a listener on
+ * the port. Called under the RCU read lock; the TCB must be tryretained.
+ */
+static tcp_t *
+tcp_lookup(struct in_addr src, uint16_t sport, struct in_addr dst,
+    uint16_t dport)
+{
+	unsigned int seq;
+	tcp_t *t;
+
+	seq = __atomic_load_n(&tcp_connhash_seq, __ATOMIC_ACQUIRE);
+
+	t = tcp_connhash_lookup(src, sport, dst, dport);
+	if (t != NULL)
+		return t;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if ((seq & 1) != 0 ||
+	    __atomic_load_n(&tcp_connhash_seq, __ATOMIC_RELAXED) != seq) {
+		/* raced with a resize; the connection may have been missed */
+		ke_spinlock_enter_nospl(&tcp_conntab_lock);
+		t = tcp_connhash_lookup(src, sport, dst, dport);
+		ke_spinlock_exit_nospl(&tcp_conntab_lock);
+		if (t != NULL)
 			return t;
 	}
 
-	return NULL;
+	return tcp_listenhash_lookup(dst, dport);
 }
 
 static int
 tcp_do_bind(tcp_t *tp, struct sockaddr_in *laddr)
 {
 	uint16_t port;
-	int r;
 	ipl_t ipl;
 
 	ipl = ke_spinlock_enter(&tcp_conntab_lock);
@@ -781,12 +1101,7 @@ tcp_do_bind(tcp_t *tp, struct sockaddr_in *laddr)
 	tp->laddr.sin_port = port;
 	tp->laddr.sin_addr = laddr->sin_addr;
 
-	r = tcp_conn_table_insert_locked(tp);
-	if (r != 0) {
-		ke_spinlock_exit(&tcp_conntab_lock, ipl);
-		return r;
-	}
-
+	tcp_porthash_insert_locked(tp);
 	tcp_change_state(tp, TCPS_BOUND);
 
 	ke_spinlock_exit(&tcp_conntab_lock, ipl);
@@ -799,6 +1114,261 @@ tcp_issgen(void)
 	return ke_time() / 4000;
 }
 
+/* millisecond clock for timestamps */
+static uint32_t
+tcp_ts_now(void)
+{
+	return (uint32_t)(ke_time() / NS_PER_MS);
+}
+
+/* the window shift we need to advertise a TCP_RCVBUF_MAX window */
+static uint8_t
+tcp_rcv_wscale(void)
+{
+	uint8_t shift = 0;
+
+	while (shift < TCP_MAX_WINSHIFT &&
+	    ((uint32_t)UINT16_MAX << shift) < TCP_RCVBUF_MAX)
+		shift++;
+
+	return shift;
+}
+
+/* the largest receive buffer the agreed window shift lets us advertise */
+static uint32_t
+tcp_rcvbuf_limit(tcp_t *tp)
+{
+	return tp->ws_ok ? TCP_RCVBUF_MAX : UINT16_MAX;
+}
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint8_t *
+put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static void
+tcp_parse_options(const struct tcphdr *th, struct tcp_opts *opts)
+{
+	const uint8_t *p = (const uint8_t *)(th + 1);
+	const uint8_t *lim = (const uint8_t *)th + (th->th_off << 2);
+	bool syn = (th->th_flags & TH_SYN) != 0;
+
+	opts->mss = 0;
+	opts->wscale = -1;
+	opts->sack_permitted = false;
+	opts->ts = false;
+	opts->tsval = opts->tsecr = 0;
+	opts->nsack = 0;
+
+	while (p < lim) {
+		uint8_t kind = p[0], len;
+
+		if (kind == TCPOPT_EOL)
+			break;
+		if (kind == TCPOPT_NOP) {
+			p++;
+			continue;
+		}
+		if (lim - p < 2)
+			break;
+		len = p[1];
+		if (len < 2 || len > lim - p)
+			break;
+
+		switch (kind) {
+		case TCPOPT_MAXSEG:
+			if (syn && len == TCPOLEN_MAXSEG)
+				opts->mss = (uint16_t)p[2] << 8 | p[3];
+			break;
+
+		case TCPOPT_WINDOW:
+			if (syn && len == TCPOLEN_WINDOW)
+				opts->wscale = MIN2(p[2], TCP_MAX_WINSHIFT);
+			break;
+
+		case TCPOPT_SACK_PERMITTED:
+			if (syn && len == TCPOLEN_SACK_PERMITTED)
+				opts->sack_permitted = true;
+			break;
+
+		case TCPOPT_SACK:
+			if ((len - 2) % TCPOLEN_SACK != 0)
+				break;
+			for (const uint8_t *b = p + 2; b < p + len &&
+			    opts->nsack < TCP_SACK_MAXBLOCKS;
+			    b += TCPOLEN_SACK) {
+				opts->sack[opts->nsack].start = get_be32(b);
+				opts->sack[opts->nsack].end = get_be32(b + 4);
+				opts->nsack++;
+			}
+			break;
+
+		case TCPOPT_TIMESTAMP:
+			if (len == TCPOLEN_TIMESTAMP) {
+				opts->ts = true;
+				opts->tsval = get_be32(p + 2);
+				opts->tsecr = get_be32(p + 6);
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		p += len;
+	}
+}
+
+/*
+ * Settle the options of a connection from those of the peer's SYN; those we
+ * offered but the peer didn't are turned off.
+ */
+static void
+tcp_syn_options(tcp_t *tp, const struct tcp_opts *opts)
+{
+	if (opts->mss != 0)
+		tp->mss = MIN2(tp->mss, opts->mss);
+
+	if (tp->ws_ok && opts->wscale >= 0) {
+		tp->snd_wscale = opts->wscale;
+	} else {
+		tp->ws_ok = false;
+		tp->snd_wscale = tp->rcv_wscale = 0;
+		tp->rcv_wnd_max = MIN2(tp->rcv_wnd_max, tcp_rcvbuf_limit(tp));
+		tp->rcv_wnd = MIN2(tp->rcv_wnd, tp->rcv_wnd_max);
+	}
+
+	if (tp->ts_ok && opts->ts) {
+		tp->ts_recent = opts->tsval;
+		tp->ts_recent_age = ke_time();
+	} else {
+		tp->ts_ok = false;
+	}
+
+	tp->sack_ok = tp->sack_ok && opts->sack_permitted;
+}
+
+/* Build the SACK blocks describing the reassembly queue. */
+static size_t
+tcp_sack_blocks_build(tcp_t *tp, struct tcp_sack_block *blocks, size_t max)
+{
+	struct tcp_sack_block runs[TCP_SACK_SCOREBOARD];
+	size_t nruns = 0, n = 0;
+	mblk_t *mq;
+
+	TAILQ_FOREACH(mq, &tp->reass_queue, link) {
+		const struct tcphdr *thq = (struct tcphdr *)mq->rptr;
+		tcp_seq_t seq = ntohl(thq->th_seq);
+		tcp_seq_t end = seq + thq->th_datalen;
+
+		if (seq == end)
+			continue;
+
+		if (nruns != 0 && runs[nruns - 1].end == seq)
+			runs[nruns - 1].end = end;
+		else if (nruns < TCP_SACK_SCOREBOARD)
+			runs[nruns++] = (struct tcp_sack_block) { seq, end };
+		else
+			break;
+	}
+
+	/* RFC 2018: the first block must hold the latest segment received */
+	for (size_t i = 0; i < nruns; i++) {
+		if (SEQ_GEQ(tp->rcv_lastsack, runs[i].start) &&
+		    SEQ_LT(tp->rcv_lastsack, runs[i].end)) {
+			blocks[n++] = runs[i];
+			runs[i].start = runs[i].end;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < nruns && n < max; i++)
+		if (runs[i].start != runs[i].end)
+			blocks[n++] = runs[i];
+
+	return n;
+}
+
+/*
+ * Write out the options for a segment with the given flags into opt, which
+ * has room for TCP_MAXOLEN bytes. Returns their length, a multiple of 4.
+ */
+static size_t
+tcp_build_options(tcp_t *tp, uint8_t flags, uint8_t *opt)
+{
+	uint8_t *p = opt;
+
+	if (flags & TH_SYN) {
+		*p++ = TCPOPT_MAXSEG;
+		*p++ = TCPOLEN_MAXSEG;
+		*p++ = tp->mss >> 8;
+		*p++ = tp->mss & 0xff;
+
+		if (tp->ws_ok) {
+			*p++ = TCPOPT_NOP;
+			*p++ = TCPOPT_WINDOW;
+			*p++ = TCPOLEN_WINDOW;
+			*p++ = tp->rcv_wscale;
+		}
+
+		if (tp->sack_ok) {
+			if (!tp->ts_ok) {
+				*p++ = TCPOPT_NOP;
+				*p++ = TCPOPT_NOP;
+			}
+			*p++ = TCPOPT_SACK_PERMITTED;
+			*p++ = TCPOLEN_SACK_PERMITTED;
+		} else if (tp->ts_ok) {
+			*p++ = TCPOPT_NOP;
+			*p++ = TCPOPT_NOP;
+		}
+	} else if (tp->ts_ok) {
+		*p++ = TCPOPT_NOP;
+		*p++ = TCPOPT_NOP;
+	}
+
+	if (tp->ts_ok) {
+		*p++ = TCPOPT_TIMESTAMP;
+		*p++ = TCPOLEN_TIMESTAMP;
+		p = put_be32(p, tcp_ts_now());
+		p = put_be32(p, tp->ts_recent);
+	}
+
+	if (tp->sack_ok && !(flags & (TH_SYN | TH_RST)) &&
+	    !TAILQ_EMPTY(&tp->reass_queue)) {
+		struct tcp_sack_block blocks[TCP_SACK_MAXBLOCKS];
+		size_t n;
+
+		n = tcp_sack_blocks_build(tp, blocks,
+		    (TCP_MAXOLEN - (p - opt) - 4) / TCPOLEN_SACK);
+		if (n != 0) {
+			*p++ = TCPOPT_NOP;
+			*p++ = TCPOPT_NOP;
+			*p++ = TCPOPT_SACK;
+			*p++ = 2 + n * TCPOLEN_SACK;
+			for (size_t i = 0; i < n; i++) {
+				p = put_be32(p, blocks[i].start);
+				p = put_be32(p, blocks[i].end);
+			}
+		}
+	}
+
+	kassert((p - opt) % 4 == 0 && (size_t)(p - opt) <= TCP_MAXOLEN);
+	return p - opt;
+}
+
 static int
 tcp_setup_connection(tcp_t *tp, struct sockaddr_in *faddr)
 {
@@ -813,18 +1383,24 @@ tcp_setup_connection(tcp_t *tp, struct sockaddr_in *faddr)
 	tp->snd_wl2 = 0;
 
 	if (tp->mss > 2190)
-		tp->snd_cwnd = 2 * tp->mss;
+		tp->cc.snd_cwnd = 2 * tp->mss;
 	else if (tp->mss > 1095)
-		tp->snd_cwnd = 3 * tp->mss;
+		tp->cc.snd_cwnd = 3 * tp->mss;
 	else
-		tp->snd_cwnd = 4 * tp->mss;
-	tp->snd_ssthresh = INT32_MAX;
+		tp->cc.snd_cwnd = 4 * tp->mss;
+	tp->cc.snd_ssthresh = INT32_MAX;
+	tp->cc.algo->init(&tp->cc, tp->mss);
 	tp->snd_recover = tp->iss;
 
-	tp->bytes_acked = 0;
 	tp->dupacks = 0;
 	tp->fast_recovery = false;
 
+	/* offer everything; tcp_syn_options() keeps what the peer agrees to */
+	tp->ws_ok = true;
+	tp->ts_ok = true;
+	tp->sack_ok = true;
+	tp->rcv_wscale = tcp_rcv_wscale();
+
 	tp->emit_ack = false;
 
 	tp->conn_con_m = str_allocb(sizeof(struct T_conn_con));
@@ -917,6 +1493,9 @@ tcp_wput_bind_req(queue_t *wq, mblk_t *mp)
 	if (br->CONIND_number > 0) {
 		tp->closing = false;
 		tcp_change_state(tp, TCPS_LISTEN);
+		ke_spinlock_enter_nospl(&tcp_conntab_lock);
+		tcp_listenhash_insert_locked(tp);
+		ke_spinlock_exit_nospl(&tcp_conntab_lock);
 	} else {
 		tcp_change_state(tp, TCPS_BOUND);
 	}
@@ -933,6 +1512,7 @@ tcp_wput_conn_req(queue_t *wq, mblk_t *mp)
 	struct T_conn_req *cr = (struct T_conn_req *)mp->rptr;
 	struct sockaddr_in *dest = (struct sockaddr_in *)&cr->DEST;
 	tcp_t *tp = wq->ptr;
+	bool grow;
 	ipl_t ipl;
 	int r;
 
@@ -997,11 +1577,18 @@ tcp_wput_conn_req(queue_t *wq, mblk_t *mp)
 			return;
 		}
 
+		ke_spinlock_enter_nospl(&tcp_conntab_lock);
+		grow = tcp_connhash_insert_locked(tp);
+		ke_spinlock_exit_nospl(&tcp_conntab_lock);
+
 		tcp_change_state(tp, TCPS_SYN_SENT);
 		tcp_output(tp);
 
 		ke_spinlock_exit(&tp->lock, ipl);
 
+		if (grow)
+			tcp_connhash_grow();
+
 		reply_ok_ack(wq, mp, T_CONN_REQ);
 		break;
 
@@ -1139,6 +1726,82 @@ tcp_wput_addr_req(queue_t *wq, mblk_t *mp)
 	str_qreply(wq, ackmp);
 }
 
+/* switch congestion control algorithm; the new one starts from the window */
+static int
+tcp_set_congestion(tcp_t *tp, const char *val, size_t len)
+{
+	const struct tcp_cc_algo *algo;
+	char name[TCP_CC_NAME_MAX];
+	ipl_t ipl;
+
+	len = MIN2(len, sizeof(name) - 1);
+	memcpy(name, val, len);
+	name[len] = '\0';
+
+	algo = tcp_cc_lookup(name);
+	if (algo == NULL)
+		return ENOENT;
+
+	ipl = ke_spinlock_enter(&tp->lock);
+	if (tp->cc.algo != algo) {
+		tp->cc.algo = algo;
+		algo->init(&tp->cc, tp->mss);
+	}
+	ke_spinlock_exit(&tp->lock, ipl);
+
+	return 0;
+}
+
+static void
+tcp_wput_optmgmt_req(queue_t *wq, mblk_t *mp, struct T_optmgmt_req *req)
+{
+	struct T_optmgmt_ack *ack;
+	tcp_t *tp = wq->ptr;
+	struct opthdr *opt;
+	size_t msg_len = (size_t)(mp->wptr - mp->rptr);
+	int r;
+
+	if (req->OPT_length < sizeof(struct opthdr) ||
+	    req->OPT_offset + req->OPT_length > msg_len)
+		return reply_error_ack(wq, mp, req->PRIM_type, EINVAL);
+
+	if (req->MGMT_flags != T_NEGOTIATE)
+		return reply_error_ack(wq, mp, req->PRIM_type, EOPNOTSUPP);
+
+	opt = (struct opthdr *)(mp->rptr + req->OPT_offset);
+
+	if (opt->len > req->OPT_length - sizeof(struct opthdr))
+		return reply_error_ack(wq, mp, req->PRIM_type, EINVAL);
+
+	switch (opt->level) {
+	case IPPROTO_TCP:
+		switch (opt->name) {
+		case TCP_CONGESTION:
+			r = tcp_set_congestion(tp, OPTVAL(opt), opt->len);
+			if (r != 0)
+				return reply_error_ack(wq, mp, req->PRIM_type,
+				    r);
+			break;
+
+		default:
+			kdprintf("tcp: IPPROTO_TCP unhandled option %zu\n",
+			    opt->name);
+			return reply_error_ack(wq, mp, req->PRIM_type,
+			    ENOPROTOOPT);
+		}
+
+		break;
+
+	default:
+		return reply_error_ack(wq, mp, req->PRIM_type, ENOPROTOOPT);
+	}
+
+	mp->db->type = M_PCPROTO;
+	ack = (struct T_optmgmt_ack *)mp->rptr;
+	ack->PRIM_type = T_OPTMGMT_ACK;
+	str_qreply(wq, mp);
+}
+
 static void
 tcp_wput_ordrel_req(queue_t *wq, mblk_t *mp)
 {
@@ -1229,6 +1892,10 @@ tcp_wput(queue_t *wq, mblk_t *mp)
 			tcp_wput_addr_req(wq, mp);
 			break;
 
+		case T_OPTMGMT_REQ:
+			tcp_wput_optmgmt_req(wq, mp, &prim->optmgmt_req);
+			break;
+
 		case T_ORDREL_REQ:
 			tcp_wput_ordrel_req(wq, mp);
 			break;
@@ -1308,6 +1975,28 @@ tcp_rsrv(queue_t *rq)
 
 		return;
 	}
+
+	/* the receive buffer grew; let the stream head hold as much */
+	if (tp->pending_setopts) {
+		mblk_t *mp = str_allocb(sizeof(struct stroptions));
+
+		if (mp != NULL) {
+			struct stroptions *sop = (struct stroptions *)mp->rptr;
+
+			tp->pending_setopts = false;
+			rq->hiwat = tp->rcv_wnd_max;
+
+			mp->db->type = M_SETOPTS;
+			mp->wptr += sizeof(*sop);
+			sop->flags = SO_HIWAT;
+			sop->hiwat = tp->rcv_wnd_max;
+			ke_spinlock_exit(&tp->lock, ipl);
+
+			str_putnext(rq, mp);
+
+			ipl = ke_spinlock_enter(&tp->lock);
+		}
+	}
 	ke_spinlock_exit(&tp->lock, ipl);
 
 	for (;;) {
@@ -1361,48 +2050,14 @@ tcp_rsrv(queue_t *rq)
 	}
 }
 
-static uint32_t
-csum_add(uint32_t sum, const uint8_t *p, size_t len)
-{
-	while (len >= 2) {
-		sum += ((uint16_t)p[0] << 8) | p[1];
-		p += 2;
-		len -= 2;
-	}
-	if (len)
-		sum += (uint16_t)p[0] << 8;
-
-	while (sum >> 16)
-		sum = (sum & 0xffff) + (sum >> 16);
-
-	return sum;
-}
-
-static uint16_t
-csum_finish(uint32_t sum)
-{
-	while (sum >> 16)
-		sum = (sum & 0xffff) + (sum >> 16);
-	return (uint16_t)~sum;
-}
-
+/* the checksum, in network byte order; 0 if verifying a correct one */
 static uint16_t
 tcp_checksum(const struct ip *ip, const struct tcphdr *th, size_t tcp_len)
 {
-	uint8_t pseudo[12];
-	uint32_t sum = 0;
-
-	memcpy(&pseudo[0], &ip->ip_src.s_addr, 4);
-	memcpy(&pseudo[4], &ip->ip_dst.s_addr, 4);
-	pseudo[8] = 0;
-	pseudo[9] = IPPROTO_TCP;
-	pseudo[10] = (tcp_len >> 8) & 0xff;
-	pseudo[11] = tcp_len & 0xff;
-
-	sum = csum_add(sum, pseudo, sizeof(pseudo));
-	sum = csum_add(sum, (const uint8_t *)th, tcp_len);
+	uint64_t sum;
 
-	return csum_finish(sum);
+	sum = ip_cksum_pseudo4(ip->ip_src, ip->ip_dst, IPPROTO_TCP, tcp_len);
+	return ~in_cksum_fold(in_cksum_partial(th, tcp_len, sum));
 }
 
 static void
@@ -1446,7 +2101,7 @@ tcp_reply(const struct ip *orig_ip, const struct tcphdr *orig_th,
 	th->th_win = 0;
 	th->th_urp = 0;
 	th->th_sum = 0;
-	th->th_sum = htons(tcp_checksum(ip, th, sizeof(struct tcphdr)));
+	th->th_sum = tcp_checksum(ip, th, sizeof(struct tcphdr));
 
 	ipv4_output(mp);
 }
@@ -1541,18 +2196,24 @@ static int
 do_send(tcp_t *tp, tcp_seq_t seq, uint8_t flags, size_t data_len,
     size_t data_off)
 {
+	uint8_t opt[TCP_MAXOLEN];
+	size_t optlen, hdrlen;
 	mblk_t *mp;
 	struct ip *ip;
 	struct tcphdr *th;
+	uint32_t win;
+
+	optlen = tcp_build_options(tp, flags, opt);
+	hdrlen = sizeof(struct tcphdr) + optlen;
 
 	mp = str_allocb(sizeof(struct ether_header) + sizeof(struct ip) +
-	    sizeof(struct tcphdr) + data_len);
+	    hdrlen + data_len);
 	if (mp == NULL)
 		return -ENOMEM;
 
 	mp->rptr += sizeof(struct ether_header);
-	mp->wptr += sizeof(struct ether_header) + sizeof(struct ip) +
-	    sizeof(struct tcphdr) + data_len;
+	mp->wptr += sizeof(struct ether_header) + sizeof(struct ip) + hdrlen +
+	    data_len;
 
 	ip = (struct ip *)mp->rptr;
 	th = (struct tcphdr *)(ip + 1);
@@ -1560,7 +2221,7 @@ do_send(tcp_t *tp, tcp_seq_t seq, uint8_t flags, size_t data_len,
 	ip->ip_v = IPVERSION;
 	ip->ip_hl = sizeof(struct ip) >> 2;
 	ip->ip_tos = 0;
-	ip->ip_len = htons(sizeof(struct ip) + sizeof(struct tcphdr) + data_len);
+	ip->ip_len = htons(sizeof(struct ip) + hdrlen + data_len);
 	ip->ip_id = htons(0);
 	ip->ip_off = 0;
 	ip->ip_ttl = 64;
@@ -1573,18 +2234,30 @@ do_send(tcp_t *tp, tcp_seq_t seq, uint8_t flags, size_t data_len,
 	th->th_dport = tp->faddr.sin_port;
 	th->th_seq = htonl(seq);
 	th->th_ack = htonl(tp->rcv_nxt);
-	th->th_off = sizeof(struct tcphdr) >> 2;
+	th->th_off = hdrlen >> 2;
 	th->th_flags = flags;
-	th->th_win = htons(tp->rcv_wnd);
+	/* the window in a SYN is never scaled */
+	win = (flags & TH_SYN) ? tp->rcv_wnd : tp->rcv_wnd >> tp->rcv_wscale;
+	th->th_win = htons(MIN2(win, UINT16_MAX));
 	th->th_x2 = 0;
 	th->th_urp = 0;
 
-	kassert(copy_data(tp, data_off, data_len, (uint8_t *)(th + 1)) ==
-	    data_len);
+	memcpy(th + 1, opt, optlen);
+	kassert(copy_data(tp, data_off, data_len, (uint8_t *)(th + 1) +
+	    optlen) == data_len);
 
-	th->th_sum = 0;
-	th->th_sum = htons(tcp_checksum(ip, th, sizeof(struct tcphdr) +
-	    data_len));
+	/* the checksum is finished by the NIC, or by ip_if_output() */
+	th->th_sum = in_cksum_fold(ip_cksum_pseudo4(ip->ip_src, ip->ip_dst,
+	    IPPROTO_TCP, hdrlen + data_len));
+	mp->db->cksum_flags = DB_CKSUM_PARTIAL;
+	mp->db->cksum_start = sizeof(struct ip);
+	mp->db->cksum_stuff = sizeof(struct ip) +
+	    offsetof(struct tcphdr, th_sum);
+	/* a super-segment, for the NIC or ip_gso_output() to cut up */
+	if (data_len > tp->mss - optlen)
+		mp->db->lso_mss = tp->mss - optlen;
+
+	tp->last_ack_sent = tp->rcv_nxt;
 
 	ipv4_output(mp);
 
@@ -1606,12 +2279,44 @@ static uint8_t tcp_out_flags[] = {
 	[TCPS_TIME_WAIT]	= TH_ACK,
 };
 
+/* payload that fits in a segment alongside its options */
+static uint32_t
+tcp_maxseg(tcp_t *tp, uint8_t flags)
+{
+	uint8_t opt[TCP_MAXOLEN];
+
+	return tp->mss - tcp_build_options(tp, flags, opt);
+}
+
+/* payload of the largest super-segment, in whole segments of maxseg */
+static uint32_t
+tcp_maxburst(tcp_t *tp, uint32_t maxseg)
+{
+	uint32_t optlen = tp->mss - maxseg;
+
+	return (TCP_GSO_MAX - sizeof(struct ip) - sizeof(struct tcphdr) -
+	    optlen) / maxseg * maxseg;
+}
+
+/*
+ * Estimate of the bytes outstanding in the network during SACK loss recovery
+ * (RFC 6675 "pipe"): those sent and neither acknowledged nor SACKed, counting
+ * retransmissions again. Retransmissions later acknowledged cumulatively are
+ * uncounted as snd_una passes them; see tcp_sack_ack().
+ */
+static uint32_t
+tcp_pipe(tcp_t *tp)
+{
+	return tp->snd_max - tp->snd_una - tp->sacked_bytes +
+	    tp->sack_bytes_rexmit;
+}
+
 int
 tcp_output(tcp_t *tp)
 {
 	uint8_t flags;
 	int data_len, data_off;
-	int swnd;
+	int swnd, maxseg, maxburst;
 	uint32_t flight;
 	bool can_send_more;
 	tcp_seq_t old_nxt;
@@ -1642,11 +2347,14 @@ send_more:
 	 * And FIN, being the last thing sent, doesn't affect the offset.
 	 */
 
-	flight = tp->snd_max - tp->snd_una;
+	if (tp->fast_recovery && tp->sack_ok)
+		flight = tcp_pipe(tp);
+	else
+		flight = tp->snd_max - tp->snd_una;
 	data_len = tcp_snd_q_count(tp);
 	data_off = tp->snd_nxt - tp->snd_una;
 	data_len -= data_off;
-	swnd = MIN2(tp->snd_wnd, tp->snd_cwnd) - flight;
+	swnd = MIN2(tp->snd_wnd, tp->cc.snd_cwnd) - flight;
 
 	if (data_len < 0)
 		data_len = 0;
@@ -1655,8 +2363,18 @@ send_more:
 
 	data_len = MIN2(data_len, swnd);
 
-	if (data_len > tp->mss) {
-		data_len = tp->mss;
+	/*
+	 * Send as many whole segments as possible at once, in a super-segment
+	 * that the NIC or ip_gso_output() cuts up. A runt goes separately, so
+	 * Nagle can hold it back.
+	 */
+	maxseg = tcp_maxseg(tp, flags);
+	maxburst = tcp_maxburst(tp, maxseg);
+	if (data_len > maxburst) {
+		data_len = maxburst;
+		can_send_more = true;
+	} else if (data_len > maxseg && data_len % maxseg != 0) {
+		data_len -= data_len % maxseg;
 		can_send_more = true;
 	}
 
@@ -1667,7 +2385,7 @@ send_more:
 	 * Also sending FIN.
 	 */
 	if (data_len != 0 && (flags & TH_FIN) == 0) {
-		if (tp->snd_wnd < tp->mss || data_len < tp->mss) {
+		if (tp->snd_wnd < (uint32_t)maxseg || data_len < maxseg) {
 			if (tp->snd_una != tp->snd_max) {
 				TCP_TRACE("nagle delaying send\n");
 				data_len = 0;
@@ -1749,7 +2467,12 @@ tcp_rexmit(tcp_t *tp)
 	flags = tcp_out_flags[tp->state];
 
 	data_out = MIN2(outstanding, (uint32_t)tcp_snd_q_count(tp));
-	rexmit_len = MIN2((size_t)data_out, (size_t)tp->mss);
+	rexmit_len = MIN2((size_t)data_out, (size_t)tcp_maxseg(tp, flags));
+
+	/* nor resend what the peer has SACKed */
+	if (tp->nsack_blocks != 0)
+		rexmit_len = MIN2(rexmit_len,
+		    (size_t)(tp->sack_blocks[0].start - tp->snd_una));
 
 	/*
 	 * only retransmit fin if it is unacknowledged, AND this rexmit includes
@@ -1765,6 +2488,159 @@ tcp_rexmit(tcp_t *tp)
 	return do_send(tp, tp->snd_una, flags, rexmit_len, 0);
 }
 
+/*
+ * SACK scoreboard and loss recovery (RFC 6675)
+ */
+
+static void
+tcp_sack_count(tcp_t *tp)
+{
+	tp->sacked_bytes = 0;
+	for (size_t i = 0; i < tp->nsack_blocks; i++)
+		tp->sacked_bytes += tp->sack_blocks[i].end -
+		    tp->sack_blocks[i].start;
+}
+
+static void
+tcp_sack_clear(tcp_t *tp)
+{
+	tp->nsack_blocks = 0;
+	tp->sacked_bytes = 0;
+	tp->sack_bytes_rexmit = 0;
+}
+
+/* Merge [start, end) into the scoreboard, which is kept sorted and disjoint. */
+static void
+tcp_sack_insert(tcp_t *tp, tcp_seq_t start, tcp_seq_t end)
+{
+	struct tcp_sack_block *b = tp->sack_blocks;
+	size_t n = tp->nsack_blocks, i, j;
+
+	for (i = 0; i < n && SEQ_LT(b[i].end, start); i++)
+		;
+
+	/* absorb the blocks that overlap or abut it */
+	for (j = i; j < n && SEQ_LEQ(b[j].start, end); j++) {
+		if (SEQ_LT(b[j].start, start))
+			start = b[j].start;
+		if (SEQ_GT(b[j].end, end))
+			end = b[j].end;
+	}
+
+	if (j == i) {
+		if (n == TCP_SACK_SCOREBOARD) {
+			/* full; forget the highest block */
+			if (i == n)
+				return;
+			n--;
+		}
+		memmove(&b[i + 1], &b[i], (n - i) * sizeof(*b));
+		n++;
+	} else if (j > i + 1) {
+		memmove(&b[i + 1], &b[j], (n - j) * sizeof(*b));
+		n -= j - i - 1;
+	}
+
+	b[i].start = start;
+	b[i].end = end;
+	tp->nsack_blocks = n;
+}
+
+/* Take in the SACK blocks of an incoming ACK. */
+static void
+tcp_sack_update(tcp_t *tp, const struct tcp_opts *opts)
+{
+	for (size_t i = 0; i < opts->nsack; i++) {
+		tcp_seq_t start = opts->sack[i].start, end = opts->sack[i].end;
+
+		if (!SEQ_LT(start, end) || SEQ_LEQ(end, tp->snd_una) ||
+		    SEQ_GT(end, tp->snd_max))
+			continue;
+		if (SEQ_LT(start, tp->snd_una))
+			start = tp->snd_una;
+
+		tcp_sack_insert(tp, start, end);
+	}
+
+	tcp_sack_count(tp);
+}
+
+/* Forget what the cumulative ACK has passed; snd_una was old_una. */
+static void
+tcp_sack_ack(tcp_t *tp, tcp_seq_t old_una)
+{
+	struct tcp_sack_block *b = tp->sack_blocks;
+	size_t n = tp->nsack_blocks, i;
+
+	for (i = 0; i < n && SEQ_LEQ(b[i].end, tp->snd_una); i++)
+		;
+	if (i < n && SEQ_LT(b[i].start, tp->snd_una))
+		b[i].start = tp->snd_una;
+	memmove(b, &b[i], (n - i) * sizeof(*b));
+	tp->nsack_blocks = n - i;
+	tcp_sack_count(tp);
+
+	/* retransmissions below the ACK have left the network */
+	if (SEQ_GT(tp->sack_rxt_next, old_una)) {
+		tcp_seq_t end = SEQ_LT(tp->snd_una, tp->sack_rxt_next) ?
+		    tp->snd_una : tp->sack_rxt_next;
+		uint32_t left = end - old_una;
+
+		tp->sack_bytes_rexmit -= MIN2(left, tp->sack_bytes_rexmit);
+	}
+}
+
+/*
+ * Retransmit as much as fits in a segment of the first hole in the scoreboard
+ * at or above sack_rxt_next. Only data below a SACKed range is taken to be
+ * lost. Returns whether there was such a hole.
+ */
+static bool
+tcp_sack_rexmit_hole(tcp_t *tp)
+{
+	uint32_t queued = tcp_snd_q_count(tp);
+	tcp_seq_t seq;
+
+	seq = SEQ_GT(tp->sack_rxt_next, tp->snd_una) ? tp->sack_rxt_next :
+						       tp->snd_una;
+
+	for (size_t i = 0; i < tp->nsack_blocks; i++) {
+		struct tcp_sack_block *blk = &tp->sack_blocks[i];
+		uint32_t len;
+
+		if (SEQ_GEQ(seq, blk->end))
+			continue;
+		if (SEQ_GEQ(seq, blk->start)) {
+			seq = blk->end;
+			continue;
+		}
+
+		if (seq - tp->snd_una >= queued)
+			return false;
+
+		len = MIN2(blk->start - seq, tcp_maxseg(tp, TH_ACK));
+		len = MIN2(len, queued - (seq - tp->snd_una));
+		if (do_send(tp, seq, TH_ACK, len, seq - tp->snd_una) != 0)
+			return false;
+
+		tp->sack_rxt_next = seq + len;
+		tp->sack_bytes_rexmit += len;
+		return true;
+	}
+
+	return false;
+}
+
+/* Send what the pipe allows during SACK recovery: holes, then new data. */
+static void
+tcp_sack_output(tcp_t *tp)
+{
+	while (tcp_pipe(tp) + tp->mss <= tp->cc.snd_cwnd &&
+	    tcp_sack_rexmit_hole(tp))
+		;
+	tcp_output(tp);
+}
+
 /*
  * input processing
  */
@@ -1944,10 +2820,6 @@ tcp_abort(tcp_t *tp, int err)
  * reassembly/segment delivery
  */
 
-/* reuse header fields for our own bookkeeping within tcp_conn_input */
-#define th_1stdata th_sport
-#define th_datalen th_dport
-
 static void
 tcp_snd_q_consume(tcp_t *tp, int bytes_acked)
 {
@@ -1997,6 +2869,40 @@ tcp_snd_q_consume(tcp_t *tp, int bytes_acked)
 	}
 }
 
+/*
+ * Grow the receive buffer when the peer sends more than half of it within a
+ * round trip, so that the window doesn't hold the connection back. The stream
+ * head is told to buffer as much by tcp_rsrv().
+ */
+static void
+tcp_rcvbuf_autotune(tcp_t *tp)
+{
+	kabstime_t now = ke_time();
+	uint32_t rtt_ms = tp->srtt != 0 ? tp->srtt : TCP_INIT_RTO_MS;
+	uint32_t received, limit, grow;
+
+	if (tp->rcvbuf_time != 0 &&
+	    now - tp->rcvbuf_time < (kabstime_t)rtt_ms * NS_PER_MS)
+		return;
+
+	received = tp->rcv_nxt - tp->rcvbuf_seq;
+	if (tp->rcvbuf_time == 0)
+		received = 0;
+	tp->rcvbuf_seq = tp->rcv_nxt;
+	tp->rcvbuf_time = now;
+
+	limit = tcp_rcvbuf_limit(tp);
+	if (received <= tp->rcv_wnd_max / 2 || tp->rcv_wnd_max >= limit)
+		return;
+
+	grow = MIN2(tp->rcv_wnd_max * 2, limit) - tp->rcv_wnd_max;
+	tp->rcv_wnd_max += grow;
+	tp->rcv_wnd += grow;
+	tp->pending_setopts = true;
+
+	TCP_TRACE("TCB %p receive buffer now %u\n", tp, tp->rcv_wnd_max);
+}
+
 static struct tcphdr *
 mtoth(mblk_t *m)
 {
@@ -2056,6 +2962,10 @@ tcp_queue_for_reassembly(tcp_t *tp, mblk_t *m, struct tcphdr *th,
 
 	*drop_mp = false;
 
+	/* out of order: the first SACK block we send must report it */
+	if (seg_seq != tp->rcv_nxt)
+		tp->rcv_lastsack = seg_seq;
+
 	if (mq != NULL)
 		TAILQ_INSERT_BEFORE(mq, m, link);
 	else
@@ -2140,24 +3050,34 @@ tcp_queue_for_reassembly(tcp_t *tp, mblk_t *m, struct tcphdr *th,
 		TAILQ_INSERT_TAIL(&tp->rcv_q, data_head, link);
 		tp->rcv_q_count += str_msgsize(data_head);
 		tp->rcv_wnd -= str_msgsize(data_head);
+
+		tcp_rcvbuf_autotune(tp);
 	}
 
 	return fin_reached;
 #undef SEG_LEN
 }
 
+/*
+ * Take an RTT sample from an ACK that advances snd_una: from the timestamp
+ * it echoes if timestamps are in use, else if it covers the segment timed.
+ */
 static void
-tcp_rtt_update(tcp_t *tp, tcp_seq_t ack_seq)
+tcp_rtt_update(tcp_t *tp, tcp_seq_t ack_seq, const struct tcp_opts *opts)
 {
 	kabstime_t now = ke_time();
 	uint32_t r;
 
-	if (!tp->timing_rtt || !SEQ_GEQ(ack_seq, tp->rtseq))
-		return;
-
-	r = (uint32_t)((now - tp->rtstart) / 1000000ULL);
+	if (tp->ts_ok && opts->ts && opts->tsecr != 0 &&
+	    (int32_t)(tcp_ts_now() - opts->tsecr) >= 0) {
+		r = tcp_ts_now() - opts->tsecr;
+	} else {
+		if (!tp->timing_rtt || !SEQ_GEQ(ack_seq, tp->rtseq))
+			return;
+		r = (uint32_t)((now - tp->rtstart) / 1000000ULL);
+	}
 
-	TCP_TRACE("Measured RTT = %u ms for seq %u\n", r, tp->rtseq);
+	TCP_TRACE("Measured RTT = %u ms for ack %u\n", r, ack_seq);
 
 #define ALPHA_RTT_SHIFT   3
 #define BETA_RTTVAR_SHIFT 2
@@ -2186,7 +3106,7 @@ tcp_rtt_update(tcp_t *tp, tcp_seq_t ack_seq)
 
 static tcp_t *
 tcp_passive_open(tcp_t *listener, const struct ip *ip, const struct tcphdr *th,
-    in_port_t sport, in_port_t dport)
+    const struct tcp_opts *opts, in_port_t sport, in_port_t dport)
 {
 	tcp_t *child;
 	struct sockaddr_in faddr;
@@ -2198,6 +3118,7 @@ tcp_passive_open(tcp_t *listener, const struct ip *ip, const struct tcphdr *th,
 	struct in_addr laddr = { .s_addr = INADDR_ANY };
 	uint32_t mtu;
 	uint16_t mss;
+	bool grow;
 	int r;
 
 	r = route_lookup(&rt_dst, &rt, true);
@@ -2226,6 +3147,7 @@ tcp_passive_open(tcp_t *listener, const struct ip *ip, const struct tcphdr *th,
 	ke_spinlock_enter_nospl(&child->lock);
 
 	child->mss = mss;
+	child->cc.algo = listener->cc.algo;
 
 	child->laddr.sin_family = AF_INET;
 	child->laddr.sin_port = dport;
@@ -2239,6 +3161,8 @@ tcp_passive_open(tcp_t *listener, const struct ip *ip, const struct tcphdr *th,
 	if (r != 0)
 		goto fail;
 
+	tcp_syn_options(child, opts);
+
 	child->conn_ind_m = str_allocb(sizeof(struct T_conn_ind));
 	if (child->conn_ind_m == NULL)
 		goto fail;
@@ -2247,10 +3171,11 @@ tcp_passive_open(tcp_t *listener, const struct ip *ip, const struct tcphdr *th,
 	child->conn_ind_m->wptr += sizeof(struct T_conn_ind);
 
 	ke_spinlock_enter_nospl(&tcp_conntab_lock);
-	r = tcp_conn_table_insert_locked(child);
+	tcp_porthash_insert_locked(child);
+	grow = tcp_connhash_insert_locked(child);
 	ke_spinlock_exit_nospl(&tcp_conntab_lock);
-	if (r != 0)
-		goto fail;
+	if (grow)
+		tcp_connhash_grow();
 
 	child->irs = ntohl(th->th_seq);
 	child->rcv_nxt = child->irs + 1;
@@ -2282,25 +3207,42 @@ tcp_cc_on_dup_ack(tcp_t *tp)
 		tp->dupacks++;
 
 	if (tp->fast_recovery) {
-		tp->snd_cwnd += tp->mss;
+		if (tp->sack_ok) {
+			tcp_sack_output(tp);
+			return;
+		}
+		if (tp->cc.algo->dupack != NULL)
+			tp->cc.algo->dupack(&tp->cc, tp->mss);
 		tcp_output(tp);
 		return;
 	}
 
-	if (tp->dupacks != 3)
+	/* with SACK, enough data SACKed above a hole also indicates a loss */
+	if (tp->dupacks != 3 &&
+	    !(tp->sack_ok && tp->sacked_bytes > 2 * (uint32_t)tp->mss))
 		return;
 
 	if (!SEQ_GT(tp->snd_una, tp->snd_recover))
 		return;
 
-	tp->snd_ssthresh = MAX2((tp->snd_max - tp->snd_una) / 2,
-	    2 * (uint32_t)tp->mss);
+	tp->cc.algo->loss(&tp->cc, tp->mss, tp->snd_max - tp->snd_una);
 	tp->snd_recover = tp->snd_max;
-	tp->snd_cwnd = tp->snd_ssthresh + 3 * tp->mss;
 	tp->fast_recovery = true;
 
 	tp->timing_rtt = false;
 
+	if (tp->sack_ok) {
+		tp->sack_rxt_next = tp->snd_una;
+		tp->sack_bytes_rexmit = 0;
+		/* the first hole goes regardless of the pipe */
+		if (!tcp_sack_rexmit_hole(tp))
+			tcp_rexmit(tp);
+		tcp_sack_output(tp);
+		return;
+	}
+
+	/* inflate by the three segments that left the network (RFC 6582) */
+	tp->cc.snd_cwnd += 3 * tp->mss;
 	tcp_rexmit(tp);
 }
 
@@ -2312,14 +3254,22 @@ tcp_cc_on_new_ack(tcp_t *tp, uint32_t acked_data, tcp_seq_t ack)
 
 	if (tp->fast_recovery) {
 		if (SEQ_GEQ(ack, tp->snd_recover)) {
-			tp->snd_cwnd = tp->snd_ssthresh;
+			tp->cc.algo->recovered(&tp->cc, tp->mss);
 			tp->fast_recovery = false;
+			tp->sack_bytes_rexmit = 0;
+			return;
+		} else if (tp->sack_ok) {
+			/* partial ACK; carry on through the holes */
+			tp->timing_rtt = false;
+			tcp_sack_output(tp);
 			return;
 		} else {
-			tp->snd_cwnd -= MIN2(tp->snd_cwnd, acked_data);
+			/* partial ACK: deflate by what it acked */
+			tp->cc.snd_cwnd -= MIN2(tp->cc.snd_cwnd, acked_data);
 			if (acked_data >= tp->mss)
-				tp->snd_cwnd += tp->mss;
-			tp->snd_cwnd = MAX2(tp->snd_cwnd, (uint32_t)tp->mss);
+				tp->cc.snd_cwnd += tp->mss;
+			tp->cc.snd_cwnd = MAX2(tp->cc.snd_cwnd,
+			    (uint32_t)tp->mss);
 
 			tp->timing_rtt = false;
 			tcp_rexmit(tp);
@@ -2328,15 +3278,8 @@ tcp_cc_on_new_ack(tcp_t *tp, uint32_t acked_data, tcp_seq_t ack)
 		}
 	}
 
-	if (tp->snd_cwnd < tp->snd_ssthresh) {
-		tp->snd_cwnd += MIN2((uint32_t)acked_data, tp->mss);
-	} else {
-		tp->bytes_acked += acked_data;
-		if (tp->bytes_acked >= tp->snd_cwnd) {
-			tp->bytes_acked -= tp->snd_cwnd;
-			tp->snd_cwnd += tp->mss;
-		}
-	}
+	if (acked_data != 0)
+		tp->cc.algo->ack(&tp->cc, tp->mss, acked_data, tp->srtt);
 }
 
 void
@@ -2345,6 +3288,8 @@ tcp_conn_input(tcp_t **tpp, mblk_t *mp, const ip_rxattr_t *attr)
 	const struct ip *ip = attr->l3hdr.ip4;
 	uint16_t tcp_len = (uint16_t)(mp->wptr - mp->rptr);
 	struct tcphdr *th = (struct tcphdr *)mp->rptr;
+	struct tcp_opts opts;
+	tcp_seq_t seg_seq;
 	bool got_fin = false;
 	uint16_t sport, dport;
 	bool dropmp = true;
@@ -2363,6 +3308,8 @@ do { \
 	goto finish; \
 } while (0)
 
+	tcp_parse_options(th, &opts);
+
 	th->th_1stdata = (th->th_off << 2);
 	th->th_datalen = tcp_len - th->th_1stdata;
 
@@ -2385,8 +3332,8 @@ do { \
 			if (listener->closing)
 				goto finish;
 
-			child = tcp_passive_open(listener, ip, th, sport,
-			    dport);
+			child = tcp_passive_open(listener, ip, th, &opts,
+			    sport, dport);
 			if (child == NULL)
 				goto finish;
 
@@ -2433,6 +3380,8 @@ do { \
 			tp->irs = ntohl(th->th_seq);
 			tp->rcv_nxt = tp->irs + 1;
 
+			tcp_syn_options(tp, &opts);
+
 			if (th->th_flags & TH_ACK)
 				tp->snd_una = ntohl(th->th_ack);
 
@@ -2451,7 +3400,7 @@ do { \
 
 			/* Maybe update RTT based on the SYN we sent. */
 			tcp_cancel_timer(tp, TCP_TIMER_REXMT);
-			tcp_rtt_update(tp, ntohl(th->th_ack));
+			tcp_rtt_update(tp, ntohl(th->th_ack), &opts);
 
 			/* skip the SYN space & trim excess data if any */
 			th->th_seq = htonl(ntohl(th->th_seq) + 1);
@@ -2473,6 +3422,24 @@ do { \
 		break;
 	}
 
+	/*
+	 * RFC 7323 5.3: PAWS. A segment with a timestamp older than the last
+	 * one accepted is an old duplicate; unless the connection has been idle
+	 * so long that the peer's clock may have wrapped.
+	 */
+	if (tp->ts_ok && opts.ts && !(th->th_flags & TH_RST) &&
+	    tp->ts_recent_age != 0 &&
+	    (int32_t)(opts.tsval - tp->ts_recent) < 0 &&
+	    ke_time() - tp->ts_recent_age <=
+		(kabstime_t)TCP_PAWS_IDLE_MS * NS_PER_MS) {
+		TCP_TRACE("PAWS: dropping segment with old timestamp\n");
+		tp->emit_ack = true;
+		tcp_output(tp);
+		goto finish;
+	}
+
+	seg_seq = ntohl(th->th_seq);
+
 	/* First, check sequence number: */
 
 	if (tp->rcv_wnd == 0) {
@@ -2538,6 +3505,14 @@ do { \
 		}
 	}
 
+	/* RFC 7323 4.3: the timestamp to echo is the acceptable segment's */
+	if (tp->ts_ok && opts.ts &&
+	    (int32_t)(opts.tsval - tp->ts_recent) >= 0 &&
+	    SEQ_LEQ(seg_seq, tp->last_ack_sent)) {
+		tp->ts_recent = opts.tsval;
+		tp->ts_recent_age = ke_time();
+	}
+
 	/* Second, check the RST bit: */
 	if (th->th_flags & TH_RST) {
 		if (SEQ_LT(ntohl(th->th_seq), tp->rcv_nxt) ||
@@ -2598,7 +3573,8 @@ do { \
 			else
 				tcp_passive_maybe_ind(tp);
 
-			tp->snd_wnd = ntohs(th->th_win);
+			tp->snd_wnd = (uint32_t)ntohs(th->th_win) <<
+			    tp->snd_wscale;
 			tp->snd_wl1 = ntohl(th->th_seq);
 			tp->snd_wl2 = ntohl(th->th_ack);
 
@@ -2616,12 +3592,16 @@ do { \
 	case TCPS_TIME_WAIT: {
 		bool our_fin_acked = false;
 
+		if (tp->sack_ok && opts.nsack != 0)
+			tcp_sack_update(tp, &opts);
+
 		if (SEQ_LEQ(ntohl(th->th_ack), tp->snd_una)) {
 			if (tp->snd_una != tp->snd_max &&
 			    th->th_datalen == 0 &&
 			    (th->th_flags & (TH_SYN | TH_FIN)) == 0 &&
 			    ntohl(th->th_ack) == tp->snd_una &&
-			    ntohs(th->th_win) == tp->snd_wnd) {
+			    ((uint32_t)ntohs(th->th_win) << tp->snd_wscale) ==
+				tp->snd_wnd) {
 				tcp_cc_on_dup_ack(tp);
 				goto finish;
 			}
@@ -2632,14 +3612,18 @@ do { \
 			goto finish;
 		} else {
 			uint32_t nseq_acked, bytes_acked;
+			tcp_seq_t old_una;
 
 		acceptable_ack:
 			nseq_acked = ntohl(th->th_ack) - tp->snd_una;
 			bytes_acked = MIN2(nseq_acked, tcp_snd_q_count(tp));
 
+			old_una = tp->snd_una;
 			tp->snd_una = ntohl(th->th_ack);
 			if (SEQ_LT(tp->snd_nxt, tp->snd_una))
 				tp->snd_nxt = tp->snd_una;
+			if (tp->sack_ok)
+				tcp_sack_ack(tp, old_una);
 
 			if (nseq_acked > tcp_snd_q_count(tp)) {
 				tp->snd_wnd -= tcp_snd_q_count(tp);
@@ -2657,13 +3641,14 @@ do { \
 			else
 				tcp_set_timer(tp, TCP_TIMER_REXMT, tp->rto);
 
-			tcp_rtt_update(tp, ntohl(th->th_ack));
+			tcp_rtt_update(tp, ntohl(th->th_ack), &opts);
 		}
 
 		if (SEQ_LT(tp->snd_wl1, ntohl(th->th_seq)) ||
 		    (tp->snd_wl1 == ntohl(th->th_seq) &&
 			SEQ_LEQ(tp->snd_wl2, ntohl(th->th_ack)))) {
-			tp->snd_wnd = ntohs(th->th_win);
+			tp->snd_wnd = (uint32_t)ntohs(th->th_win) <<
+			    tp->snd_wscale;
 			tp->snd_wl1 = ntohl(th->th_seq);
 			tp->snd_wl2 = ntohl(th->th_ack);
 			if (tp->snd_wnd != 0)
@@ -2796,6 +3781,20 @@ tcp_ipv4_input(ip_if_t *ifp, mblk_t *mp, ip_rxattr_t *attr)
 
 	th = (struct tcphdr *)mp->rptr;
 
+	if (th->th_off < sizeof(struct tcphdr) >> 2 ||
+	    (th->th_off << 2) > tcp_len) {
+		TCP_TRACE("Bad data offset\n");
+		str_freemsg(mp);
+		return;
+	}
+
+	if ((mp->db->cksum_flags & DB_CKSUM_VALID) == 0 &&
+	    tcp_checksum(ip, th, tcp_len) != 0) {
+		TCP_TRACE("Bad checksum\n");
+		str_freemsg(mp);
+		return;
+	}
+
 	TCP_TRACE(" -- src=" FMT_IP4 ":%u dst=" FMT_IP4 ":%u "
 	    "seq=%u ack=%u len=%u flags=%s%s%s%s%s%s\n",
 	    ARG_IP4(ip->ip_src.s_addr), ntohs(th->th_sport),
@@ -2808,12 +3807,11 @@ tcp_ipv4_input(ip_if_t *ifp, mblk_t *mp, ip_rxattr_t *attr)
 	    (th->th_flags & TH_ACK) ? "ACK " : "",
 	    (th->th_flags & TH_URG) ? "URG " : "");
 
-	ipl = ke_spinlock_enter(&tcp_conntab_lock);
-	tp = tcp_conn_lookup_locked(ip->ip_src, th->th_sport, ip->ip_dst,
-	    th->th_dport);
-	if (tp != NULL)
-		tcp_retain(tp);
-	ke_spinlock_exit(&tcp_conntab_lock, ipl);
+	ipl = ke_rcu_read_lock();
+	tp = tcp_lookup(ip->ip_src, th->th_sport, ip->ip_dst, th->th_dport);
+	if (tp != NULL && !tcp_tryretain(tp))
+		tp = NULL;
+	ke_rcu_read_unlock(ipl);
 
 	if (tp == NULL) {
 		TCP_TRACE("No matching connection found\n");
@@ -2844,13 +3842,20 @@ tcp_ipv4_input(ip_if_t *ifp, mblk_t *mp, ip_rxattr_t *attr)
  * Timer infrastructure
  */
 
+/*
+ * Only the retransmit timer needs to be punctual; the others may run up to an
+ * eighth late, so that e.g. the 2MSL timers of connections closed around the
+ * same time are expired together.
+ */
 void
 tcp_set_timer(tcp_t *tp, enum tcp_timer_type type, uint32_t timeout_ms)
 {
-	kabstime_t deadline = ke_time() + (kabstime_t)timeout_ms * NS_PER_MS;
+	kabstime_t timeout = (kabstime_t)timeout_ms * NS_PER_MS;
+	kabstime_t deadline = ke_time() + timeout;
 	tcp_cancel_timer(tp, type);
 	tp->timers[type].deadline = deadline;
-	ke_callout_set(&tp->timers[type].callout, deadline);
+	ke_callout_set_slack(&tp->timers[type].callout, deadline,
+	    type == TCP_TIMER_REXMT ? 0 : timeout / 8);
 }
 
 void
@@ -2909,16 +3914,17 @@ tcp_rexmt_timer(tcp_t *tp)
 		return;
 	}
 
-	if (tp->n_rexmits == 0) {
-		tp->snd_ssthresh = MAX2((tp->snd_max - tp->snd_una) / 2,
-		    2 * (uint32_t)tp->mss);
+	/* restart slow start; ssthresh is only cut on the first timeout */
+	tp->cc.algo->rto(&tp->cc, tp->mss, tp->snd_max - tp->snd_una,
+	    tp->n_rexmits == 0);
+	if (tp->n_rexmits == 0)
 		tp->snd_recover = tp->snd_max;
-	}
 
 	tp->n_rexmits++;
-	tp->snd_cwnd = tp->mss;	/* restart slow start */
 	tp->fast_recovery = false;
 	tp->dupacks = 0;
+	/* the receiver may since have discarded what it SACKed */
+	tcp_sack_clear(tp);
 
 	/*
 	 * Retransmit timer expired - stop timing RTT, backoff RTO, and let the
@@ -2971,4 +3977,43 @@ void
 tcp_init(void)
 {
 	ke_spinlock_init(&tcp_conntab_lock);
+	tcp_hash_seed = (uint32_t)ke_time();
+	tcp_connhash = tcp_connhash_alloc(TCP_CONNHASH_MIN);
+	kassert(tcp_connhash != NULL);
+	for (size_t i = 0; i < TCP_LISTENHASH_SIZE; i++)
+		RCULIST_INIT(&tcp_listenhash[i]);
+	for (size_t i = 0; i < TCP_PORTHASH_SIZE; i++)
+		LIST_INIT(&tcp_porthash[i]);
+}
+
+void
+dbg_tcp_dump(void)
+{
+	struct tcp_connhash *ch = tcp_connhash;
+	size_t used = 0, longest = 0;
+
+	for (size_t i = 0; i < ch->nbuckets; i++) {
+		size_t n = 0;
+		tcp_t *t;
+
+		RCULIST_FOREACH(t, &ch->buckets[i], connhash_entry)
+			n++;
+		used += n != 0;
+		longest = MAX2(longest, n);
+	}
+
+	kdprintf("tcp: %zu connections in %zu buckets (%zu used, "
+		 "longest chain %zu)\n",
+	    tcp_connhash_count, ch->nbuckets, used, longest);
+	kdprintf("tcp: default congestion control %s\n",
+	    tcp_cc_get_default()->name);
+
+	for (size_t i = 0; i < TCP_LISTENHASH_SIZE; i++) {
+		tcp_t *t;
+
+		RCULIST_FOREACH(t, &tcp_listenhash[i], listenhash_entry)
+			kdprintf("tcp: TCB %p listening on " FMT_IP4 ":%u\n",
+			    t, ARG_IP4(t->laddr.sin_addr.s_addr),
+			    ntohs(t->laddr.sin_port));
+	}
 }
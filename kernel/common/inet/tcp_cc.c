@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2026 Cloudarox Solutions.
+ * Created on Sat Oct 17 2026.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*!
+ * @file tcp_cc.c
+ * @brief TCP congestion control registry, and NewReno.
+ *
+ * NewReno (RFC 5681, with the fast recovery of RFC 6582) is the baseline the
+ * other algorithms are measured against, and lends them its handling of
+ * duplicate ACKs and recovery. New connections get the system default
+ * algorithm; setsockopt(TCP_CONGESTION) picks another for one socket.
+ */
+
+#include <sys/errno.h>
+#include <sys/k_types.h>
+#include <sys/libkern.h>
+
+#include <inet/tcp_cc.h>
+
+static const struct tcp_cc_algo *tcp_cc_algos[] = {
+	&tcp_cc_newreno,
+	&tcp_cc_cubic,
+};
+
+static const struct tcp_cc_algo *tcp_cc_default = &tcp_cc_cubic;
+
+/*! @brief Find an algorithm by name; NULL if there's none. */
+const struct tcp_cc_algo *
+tcp_cc_lookup(const char *name)
+{
+	for (size_t i = 0; i < elementsof(tcp_cc_algos); i++)
+		if (strcmp(tcp_cc_algos[i]->name, name) == 0)
+			return tcp_cc_algos[i];
+
+	return NULL;
+}
+
+/*! @brief Get the algorithm new connections use. */
+const struct tcp_cc_algo *
+tcp_cc_get_default(void)
+{
+	return __atomic_load_n(&tcp_cc_default, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief Set the algorithm new connections use.
+ * @returns 0, or -ENOENT if there's no such algorithm.
+ */
+int
+tcp_cc_set_default(const char *name)
+{
+	const struct tcp_cc_algo *algo = tcp_cc_lookup(name);
+
+	if (algo == NULL)
+		return -ENOENT;
+
+	__atomic_store_n(&tcp_cc_default, algo, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*! @brief Slow start: a segment's worth at most for each ACK (RFC 5681). */
+void
+tcp_cc_slow_start(struct tcp_cc *cc, uint16_t mss, uint32_t acked)
+{
+	cc->snd_cwnd += MIN2(acked, (uint32_t)mss);
+}
+
+/*! @brief Inflate the window by the segment that left the network. */
+void
+tcp_cc_newreno_dupack(struct tcp_cc *cc, uint16_t mss)
+{
+	cc->snd_cwnd += mss;
+}
+
+/*! @brief Deflate the window to ssthresh (RFC 6582 section 3.2, step 3). */
+void
+tcp_cc_newreno_recovered(struct tcp_cc *cc, uint16_t)
+{
+	cc->snd_cwnd = cc->snd_ssthresh;
+	cc->bytes_acked = 0;
+}
+
+static void
+newreno_init(struct tcp_cc *cc, uint16_t)
+{
+	cc->bytes_acked = 0;
+}
+
+static void
+newreno_ack(struct tcp_cc *cc, uint16_t mss, uint32_t acked, uint32_t)
+{
+	if (cc->snd_cwnd < cc->snd_ssthresh) {
+		tcp_cc_slow_start(cc, mss, acked);
+		return;
+	}
+
+	/* congestion avoidance: a segment per window acked */
+	cc->bytes_acked += acked;
+	if (cc->bytes_acked >= cc->snd_cwnd) {
+		cc->bytes_acked -= cc->snd_cwnd;
+		cc->snd_cwnd += mss;
+	}
+}
+
+static void
+newreno_loss(struct tcp_cc *cc, uint16_t mss, uint32_t flight)
+{
+	cc->snd_ssthresh = MAX2(flight / 2, 2 * (uint32_t)mss);
+	cc->snd_cwnd = cc->snd_ssthresh;
+	cc->bytes_acked = 0;
+}
+
+static void
+newreno_rto(struct tcp_cc *cc, uint16_t mss, uint32_t flight, bool first)
+{
+	if (first)
+		cc->snd_ssthresh = MAX2(flight / 2, 2 * (uint32_t)mss);
+	cc->snd_cwnd = mss;
+	cc->bytes_acked = 0;
+}
+
+const struct tcp_cc_algo tcp_cc_newreno = {
+	.name = "newreno",
+	.init = newreno_init,
+	.ack = newreno_ack,
+	.dupack = tcp_cc_newreno_dupack,
+	.loss = newreno_loss,
+	.recovered = tcp_cc_newreno_recovered,
+	.rto = newreno_rto,
+};
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2026 Cloudarox Solutions.
+ * Created on Sat Oct 17 2026.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*!
+ * @file tcp_cc.h
+ * @brief TCP congestion control algorithm interface.
+ *
+ * An algorithm decides how the congestion window and slow start threshold
+ * respond to acknowledgements and losses. The loss recovery mechanics (when
+ * to retransmit what, and the SACK scoreboard) stay in tcp.c; the hooks are
+ * called from there with the TCB lock held, at IPL_DISP, and must not sleep.
+ */
+
+#ifndef ECX_INET_TCP_CC_H
+#define ECX_INET_TCP_CC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* setsockopt(IPPROTO_TCP) option number, as in the Linux ABI */
+#ifndef TCP_CONGESTION
+#define TCP_CONGESTION 13
+#endif
+
+#define TCP_CC_NAME_MAX 16	/* including the NUL */
+
+struct tcp_cc_algo;
+
+/*! Congestion control state of a connection. */
+struct tcp_cc {
+	const struct tcp_cc_algo *algo;
+	uint32_t	snd_cwnd;	/* congestion window */
+	uint32_t	snd_ssthresh;	/* slow start threshold */
+	uint32_t	bytes_acked;	/* acked towards the next increase */
+	uint64_t	priv[6];	/* the algorithm's own state */
+};
+
+/*! A congestion control algorithm. */
+struct tcp_cc_algo {
+	const char *name;
+
+	/*!
+	 * Connection starting, snd_cwnd set to the initial window, or the
+	 * algorithm changed on a running connection.
+	 */
+	void (*init)(struct tcp_cc *cc, uint16_t mss);
+
+	/*!
+	 * New data acknowledged, outside loss recovery. srtt is the smoothed
+	 * RTT in milliseconds, or 0 if there is no sample yet.
+	 */
+	void (*ack)(struct tcp_cc *cc, uint16_t mss, uint32_t acked,
+	    uint32_t srtt);
+
+	/*! Duplicate ACK during fast recovery without SACK. May be NULL. */
+	void (*dupack)(struct tcp_cc *cc, uint16_t mss);
+
+	/*! Loss detected: entering fast recovery with flight bytes out. */
+	void (*loss)(struct tcp_cc *cc, uint16_t mss, uint32_t flight);
+
+	/*! Fast recovery complete. */
+	void (*recovered)(struct tcp_cc *cc, uint16_t mss);
+
+	/*!
+	 * Retransmission timeout; first is false if this is a backed-off
+	 * repeat of the one before.
+	 */
+	void (*rto)(struct tcp_cc *cc, uint16_t mss, uint32_t flight,
+	    bool first);
+};
+
+extern const struct tcp_cc_algo tcp_cc_newreno;
+extern const struct tcp_cc_algo tcp_cc_cubic;
+
+const struct tcp_cc_algo *tcp_cc_lookup(const char *name);
+const struct tcp_cc_algo *tcp_cc_get_default(void);
+int tcp_cc_set_default(const char *name);
+
+void tcp_cc_slow_start(struct tcp_cc *cc, uint16_t mss, uint32_t acked);
+void tcp_cc_newreno_dupack(struct tcp_cc *cc, uint16_t mss);
+void tcp_cc_newreno_recovered(struct tcp_cc *cc, uint16_t mss);
+
+#endif /* ECX_INET_TCP_CC_H */
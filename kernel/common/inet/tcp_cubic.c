@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2026 Cloudarox Solutions.
+ * Created on Sat Oct 17 2026.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*!
+ * @file tcp_cubic.c
+ * @brief CUBIC congestion control (RFC 9438).
+ *
+ * After a loss the window grows as a cubic function of the time since,
+ * W(t) = C (t - K)^3 + W_max, flattening out as it nears W_max, the window
+ * before the loss, and probing beyond it more and more quickly after. It
+ * thus doesn't depend on the RTT as Reno's linear increase does. Where Reno
+ * would do better - short RTTs, small windows - the window follows an
+ * estimate of Reno's instead.
+ *
+ * There's no floating point in the kernel: windows are in bytes, times in
+ * milliseconds, and beta (0.7) and C (0.4) are applied as fractions.
+ */
+
+#include <sys/k_cpu.h>
+#include <sys/k_types.h>
+#include <sys/libkern.h>
+
+#include <inet/tcp_cc.h>
+
+/* beta_cubic, the multiplicative decrease factor, is 7/10 */
+#define CUBIC_BETA_NUM 7
+#define CUBIC_BETA_DEN 10
+/* alpha_cubic = 3 (1 - beta) / (1 + beta) = 9/17 */
+#define CUBIC_ALPHA_NUM 9
+#define CUBIC_ALPHA_DEN 17
+/* the time from the epoch start is clamped to this, in ms */
+#define CUBIC_T_MAX (1U << 20)
+
+struct cubic {
+	uint32_t	w_max;		/* window before the last reduction */
+	uint32_t	origin;		/* window the curve plateaus at */
+	uint32_t	k;		/* ms from epoch start to origin */
+	uint32_t	w_est;		/* Reno-friendly estimate */
+	uint32_t	est_acked;	/* acked towards next w_est increase */
+	uint32_t	frac;		/* remainder of the cwnd increase */
+	kabstime_t	epoch_start;	/* when growth began, or 0 */
+};
+
+_Static_assert(sizeof(struct cubic) <= sizeof(((struct tcp_cc *)0)->priv),
+    "struct cubic too large for tcp_cc::priv");
+
+static inline struct cubic *
+cubic(struct tcp_cc *cc)
+{
+	return (struct cubic *)cc->priv;
+}
+
+/* largest x with x^3 <= a */
+static uint32_t
+cubic_cbrt(uint64_t a)
+{
+	uint64_t lo = 0, hi = 2642245; /* cbrt(2^64) */
+
+	while (lo < hi) {
+		uint64_t mid = (lo + hi + 1) / 2;
+
+		if (mid * mid * mid <= a)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/*
+ * K = cbrt(W_max - cwnd / C) seconds, with windows in segments. In ms and
+ * bytes that's cbrt(diff / mss / 0.4 * 10^9).
+ */
+static uint32_t
+cubic_k(uint32_t diff, uint16_t mss)
+{
+	return cubic_cbrt((uint64_t)diff * 2500000000ULL / mss);
+}
+
+/* W_cubic(t), t in ms since the epoch start */
+static uint32_t
+cubic_window(struct cubic *st, uint16_t mss, uint32_t t)
+{
+	uint64_t d, delta;
+
+	t = MIN2(t, CUBIC_T_MAX);
+	d = t >= st->k ? t - st->k : st->k - t;
+	/* C (d / 1000)^3 segments */
+	delta = d * d * d / 1000000 * mss * 4 / 10000;
+
+	if (t >= st->k)
+		return (uint32_t)MIN2(st->origin + delta, (uint64_t)INT32_MAX);
+	else
+		return delta < st->origin ? st->origin - (uint32_t)delta : 0;
+}
+
+/* congestion event: note where the window was, and cut it */
+static void
+cubic_reduce(struct tcp_cc *cc, uint16_t mss, uint32_t flight)
+{
+	struct cubic *st = cubic(cc);
+
+	/* fast convergence: release bandwidth to newer flows */
+	if (cc->snd_cwnd < st->w_max)
+		st->w_max = (uint64_t)cc->snd_cwnd *
+		    (CUBIC_BETA_DEN + CUBIC_BETA_NUM) / (2 * CUBIC_BETA_DEN);
+	else
+		st->w_max = cc->snd_cwnd;
+
+	cc->snd_ssthresh = MAX2((uint32_t)((uint64_t)flight * CUBIC_BETA_NUM /
+	    CUBIC_BETA_DEN), 2 * (uint32_t)mss);
+	st->epoch_start = 0;
+}
+
+static void
+cubic_init(struct tcp_cc *cc, uint16_t)
+{
+	struct cubic *st = cubic(cc);
+
+	cc->bytes_acked = 0;
+	st->w_max = 0;
+	st->epoch_start = 0;
+}
+
+static void
+cubic_ack(struct tcp_cc *cc, uint16_t mss, uint32_t acked, uint32_t srtt)
+{
+	struct cubic *st = cubic(cc);
+	uint32_t cwnd = cc->snd_cwnd, target, t, thresh;
+	kabstime_t now;
+	uint64_t inc;
+
+	if (cwnd < cc->snd_ssthresh) {
+		tcp_cc_slow_start(cc, mss, acked);
+		return;
+	}
+
+	now = ke_time();
+
+	if (st->epoch_start == 0) {
+		st->epoch_start = now;
+		st->w_est = cwnd;
+		st->est_acked = 0;
+		st->frac = 0;
+		if (cwnd < st->w_max) {
+			st->k = cubic_k(st->w_max - cwnd, mss);
+			st->origin = st->w_max;
+		} else {
+			st->k = 0;
+			st->origin = cwnd;
+		}
+	}
+
+	/* where the curve will be an RTT from now */
+	t = (uint32_t)MIN2((now - st->epoch_start) / NS_PER_MS + srtt,
+	    (kabstime_t)CUBIC_T_MAX);
+	target = cubic_window(st, mss, t);
+
+	/* Reno-friendly region: grow at least as fast as Reno would */
+	st->est_acked += acked;
+	thresh = (uint64_t)cwnd * CUBIC_ALPHA_DEN / CUBIC_ALPHA_NUM;
+	while (st->est_acked >= thresh) {
+		st->est_acked -= thresh;
+		st->w_est += mss;
+	}
+	target = MAX2(target, st->w_est);
+
+	/* never more than half a segment per segment acked */
+	target = MIN2(target, cwnd + cwnd / 2);
+	if (target <= cwnd)
+		return;
+
+	inc = (uint64_t)(target - cwnd) * acked + st->frac;
+	st->frac = inc % cwnd;
+	cc->snd_cwnd += inc / cwnd;
+}
+
+static void
+cubic_loss(struct tcp_cc *cc, uint16_t mss, uint32_t flight)
+{
+	cubic_reduce(cc, mss, flight);
+	cc->snd_cwnd = cc->snd_ssthresh;
+	cc->bytes_acked = 0;
+}
+
+static void
+cubic_rto(struct tcp_cc *cc, uint16_t mss, uint32_t flight, bool first)
+{
+	if (first)
+		cubic_reduce(cc, mss, flight);
+	cubic(cc)->epoch_start = 0;
+	cc->snd_cwnd = mss;
+	cc->bytes_acked = 0;
+}
+
+const struct tcp_cc_algo tcp_cc_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.ack = cubic_ack,
+	.dupack = tcp_cc_newreno_dupack,
+	.loss = cubic_loss,
+	.recovered = tcp_cc_newreno_recovered,
+	.rto = cubic_rto,
+};
@@ -30,5 +30,22 @@ struct tcphdr {
 	uint16_t	th_urp;			/* urgent pointer */
 };
 
+#define	TCPOPT_EOL		0
+#define	TCPOPT_NOP		1
+#define	TCPOPT_MAXSEG		2
+#define	   TCPOLEN_MAXSEG		4
+#define	TCPOPT_WINDOW		3
+#define	   TCPOLEN_WINDOW		3
+#define	TCPOPT_SACK_PERMITTED	4
+#define	   TCPOLEN_SACK_PERMITTED	2
+#define	TCPOPT_SACK		5
+#define	   TCPOLEN_SACK			8	/* len of sack block */
+#define	TCPOPT_TIMESTAMP	8
+#define	   TCPOLEN_TIMESTAMP		10
+#define	   TCPOLEN_TSTAMP_APPA		(TCPOLEN_TIMESTAMP+2) /* appendix A */
+
+#define	TCP_MAXOLEN	(60 - sizeof(struct tcphdr))	/* max option space */
+#define	TCP_MAX_WINSHIFT	14	/* maximum window shift */
+
 
 #endif /* ECX_INET_TCPHDR_H */
@@ -22,6 +22,8 @@
 #include <sys/strsubr.h>
 #include <sys/tihdr.h>
 
+#include <libkern/in_cksum.h>
+#include <inttypes.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
@@ -75,6 +77,11 @@ typedef struct udp {
 } udp_t;
 
 
+/* datagrams discarded on input, for want of a sound header or checksum */
+static struct udp_stats {
+	_Atomic(uint64_t) hdrops, badsum;
+} udp_stats;
+
 static kspinlock_t udp_bind_lock = KSPINLOCK_INITIALISER;
 static RCULIST_HEAD(, udp) udp_ipv4_pcb_list;
 
@@ -400,6 +407,8 @@ udp_ipv4_input(ip_if_t *ifp, mblk_t *mp, ip_rxattr_t *attr)
 
 	avail = mp->wptr - mp->rptr;
 	if (avail < sizeof(*uh)) {
+		atomic_fetch_add_explicit(&udp_stats.hdrops, 1,
+		    memory_order_relaxed);
 		str_freemsg(mp);
 		return;
 	}
@@ -408,10 +417,26 @@ udp_ipv4_input(ip_if_t *ifp, mblk_t *mp, ip_rxattr_t *attr)
 	udp_len = ntohs(uh->uh_ulen);
 
 	if (udp_len < sizeof(*uh) || avail < udp_len) {
+		atomic_fetch_add_explicit(&udp_stats.hdrops, 1,
+		    memory_order_relaxed);
 		str_freemsg(mp);
 		return;
 	}
 
+	/* a zero checksum means the sender didn't compute one */
+	if (uh->uh_sum != 0 && (mp->db->cksum_flags & DB_CKSUM_VALID) == 0) {
+		uint64_t sum = ip_cksum_pseudo4(iph->ip_src, iph->ip_dst,
+		    IPPROTO_UDP, udp_len);
+
+		sum = in_cksum_partial(uh, udp_len, sum);
+		if ((uint16_t)~in_cksum_fold(sum) != 0) {
+			atomic_fetch_add_explicit(&udp_stats.badsum, 1,
+			    memory_order_relaxed);
+			str_freemsg(mp);
+			return;
+		}
+	}
+
 	mp->wptr = mp->rptr + udp_len;
 	mp->rptr += sizeof(*uh);
 
@@ -451,3 +476,12 @@ udp_ipv4_input(ip_if_t *ifp, mblk_t *mp, ip_rxattr_t *attr)
 	else
 		str_freemsg(mp);
 }
+
+void
+dbg_udp_dump(void)
+{
+	kdprintf("udp: %" PRIu64 " datagrams with bad headers, %" PRIu64
+		 " with bad checksums discarded\n",
+	    atomic_load_explicit(&udp_stats.hdrops, memory_order_relaxed),
+	    atomic_load_explicit(&udp_stats.badsum, memory_order_relaxed));
+}
@@ -33,8 +33,6 @@
 	((ntohl(ip_net) >>  0) & 0xff)
 #define ARG_IP4_U8(ip) (ip)[0], (ip)[1], (ip)[2], (ip)[3]
 
-uint16_t ip_checksum(void *data, size_t len);
-
 struct in6_addr ipv6_solicited_node_mc(const struct in6_addr *);
 
 #endif /* ECX_INET_UTIL_H */
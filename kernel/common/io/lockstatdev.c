@@ -0,0 +1,106 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file lockstatdev.c
+ * @brief /dev/lockstat, userland interface to the lock profiler.
+ *
+ * Reading yields a text report with a line per lock site. Writing "1" enables
+ * profiling, "0" disables it, and "r" zeroes the counters. A typical session
+ * is `echo r > /dev/lockstat; echo 1 > /dev/lockstat; <run workload>;
+ * echo 0 > /dev/lockstat; sort -k5 -n -r /dev/lockstat`.
+ */
+
+#include <sys/errno.h>
+#include <sys/k_lockstat.h>
+#include <sys/libkern.h>
+
+#include <fs/devfs/devfs.h>
+
+static int lockstat_read(void *dev, void *buf, size_t len, io_off_t offset,
+    int);
+static int lockstat_write(void *dev, const void *buf, size_t len,
+    io_off_t offset, int);
+
+static dev_ops_t lockstat_devops = {
+	.read = lockstat_read,
+	.write = lockstat_write,
+};
+
+void
+lockstat_init(void)
+{
+	devfs_create_node(DEV_KIND_CHAR, &lockstat_devops, NULL, "lockstat");
+}
+
+/*
+ * The report is regenerated line by line on each read and the lines preceding
+ * the offset are skipped, so a read(2) loop sees a consistent-enough snapshot
+ * without the kernel having to buffer the whole report.
+ */
+static int
+lockstat_read(void *dev, void *buf, size_t len, io_off_t offset, int)
+{
+	char line[160];
+	size_t cursor = 0, done = 0;
+	io_off_t pos = 0;
+	int r;
+
+	if (offset < 0)
+		return -EINVAL;
+
+	while (done < len && ke_lockstat_format(&cursor, line, sizeof(line))) {
+		size_t linelen = strlen(line), skip, n;
+
+		if (pos + (io_off_t)linelen <= offset) {
+			pos += linelen;
+			continue;
+		}
+
+		skip = offset > pos ? offset - pos : 0;
+		n = MIN2(linelen - skip, len - done);
+
+		r = memcpy_to_user((char *)buf + done, line + skip, n);
+		if (r != 0)
+			return r;
+
+		done += n;
+		pos += linelen;
+	}
+
+	return done;
+}
+
+static int
+lockstat_write(void *dev, const void *buf, size_t len, io_off_t offset, int)
+{
+	char cmd;
+	int r;
+
+	if (len == 0)
+		return 0;
+
+	r = memcpy_from_user(&cmd, buf, 1);
+	if (r != 0)
+		return r;
+
+	switch (cmd) {
+	case '0':
+		ke_lockstat_enable(false);
+		break;
+
+	case '1':
+		ke_lockstat_enable(true);
+		break;
+
+	case 'r':
+		ke_lockstat_reset();
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return len;
+}
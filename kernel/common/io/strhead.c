@@ -1225,6 +1225,8 @@ sth_rput(queue_t *q, mblk_t *mp)
 
 		if (sop->flags & SO_READMODE)
 			sh->read_mode = sop->readopt;
+		if (sop->flags & SO_HIWAT)
+			q->hiwat = sop->hiwat;
 
 		str_freeb(mp);
 		break;
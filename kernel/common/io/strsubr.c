@@ -55,6 +55,10 @@ str_allocb(size_t size)
 	db->type = M_DATA;
 	db->base = data;
 	db->lim = data + size;
+	db->cksum_flags = 0;
+	db->cksum_start = 0;
+	db->cksum_stuff = 0;
+	db->lso_mss = 0;
 
 	mp->link.tqe_next = NULL;
 	mp->link.tqe_prev = NULL;
@@ -108,6 +112,28 @@ str_copyb(mblk_t *mp)
 	return nmp;
 }
 
+/* a new mblk sharing mp's data block */
+mblk_t *
+str_dupb(mblk_t *mp)
+{
+	mblk_t *nmp;
+
+	nmp = kmem_alloc(sizeof(*nmp));
+	if (nmp == NULL)
+		return NULL;
+
+	atomic_fetch_add_explicit(&mp->db->refcnt, 1, memory_order_relaxed);
+
+	nmp->link.tqe_next = NULL;
+	nmp->link.tqe_prev = NULL;
+	nmp->db = mp->db;
+	nmp->rptr = mp->rptr;
+	nmp->wptr = mp->wptr;
+	nmp->cont = NULL;
+
+	return nmp;
+}
+
 mblk_t *
 str_copymsg(mblk_t *mp)
 {
@@ -3,39 +3,257 @@
  * Copyright (c) 2026 Cloudarox Solutions.
  */
 /*!
- * @file kcallout.c
+ * @file callout.c
  * @brief Callouts - waitable or DPC-queuing timers.
+ *
+ * Each CPU keeps its callouts in a hierarchical timing wheel. Time is divided
+ * into units of 2^WHEEL_SHIFT ns (about a millisecond.) Level 0 has a slot
+ * for each of the next 64 units; level 1 a slot for each of the next 64
+ * spans of 64 units; and so on. A callout is put in the slot of the lowest
+ * level that reaches its deadline, so setting and stopping are O(1).
+ *
+ * The wheel is advanced by the expiry DPC. Level 0 slots are expired as the
+ * wheel passes them. When the wheel reaches the start of a span covered by a
+ * higher-level slot, that slot's callouts are cascaded - reinserted, and so
+ * moved down a level or more. Empty stretches are skipped over using the
+ * per-level bitmaps of non-empty slots, so a CPU that has been idle for a
+ * long time doesn't walk every slot it missed.
+ *
+ * next_deadline is when the expiry DPC next needs to run: either the
+ * earliest deadline in level 0, or the next cascade if that's sooner.
+ * Deadlines too far off for the wheel sit in the furthest slot and are
+ * cascaded back into it until they come into range.
  */
 
 #include <sys/k_cpu.h>
 #include <sys/k_log.h>
 #include <sys/k_intr.h>
 #include <sys/k_wait.h>
+#include <sys/kmem.h>
+#include <sys/libkern.h>
+
+#include <inttypes.h>
+
+#define WHEEL_SHIFT 20
+#define WHEEL_LEVELS CALLOUT_WHEEL_LEVELS
+#define WHEEL_SLOTS CALLOUT_WHEEL_SLOTS
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVEL_BITS 6
+#define LEVEL_SHIFT(L) ((L) * WHEEL_LEVEL_BITS)
+/* units covered by the whole wheel */
+#define WHEEL_RANGE (1ULL << LEVEL_SHIFT(WHEEL_LEVELS))
+
+_Static_assert(WHEEL_SLOTS == 1 << WHEEL_LEVEL_BITS &&
+    WHEEL_SLOTS == sizeof(uint64_t) * 8, "slot bitmap is a uint64_t");
+
+void kep_clock_reprogram(void);
+
+static inline uint64_t
+rotr64(uint64_t x, unsigned int n)
+{
+	n &= 63;
+	return n == 0 ? x : (x >> n) | (x << (64 - n));
+}
+
+void
+kep_callout_cpu_init(struct kcpu_callout *cc)
+{
+	void kep_callout_expiry_dpc(void *, void *);
+
+	ke_spinlock_init(&cc->lock);
+	ke_dpc_init(&cc->expiry_dpc, kep_callout_expiry_dpc, cc, NULL);
+	cc->wheel_now = 0;
+	cc->next_deadline = ABSTIME_NEVER;
+	for (size_t l = 0; l < WHEEL_LEVELS; l++) {
+		cc->wheel_bitmap[l] = 0;
+		for (size_t s = 0; s < WHEEL_SLOTS; s++)
+			TAILQ_INIT(&cc->wheel[l][s]);
+	}
+}
 
 static void
-insert(kcallout_t *co, struct kcpu_callout *cc)
-{
-	kcallout_t *existing;
-	bool first = true;
-
-	TAILQ_FOREACH(existing, &cc->callouts, callout_qlink) {
-		if (existing->deadline > co->deadline) {
-			TAILQ_INSERT_BEFORE(existing, co, callout_qlink);
-			if (first) {
-				int x = ke_arch_disable();
-				cc->next_deadline = co->deadline;
-				ke_arch_enable(x);
-			}
-			return;
+wheel_insert(struct kcpu_callout *cc, kcallout_t *co)
+{
+	uint64_t when = co->deadline >> WHEEL_SHIFT, delta;
+	unsigned int level, slot;
+
+	if (when < cc->wheel_now)
+		when = cc->wheel_now;
+	delta = when - cc->wheel_now;
+
+	if (delta >= WHEEL_RANGE) {
+		/* out of range; will be cascaded back when we get there */
+		when = cc->wheel_now + WHEEL_RANGE - 1;
+		delta = WHEEL_RANGE - 1;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < (1ULL << LEVEL_SHIFT(level + 1)))
+			break;
+
+	slot = (when >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+	co->wheel_level = level;
+	co->wheel_slot = slot;
+	TAILQ_INSERT_TAIL(&cc->wheel[level][slot], co, callout_qlink);
+	cc->wheel_bitmap[level] |= 1ULL << slot;
+}
+
+static void
+wheel_remove(struct kcpu_callout *cc, kcallout_t *co)
+{
+	struct kcallout_queue *q = &cc->wheel[co->wheel_level][co->wheel_slot];
+
+	TAILQ_REMOVE(q, co, callout_qlink);
+	if (TAILQ_EMPTY(q))
+		cc->wheel_bitmap[co->wheel_level] &= ~(1ULL << co->wheel_slot);
+}
+
+/*!
+ * @brief At which unit does a level 1+ slot next need cascading?
+ *
+ * That's the start of the first span after the current one to map to it.
+ */
+static uint64_t
+cascade_unit(struct kcpu_callout *cc, unsigned int level, unsigned int slot)
+{
+	uint64_t base = (cc->wheel_now >> LEVEL_SHIFT(level)) + 1;
+
+	return (base + ((slot - base) & WHEEL_MASK)) << LEVEL_SHIFT(level);
+}
+
+/*!
+ * @brief Find the next unit after the current one that needs the wheel's
+ * attention, i.e. a non-empty level 0 slot or a cascade.
+ */
+static uint64_t
+wheel_next_unit(struct kcpu_callout *cc)
+{
+	uint64_t now = cc->wheel_now, next = UINT64_MAX;
+
+	if (cc->wheel_bitmap[0] != 0) {
+		uint64_t r = rotr64(cc->wheel_bitmap[0],
+		    (now + 1) & WHEEL_MASK);
+		next = now + 1 + __builtin_ctzll(r);
+	}
+
+	for (unsigned int l = 1; l < WHEEL_LEVELS; l++) {
+		uint64_t base, r;
+
+		if (cc->wheel_bitmap[l] == 0)
+			continue;
+
+		base = (now >> LEVEL_SHIFT(l)) + 1;
+		r = rotr64(cc->wheel_bitmap[l], base & WHEEL_MASK);
+		next = MIN2(next, cascade_unit(cc, l,
+		    (base + __builtin_ctzll(r)) & WHEEL_MASK));
+	}
+
+	return next;
+}
+
+/*!
+ * @brief Work out when the expiry DPC next needs to run.
+ */
+static kabstime_t
+wheel_next_deadline(struct kcpu_callout *cc)
+{
+	uint64_t now = cc->wheel_now;
+	kabstime_t next = ABSTIME_NEVER;
+
+	if (cc->wheel_bitmap[0] != 0) {
+		/* the first non-empty slot has the earliest deadlines */
+		uint64_t r = rotr64(cc->wheel_bitmap[0], now & WHEEL_MASK);
+		unsigned int slot = (now + __builtin_ctzll(r)) & WHEEL_MASK;
+		kcallout_t *co;
+
+		TAILQ_FOREACH(co, &cc->wheel[0][slot], callout_qlink)
+			if (next == ABSTIME_NEVER || co->deadline < next)
+				next = co->deadline;
+	}
+
+	for (unsigned int l = 1; l < WHEEL_LEVELS; l++) {
+		uint64_t base, r;
+		kabstime_t cascade;
+
+		if (cc->wheel_bitmap[l] == 0)
+			continue;
+
+		base = (now >> LEVEL_SHIFT(l)) + 1;
+		r = rotr64(cc->wheel_bitmap[l], base & WHEEL_MASK);
+		cascade = cascade_unit(cc, l,
+		    (base + __builtin_ctzll(r)) & WHEEL_MASK) << WHEEL_SHIFT;
+		if (next == ABSTIME_NEVER || cascade < next)
+			next = cascade;
+	}
+
+	return next;
+}
+
+/*!
+ * @brief Cascade the higher-level slots whose span starts at the current unit.
+ *
+ * The highest level goes first, as it may refill the lower levels' slots.
+ */
+static void
+wheel_cascade(struct kcpu_callout *cc)
+{
+	uint64_t now = cc->wheel_now;
+	int top = 0;
+
+	while (top < WHEEL_LEVELS - 1 &&
+	    (now & ((1ULL << LEVEL_SHIFT(top + 1)) - 1)) == 0)
+		top++;
+
+	for (int l = top; l > 0; l--) {
+		unsigned int slot = (now >> LEVEL_SHIFT(l)) & WHEEL_MASK;
+		struct kcallout_queue q = TAILQ_HEAD_INITIALIZER(q);
+		kcallout_t *co;
+
+		if ((cc->wheel_bitmap[l] & (1ULL << slot)) == 0)
+			continue;
+
+		TAILQ_CONCAT(&q, &cc->wheel[l][slot], callout_qlink);
+		cc->wheel_bitmap[l] &= ~(1ULL << slot);
+
+		while ((co = TAILQ_FIRST(&q)) != NULL) {
+			TAILQ_REMOVE(&q, co, callout_qlink);
+			wheel_insert(cc, co);
 		}
-		first = false;
 	}
-	/* no callouts or it's the longest till elapsing */
-	TAILQ_INSERT_TAIL(&cc->callouts, co, callout_qlink);
-	if (first) {
-		int x = ke_arch_disable();
-		cc->next_deadline = co->deadline;
-		ke_arch_enable(x);
+}
+
+/*!
+ * @brief Advance the wheel to \p now, moving expired callouts to \p expired.
+ */
+static void
+wheel_advance(struct kcpu_callout *cc, kabstime_t now,
+    struct kcallout_queue *expired)
+{
+	uint64_t to = now >> WHEEL_SHIFT;
+
+	for (;;) {
+		unsigned int slot = cc->wheel_now & WHEEL_MASK;
+
+		if (cc->wheel_bitmap[0] & (1ULL << slot)) {
+			struct kcallout_queue *q = &cc->wheel[0][slot];
+			kcallout_t *co, *tmp;
+
+			/* only the current unit's slot can have any not due */
+			TAILQ_FOREACH_SAFE(co, q, callout_qlink, tmp) {
+				if (co->deadline > now)
+					continue;
+				TAILQ_REMOVE(q, co, callout_qlink);
+				TAILQ_INSERT_TAIL(expired, co, callout_qlink);
+			}
+			if (TAILQ_EMPTY(q))
+				cc->wheel_bitmap[0] &= ~(1ULL << slot);
+		}
+
+		if (cc->wheel_now >= to)
+			break;
+
+		cc->wheel_now = MIN2(wheel_next_unit(cc), to);
+		wheel_cascade(cc);
 	}
 }
 
@@ -62,6 +280,8 @@ ke_callout_set(kcallout_t *co, kabstime_t deadline)
 {
 	ipl_t ipl;
 	struct kcpu_callout *cc;
+	kabstime_t now = ke_time(), next, co_next;
+	bool x;
 
 	ipl = spldisp();
 	cc = CPU_LOCAL_ADDROF(callout);
@@ -77,9 +297,29 @@ ke_callout_set(kcallout_t *co, kabstime_t deadline)
 	    memory_order_relaxed);
 	co->deadline = deadline;
 	co->header.signalled = 0;
-	insert(co, cc);
+
+	/*
+	 * If nothing is due yet, nothing is in the way of bringing the wheel
+	 * up to date, which spares a cascade through the levels in between.
+	 */
+	next = cc->next_deadline;
+	if (next == ABSTIME_NEVER || next > now)
+		cc->wheel_now = MAX2(cc->wheel_now, now >> WHEEL_SHIFT);
+
+	wheel_insert(cc, co);
+
+	co_next = co->wheel_level == 0 ? deadline :
+	    cascade_unit(cc, co->wheel_level, co->wheel_slot) << WHEEL_SHIFT;
 
 	ke_spinlock_exit_nospl(&co->header.lock);
+
+	if (next == ABSTIME_NEVER || co_next < next) {
+		x = ke_arch_disable();
+		cc->next_deadline = co_next;
+		ke_arch_enable(x);
+		kep_clock_reprogram();
+	}
+
 	ke_spinlock_exit_nospl(&cc->lock);
 
 	splx(ipl);
@@ -87,6 +327,28 @@ ke_callout_set(kcallout_t *co, kabstime_t deadline)
 	return 0;
 }
 
+/*!
+ * @brief Set a callout which may expire up to \p slack ns late.
+ *
+ * The deadline is rounded up to a multiple of the largest power of two not
+ * greater than the slack, so that callouts set around the same time with
+ * similar slack share a deadline and are expired together, rather than each
+ * needing a wakeup of its own.
+ */
+int
+ke_callout_set_slack(kcallout_t *co, kabstime_t deadline, kabstime_t slack)
+{
+	if (slack != 0) {
+		kabstime_t gran = (kabstime_t)1
+		    << (63 - __builtin_clzll(slack));
+
+		if (deadline <= ABSTIME_FOREVER - gran)
+			deadline = roundup2(deadline, gran);
+	}
+
+	return ke_callout_set(co, deadline);
+}
+
 int
 ke_callout_stop(kcallout_t *co)
 {
@@ -112,7 +374,8 @@ retry:
 		goto retry;
 	}
 
-	TAILQ_REMOVE(&cc->callouts, co, callout_qlink);
+	/* next_deadline is left be; at worst the expiry DPC runs for nothing */
+	wheel_remove(cc, co);
 	atomic_store_explicit(&co->cpu_num, KCPUNUM_NULL, memory_order_relaxed);
 
 	ke_spinlock_exit_nospl(&co->header.lock);
@@ -126,26 +389,17 @@ kep_callout_expiry_dpc(void *arg1, void *arg2)
 {
 	struct kcpu_callout *cc = arg1;
 	struct kwaitblock_queue wake_queue = TAILQ_HEAD_INITIALIZER(wake_queue);
+	struct kcallout_queue expired = TAILQ_HEAD_INITIALIZER(expired);
+	kcallout_t *co;
+	kabstime_t next;
+	bool x;
 
 	ke_spinlock_enter_nospl(&cc->lock);
 
-	while (true) {
-		kabstime_t now = ke_time();
-		kcallout_t *co = TAILQ_FIRST(&cc->callouts);
-
-		if (co == NULL) {
-			int x = ke_arch_disable();
-			cc->next_deadline = ABSTIME_NEVER;
-			ke_arch_enable(x);
-			break;
-		} else if (co->deadline > now) {
-			int x = ke_arch_disable();
-			cc->next_deadline = co->deadline;
-			ke_arch_enable(x);
-			break;
-		}
+	wheel_advance(cc, ke_time(), &expired);
 
-		TAILQ_REMOVE(&cc->callouts, co, callout_qlink);
+	while ((co = TAILQ_FIRST(&expired)) != NULL) {
+		TAILQ_REMOVE(&expired, co, callout_qlink);
 
 		ke_spinlock_enter_nospl(&co->header.lock);
 		co->header.signalled = 1;
@@ -159,8 +413,14 @@ kep_callout_expiry_dpc(void *arg1, void *arg2)
 		ke_spinlock_exit_nospl(&co->header.lock);
 	}
 
+	next = wheel_next_deadline(cc);
+	x = ke_arch_disable();
+	cc->next_deadline = next;
+	ke_arch_enable(x);
+
 	ke_spinlock_exit_nospl(&cc->lock);
 
+	kep_clock_reprogram();
 	kep_waiters_wake(&wake_queue);
 }
 
@@ -177,3 +437,44 @@ kep_callout_hardclock(void)
 
 	return;
 }
+
+/*!
+ * @brief Time setting and stopping 100,000 callouts on the current CPU.
+ *
+ * Deadlines are spread over ten minutes, so the callouts land in all levels
+ * of the wheel.
+ */
+void
+dbg_callout_bench(void)
+{
+	const size_t n = 100000;
+	kcallout_t *cos = kmem_alloc(sizeof(kcallout_t) * n);
+	kabstime_t base, start, set, stopped;
+	uint64_t rand = 88172645463325252ULL;
+
+	for (size_t i = 0; i < n; i++)
+		ke_callout_init(&cos[i]);
+
+	base = ke_time();
+
+	start = ke_time();
+	for (size_t i = 0; i < n; i++) {
+		rand ^= rand << 13;
+		rand ^= rand >> 7;
+		rand ^= rand << 17;
+		ke_callout_set(&cos[i], base + NS_PER_S +
+		    rand % ((kabstime_t)600 * NS_PER_S));
+	}
+	set = ke_time();
+
+	for (size_t i = 0; i < n; i++)
+		ke_callout_stop(&cos[i]);
+	stopped = ke_time();
+
+	kdprintf("callout bench: %zu set in %" PRIu64 " us (%" PRIu64
+		 " ns each), stopped in %" PRIu64 " us (%" PRIu64 " ns each)\n",
+	    n, (set - start) / 1000, (set - start) / n,
+	    (stopped - set) / 1000, (stopped - set) / n);
+
+	kmem_free(cos, sizeof(kcallout_t) * n);
+}
@@ -3,18 +3,169 @@
  * Copyright (c) 2026 Cloudarox Solutions.
  */
 /*!
- * @file kcallout.c
+ * @file clock.c
  * @brief Kernel clock.
+ *
+ * Ports whose timer can only tick periodically call ke_hardclock() KERN_HZ
+ * times a second. Those with a one-shot timer call kep_clock_start_tickless()
+ * once they've set it up, after which the timer is programmed for the next
+ * moment anything needs the CPU: the earliest callout, the expiry of the
+ * current thread's timeslice or the next load balance, or the next tick if
+ * RCU is waiting on the CPU. An idle CPU so only wakes for callouts and RCU.
+ *
+ * Ticks are still the unit of timeslices and balancing; ke_hardclock() works
+ * out how many have elapsed since the last one it accounted for and passes
+ * that on. Ticks that elapse while the CPU is idle aren't charged to the thread
+ * it goes on to run.
+ *
+ * The clock state is per-CPU and only touched with interrupts disabled.
  */
 
 #include <sys/k_cpu.h>
+#include <sys/k_intr.h>
+#include <sys/libkern.h>
+
+#define TICK_NS ((kabstime_t)NS_PER_S / KERN_HZ)
+
+/* CPUs idle with their tick stopped; see kep_rcu_kick_idle() */
+katomic_cpumask_t kep_clock_idle_mask;
 
 void kep_callout_hardclock();
-void kep_disp_hardclock(void);
+void kep_disp_hardclock(uint32_t ticks);
+uint32_t kep_disp_ticks_needed(void);
+bool kep_rcu_needs_cpu(void);
+
+static void
+clock_reprogram(struct kcpu_clock *clk)
+{
+	struct kcpu_callout *cc = CPU_LOCAL_ADDROF(callout);
+	kabstime_t now = ke_time(), next = ABSTIME_NEVER, co_next;
+	uint32_t ticks = clk->idle ? UINT32_MAX : kep_disp_ticks_needed();
+
+	if (kep_rcu_needs_cpu())
+		ticks = 1;
+	if (ticks != UINT32_MAX)
+		next = clk->last_tick + ticks * TICK_NS;
+
+	/*
+	 * A callout already due has had, or is about to have, the expiry DPC
+	 * scheduled by kep_callout_hardclock(); that reprograms us once it
+	 * has worked out the next deadline. Don't fire again meanwhile.
+	 */
+	co_next = cc->next_deadline;
+	if (co_next != ABSTIME_NEVER && co_next <= now)
+		ke_dpc_schedule(&cc->expiry_dpc);
+	else if (co_next != ABSTIME_NEVER &&
+	    (next == ABSTIME_NEVER || co_next < next))
+		next = co_next;
+
+	if (next == clk->next_event)
+		return;
+
+	clk->next_event = next;
+	kep_arch_timer_oneshot(next);
+}
+
+/*!
+ * @brief Reprogram the timer after something changed the next event.
+ *
+ * Called when a callout becomes the first on this CPU's queue and when the
+ * callout expiry DPC has worked out the next deadline.
+ */
+void
+kep_clock_reprogram(void)
+{
+	struct kcpu_clock *clk;
+	bool x = ke_arch_disable();
+
+	clk = CPU_LOCAL_ADDROF(clock);
+	if (clk->tickless)
+		clock_reprogram(clk);
+
+	ke_arch_enable(x);
+}
+
+/*!
+ * @brief Note that ke_dispatch() chose a thread and set its timeslice.
+ *
+ * Stops the tick on entering idle and restarts it on leaving. Called at
+ * IPL_DISP with the dispatcher lock held.
+ */
+void
+kep_clock_dispatched(bool idle)
+{
+	struct kcpu_clock *clk;
+	kcpunum_t self = CPU_LOCAL_LOAD(cpu_num);
+	bool x = ke_arch_disable();
+
+	clk = CPU_LOCAL_ADDROF(clock);
+	if (!clk->tickless) {
+		ke_arch_enable(x);
+		return;
+	}
+
+	if (clk->idle && !idle) {
+		/* skip the ticks that passed while idle */
+		kabstime_t now = ke_time();
+		clk->last_tick += (now - clk->last_tick) / TICK_NS * TICK_NS;
+		atomic_cpumask_clear(&kep_clock_idle_mask, self,
+		    memory_order_relaxed);
+	} else if (!clk->idle && idle) {
+		/*
+		 * Pairs with the fence in kep_rcu_kick_idle(): either that
+		 * sees our bit or kep_rcu_needs_cpu() sees its grace period.
+		 */
+		atomic_cpumask_set(&kep_clock_idle_mask, self,
+		    memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	clk->idle = idle;
+	clock_reprogram(clk);
+
+	ke_arch_enable(x);
+}
+
+/*!
+ * @brief Switch the current CPU's clock over to one-shot operation.
+ *
+ * Called by the port once its timer is ready for kep_arch_timer_oneshot().
+ */
+void
+kep_clock_start_tickless(void)
+{
+	struct kcpu_clock *clk;
+	bool x = ke_arch_disable();
+
+	clk = CPU_LOCAL_ADDROF(clock);
+	clk->last_tick = ke_time();
+	clk->next_event = ABSTIME_NEVER;
+	clk->idle = false;
+	clk->tickless = true;
+	clock_reprogram(clk);
+
+	ke_arch_enable(x);
+}
 
 void
 ke_hardclock(void)
 {
-	kep_disp_hardclock();
+	struct kcpu_clock *clk = CPU_LOCAL_ADDROF(clock);
+	uint32_t ticks = 1;
+
+	if (clk->tickless) {
+		kabstime_t elapsed = ke_time() - clk->last_tick;
+
+		ticks = MIN2(elapsed / TICK_NS, (kabstime_t)UINT32_MAX);
+		clk->last_tick += ticks * TICK_NS;
+		clk->next_event = ABSTIME_NEVER;
+	}
+
+	/* may be early if a callout is due between ticks */
+	if (ticks > 0)
+		kep_disp_hardclock(ticks);
 	kep_callout_hardclock();
+
+	if (clk->tickless)
+		clock_reprogram(clk);
 }
@@ -11,7 +11,34 @@
 #include <sys/k_thread.h>
 #include <sys/k_log.h>
 
-/* todo... */
+#include <sched.h>
+
+#define RR_QUANTUM 6
+
+/* real-time priorities are fixed; only inheritance moves them */
+
+static void
+rt_did_preempt_thread(kthread_t *t, bool)
+{
+	kassert(t->base_prio >= PRIO_MIN_RT && t->base_prio <= PRIO_MAX_RT,
+	    "bad RT base prio");
+}
+
+static void
+rt_io_completed(kthread_t *)
+{
+	/* epsilon */
+}
+
+/* FIFO threads run until they block, yield or are preempted */
+static uint16_t
+rt_quantum(kthread_t *t)
+{
+	return t->sched_class == SCHED_RR ? RR_QUANTUM : KQUANTUM_NONE;
+}
 
 struct ksched_class kep_rt_class = {
+	.did_preempt_thread = rt_did_preempt_thread,
+	.io_completed = rt_io_completed,
+	.quantum = rt_quantum,
 };
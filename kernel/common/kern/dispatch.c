@@ -5,6 +5,51 @@
 /*!
  * @file dispatch.c
  * @brief Thread dispatcher.
+ *
+ * Load balancing
+ * --------------
+ *
+ * Timesharing threads are queued on per-CPU run queues and only leave them
+ * by being stolen. A CPU about to go idle steals the highest-priority
+ * migratable thread from the CPU with the longest run queue. Every
+ * BALANCE_TICKS, each CPU also compares its queue length against the busiest
+ * and pulls half the difference over if it's at least BALANCE_IMBALANCE.
+ *
+ * An idle CPU also redispatches, so as to steal, whenever its clock ticks
+ * while another CPU has a backlog. With a tickless clock an idle CPU doesn't
+ * tick, so it relies on wakeups preferring idle CPUs instead.
+ *
+ * Threads bound to a CPU are never migrated. Threads which were switched out
+ * less than CACHE_HOT_NS ago are assumed to have a warm cache on their last
+ * CPU and are left alone, except by an idle CPU when there's nothing colder
+ * to take and the victim has more than one thread queued.
+ *
+ * Real-time threads
+ * -----------------
+ *
+ * SCHED_FIFO/SCHED_RR threads are queued on the same per-CPU run queues as
+ * everything else, in rq[PRIO_MIN_RT..PRIO_LIMIT). To keep to the guarantee
+ * that the N highest-priority runnable RT threads are the ones running, they
+ * are moved between CPUs by push and pull:
+ *
+ * - On wakeup, an RT thread is placed on an idle CPU if there is one, else on
+ *   the CPU running the lowest-priority thread, if that's lower than its own.
+ * - When a dispatch leaves an RT thread queued behind a higher-priority one,
+ *   the CPU schedules its rt_push_dpc, which moves queued RT threads to CPUs
+ *   running something of lower priority.
+ * - Whenever a CPU dispatches, it checks the CPUs in rt_overload_mask (those
+ *   with queued RT threads) and pulls one if it's higher priority than the
+ *   best thing it has locally.
+ *
+ * Each dispatcher publishes the priority it's running at (cur_pri) and the
+ * real-time word of its bitmap (rt_bitmap) so that other CPUs can make these
+ * decisions without taking its lock.
+ *
+ * Setting ke_rt_latency_trace records, per CPU, a histogram of how long RT
+ * threads took to run after being made runnable. dbg_disp_dump() prints it.
+ *
+ * Dispatcher locks of other CPUs are only ever try-entered while holding our
+ * own, so there is no lock ordering to observe.
  */
 
 #include <sys/k_cpu.h>
@@ -17,22 +62,39 @@
 #include <libkern/lib.h>
 #include <libkern/queue.h>
 
+#include <inttypes.h>
 #include <sched.h>
 #include <stdatomic.h>
 
-#define UINTPTR_BITS (sizeof(uintptr_t) * 8)
-
 #define elementsof(x) (sizeof(x) / sizeof((x)[0]))
 
+#define BALANCE_TICKS (KERN_HZ / 8)
+#define BALANCE_IMBALANCE 2
+#define CACHE_HOT_NS (NS_PER_MS / 2)
+
+#define RT_WORD (PRIO_MIN_RT / 32)
+_Static_assert(PRIO_MIN_RT % 32 == 0 && PRIO_LIMIT - PRIO_MIN_RT == 32,
+    "real-time priorities must occupy exactly one bitmap word");
+
+#define THREAD_IS_RT(T) \
+	((T)->sched_class == SCHED_FIFO || (T)->sched_class == SCHED_RR)
+#define DISP_CPU_NUM(DP) (containerof((DP), struct kcpu_data, disp)->cpu_num)
+
 /* layering violation... */
 void thread_activate(kthread_t *old, kthread_t *new);
 
+/* kern/clock.c */
+void kep_clock_dispatched(bool idle);
+
+/* kern/rcu.c */
+void kep_rcu_quiet(void);
+void kep_rcu_hardclock(void);
+
 extern struct ksched_class kep_ts_class, kep_rt_class;
 
-static kspinlock_t rt_lock = KSPINLOCK_INITIALISER;
-static atomic_uint_fast32_t rt_bitmap;
-static runq_t global_rt_rq[RT_PRIO_N];
 static katomic_cpumask_t idle_cpu_mask;
+static katomic_cpumask_t rt_overload_mask;
+bool ke_rt_latency_trace = false;
 
 static struct ksched_class *kep_sched_class[3] = {
 	[SCHED_RR] = &kep_rt_class,
@@ -40,59 +102,17 @@ static struct ksched_class *kep_sched_class[3] = {
 	[SCHED_OTHER] = &kep_ts_class,
 };
 
-static void
-atomic_cpumask_set(katomic_cpumask_t *set, kcpunum_t cpunum, memory_order order)
-{
-	size_t idx = cpunum / UINTPTR_BITS;
-	size_t bit = cpunum % UINTPTR_BITS;
-
-	atomic_fetch_or_explicit(&set->mask[idx], 1UL << bit, order);
-}
-
-static void
-atomic_cpumask_clear(katomic_cpumask_t *set, kcpunum_t cpunum,
-    memory_order order)
-{
-	size_t idx = cpunum / UINTPTR_BITS;
-	size_t bit = cpunum % UINTPTR_BITS;
-
-	atomic_fetch_and_explicit(&set->mask[idx], ~(1UL << bit), order);
-}
-
-static bool
-atomic_cpumask_isset(katomic_cpumask_t *set, kcpunum_t cpunum,
-    memory_order order)
-{
-	size_t idx = cpunum / UINTPTR_BITS;
-	size_t bit = cpunum % UINTPTR_BITS;
-	uintptr_t mask = atomic_load_explicit(&set->mask[idx], order);
-	return (mask & (1UL << bit)) != 0;
-}
-
-static kcpunum_t
-atomic_cpumask_first_set(katomic_cpumask_t *set, memory_order order)
-{
-	size_t width = (ke_ncpu + UINTPTR_BITS - 1) / UINTPTR_BITS;
-	for (size_t i = 0; i < width; i++) {
-		uintptr_t mask = atomic_load_explicit(&set->mask[i], order);
-		if (mask != 0) {
-			kcpunum_t cpu = i * UINTPTR_BITS + __builtin_ctzl(mask);
-			return cpu < ke_ncpu ? cpu : KCPUNUM_NULL;
-		}
-	}
-	return KCPUNUM_NULL;
-}
-
 void
 ke_disp_global_init(void)
 {
 	for (size_t i = 0; i < elementsof(idle_cpu_mask.mask); i++)
 		atomic_store_explicit(&idle_cpu_mask.mask[i], UINTPTR_MAX,
 		    memory_order_relaxed);
-	for (size_t i = 0; i < RT_PRIO_N; i++)
-		TAILQ_INIT(&global_rt_rq[i]);
 }
 
+static void balance_dpc(void *, void *);
+static void rt_push_dpc(void *, void *);
+
 void
 ke_disp_init(kcpunum_t cpunum)
 {
@@ -108,6 +128,16 @@ ke_disp_init(kcpunum_t cpunum)
 	disp->idle_thread = ke_cpu_data[cpunum]->curthread;
 	disp->cur_thread = disp->idle_thread;
 	atomic_store_explicit(&disp->timeslice, 5, memory_order_relaxed);
+	disp->timeslice_none = false;
+	atomic_store_explicit(&disp->nready, 0, memory_order_relaxed);
+	atomic_store_explicit(&disp->cur_pri, 0, memory_order_relaxed);
+	atomic_store_explicit(&disp->rt_bitmap, 0, memory_order_relaxed);
+	memset(&disp->stats, 0, sizeof(disp->stats));
+
+	/* stagger so CPUs don't all balance on the same tick */
+	disp->balance_ticks = cpunum % BALANCE_TICKS;
+	ke_dpc_init(&disp->balance_dpc, balance_dpc, disp, NULL);
+	ke_dpc_init(&disp->rt_push_dpc, rt_push_dpc, disp, NULL);
 }
 
 static bool
@@ -132,6 +162,54 @@ should_preempt(struct kcpu_dispatcher *disp, kthread_t *thread)
 	}
 }
 
+static uint32_t
+cur_pri(kcpunum_t cpu)
+{
+	return atomic_load_explicit(&ke_cpu_data[cpu]->disp.cur_pri,
+	    memory_order_relaxed);
+}
+
+/*!
+ * @brief Find the CPU running the lowest-priority thread, if lower than
+ * \p thread's priority, for placing an RT thread.
+ */
+static kcpunum_t
+find_lowest(kthread_t *thread, kcpunum_t except)
+{
+	kcpunum_t lowest = KCPUNUM_NULL;
+	uint32_t lowest_pri = thread->effective_prio;
+
+	if (thread->bound_cpu != KCPUNUM_NULL) {
+		if (thread->bound_cpu != except &&
+		    cur_pri(thread->bound_cpu) < lowest_pri)
+			return thread->bound_cpu;
+		return KCPUNUM_NULL;
+	}
+
+	/* prefer the last CPU for its warm cache, all else being equal */
+	if (thread->last_cpu_num != KCPUNUM_NULL &&
+	    thread->last_cpu_num != except &&
+	    cur_pri(thread->last_cpu_num) < PRIO_MIN_RT) {
+		lowest = thread->last_cpu_num;
+		lowest_pri = cur_pri(lowest);
+	}
+
+	for (kcpunum_t i = 0; i < ke_ncpu; i++) {
+		uint32_t pri;
+
+		if (i == except)
+			continue;
+
+		pri = cur_pri(i);
+		if (pri < lowest_pri) {
+			lowest = i;
+			lowest_pri = pri;
+		}
+	}
+
+	return lowest;
+}
+
 uint32_t
 pick_cpu(kthread_t *thread)
 {
@@ -146,40 +224,382 @@ pick_cpu(kthread_t *thread)
 		    memory_order_relaxed);
 		if (cpu != KCPUNUM_NULL)
 			return cpu;
-		else
-			return CPU_LOCAL_LOAD(cpu_num);
+		if (THREAD_IS_RT(thread)) {
+			cpu = find_lowest(thread, KCPUNUM_NULL);
+			if (cpu != KCPUNUM_NULL)
+				return cpu;
+			if (thread->last_cpu_num != KCPUNUM_NULL)
+				return thread->last_cpu_num;
+		}
+		return CPU_LOCAL_LOAD(cpu_num);
 	}
 }
 
+/*! @brief Publish the real-time part of the bitmap after it changes. */
+static void
+rt_bitmap_update(struct kcpu_dispatcher *dp)
+{
+	uint32_t bm = dp->bitmap[RT_WORD];
+
+	if (bm == atomic_load_explicit(&dp->rt_bitmap, memory_order_relaxed))
+		return;
+
+	atomic_store_explicit(&dp->rt_bitmap, bm, memory_order_relaxed);
+	if (bm != 0)
+		atomic_cpumask_set(&rt_overload_mask, DISP_CPU_NUM(dp),
+		    memory_order_relaxed);
+	else
+		atomic_cpumask_clear(&rt_overload_mask, DISP_CPU_NUM(dp),
+		    memory_order_relaxed);
+}
+
 static void
 runq_insert(struct kcpu_dispatcher *dp, kthread_t *thread)
 {
 	kpri_t epri = thread->effective_prio;
 
-	if (thread->sched_class == SCHED_FIFO ||
-	    thread->sched_class == SCHED_RR) {
-		kassert(epri >= PRIO_MIN_RT &&
-		    epri < PRIO_LIMIT, "invalid real-time effective priority");
+	/*
+	 * The priority and class may change while we're queued (priority
+	 * inheritance); runq_remove() must undo exactly what we do here.
+	 */
+	thread->runq_prio = epri;
+	thread->runq_rt = THREAD_IS_RT(thread);
 
-		ke_spinlock_enter_nospl(&rt_lock);
-		TAILQ_INSERT_TAIL(&global_rt_rq[epri - PRIO_MIN_RT],
-		    thread, tqlink);
-		atomic_fetch_or_explicit(&rt_bitmap,
-		    1U << (epri - PRIO_MIN_RT), memory_order_relaxed);
+	TAILQ_INSERT_TAIL(&dp->rq[epri], thread, tqlink);
+	dp->bitmap[epri / 32] |= 1U << (epri % 32);
 
-		ke_spinlock_exit_nospl(&rt_lock);
+	if (thread->runq_rt) {
+		kassert(epri >= PRIO_MIN_RT &&
+		    epri < PRIO_LIMIT, "invalid real-time effective priority");
+		rt_bitmap_update(dp);
 	} else {
-		TAILQ_INSERT_TAIL(&dp->rq[epri], thread, tqlink);
-		dp->bitmap[epri / 32] |= 1U << (epri % 32);
+		uint32_t nready;
+
+		nready = atomic_load_explicit(&dp->nready,
+		    memory_order_relaxed) + 1;
+		atomic_store_explicit(&dp->nready, nready,
+		    memory_order_relaxed);
+		if (nready > dp->stats.nready_max)
+			dp->stats.nready_max = nready;
 	}
 }
 
+static void
+runq_remove(struct kcpu_dispatcher *dp, kthread_t *thread)
+{
+	kpri_t prio = thread->runq_prio;
+	runq_t *rq = &dp->rq[prio];
+
+	TAILQ_REMOVE(rq, thread, tqlink);
+	if (TAILQ_EMPTY(rq))
+		dp->bitmap[prio / 32] &= ~(1U << (prio % 32));
+
+	if (thread->runq_rt)
+		rt_bitmap_update(dp);
+	else
+		atomic_store_explicit(&dp->nready,
+		    atomic_load_explicit(&dp->nready, memory_order_relaxed) - 1,
+		    memory_order_relaxed);
+}
+
 static void do_reschedule(void*)
 {
 	CPU_LOCAL_STORE(redispatch_requested, true);
 	ke_raise_disp_int();
 }
 
+static inline int
+msb(uint32_t x)
+{
+	return 31 - __builtin_clz(x);
+}
+
+/*! @brief Find the CPU with the longest run queue, other than \p self. */
+static kcpunum_t
+find_busiest(kcpunum_t self, uint32_t *nready_out)
+{
+	kcpunum_t busiest = KCPUNUM_NULL;
+	uint32_t max = 0;
+
+	for (kcpunum_t i = 0; i < ke_ncpu; i++) {
+		uint32_t nready;
+
+		if (i == self)
+			continue;
+
+		nready = atomic_load_explicit(&ke_cpu_data[i]->disp.nready,
+		    memory_order_relaxed);
+		if (nready > max) {
+			max = nready;
+			busiest = i;
+		}
+	}
+
+	*nready_out = max;
+	return busiest;
+}
+
+static bool
+can_migrate(kthread_t *thread, kcpunum_t to, kabstime_t now, bool allow_hot)
+{
+	if (thread->bound_cpu != KCPUNUM_NULL && thread->bound_cpu != to)
+		return false;
+	if (!allow_hot && now - thread->last_ran < CACHE_HOT_NS)
+		return false;
+	return true;
+}
+
+/*!
+ * @brief Take the highest-priority migratable thread with priority in
+ * [\p minprio, \p maxprio] off another CPU's queues.
+ *
+ * Both our and the victim's dispatcher locks must be held.
+ *
+ * A thread whose lock is held may still be in the middle of being switched
+ * out by its CPU (ke_dispatch() queues it before switching away), so such
+ * threads are passed over.
+ */
+static kthread_t *
+runq_steal(struct kcpu_dispatcher *victim, kcpunum_t to, kabstime_t now,
+    bool allow_hot, int minprio, int maxprio)
+{
+	for (int w = maxprio / 32; w >= minprio / 32; --w) {
+		uint32_t bm = victim->bitmap[w];
+
+		if (w == maxprio / 32 && maxprio % 32 != 31)
+			bm &= (2U << (maxprio % 32)) - 1;
+		if (w == minprio / 32)
+			bm &= ~((1U << (minprio % 32)) - 1);
+
+		while (bm != 0) {
+			int prio = w * 32 + msb(bm);
+			kthread_t *t;
+
+			bm &= ~(1U << (prio % 32));
+
+			TAILQ_FOREACH(t, &victim->rq[prio], tqlink) {
+				if (!can_migrate(t, to, now, allow_hot))
+					continue;
+				if (!ke_spinlock_tryenter_nospl(&t->lock))
+					continue;
+				ke_spinlock_exit_nospl(&t->lock);
+
+				runq_remove(victim, t);
+				victim->stats.stolen_from++;
+				return t;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * @brief Try to find a thread for this CPU to run instead of going idle.
+ *
+ * Called from ke_dispatch() with our dispatcher lock held.
+ */
+static kthread_t *
+idle_steal(struct kcpu_dispatcher *dp)
+{
+	kcpunum_t self = CPU_LOCAL_LOAD(cpu_num), victim_num;
+	struct kcpu_dispatcher *victim;
+	kthread_t *t;
+	kabstime_t now;
+	uint32_t nready;
+
+	victim_num = find_busiest(self, &nready);
+	if (victim_num == KCPUNUM_NULL)
+		return NULL;
+
+	victim = &ke_cpu_data[victim_num]->disp;
+	if (!ke_spinlock_tryenter_nospl(&victim->lock))
+		return NULL;
+
+	/*
+	 * Prefer a cache-cold thread; failing that, a hot one is fair game if
+	 * the victim has a backlog.
+	 */
+	now = ke_time();
+	t = runq_steal(victim, self, now, false, 0, PRIO_MIN_RT - 1);
+	if (t == NULL && nready > 1)
+		t = runq_steal(victim, self, now, true, 0, PRIO_MIN_RT - 1);
+	ke_spinlock_exit_nospl(&victim->lock);
+
+	if (t != NULL)
+		dp->stats.idle_steals++;
+
+	return t;
+}
+
+/*!
+ * @brief Periodic load balancing, run as a DPC every BALANCE_TICKS.
+ */
+static void
+balance_dpc(void *arg, void *)
+{
+	struct kcpu_dispatcher *dp = arg, *victim;
+	kcpunum_t self = CPU_LOCAL_LOAD(cpu_num), victim_num;
+	uint32_t nready, mine, nmove;
+	bool preempt = false;
+	kabstime_t now;
+	kthread_t *t;
+
+	victim_num = find_busiest(self, &nready);
+	mine = atomic_load_explicit(&dp->nready, memory_order_relaxed);
+	if (victim_num == KCPUNUM_NULL || nready < mine + BALANCE_IMBALANCE)
+		return;
+
+	victim = &ke_cpu_data[victim_num]->disp;
+	nmove = (nready - mine) / 2;
+	now = ke_time();
+
+	ke_spinlock_enter_nospl(&dp->lock);
+	if (!ke_spinlock_tryenter_nospl(&victim->lock)) {
+		ke_spinlock_exit_nospl(&dp->lock);
+		return;
+	}
+
+	while (nmove-- > 0 &&
+	    (t = runq_steal(victim, self, now, false, 0,
+	    PRIO_MIN_RT - 1)) != NULL) {
+		runq_insert(dp, t);
+		dp->stats.balance_pulls++;
+		if (should_preempt(dp, t))
+			preempt = true;
+	}
+
+	ke_spinlock_exit_nospl(&victim->lock);
+	ke_spinlock_exit_nospl(&dp->lock);
+
+	if (preempt)
+		do_reschedule(NULL);
+}
+
+/*!
+ * @brief Pull a real-time thread of higher priority than \p lprio from
+ * another CPU with RT threads queued.
+ *
+ * Called from ke_dispatch() with our dispatcher lock held.
+ */
+static kthread_t *
+rt_pull(struct kcpu_dispatcher *dp, int lprio)
+{
+	kcpunum_t self = CPU_LOCAL_LOAD(cpu_num);
+	size_t width = (ke_ncpu + UINTPTR_BITS - 1) / UINTPTR_BITS;
+
+	for (size_t i = 0; i < width; i++) {
+		uintptr_t mask = atomic_load_explicit(&rt_overload_mask.mask[i],
+		    memory_order_relaxed);
+
+		while (mask != 0) {
+			kcpunum_t cpu = i * UINTPTR_BITS + __builtin_ctzl(mask);
+			struct kcpu_dispatcher *victim;
+			uint32_t bm;
+			kthread_t *t;
+
+			mask &= mask - 1;
+
+			if (cpu == self || cpu >= ke_ncpu)
+				continue;
+
+			victim = &ke_cpu_data[cpu]->disp;
+			bm = atomic_load_explicit(&victim->rt_bitmap,
+			    memory_order_relaxed);
+			if (bm == 0 || (int)(PRIO_MIN_RT + msb(bm)) <= lprio)
+				continue;
+
+			if (!ke_spinlock_tryenter_nospl(&victim->lock))
+				continue;
+			t = runq_steal(victim, self, 0, true,
+			    MAX2(lprio + 1, PRIO_MIN_RT), PRIO_LIMIT - 1);
+			ke_spinlock_exit_nospl(&victim->lock);
+
+			if (t != NULL) {
+				dp->stats.rt_pulls++;
+				return t;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * @brief Push queued real-time threads to CPUs running lower priority work.
+ *
+ * Scheduled by ke_dispatch() when it leaves an RT thread queued.
+ */
+static void
+rt_push_dpc(void *arg, void *)
+{
+	struct kcpu_dispatcher *dp = arg, *target_dp;
+	kcpunum_t self = CPU_LOCAL_LOAD(cpu_num), target;
+
+	for (size_t tries = 0; tries < ke_ncpu; tries++) {
+		uint32_t bm;
+		kpri_t prio;
+		kthread_t *t;
+
+		ke_spinlock_enter_nospl(&dp->lock);
+
+		bm = dp->bitmap[RT_WORD];
+		if (bm == 0) {
+			ke_spinlock_exit_nospl(&dp->lock);
+			return;
+		}
+
+		prio = PRIO_MIN_RT + msb(bm);
+		t = TAILQ_FIRST(&dp->rq[prio]);
+
+		target = find_lowest(t, self);
+		if (target == KCPUNUM_NULL) {
+			ke_spinlock_exit_nospl(&dp->lock);
+			return;
+		}
+
+		target_dp = &ke_cpu_data[target]->disp;
+		if (!ke_spinlock_tryenter_nospl(&target_dp->lock)) {
+			ke_spinlock_exit_nospl(&dp->lock);
+			continue;
+		}
+
+		if (!should_preempt(target_dp, t) ||
+		    !ke_spinlock_tryenter_nospl(&t->lock)) {
+			ke_spinlock_exit_nospl(&target_dp->lock);
+			ke_spinlock_exit_nospl(&dp->lock);
+			return;
+		}
+		ke_spinlock_exit_nospl(&t->lock);
+
+		runq_remove(dp, t);
+		runq_insert(target_dp, t);
+		dp->stats.rt_pushes++;
+
+		ke_spinlock_exit_nospl(&target_dp->lock);
+		ke_spinlock_exit_nospl(&dp->lock);
+
+		ke_xcall_unicast(do_reschedule, NULL, target);
+	}
+}
+
+static void
+rt_latency_record(struct kcpu_dispatcher *dp, kthread_t *thread)
+{
+	struct kcpu_disp_stats *st = &dp->stats;
+	uint64_t lat = ke_time() - thread->wakeup_time;
+	uint64_t us = lat / 1000;
+	size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+	thread->wakeup_time = 0;
+
+	st->rt_lat_count++;
+	st->rt_lat_sum_ns += lat;
+	if (lat > st->rt_lat_max_ns)
+		st->rt_lat_max_ns = lat;
+	st->rt_lat_hist[MIN2(bucket, elementsof(st->rt_lat_hist) - 1)]++;
+}
+
 /*
  * Resume a blocked thread.
  *
@@ -199,6 +619,9 @@ ke_thread_resume(kthread_t *t, bool io_completion)
 	if (io_completion)
 		kep_sched_class[t->sched_class]->io_completed(t);
 
+	if (ke_rt_latency_trace && THREAD_IS_RT(t))
+		t->wakeup_time = ke_time();
+
 	ipl = spldisp();
 
 	cpunum = pick_cpu(t);
@@ -222,12 +645,6 @@ ke_thread_resume(kthread_t *t, bool io_completion)
 	splx(ipl);
 }
 
-static inline int
-msb(uint32_t x)
-{
-	return 31 - __builtin_clz(x);
-}
-
 kthread_t *
 next_thread(struct kcpu_dispatcher *dp)
 {
@@ -241,50 +658,99 @@ next_thread(struct kcpu_dispatcher *dp)
 		}
 	}
 
-	if (atomic_load_explicit(&rt_bitmap, memory_order_relaxed)) {
-		uint32_t gbm;
-		int grt_idx;
-
-		ke_spinlock_enter_nospl(&rt_lock);
-
-		gbm = atomic_load_explicit(&rt_bitmap, memory_order_relaxed);
-		grt_idx = (gbm != 0) ? msb(gbm) : -1;
-
-		if (grt_idx != -1 && (grt_idx + PRIO_MIN_RT) >= lprio) {
-			runq_t *rq = &global_rt_rq[grt_idx];
-			kthread_t *t = TAILQ_FIRST(rq);
-			TAILQ_REMOVE(rq, t, tqlink);
-			if (TAILQ_EMPTY(rq))
-				atomic_fetch_and_explicit(&rt_bitmap,
-				    ~(1U << grt_idx), memory_order_relaxed);
-			ke_spinlock_exit_nospl(&rt_lock);
+	if (ke_ncpu > 1 && atomic_cpumask_first_set(&rt_overload_mask,
+	    memory_order_relaxed) != KCPUNUM_NULL) {
+		kthread_t *t = rt_pull(dp, lprio);
+		if (t != NULL)
 			return t;
-		}
-
-		ke_spinlock_exit_nospl(&rt_lock);
 	}
 
 	if (lprio >= 0) {
-		runq_t *rq = &dp->rq[lprio];
-		kthread_t *t = TAILQ_FIRST(rq);
+		kthread_t *t = TAILQ_FIRST(&dp->rq[lprio]);
 		kassert(t != NULL, "dispatcher bitmap and queue out of sync");
-		TAILQ_REMOVE(rq, t, tqlink);
-		if (TAILQ_EMPTY(rq))
-			dp->bitmap[lprio / 32] &= ~(1U << (lprio % 32));
+		runq_remove(dp, t);
 		return t;
 	}
 
+	if (ke_ncpu > 1) {
+		kthread_t *t = idle_steal(dp);
+		if (t != NULL)
+			return t;
+	}
+
 	return dp->idle_thread;
 }
 
+/*!
+ * @brief Account for \p ticks clock ticks having elapsed.
+ *
+ * Usually 1; may be more with a tickless clock, which only interrupts when
+ * something is due.
+ */
 void
-kep_disp_hardclock(void)
+kep_disp_hardclock(uint32_t ticks)
 {
 	struct kcpu_dispatcher *disp = CPU_LOCAL_ADDROF(disp);
+	uint32_t nready = atomic_load_explicit(&disp->nready,
+	    memory_order_relaxed), left;
 
-	if (atomic_fetch_sub_explicit(&disp->timeslice, 1,
-	    memory_order_relaxed) <= 1)
-		do_reschedule(NULL);
+	kep_rcu_hardclock();
+
+	disp->stats.nready_sum += (uint64_t)nready * ticks;
+	disp->stats.ticks += ticks;
+
+	/*
+	 * Only this CPU writes the timeslice, and ke_dispatch() can't run
+	 * meanwhile, so a plain load and store will do. A tickless clock may
+	 * charge more ticks than are left; stop at 0 so the overrun reads as
+	 * expiry.
+	 */
+	if (!disp->timeslice_none) {
+		left = atomic_load_explicit(&disp->timeslice,
+		    memory_order_relaxed);
+		left = left > ticks ? left - ticks : 0;
+		atomic_store_explicit(&disp->timeslice, left,
+		    memory_order_relaxed);
+		if (left == 0)
+			do_reschedule(NULL);
+	}
+
+	if (ke_ncpu == 1)
+		return;
+
+	if (disp->cur_thread == disp->idle_thread) {
+		/* idle - redispatch to steal if someone has a backlog */
+		kcpunum_t self = CPU_LOCAL_LOAD(cpu_num);
+		if (find_busiest(self, &nready) != KCPUNUM_NULL)
+			do_reschedule(NULL);
+	} else if ((disp->balance_ticks += ticks) >= BALANCE_TICKS) {
+		disp->balance_ticks = 0;
+		ke_dpc_schedule(&disp->balance_dpc);
+	}
+}
+
+/*!
+ * @brief How many ticks from the last until the dispatcher next needs one?
+ *
+ * That's when the current thread's timeslice runs out or the next periodic
+ * balance is due, whichever comes first. Called by a tickless clock with
+ * interrupts disabled.
+ */
+uint32_t
+kep_disp_ticks_needed(void)
+{
+	struct kcpu_dispatcher *disp = CPU_LOCAL_ADDROF(disp);
+	uint32_t ticks = disp->timeslice_none ? UINT16_MAX :
+	    atomic_load_explicit(&disp->timeslice, memory_order_relaxed);
+
+	if (ke_ncpu > 1 && disp->balance_ticks < BALANCE_TICKS)
+		ticks = MIN2(ticks, BALANCE_TICKS - disp->balance_ticks);
+
+	/* an expired timeslice has a redispatch due anyway */
+	if (ticks == 0)
+		ticks = 1;
+
+	return ticks;
 }
 
 void
@@ -292,6 +758,7 @@ ke_dispatch(void)
 {
 	kthread_t *oldt = CPU_LOCAL_LOAD(curthread), *nextt;
 	struct kcpu_dispatcher *disp = CPU_LOCAL_ADDROF(disp);
+	uint16_t quantum;
 
 	kassert(ke_ipl() == IPL_DISP, "ke_dispatch called at invalid IPL");
 
@@ -299,7 +766,7 @@ ke_dispatch(void)
 	    "current thread lock not held in ke_dispatch");
 	CPU_LOCAL_STORE(redispatch_requested, false);
 
-	// rcu_quiet();
+	kep_rcu_quiet();
 
 	ke_spinlock_enter_nospl(&disp->lock);
 
@@ -310,12 +777,15 @@ ke_dispatch(void)
 	} else if (oldt->state == TS_RUNNING) {
 		/* currently running - replace on runqueue */
 		oldt->state = TS_READY;
+		oldt->last_ran = ke_time();
 		kep_sched_class[oldt->sched_class]->did_preempt_thread(oldt,
+		    !disp->timeslice_none &&
 		    atomic_load_explicit(&disp->timeslice,
-		    memory_order_relaxed) <= 0);
+		    memory_order_relaxed) == 0);
 		runq_insert(disp, oldt);
 	} else if (oldt->state == TS_SLEEPING) {
 		/* going to sleep. account for sleep time here? */
+		oldt->last_ran = ke_time();
 	} else if (oldt->state == TS_TERMINATED) {
 		/* queue it on a done queue, to be invoked from DPC... */
 		kdprintf("TODO: queue thread for destruction\n");
@@ -323,9 +793,20 @@ ke_dispatch(void)
 
 	nextt = next_thread(disp);
 	nextt->state = TS_RUNNING;
-	atomic_store_explicit(&disp->timeslice,
-	    kep_sched_class[nextt->sched_class]->quantum(nextt),
+	quantum = kep_sched_class[nextt->sched_class]->quantum(nextt);
+	disp->timeslice_none = quantum == KQUANTUM_NONE;
+	atomic_store_explicit(&disp->timeslice, quantum, memory_order_relaxed);
+	atomic_store_explicit(&disp->cur_pri,
+	    nextt == disp->idle_thread ? 0 : nextt->effective_prio,
 	    memory_order_relaxed);
+	kep_clock_dispatched(nextt == disp->idle_thread);
+
+	if (nextt->wakeup_time != 0)
+		rt_latency_record(disp, nextt);
+
+	/* an RT thread is left waiting; see if another CPU can take it */
+	if (disp->bitmap[RT_WORD] != 0 && ke_ncpu > 1)
+		ke_dpc_schedule(&disp->rt_push_dpc);
 
 	if (nextt == oldt) {
 		ke_spinlock_exit_nospl(&oldt->lock);
@@ -355,6 +836,33 @@ ke_dispatch(void)
 	ke_spinlock_exit_nospl(&CPU_LOCAL_LOAD(prevthread)->lock);
 }
 
+/*!
+ * @brief Is the thread currently running on a CPU other than ours?
+ *
+ * Used by the adaptive locks to decide whether to spin on an owner. This is
+ * racy by nature. It's safe to look at a thread that may have exited because
+ * thread structures are not freed while they can still be found as a lock
+ * owner (at present they aren't freed at all; if that changes it must be done
+ * with ke_rcu_call().)
+ */
+bool
+ke_thread_oncpu(kthread_t *thread)
+{
+	kcpunum_t cpu;
+	bool oncpu;
+	ipl_t ipl;
+
+	ipl = ke_rcu_read_lock();
+	cpu = __atomic_load_n(&thread->last_cpu_num, __ATOMIC_RELAXED);
+	oncpu = cpu != KCPUNUM_NULL && cpu < ke_ncpu &&
+	    cpu != CPU_LOCAL_LOAD(cpu_num) &&
+	    __atomic_load_n(&ke_cpu_data[cpu]->curthread, __ATOMIC_RELAXED) ==
+	    thread;
+	ke_rcu_read_unlock(ipl);
+
+	return oncpu;
+}
+
 kpri_t
 ke_thread_epri_locked(kthread_t *thread)
 {
@@ -412,6 +920,8 @@ ke_idle_thread_init(kcpunum_t cpunum, kthread_t *thread)
 	thread->effective_prio = 0;
 	SLIST_INIT(&thread->pi_head);
 	thread->last_cpu_num = cpunum;
+	thread->last_ran = 0;
+	thread->wakeup_time = 0;
 	thread->bound_cpu = cpunum;
 
 	(void)ipl;
@@ -419,12 +929,6 @@ ke_idle_thread_init(kcpunum_t cpunum, kthread_t *thread)
 	ipl = ke_spinlock_enter(&ke_task0->threads_lock);
 	LIST_INSERT_HEAD(&ke_task0->threads, thread, proc_link);
 	ke_spinlock_exit(&ke_task0->threads_lock, ipl);
-
-#if 0 // defined (__amd64__) /* TODO: move this out */
-	memset(&thread->pcb, 0, sizeof(thread->pcb));
-	(*(uint16_t *)(thread->pcb.fpu + 0)) = 0x037f;
-	(*(uint32_t *)(thread->pcb.fpu + 24)) = 0x1f80;
-#endif
 }
 
 void kep_rcu_per_cpu_init(struct kep_rcu_per_cpu_data *data);
@@ -441,13 +945,8 @@ ke_cpu_init(kcpunum_t cpunum, struct kcpu_data *data,
 	ke_spinlock_init(&data->dpc_lock);
 	TAILQ_INIT(&data->dpc_queue);
 
-	/* todo(low): into callout.c please */
-	TAILQ_INIT(&data->callout.callouts);
-	data->callout.next_deadline = 0;
-	ke_spinlock_init(&data->callout.lock);
-	void kep_callout_expiry_dpc(void *, void *);
-	ke_dpc_init(&data->callout.expiry_dpc, kep_callout_expiry_dpc,
-	    &data->callout, NULL);
+	void kep_callout_cpu_init(struct kcpu_callout *);
+	kep_callout_cpu_init(&data->callout);
 
 	kep_rcu_per_cpu_init(&data->rcu_cpustate);
 
@@ -474,3 +973,36 @@ ke_thread_exit(void)
 	ke_curthread()->state = TS_TERMINATED;
 	ke_dispatch();
 }
+
+void
+dbg_disp_dump(void)
+{
+	for (kcpunum_t i = 0; i < ke_ncpu; i++) {
+		struct kcpu_dispatcher *disp = &ke_cpu_data[i]->disp;
+		struct kcpu_disp_stats *st = &disp->stats;
+
+		kdprintf("cpu %u: nready %" PRIu64 " (max %" PRIu64 ", avg %"
+		    PRIu64 ".%02" PRIu64 "), idle steals %" PRIu64
+		    ", balance pulls %" PRIu64 ", stolen from %" PRIu64 "\n", i,
+		    (uint64_t)atomic_load_explicit(&disp->nready,
+		    memory_order_relaxed), st->nready_max,
+		    st->ticks ? st->nready_sum / st->ticks : 0,
+		    st->ticks ? (st->nready_sum * 100 / st->ticks) % 100 : 0,
+		    st->idle_steals, st->balance_pulls, st->stolen_from);
+		kdprintf("  rt: pushes %" PRIu64 ", pulls %" PRIu64 "\n",
+		    st->rt_pushes, st->rt_pulls);
+
+		if (st->rt_lat_count == 0)
+			continue;
+
+		kdprintf("  rt wakeup latency: n %" PRIu64 ", avg %" PRIu64
+		    "ns, max %" PRIu64 "ns\n", st->rt_lat_count,
+		    st->rt_lat_sum_ns / st->rt_lat_count, st->rt_lat_max_ns);
+		for (size_t j = 0; j < elementsof(st->rt_lat_hist); j++) {
+			if (st->rt_lat_hist[j] == 0)
+				continue;
+			kdprintf("    < %luus: %" PRIu64 "\n", 1UL << j,
+			    st->rt_lat_hist[j]);
+		}
+	}
+}
@@ -0,0 +1,262 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file lockstat.c
+ * @brief Lock profiling.
+ *
+ * Contended acquisitions of mutexes and rwlocks are always counted; spinlocks
+ * are only profiled while profiling is enabled, as they're taken too often,
+ * and in too many places, for the table to hold them all. When profiling is
+ * enabled (ke_lockstat_enable(), or by writing "1" to /dev/lockstat) every
+ * acquisition is counted and the time spent spinning and blocking is
+ * accumulated too.
+ *
+ * Sites are kept in fixed-size open-addressed hash tables, one per kind of
+ * lock, keyed by the address of their reason string (or, for spinlocks, which
+ * have none, by the return address of the lock call, so that the many
+ * instances of a per-object lock share a site.) Slots are claimed with a CAS
+ * and never freed, so lookup is lock-free; in particular, recording never
+ * takes a lock, so spinlocks can be profiled too. If a table fills up, further
+ * sites go unrecorded and are counted in ls_overflow.
+ */
+
+#include <sys/k_intr.h>
+#include <sys/k_lockstat.h>
+#include <sys/k_log.h>
+#include <sys/libkern.h>
+
+#include <stdint.h>
+
+#define LS_SITES 512
+#define LS_MASK (LS_SITES - 1)
+
+uint64_t murmur64(uint64_t);
+
+bool kep_lockstat_enabled = false;
+
+static struct klockstat_site ls_sites[kLockstatKindMax][LS_SITES];
+static atomic_ulong ls_overflow;
+
+static const char *kind_names[kLockstatKindMax] = {
+	[kLockstatMutex] = "mutex",
+	[kLockstatRWRead] = "rw_read",
+	[kLockstatRWWrite] = "rw_write",
+	[kLockstatSpin] = "spin",
+};
+
+static struct klockstat_site *
+site_lookup(enum klockstat_kind kind, const void *key)
+{
+	struct klockstat_site *table = ls_sites[kind];
+	size_t i = murmur64((uintptr_t)key) & LS_MASK;
+
+	if (key == NULL)
+		return NULL;
+
+	for (size_t n = 0; n < LS_SITES; n++, i = (i + 1) & LS_MASK) {
+		struct klockstat_site *site = &table[i];
+		const void *cur = atomic_load_explicit(&site->key,
+		    memory_order_acquire);
+
+		if (cur == NULL && atomic_compare_exchange_strong_explicit(
+		    &site->key, &cur, key, memory_order_acq_rel,
+		    memory_order_acquire))
+			return site;
+
+		if (cur == key)
+			return site;
+	}
+
+	atomic_fetch_add_explicit(&ls_overflow, 1, memory_order_relaxed);
+	return NULL;
+}
+
+/*!
+ * @brief Record an acquisition of a lock.
+ *
+ * Called by the lock primitives on every acquisition while profiling is
+ * enabled, and otherwise only on contended ones.
+ *
+ * @param spun Whether the acquirer spun waiting for the lock.
+ * @param blocked Whether the acquirer blocked waiting for the lock.
+ * @param spin_ns Time spent spinning (0 if profiling is disabled.)
+ * @param block_ns Time spent blocked (0 if profiling is disabled.)
+ */
+void
+kep_lockstat_record(enum klockstat_kind kind, const void *key, bool spun,
+    bool blocked, kabstime_t spin_ns, kabstime_t block_ns)
+{
+	struct klockstat_site *site = site_lookup(kind, key);
+
+	if (site == NULL)
+		return;
+
+	if (kep_lockstat_enabled) {
+		atomic_fetch_add_explicit(&site->acquisitions, 1,
+		    memory_order_relaxed);
+		if (spin_ns != 0)
+			atomic_fetch_add_explicit(&site->spin_ns, spin_ns,
+			    memory_order_relaxed);
+		if (block_ns != 0)
+			atomic_fetch_add_explicit(&site->block_ns, block_ns,
+			    memory_order_relaxed);
+	}
+
+	if (!spun && !blocked)
+		return;
+
+	atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+	if (blocked)
+		atomic_fetch_add_explicit(&site->blocks, 1,
+		    memory_order_relaxed);
+	else
+		atomic_fetch_add_explicit(&site->spins, 1,
+		    memory_order_relaxed);
+}
+
+/*
+ * ke_spinlock_enter{,_nospl}() are inline, so our return address is in the
+ * function that took the lock.
+ */
+void
+kep_lockstat_spin_acquired(kspinlock_t *)
+{
+	kep_lockstat_record(kLockstatSpin, __builtin_return_address(0), false,
+	    false, 0, 0);
+}
+
+/*!
+ * @brief Slow path of ke_spinlock_enter_nospl(), entered if the lock was
+ * found to be held.
+ */
+void
+kep_lockstat_spin_contended(kspinlock_t *lock)
+{
+	kabstime_t start = KEP_LOCKSTAT_TIME();
+
+	while (__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE))
+		;
+
+	if (start != 0)
+		kep_lockstat_record(kLockstatSpin, __builtin_return_address(0),
+		    true, false, ke_time() - start, 0);
+}
+
+void
+ke_lockstat_enable(bool enable)
+{
+	__atomic_store_n(&kep_lockstat_enabled, enable, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief Zero all counters.
+ *
+ * Sites stay claimed, since lookups may be running concurrently. Counts
+ * recorded during the reset may be partially lost.
+ */
+void
+ke_lockstat_reset(void)
+{
+	for (size_t k = 0; k < kLockstatKindMax; k++) {
+		for (size_t i = 0; i < LS_SITES; i++) {
+			struct klockstat_site *site = &ls_sites[k][i];
+
+			atomic_store_explicit(&site->acquisitions, 0,
+			    memory_order_relaxed);
+			atomic_store_explicit(&site->contended, 0,
+			    memory_order_relaxed);
+			atomic_store_explicit(&site->spins, 0,
+			    memory_order_relaxed);
+			atomic_store_explicit(&site->blocks, 0,
+			    memory_order_relaxed);
+			atomic_store_explicit(&site->spin_ns, 0,
+			    memory_order_relaxed);
+			atomic_store_explicit(&site->block_ns, 0,
+			    memory_order_relaxed);
+		}
+	}
+
+	atomic_store_explicit(&ls_overflow, 0, memory_order_relaxed);
+}
+
+/*!
+ * @brief Format the next line of the lockstat report.
+ *
+ * The first line is a header; each subsequent one describes a site. Sites
+ * with no recorded activity are skipped.
+ *
+ * @param cursor Position in the report; initialise to 0.
+ * @returns false once there are no more lines.
+ */
+bool
+ke_lockstat_format(size_t *cursor, char *buf, size_t size)
+{
+	if (*cursor == 0) {
+		ksnprintf(buf, size,
+		    "%-8s %-40s %10s %10s %10s %10s %14s %14s\n", "kind",
+		    "site", "acquired", "contended", "spins", "blocks",
+		    "spin_ns", "block_ns");
+		(*cursor)++;
+		return true;
+	}
+
+	while (*cursor <= kLockstatKindMax * LS_SITES) {
+		size_t idx = *cursor - 1;
+		enum klockstat_kind kind = idx / LS_SITES;
+		struct klockstat_site *site = &ls_sites[kind][idx % LS_SITES];
+		const void *key = atomic_load_explicit(&site->key,
+		    memory_order_acquire);
+		unsigned long acquisitions, contended;
+
+		(*cursor)++;
+
+		if (key == NULL)
+			continue;
+
+		acquisitions = atomic_load_explicit(&site->acquisitions,
+		    memory_order_relaxed);
+		contended = atomic_load_explicit(&site->contended,
+		    memory_order_relaxed);
+		if (acquisitions == 0 && contended == 0)
+			continue;
+
+		if (kind == kLockstatSpin)
+			ksnprintf(buf, size, "%-8s %-40p", kind_names[kind],
+			    key);
+		else
+			ksnprintf(buf, size, "%-8s %-40s", kind_names[kind],
+			    (const char *)key);
+
+		ksnprintf(buf + strlen(buf), size - strlen(buf),
+		    " %10lu %10lu %10lu %10lu %14lu %14lu\n", acquisitions,
+		    contended,
+		    atomic_load_explicit(&site->spins, memory_order_relaxed),
+		    atomic_load_explicit(&site->blocks, memory_order_relaxed),
+		    atomic_load_explicit(&site->spin_ns, memory_order_relaxed),
+		    atomic_load_explicit(&site->block_ns,
+			memory_order_relaxed));
+		return true;
+	}
+
+	if (*cursor == kLockstatKindMax * LS_SITES + 1) {
+		ksnprintf(buf, size, "# profiling %s, %lu unrecorded\n",
+		    kep_lockstat_enabled ? "enabled" : "disabled",
+		    atomic_load_explicit(&ls_overflow, memory_order_relaxed));
+		(*cursor)++;
+		return true;
+	}
+
+	return false;
+}
+
+void
+dbg_lockstat_dump(void)
+{
+	char line[160];
+	size_t cursor = 0;
+
+	while (ke_lockstat_format(&cursor, line, sizeof(line)))
+		kdprintf("%s", line);
+}
@@ -6,10 +6,13 @@
  * @file mutex.c
  * @brief Mutex.
  *
- * TODO:
- * - adaptive spinning
+ * Mutexes are adaptive: a contending thread spins for as long as the owner is
+ * running on another CPU, since it's likely to release the mutex soon, and
+ * only blocks on the turnstile when the owner is not running (or has held
+ * the lock for longer than ADAPTIVE_SPIN_MAX iterations.)
  */
 
+#include <sys/k_lockstat.h>
 #include <sys/k_log.h>
 #include <sys/k_thread.h>
 #include <sys/k_wait.h>
@@ -21,6 +24,29 @@
 
 #define MTX_OWNER(V)	((kthread_t *)((V) & ~MTX_FLAGMASK))
 
+#define ADAPTIVE_SPIN_MAX 8192
+
+/*!
+ * @brief Spin while the mutex's owner is running on another CPU.
+ *
+ * @returns true if the mutex was seen to be released, so acquisition should
+ * be retried; false if the caller should block.
+ */
+static bool
+mutex_spin(kmutex_t *mtx, uintptr_t val)
+{
+	for (unsigned i = 0; i < ADAPTIVE_SPIN_MAX; i++) {
+		if (val == 0)
+			return true;
+		if (!ke_thread_oncpu(MTX_OWNER(val)))
+			return false;
+		ke_arch_pause();
+		val = __atomic_load_n(&mtx->val, __ATOMIC_RELAXED);
+	}
+
+	return false;
+}
+
 void
 ke_mutex_init(kmutex_t *mtx)
 {
@@ -34,6 +60,8 @@ ke_mutex_enter(kmutex_t *mtx, const char *reason)
 	kturnstile_t *ts;
 	uintptr_t val, new;
 	ipl_t ipl;
+	kabstime_t start, spin_ns = 0, block_ns = 0;
+	bool spun = false, blocked = false, again;
 
 	for (;;) {
 		retry:
@@ -42,8 +70,23 @@ ke_mutex_enter(kmutex_t *mtx, const char *reason)
 		if (likely(val == 0)) {
 			new = (uintptr_t)self | MTX_LOCKED;
 			if (__atomic_compare_exchange_n(&mtx->val, &val, new,
-			    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				if (unlikely(kep_lockstat_enabled || spun ||
+				    blocked))
+					kep_lockstat_record(kLockstatMutex,
+					    reason, spun, blocked, spin_ns,
+					    block_ns);
 				return;
+			}
+			continue;
+		}
+
+		start = KEP_LOCKSTAT_TIME();
+		again = mutex_spin(mtx, val);
+		if (start != 0)
+			spin_ns += ke_time() - start;
+		if (again) {
+			spun = true;
 			continue;
 		}
 
@@ -66,7 +109,11 @@ ke_mutex_enter(kmutex_t *mtx, const char *reason)
 			}
 		}
 
+		blocked = true;
+		start = KEP_LOCKSTAT_TIME();
 		ke_turnstile_block(ts, true, mtx, MTX_OWNER(val), ipl, reason);
+		if (start != 0)
+			block_ns += ke_time() - start;
 		/* note: no ownership handoff */
 	}
 }
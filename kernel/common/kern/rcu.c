@@ -8,130 +8,411 @@
  */
 /*!
  * @file rcu.c
- * @brief Brief explanation.
+ * @brief Read-copy-update.
+ *
+ * Read-side critical sections run at IPL_DISP, so a CPU is in a quiescent
+ * state whenever it is running a DPC or in ke_dispatch(): at those points it
+ * can't be within a read-side critical section.
+ *
+ * Quiescent states are tracked with a tree of krcu_node. Each CPU belongs to
+ * a leaf, and each leaf (and each interior node) has a bitmask of the
+ * children yet to report in the current grace period. A CPU clears its bit
+ * in its leaf; the CPU that clears the last bit of a node goes on to clear
+ * the node's bit in its parent, and so on. When the root's mask is empty,
+ * the grace period is over. So most reports touch only a leaf's lock, shared
+ * with at most RCU_FANOUT_LEAF - 1 other CPUs.
+ *
+ * A grace period is started by setting up the masks top-down. A node's
+ * gp_seq is only written once its mask is set up, and CPUs find out about a
+ * new grace period by reading their leaf's gp_seq, so they can't report to a
+ * node before it's ready. A parent is always set up before its children, so
+ * a node's bit in its parent is already set by the time it's able to clear it.
+ *
+ * Callbacks queued with ke_rcu_call() go to the per-CPU next list. Every
+ * so often (from the clock interrupt, via the qs DPC) the CPU moves the next
+ * list to its current list, noting that it must wait for the grace period
+ * after the one now in progress (if any), and asks for that grace period to be
+ * started. Once it completes the current list moves to the past list and the
+ * callbacks are invoked, no more than RCU_BATCH_LIMIT per DPC, so that a flood
+ * of frees can't hold up other DPCs and threads for long.
+ *
+ * ke_rcu_synchronise_expedited() doesn't wait for a grace period, but instead
+ * IPIs every CPU to run a DPC and waits for them all to have done so.
+ *
+ * With a tickless clock, a CPU keeps ticking while kep_rcu_needs_cpu() says
+ * so, but an idle CPU that has stopped its tick would never notice a new
+ * grace period. So gp_start() IPIs the CPUs in kep_clock_idle_mask to have
+ * them run their qs DPC.
  */
 
 #include <sys/cpulocal.h>
 #include <sys/k_cpu.h>
 #include <sys/k_intr.h>
 #include <sys/k_rcu.h>
+#include <sys/k_thread.h>
+#include <sys/k_wait.h>
+#include <sys/k_xcall.h>
 
 #include <sys/k_log.h>
 
-struct rcu_state {
+#define RCU_FANOUT_LEAF 16
+#define RCU_FANOUT 16
+#define RCU_MAX_LEVELS 4
+#define RCU_MAX_LEAVES ((MAX_CPUS + RCU_FANOUT_LEAF - 1) / RCU_FANOUT_LEAF)
+#define RCU_MAX_NODES (2 * RCU_MAX_LEAVES + 1)
+
+/* callbacks invoked per DPC run */
+#define RCU_BATCH_LIMIT 256
+/* backlog past which we keep the DPC going regardless */
+#define RCU_BATCH_HIGH 10000
+
+_Static_assert(RCU_FANOUT_LEAF <= 32 && RCU_FANOUT <= 32,
+    "qsmask is 32 bits");
+
+/*
+ * l: lock
+ * r: RCU_ROOT->lock
+ * a: atomic
+ * ~: invariant after kep_rcu_init()
+ */
+struct krcu_node {
 	kspinlock_t lock;
-	uint64_t quiesced;
-	uintptr_t generation, highest_generation;
+	uint32_t qsmask;		/* l: children yet to report */
+	uint32_t qsmaskinit;		/* ~: all children */
+	uintptr_t gp_seq;		/* l (write), a (read): GP set up for */
+	struct krcu_node *parent;	/* ~ */
+	uint32_t grpmask;		/* ~: my bit in parent->qsmask */
 };
 
-static struct rcu_state rcu = {
-	.lock = KSPINLOCK_INITIALISER,
-	.quiesced = 0,
-	.generation = 0,
-	.highest_generation = 0,
-};
+static struct rcu_state {
+	uintptr_t gp_current;		/* r: latest GP started */
+	uintptr_t gp_completed;		/* r (write), a (read) */
+	uintptr_t gp_requested;		/* r: latest GP anyone's waiting on */
+	size_t nnodes;			/* ~ */
+	struct krcu_node nodes[RCU_MAX_NODES]; /* ~: top-down, root first */
+} rcu;
+
+#define RCU_ROOT (&rcu.nodes[0])
+
+static struct rcu_exp_state {
+	kmutex_t mutex;
+	uintptr_t seq;			/* a: current expedited GP */
+	atomic_uint remaining;		/* CPUs yet to run exp_dpc */
+	kevent_t done;
+} rcu_exp;
+
+static void qs_dpc_handler(void *, void *);
+static void exp_dpc_handler(void *, void *);
+static void process_past_callbacks(void *, void *);
+static void kick_idle(void);
+
+/*!
+ * @brief Build the tree now that ke_ncpu is known.
+ */
+void
+kep_rcu_init(void)
+{
+	size_t counts[RCU_MAX_LEVELS], first[RCU_MAX_LEVELS];
+	size_t nlevels = 0, n = ke_ncpu, leaves_first;
+
+	do {
+		n = (n + (nlevels == 0 ? RCU_FANOUT_LEAF : RCU_FANOUT) - 1) /
+		    (nlevels == 0 ? RCU_FANOUT_LEAF : RCU_FANOUT);
+		kassert(nlevels < RCU_MAX_LEVELS);
+		counts[nlevels++] = n;
+	} while (n > 1);
+
+	/* lay out levels top-down, so root is nodes[0] */
+	for (size_t lvl = 0, idx = 0; lvl < nlevels; lvl++) {
+		size_t count = counts[nlevels - 1 - lvl];
+
+		first[lvl] = idx;
+
+		for (size_t j = 0; j < count; j++) {
+			struct krcu_node *node = &rcu.nodes[idx + j];
+
+			ke_spinlock_init(&node->lock);
+			node->qsmask = 0;
+			node->qsmaskinit = 0;
+			node->gp_seq = 0;
+
+			if (lvl == 0) {
+				node->parent = NULL;
+				node->grpmask = 0;
+			} else {
+				node->parent = &rcu.nodes[first[lvl - 1] +
+				    j / RCU_FANOUT];
+				node->grpmask = 1U << (j % RCU_FANOUT);
+				node->parent->qsmaskinit |= node->grpmask;
+			}
+		}
+
+		idx += count;
+		rcu.nnodes = idx;
+	}
 
+	leaves_first = first[nlevels - 1];
+
+	for (kcpunum_t i = 0; i < ke_ncpu; i++) {
+		struct kep_rcu_per_cpu_data *rcpu =
+		    &ke_cpu_data[i]->rcu_cpustate;
+		struct krcu_node *leaf = &rcu.nodes[leaves_first +
+		    i / RCU_FANOUT_LEAF];
+
+		rcpu->leaf_bit = 1U << (i % RCU_FANOUT_LEAF);
+		leaf->qsmaskinit |= rcpu->leaf_bit;
+		__atomic_store_n(&rcpu->leaf, leaf, __ATOMIC_RELEASE);
+	}
+
+	ke_mutex_init(&rcu_exp.mutex);
+
+	kdprintf("rcu: %zu nodes in %zu levels for %zu CPUs\n", rcu.nnodes,
+	    nlevels, ke_ncpu);
+}
+
+/*!
+ * @brief Start a new grace period.
+ *
+ * Entered with RCU_ROOT->lock held and no grace period in progress; returns
+ * with it released.
+ */
 static void
-start_generation()
+gp_start(void)
 {
-	/*
-	 * "A new generation is initiated by setting all CPU’s bits in the
-	 * bitmask, by incrementing the global current generation, and by
-	 * setting the global maximum generation to one greater than the current
-	 * value."
-	 */
-	rcu.quiesced = (1ULL << ke_ncpu) - 1;
-	rcu.generation++;
-	rcu.highest_generation = rcu.generation;
+	uintptr_t gp = ++rcu.gp_current;
+
+	kassert(rcu.gp_completed + 1 == gp);
+
+	RCU_ROOT->qsmask = RCU_ROOT->qsmaskinit;
+	__atomic_store_n(&RCU_ROOT->gp_seq, gp, __ATOMIC_RELEASE);
+	ke_spinlock_exit_nospl(&RCU_ROOT->lock);
+
+	for (size_t i = 1; i < rcu.nnodes; i++) {
+		struct krcu_node *node = &rcu.nodes[i];
+
+		ke_spinlock_enter_nospl(&node->lock);
+		node->qsmask = node->qsmaskinit;
+		__atomic_store_n(&node->gp_seq, gp, __ATOMIC_RELEASE);
+		ke_spinlock_exit_nospl(&node->lock);
+	}
+
+	kick_idle();
 }
 
-void
-kep_rcu_quiet()
+/*!
+ * @brief Report a quiescent state for grace period \p gp to a node.
+ *
+ * Propagates upward as nodes' masks empty, and ends the grace period if the
+ * root's does.
+ */
+static void
+report_qs(struct krcu_node *node, uint32_t mask, uintptr_t gp)
 {
-	struct kep_rcu_per_cpu_data *rcpu = CPU_LOCAL_ADDROF(rcu_cpustate);
-	int cpunum = CPU_LOCAL_LOAD(cpu_num);
+	for (;;) {
+		ke_spinlock_enter_nospl(&node->lock);
 
-	/*
-	 * "As each CPU notices that its bit is set, it copies its counters to
-	 * corresponding “snapshot” counters. Later, when the CPU notices that
-	 * any of the counters differs from the snapshot, it clears its bit.
-	 */
+		if (node->gp_seq != gp || (node->qsmask & mask) == 0) {
+			/* already reported (e.g. by a racing sibling) */
+			ke_spinlock_exit_nospl(&node->lock);
+			return;
+		}
 
-	if ((rcu.quiesced & 1 << cpunum)) {
-		ke_spinlock_enter_nospl(&rcu.lock);
-
-		rcu.quiesced &= ~((uint64_t)1 << cpunum);
-		if (rcu.quiesced == 0) {
-			/*
-			 * "If its bit is the last one set, it increments the
-			 * global current generation."
-			 */
-			rcu.generation++;
-			/*
-			 * "If the global current generation does not then
-			 * exceed the global maximum generation, the CPU
-			 * initiates a new generation."
-			 */
-			if (rcu.generation <= rcu.highest_generation)
-				start_generation();
+		node->qsmask &= ~mask;
+		if (node->qsmask != 0) {
+			ke_spinlock_exit_nospl(&node->lock);
+			return;
 		}
 
-		ke_spinlock_exit_nospl(&rcu.lock);
+		if (node->parent == NULL)
+			break;
+
+		mask = node->grpmask;
+		ke_spinlock_exit_nospl(&node->lock);
+		node = node->parent;
 	}
 
+	/* RCU_ROOT->lock held, every CPU has reported; GP is over. */
+	__atomic_store_n(&rcu.gp_completed, gp, __ATOMIC_RELEASE);
+
+	if (rcu.gp_requested > gp)
+		gp_start();
+	else
+		ke_spinlock_exit_nospl(&RCU_ROOT->lock);
+}
+
+/*!
+ * @brief Note a quiescent state on the current CPU.
+ *
+ * Called at IPL_DISP from ke_dispatch() and from the qs DPC. Cheap when no
+ * grace period needs us.
+ */
+void
+kep_rcu_quiet(void)
+{
+	struct kep_rcu_per_cpu_data *rcpu = CPU_LOCAL_ADDROF(rcu_cpustate);
+	struct krcu_node *leaf = rcpu->leaf;
+	uintptr_t gp;
+
+	if (leaf == NULL)
+		return;
+
+	gp = __atomic_load_n(&leaf->gp_seq, __ATOMIC_ACQUIRE);
+	if (gp != rcpu->gp_seen) {
+		rcpu->gp_seen = gp;
+		rcpu->qs_pending = true;
+	}
+
+	if (!rcpu->qs_pending)
+		return;
+
+	rcpu->qs_pending = false;
+	/* order all prior read-side accesses before the report */
+	atomic_thread_fence(memory_order_seq_cst);
+	report_qs(leaf, rcpu->leaf_bit, gp);
+}
+
+static void
+advance_callbacks(struct kep_rcu_per_cpu_data *rcpu)
+{
+	uintptr_t completed = __atomic_load_n(&rcu.gp_completed,
+	    __ATOMIC_ACQUIRE);
+
 	/*
-	 * "As each CPU notices that the global current generation has advanced
-	 * past its generation number, it appends the contents of its current
-	 * list to its intr list, and schedules a tasklet to process it."
+	 * Callbacks waiting on a GP that has now completed can be run.
 	 */
 	if (!TAILQ_EMPTY(&rcpu->current_callbacks) &&
-	    rcu.generation > rcpu->generation) {
+	    completed >= rcpu->generation) {
 		TAILQ_CONCAT(&rcpu->past_callbacks, &rcpu->current_callbacks,
 		    queue_entry);
+		rcpu->npast += rcpu->ncurrent;
+		rcpu->ncurrent = 0;
 		ke_dpc_schedule(&rcpu->past_callbacks_dpc);
 	}
 
+	/*
+	 * New callbacks must wait for a GP that begins after now, i.e. the
+	 * one after the most recently started. Request it, and start it if
+	 * there's none in progress.
+	 */
 	if (TAILQ_EMPTY(&rcpu->current_callbacks) &&
 	    !TAILQ_EMPTY(&rcpu->next_callbacks)) {
-		/*
-		 * "If the CPU’s next list is nonempty, the CPU moves it to its
-		 * current list..."
-		 * */
-
 		TAILQ_CONCAT(&rcpu->current_callbacks, &rcpu->next_callbacks,
 		    queue_entry);
+		rcpu->ncurrent = rcpu->nnext;
+		rcpu->nnext = 0;
 
-		ke_spinlock_enter_nospl(&rcu.lock);
-		/*
-		 * "... and sets its per-CPU generation number to be one greater
-		 * than the global generation number."
-		 */
-		rcpu->generation = rcu.generation + 1;
-
-		if (rcu.quiesced != 0) {
-			/*
-			 * If a generation is already in progress, the CPU sets
-			 * the global maximum generation number to be one
-			 * greater than its per-CPU generation number...
-			 */
-			kassert(rcu.highest_generation <= rcpu->generation);
-			rcu.highest_generation = rcpu->generation + 1;
-		} else
-			/* ... otherwise, it starts a new generation. */
-			start_generation();
-
-		ke_spinlock_exit_nospl(&rcu.lock);
+		ke_spinlock_enter_nospl(&RCU_ROOT->lock);
+		rcpu->generation = rcu.gp_current + 1;
+		if (rcu.gp_requested < rcpu->generation)
+			rcu.gp_requested = rcpu->generation;
+		if (rcu.gp_current == rcu.gp_completed)
+			gp_start();
+		else
+			ke_spinlock_exit_nospl(&RCU_ROOT->lock);
 	}
 }
 
+static void
+qs_dpc_handler(void *arg, void *)
+{
+	struct kep_rcu_per_cpu_data *rcpu = arg;
+
+	kep_rcu_quiet();
+	advance_callbacks(rcpu);
+}
+
+/*!
+ * @brief Per-tick RCU processing; schedules the qs DPC if there's anything
+ * for it to do.
+ */
 void
+kep_rcu_hardclock(void)
+{
+	struct kep_rcu_per_cpu_data *rcpu = CPU_LOCAL_ADDROF(rcu_cpustate);
+	struct krcu_node *leaf = rcpu->leaf;
+
+	if (leaf == NULL)
+		return;
+
+	if (rcpu->qs_pending ||
+	    __atomic_load_n(&leaf->gp_seq, __ATOMIC_RELAXED) !=
+	    rcpu->gp_seen ||
+	    !TAILQ_EMPTY(&rcpu->current_callbacks) ||
+	    !TAILQ_EMPTY(&rcpu->next_callbacks))
+		ke_dpc_schedule(&rcpu->qs_dpc);
+
+	if (!TAILQ_EMPTY(&rcpu->past_callbacks))
+		ke_dpc_schedule(&rcpu->past_callbacks_dpc);
+}
+
+/*!
+ * @brief Does RCU need the current CPU's clock to keep ticking?
+ *
+ * True if a grace period is waiting on us or we have callbacks outstanding.
+ * Called by a tickless clock with interrupts disabled.
+ */
+bool
+kep_rcu_needs_cpu(void)
+{
+	struct kep_rcu_per_cpu_data *rcpu = CPU_LOCAL_ADDROF(rcu_cpustate);
+	struct krcu_node *leaf = rcpu->leaf;
+
+	if (leaf == NULL)
+		return false;
+
+	return rcpu->qs_pending ||
+	    __atomic_load_n(&leaf->gp_seq, __ATOMIC_RELAXED) !=
+	    rcpu->gp_seen ||
+	    !TAILQ_EMPTY(&rcpu->current_callbacks) ||
+	    !TAILQ_EMPTY(&rcpu->next_callbacks) ||
+	    !TAILQ_EMPTY(&rcpu->past_callbacks);
+}
+
+static void
+kick_xcall_handler(void *)
+{
+	ke_dpc_schedule(&CPU_LOCAL_ADDROF(rcu_cpustate)->qs_dpc);
+}
+
+/*!
+ * @brief Get CPUs idling with their tick stopped to note the new grace period.
+ *
+ * Pairs with the fence in kep_clock_dispatched(): a CPU going idle either
+ * has its bit seen here or sees the new gp_seq in kep_rcu_needs_cpu() and
+ * keeps ticking.
+ */
+static void
+kick_idle(void)
+{
+	kcpumask_t mask;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	atomic_cpumask_load(&kep_clock_idle_mask, &mask, memory_order_relaxed);
+
+	for (size_t i = 0; i < CPUMASK_WIDTH; i++) {
+		if (mask.mask[i] != 0) {
+			ke_xcall_multicast(kick_xcall_handler, NULL, &mask);
+			return;
+		}
+	}
+}
+
+static void
 process_past_callbacks(void *arg, void *)
 {
 	struct kep_rcu_per_cpu_data *rcpu = arg;
+	size_t limit = rcpu->npast > RCU_BATCH_HIGH ? SIZE_MAX :
+	    RCU_BATCH_LIMIT;
 
-	while (!TAILQ_EMPTY(&rcpu->past_callbacks)) {
+	/*
+	 * Any left over are picked up on the next tick by kep_rcu_hardclock(),
+	 * unless the backlog is so large that we'd better keep going.
+	 */
+	for (size_t n = 0; n < limit && !TAILQ_EMPTY(&rcpu->past_callbacks);
+	     n++) {
 		krcu_entry_t *head = TAILQ_FIRST(&rcpu->past_callbacks);
 		TAILQ_REMOVE(&rcpu->past_callbacks, head, queue_entry);
+		rcpu->npast--;
 		head->callback(head->arg);
 	}
 }
@@ -139,22 +420,32 @@ process_past_callbacks(void *arg, void *)
 void
 kep_rcu_per_cpu_init(struct kep_rcu_per_cpu_data *data)
 {
+	data->leaf = NULL;
+	data->leaf_bit = 0;
+	data->gp_seen = 0;
+	data->qs_pending = false;
 	data->generation = 0;
+	data->npast = data->ncurrent = data->nnext = 0;
+	data->exp_seq = 0;
 	TAILQ_INIT(&data->past_callbacks);
 	TAILQ_INIT(&data->current_callbacks);
 	TAILQ_INIT(&data->next_callbacks);
 	ke_dpc_init(&data->past_callbacks_dpc, process_past_callbacks, data,
 	    NULL);
+	ke_dpc_init(&data->qs_dpc, qs_dpc_handler, data, NULL);
+	ke_dpc_init(&data->exp_dpc, exp_dpc_handler, data, NULL);
 }
 
 void
 ke_rcu_call(krcu_entry_t *head, krcu_callback_t callback, void *arg)
 {
 	ipl_t ipl = spldisp();
+	struct kep_rcu_per_cpu_data *rcpu = CPU_LOCAL_ADDROF(rcu_cpustate);
+
 	head->callback = callback;
 	head->arg = arg;
-	TAILQ_INSERT_TAIL(&CPU_LOCAL_ADDROF(rcu_cpustate)->next_callbacks, head,
-	    queue_entry);
+	TAILQ_INSERT_TAIL(&rcpu->next_callbacks, head, queue_entry);
+	rcpu->nnext++;
 	splx(ipl);
 }
 
@@ -174,3 +465,60 @@ ke_rcu_synchronise(void)
 	ke_rcu_call(&head, set_event, &ev);
 	ke_wait1(&ev, "ke_rcu_synchronise", false, ABSTIME_FOREVER);
 }
+
+/*
+ * The DPC may be scheduled more than once for the same expedited GP (e.g. by a
+ * stale xcall), so each CPU counts itself off only once per sequence number.
+ */
+static void
+exp_dpc_handler(void *arg, void *)
+{
+	struct kep_rcu_per_cpu_data *rcpu = arg;
+	uintptr_t seq = __atomic_load_n(&rcu_exp.seq, __ATOMIC_ACQUIRE);
+
+	if (rcpu->exp_seq == seq)
+		return;
+
+	rcpu->exp_seq = seq;
+	if (atomic_fetch_sub_explicit(&rcu_exp.remaining, 1,
+	    memory_order_acq_rel) == 1)
+		ke_event_set_signalled(&rcu_exp.done, true);
+}
+
+static void
+exp_xcall_handler(void *)
+{
+	ke_dpc_schedule(&CPU_LOCAL_ADDROF(rcu_cpustate)->exp_dpc);
+}
+
+/*!
+ * @brief Wait for all pre-existing RCU readers, quickly.
+ *
+ * Rather than waiting for a normal grace period, which may take several
+ * clock ticks, this makes every CPU pass through a quiescent state by running
+ * a DPC on it. It costs an IPI to every CPU, so use it only where latency
+ * matters.
+ */
+void
+ke_rcu_synchronise_expedited(void)
+{
+	ipl_t ipl;
+
+	ke_mutex_enter(&rcu_exp.mutex, "rcu_synchronise_expedited");
+
+	ke_event_init(&rcu_exp.done, false);
+	atomic_store_explicit(&rcu_exp.remaining, ke_ncpu,
+	    memory_order_relaxed);
+	__atomic_store_n(&rcu_exp.seq, rcu_exp.seq + 1, __ATOMIC_RELEASE);
+
+	ipl = spldisp();
+	ke_dpc_schedule(&CPU_LOCAL_ADDROF(rcu_cpustate)->exp_dpc);
+	if (ke_ncpu > 1)
+		ke_xcall_broadcast(exp_xcall_handler, NULL);
+	splx(ipl);
+
+	ke_wait1(&rcu_exp.done, "rcu_synchronise_expedited", false,
+	    ABSTIME_FOREVER);
+
+	ke_mutex_exit(&rcu_exp.mutex);
+}
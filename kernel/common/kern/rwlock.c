@@ -5,8 +5,13 @@
 /*!
  * @file rwlock.c
  * @brief Reader-writer lock.
+ *
+ * Like mutexes, rwlocks spin rather than block while they are write-held by a
+ * thread running on another CPU. When read-held there's no record of which
+ * threads hold it, so a would-be writer blocks straight away.
  */
 
+#include <sys/k_lockstat.h>
 #include <sys/k_log.h>
 #include <sys/k_thread.h>
 #include <sys/k_wait.h>
@@ -20,6 +25,30 @@
 #define RW_READERS(V)	((V) >> 2)
 #define RW_OWNER(V) ((V & RW_WLOCKED) ? (kthread_t*)(val & ~RW_FLAGMASK) : NULL)
 
+#define ADAPTIVE_SPIN_MAX 8192
+
+/*!
+ * @brief Spin while the rwlock is write-held by a thread running on another
+ * CPU.
+ *
+ * @returns true if the write lock was seen to be released, so acquisition
+ * should be retried; false if the caller should block.
+ */
+static bool
+rwlock_spin(krwlock_t *rw, uintptr_t val)
+{
+	for (unsigned i = 0; i < ADAPTIVE_SPIN_MAX; i++) {
+		if ((val & RW_WLOCKED) == 0)
+			return true;
+		if (!ke_thread_oncpu(RW_OWNER(val)))
+			return false;
+		ke_arch_pause();
+		val = __atomic_load_n(&rw->val, __ATOMIC_RELAXED);
+	}
+
+	return false;
+}
+
 void
 ke_rwlock_init(krwlock_t *rw)
 {
@@ -32,6 +61,8 @@ ke_rwlock_enter_read(krwlock_t *rw, const char *reason)
 	kturnstile_t *ts;
 	uintptr_t val, new;
 	ipl_t ipl;
+	kabstime_t start, spin_ns = 0, block_ns;
+	bool spun = false, again;
 
 	for (;;) {
 		retry:
@@ -40,8 +71,21 @@ ke_rwlock_enter_read(krwlock_t *rw, const char *reason)
 		if (likely((val & RW_WLOCKED) == 0)) {
 			new = val + RW_1READER;
 			if (__atomic_compare_exchange_n(&rw->val, &val, new,
-			    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				if (unlikely(kep_lockstat_enabled || spun))
+					kep_lockstat_record(kLockstatRWRead,
+					    reason, spun, false, spin_ns, 0);
 				return;
+			}
+			continue;
+		}
+
+		start = KEP_LOCKSTAT_TIME();
+		again = rwlock_spin(rw, val);
+		if (start != 0)
+			spin_ns += ke_time() - start;
+		if (again) {
+			spun = true;
 			continue;
 		}
 
@@ -65,7 +109,11 @@ ke_rwlock_enter_read(krwlock_t *rw, const char *reason)
 			}
 		}
 
+		start = KEP_LOCKSTAT_TIME();
 		ke_turnstile_block(ts, false, rw, RW_OWNER(val), ipl, reason);
+		block_ns = start != 0 ? ke_time() - start : 0;
+		kep_lockstat_record(kLockstatRWRead, reason, spun, true,
+		    spin_ns, block_ns);
 		return;
 	}
 }
@@ -77,6 +125,8 @@ ke_rwlock_enter_write(krwlock_t *rw, const char *reason)
 	kturnstile_t *ts;
 	uintptr_t val, new;
 	ipl_t ipl;
+	kabstime_t start, spin_ns = 0, block_ns;
+	bool spun = false, again;
 
 	for (;;) {
 		retry:
@@ -85,11 +135,26 @@ ke_rwlock_enter_write(krwlock_t *rw, const char *reason)
 		if (likely(val == 0)) {
 			new = (uintptr_t)self | RW_WLOCKED;
 			if (__atomic_compare_exchange_n(&rw->val, &val, new,
-			    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				if (unlikely(kep_lockstat_enabled || spun))
+					kep_lockstat_record(kLockstatRWWrite,
+					    reason, spun, false, spin_ns, 0);
 				return;
+			}
 			continue;
 		}
 
+		if (val & RW_WLOCKED) {
+			start = KEP_LOCKSTAT_TIME();
+			again = rwlock_spin(rw, val);
+			if (start != 0)
+				spin_ns += ke_time() - start;
+			if (again) {
+				spun = true;
+				continue;
+			}
+		}
+
 		/* Locked (read or write). Block on the turnstile. */
 		ipl = ke_turnstile_lookup(rw, &ts);
 
@@ -110,7 +175,11 @@ ke_rwlock_enter_write(krwlock_t *rw, const char *reason)
 			}
 		}
 
+		start = KEP_LOCKSTAT_TIME();
 		ke_turnstile_block(ts, true, rw, RW_OWNER(val), ipl, reason);
+		block_ns = start != 0 ? ke_time() - start : 0;
+		kep_lockstat_record(kLockstatRWWrite, reason, spun, true,
+		    spin_ns, block_ns);
 		return;
 	}
 }
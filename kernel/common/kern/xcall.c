@@ -10,8 +10,6 @@
 #include <sys/cpulocal.h>
 #include <sys/k_cpu.h>
 
-#define UINTPTR_BITS (sizeof(uintptr_t) * 8)
-
 void
 ke_xcall_broadcast(void (*func)(void *), void *arg)
 {
@@ -29,6 +27,11 @@ ke_xcall_broadcast(void (*func)(void *), void *arg)
 		katomic_cpumask_t *mask = &ke_cpu_data[i]->xcalls_pending;
 		uint32_t index = local->cpu_num / UINTPTR_BITS;
 		uint32_t bit = local->cpu_num % UINTPTR_BITS;
+
+		/* the broadcast IPI excludes self */
+		if (i == local->cpu_num)
+			continue;
+
 		atomic_fetch_or_explicit(&mask->mask[index],
 		    (uintptr_t)1 << bit, memory_order_relaxed);
 	}
@@ -74,6 +77,61 @@ ke_xcall_unicast(void (*func)(void *), void *arg, kcpunum_t cpu_num)
 	splx(ipl);
 }
 
+/*!
+ * @brief Run a function on a set of CPUs and wait for it to complete.
+ *
+ * The current CPU is skipped even if it's in \p targets; the caller should
+ * do the work locally itself if needed.
+ *
+ * @returns The number of CPUs that were interrupted.
+ */
+unsigned int
+ke_xcall_multicast(void (*func)(void *), void *arg, const kcpumask_t *targets)
+{
+	ipl_t ipl = splhigh();
+	struct kcpu_data *local = CPU_LOCAL_GET();
+	uint32_t index = local->cpu_num / UINTPTR_BITS;
+	uint32_t bit = local->cpu_num % UINTPTR_BITS;
+	unsigned int n = 0;
+
+	local->func = func;
+	local->arg = arg;
+	atomic_store_explicit(&local->xcalls_completed, 0,
+	    memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_release);
+
+	for (size_t w = 0; w < CPUMASK_WIDTH; w++) {
+		uintptr_t word = targets->mask[w];
+
+		while (word != 0) {
+			kcpunum_t cpu = w * UINTPTR_BITS + __builtin_ctzl(word);
+			katomic_cpumask_t *mask;
+
+			word &= word - 1;
+
+			if (cpu == local->cpu_num || cpu >= ke_ncpu)
+				continue;
+
+			mask = &ke_cpu_data[cpu]->xcalls_pending;
+			atomic_fetch_or_explicit(&mask->mask[index],
+			    (uintptr_t)1 << bit, memory_order_relaxed);
+			kep_arch_ipi_unicast(cpu);
+			n++;
+		}
+	}
+
+	splx(IPL_DISP);
+
+	while (atomic_load_explicit(&local->xcalls_completed,
+		   memory_order_relaxed) < n)
+		ke_arch_pause();
+
+	splx(ipl);
+
+	return n;
+}
+
 void
 kep_xcall_handler(void *unused)
 {
@@ -0,0 +1,110 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file in_cksum.c
+ * @brief Internet (one's complement) checksum.
+ *
+ * The one's complement sum of 16-bit words is congruent, modulo 0xffff, to
+ * that of the same data taken as 32- or 64-bit words, since 2^16, 2^32 and
+ * 2^48 are all 1 modulo 0xffff. So we add up 32-bit words into a 64-bit
+ * accumulator, which can't carry out for any buffer smaller than 16GiB, and
+ * fold once at the end. On amd64 we instead add 64-bit words with an ADC
+ * chain, carrying back into the bottom.
+ *
+ * The kernel doesn't touch the vector registers (see amd64/kern/fpu.c), so
+ * there are no SSE or AVX variants; the ADC loop goes at about the speed of
+ * the loads anyway.
+ */
+
+#include <libkern/in_cksum.h>
+#include <libkern/lib.h>
+
+/* 2 bytes at p, as a 16-bit word in memory order */
+static inline uint16_t
+load16(const uint8_t *p)
+{
+	uint16_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+static inline uint32_t
+load32(const uint8_t *p)
+{
+	uint32_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+/* the last, odd byte, as the first byte of a word padded with zero */
+static inline uint16_t
+load_odd(const uint8_t *p)
+{
+	uint8_t pad[2] = { p[0], 0 };
+	return load16(pad);
+}
+
+/*!
+ * @brief Add the 16-bit words of a buffer into a partial sum.
+ *
+ * An odd last byte is padded with zero. To continue the sum into more data,
+ * len must be even, or the sum of what follows swapped with in_cksum_swap().
+ */
+uint64_t
+in_cksum_partial(const void *buf, size_t len, uint64_t sum)
+{
+	const uint8_t *p = buf;
+
+	/* the sum passed in may be anything; leave room for ours */
+	sum = (sum & 0xffffffff) + (sum >> 32);
+
+#if defined(__amd64__)
+	if (len >= 32) {
+		size_t n = len / 32;
+
+		asm("1:\n\t"
+		    "addq 0(%[p]), %[sum]\n\t"
+		    "adcq 8(%[p]), %[sum]\n\t"
+		    "adcq 16(%[p]), %[sum]\n\t"
+		    "adcq 24(%[p]), %[sum]\n\t"
+		    "adcq $0, %[sum]\n\t"
+		    "leaq 32(%[p]), %[p]\n\t"
+		    "decq %[n]\n\t"
+		    "jnz 1b"
+		    : [sum] "+r"(sum), [p] "+r"(p), [n] "+r"(n)
+		    :
+		    : "cc", "memory");
+
+		len %= 32;
+		sum = (sum & 0xffffffff) + (sum >> 32);
+	}
+#endif
+
+	while (len >= 16) {
+		sum += load32(p);
+		sum += load32(p + 4);
+		sum += load32(p + 8);
+		sum += load32(p + 12);
+		p += 16;
+		len -= 16;
+	}
+
+	while (len >= 4) {
+		sum += load32(p);
+		p += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		sum += load16(p);
+		p += 2;
+		len -= 2;
+	}
+
+	if (len != 0)
+		sum += load_odd(p);
+
+	return sum;
+}
@@ -0,0 +1,54 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file in_cksum.h
+ * @brief Internet (one's complement) checksum.
+ *
+ * Partial sums are of 16-bit words as they lie in memory, so the folded
+ * result is in network byte order whatever the host's, and can be stored
+ * straight into a header (RFC 1071 section 2(B).) They are kept unfolded in
+ * 64 bits between calls; fold only at the end.
+ *
+ * A partial sum over data that starts at an odd offset into what's being
+ * checksummed must be byte-swapped before it's added in; see in_cksum_swap().
+ */
+
+#ifndef ECX_LIBKERN_IN_CKSUM_H
+#define ECX_LIBKERN_IN_CKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t in_cksum_partial(const void *buf, size_t len, uint64_t sum);
+
+/*! @brief Fold a partial sum to 16 bits; not complemented. */
+static inline uint16_t
+in_cksum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+/*! @brief Partial sum of odd-offset data, as if it were at an even one. */
+static inline uint64_t
+in_cksum_swap(uint64_t sum)
+{
+	return __builtin_bswap16(in_cksum_fold(sum));
+}
+
+/*!
+ * @brief Checksum a buffer. 0 when verifying a buffer with a correct
+ * checksum within it.
+ */
+static inline uint16_t
+in_cksum(const void *buf, size_t len)
+{
+	return (uint16_t)~in_cksum_fold(in_cksum_partial(buf, len, 0));
+}
+
+#endif /* ECX_LIBKERN_IN_CKSUM_H */
@@ -9,6 +9,15 @@
 /*!
  * @file futex.c
  * @brief Linux-style fast userspace mutexes.
+ *
+ * Waiters are kept in a hash table of wait queues keyed by the futex's
+ * vm_voaddr, so that waits and wakes on unrelated futexes don't contend.
+ * Each bucket has its own mutex (user memory is read with it held, so it
+ * can't be a spinlock.)
+ *
+ * A waiter's bucket can change under it when it's requeued; the pointer is
+ * only written with both the old and new bucket locks held, so holding either
+ * is enough to read it stably. See waiter_lock().
  */
 
 #include <sys/k_log.h>
@@ -16,29 +25,134 @@
 #include <sys/vm.h>
 #include <sys/errno.h>
 #include <sys/k_thread.h>
+#include <sys/krx_futex.h>
 #include <sys/libkern.h>
 
+#define FB_COUNT 256
+#define FB_MASK (FB_COUNT - 1)
+
+struct futex_bucket {
+	kmutex_t lock;
+	TAILQ_HEAD(futex_waiter_list, futex_waiter) waiters;
+};
+
+/*
+ * b: bucket->lock
+ * ~: invariant while queued
+ */
 struct futex_waiter {
-	TAILQ_ENTRY(futex_waiter) tq_entry;
-	struct vm_voaddr voaddr;
+	TAILQ_ENTRY(futex_waiter) tq_entry;	/* b: link in bucket->waiters */
+	struct futex_bucket *bucket;	/* b (old & new to write): my bucket */
+	struct vm_voaddr voaddr;	/* b: futex I'm waiting on */
+	uint32_t bitset;		/* ~: bits I'm waiting on */
 	kevent_t event;
-	bool queued;
+	bool queued;			/* b: am I in bucket->waiters? */
 };
 
-static TAILQ_HEAD(futex_waiter_list, futex_waiter) futex_waiters =
-    TAILQ_HEAD_INITIALIZER(futex_waiters);
-static kmutex_t futex_mutex = KMUTEX_INITIALISER;
+uint64_t murmur64(uint64_t);
+
+static struct futex_bucket futex_buckets[FB_COUNT];
+
+void
+futex_init(void)
+{
+	for (size_t i = 0; i < FB_COUNT; i++) {
+		ke_mutex_init(&futex_buckets[i].lock);
+		TAILQ_INIT(&futex_buckets[i].waiters);
+	}
+}
+
+static struct futex_bucket *
+bucket_for(const struct vm_voaddr *voaddr)
+{
+	uint64_t key = voaddr->object ^ voaddr->offset ^ voaddr->private;
+	return &futex_buckets[murmur64(key) & FB_MASK];
+}
+
+/*!
+ * @brief Lock the bucket a waiter is currently queued on.
+ *
+ * The waiter may be requeued between loading its bucket pointer and taking
+ * that bucket's lock, in which case we try again with the new bucket.
+ */
+static struct futex_bucket *
+waiter_lock(struct futex_waiter *waiter, const char *reason)
+{
+	for (;;) {
+		struct futex_bucket *bucket = __atomic_load_n(&waiter->bucket,
+		    __ATOMIC_ACQUIRE);
+
+		ke_mutex_enter(&bucket->lock, reason);
+		if (bucket == waiter->bucket)
+			return bucket;
+		ke_mutex_exit(&bucket->lock);
+	}
+}
+
+/*! @brief Lock a pair of buckets in address order, avoiding deadlock. */
+static void
+bucket_lock_pair(struct futex_bucket *a, struct futex_bucket *b)
+{
+	if (a == b) {
+		ke_mutex_enter(&a->lock, "futex_requeue:lock");
+	} else if (a < b) {
+		ke_mutex_enter(&a->lock, "futex_requeue:lock_a");
+		ke_mutex_enter(&b->lock, "futex_requeue:lock_b");
+	} else {
+		ke_mutex_enter(&b->lock, "futex_requeue:lock_b");
+		ke_mutex_enter(&a->lock, "futex_requeue:lock_a");
+	}
+}
+
+static void
+bucket_unlock_pair(struct futex_bucket *a, struct futex_bucket *b)
+{
+	ke_mutex_exit(&a->lock);
+	if (a != b)
+		ke_mutex_exit(&b->lock);
+}
+
+/*! @brief Wake up to \p count waiters on \p voaddr. Bucket must be locked. */
+static int
+wake_locked(struct futex_bucket *bucket, const struct vm_voaddr *voaddr,
+    int count, uint32_t bitset)
+{
+	struct futex_waiter *waiter, *tmp;
+	int woken = 0;
+
+	if (count <= 0)
+		return 0;
+
+	TAILQ_FOREACH_SAFE(waiter, &bucket->waiters, tq_entry, tmp) {
+		if (vm_voaddr_cmp(&waiter->voaddr, voaddr) != 0 ||
+		    (waiter->bitset & bitset) == 0)
+			continue;
+
+		TAILQ_REMOVE(&bucket->waiters, waiter, tq_entry);
+		waiter->queued = false;
+		ke_event_set_signalled(&waiter->event, true);
+		if (++woken >= count)
+			break;
+	}
+
+	return woken;
+}
 
 int
-sys_futex_wait(int *u_pointer, int expected, const struct timespec *user_ts)
+sys_futex_wait_bitset(int *u_pointer, int expected,
+    const struct timespec *user_ts, uint32_t bitset)
 {
 	struct vm_voaddr voaddr;
 	struct timespec ts;
 	kabstime_t deadline = ABSTIME_FOREVER;
+	struct futex_bucket *bucket;
 	struct futex_waiter waiter;
 	int value;
 	int r;
 
+	if (bitset == 0)
+		return -EINVAL;
+
 	if (user_ts != NULL) {
 		r = memcpy_from_user(&ts, user_ts, sizeof(ts));
 		if (r != 0)
@@ -52,28 +166,32 @@ sys_futex_wait(int *u_pointer, int expected, const struct timespec *user_ts)
 	if (r != 0)
 		return r;
 
-	ke_mutex_enter(&futex_mutex, "futex_wait:lock");
+	bucket = bucket_for(&voaddr);
+
+	ke_mutex_enter(&bucket->lock, "futex_wait:lock");
 
 	r = memcpy_from_user(&value, u_pointer, sizeof(int));
 	if (r != 0) {
-		ke_mutex_exit(&futex_mutex);
+		ke_mutex_exit(&bucket->lock);
 		vm_voaddr_release(thread_vm_map(curthread()), &voaddr);
 		return r;
 	}
 
 	if (value != expected) {
-		ke_mutex_exit(&futex_mutex);
+		ke_mutex_exit(&bucket->lock);
 		vm_voaddr_release(thread_vm_map(curthread()), &voaddr);
 		return -EAGAIN;
 	}
 
 	waiter.queued = true;
+	waiter.bucket = bucket;
 	waiter.voaddr = voaddr;
+	waiter.bitset = bitset;
 	ke_event_init(&waiter.event, false);
 
-	TAILQ_INSERT_TAIL(&futex_waiters, &waiter, tq_entry);
+	TAILQ_INSERT_TAIL(&bucket->waiters, &waiter, tq_entry);
 
-	ke_mutex_exit(&futex_mutex);
+	ke_mutex_exit(&bucket->lock);
 
 	r = ke_wait1(&waiter.event, "futex_wait", true, deadline);
 	switch (r) {
@@ -85,49 +203,138 @@ sys_futex_wait(int *u_pointer, int expected, const struct timespec *user_ts)
 		kdprintf("futex_wait: note mlibc may not handle EINTR here\n");
 		/* fall through */
 	case -ETIMEDOUT:
-		ke_mutex_enter(&futex_mutex, "futex_wait:remove");
+		bucket = waiter_lock(&waiter, "futex_wait:remove");
 		if (waiter.queued)
-			TAILQ_REMOVE(&futex_waiters, &waiter, tq_entry);
-		ke_mutex_exit(&futex_mutex);
+			TAILQ_REMOVE(&bucket->waiters, &waiter, tq_entry);
+		ke_mutex_exit(&bucket->lock);
 		break;
 
 	default:
 		kfatal("unexpected synch_wait1 return %d\n", r);
 	}
 
-	vm_voaddr_release(thread_vm_map(curthread()), &voaddr);
+	/* not voaddr: if we were requeued, this is the one we were moved to */
+	vm_voaddr_release(thread_vm_map(curthread()), &waiter.voaddr);
 
 	return r;
 }
 
 int
-sys_futex_wake(int *u_pointer, int count)
+sys_futex_wait(int *u_pointer, int expected, const struct timespec *user_ts)
+{
+	return sys_futex_wait_bitset(u_pointer, expected, user_ts,
+	    FUTEX_BITSET_MATCH_ANY);
+}
+
+int
+sys_futex_wake_bitset(int *u_pointer, int count, uint32_t bitset)
 {
 	struct vm_voaddr voaddr;
+	struct futex_bucket *bucket;
+	int r;
+
+	if (bitset == 0)
+		return -EINVAL;
+
+	r = vm_voaddr_acquire(thread_vm_map(curthread()), (uintptr_t)u_pointer,
+	    &voaddr);
+	if (r != 0)
+		return r;
+
+	bucket = bucket_for(&voaddr);
+
+	ke_mutex_enter(&bucket->lock, "futex_wake:lock");
+	wake_locked(bucket, &voaddr, count, bitset);
+	ke_mutex_exit(&bucket->lock);
+
+	vm_voaddr_release(thread_vm_map(curthread()), &voaddr);
+
+	return 0;
+}
+
+int
+sys_futex_wake(int *u_pointer, int count)
+{
+	return sys_futex_wake_bitset(u_pointer, count, FUTEX_BITSET_MATCH_ANY);
+}
+
+/*!
+ * @brief Wake waiters on one futex and move the rest to another.
+ *
+ * Equivalent to Linux FUTEX_CMP_REQUEUE: if *u_pointer still equals
+ * \p expected, up to \p nwake waiters on \p u_pointer are woken and up to
+ * \p nrequeue of those remaining are moved to wait on \p u_pointer2 instead,
+ * without being woken. This lets a condition variable broadcast wake just one
+ * waiter and transfer the rest to the mutex, rather than stampeding.
+ *
+ * @returns Number of waiters woken plus number requeued, or -errno.
+ */
+int
+sys_futex_requeue(int *u_pointer, int nwake, int nrequeue, int *u_pointer2,
+    int expected)
+{
+	struct vm_voaddr voaddr, voaddr2;
+	struct futex_bucket *bucket, *bucket2;
 	struct futex_waiter *waiter, *tmp;
+	int value;
+	int woken, requeued = 0;
 	int r;
-	int woken = 0;
+
+	if (nwake < 0 || nrequeue < 0)
+		return -EINVAL;
 
 	r = vm_voaddr_acquire(thread_vm_map(curthread()), (uintptr_t)u_pointer,
 	    &voaddr);
 	if (r != 0)
 		return r;
 
-	ke_mutex_enter(&futex_mutex, "futex_wake:lock");
+	r = vm_voaddr_acquire(thread_vm_map(curthread()),
+	    (uintptr_t)u_pointer2, &voaddr2);
+	if (r != 0) {
+		vm_voaddr_release(thread_vm_map(curthread()), &voaddr);
+		return r;
+	}
+
+	bucket = bucket_for(&voaddr);
+	bucket2 = bucket_for(&voaddr2);
 
-	TAILQ_FOREACH_SAFE(waiter, &futex_waiters, tq_entry, tmp) {
-		if (vm_voaddr_cmp(&waiter->voaddr, &voaddr) == 0) {
-			TAILQ_REMOVE(&futex_waiters, waiter, tq_entry);
-			waiter->queued = false;
-			ke_event_set_signalled(&waiter->event, true);
-			woken++;
-			if (woken >= count)
-				break;
+	bucket_lock_pair(bucket, bucket2);
+
+	r = memcpy_from_user(&value, u_pointer, sizeof(int));
+	if (r != 0)
+		goto out;
+
+	if (value != expected) {
+		r = -EAGAIN;
+		goto out;
+	}
+
+	woken = wake_locked(bucket, &voaddr, nwake, FUTEX_BITSET_MATCH_ANY);
+
+	TAILQ_FOREACH_SAFE(waiter, &bucket->waiters, tq_entry, tmp) {
+		if (requeued >= nrequeue)
+			break;
+		if (vm_voaddr_cmp(&waiter->voaddr, &voaddr) != 0)
+			continue;
+
+		/* the waiter owns its voaddr, so trade it for one of its own */
+		vm_voaddr_release(thread_vm_map(curthread()), &waiter->voaddr);
+		vm_voaddr_retain(&voaddr2, &waiter->voaddr);
+		if (bucket != bucket2) {
+			TAILQ_REMOVE(&bucket->waiters, waiter, tq_entry);
+			TAILQ_INSERT_TAIL(&bucket2->waiters, waiter, tq_entry);
+			__atomic_store_n(&waiter->bucket, bucket2,
+			    __ATOMIC_RELEASE);
 		}
+		requeued++;
 	}
 
-	ke_mutex_exit(&futex_mutex);
+	r = woken + requeued;
+
+out:
+	bucket_unlock_pair(bucket, bucket2);
+	vm_voaddr_release(thread_vm_map(curthread()), &voaddr2);
 	vm_voaddr_release(thread_vm_map(curthread()), &voaddr);
 
-	return 0;
+	return r;
 }
@@ -48,6 +48,15 @@ void dk_acpi_threaded_init(void);
 /* If port has it */
 void dk_platform_threaded_init(void);
 
+/* kern/rcu.c */
+void kep_rcu_init(void);
+
+/* os/futex.c */
+void futex_init(void);
+
+/* io/lockstatdev.c */
+void lockstat_init(void);
+
 /* to be sorted */
 void viewcache_init(void);
 void console_init(void);
@@ -85,6 +94,8 @@ int kern_initlevel = 0;
 static void idle(void)
 {
 	for (;;) {
+		if (vm_page_zero_idle())
+			continue;
 #if defined (__amd64__)
 		__asm__ volatile("hlt");
 #elif defined (__riscv)
@@ -124,6 +135,7 @@ smp_init(void)
 		ke_cpu_data[i] = data;
 
 		ke_cpu_init(i, data, info, &idle->kthread);
+		data->vm_domid = vm_phys_cpu_domain(info->ARCH_ID);
 	}
 }
 
@@ -228,13 +240,18 @@ threaded_init(void *)
 	dk_platform_threaded_init();
 #endif
 
+	kmem_update_init();
+	vm_pageout_init();
+	vm_readahead_init();
 	viewcache_init();
 	str_sched_init();
 	ip_init();
 	mount_root();
 	mount_devfs();
+	vm_swap_init();
 	console_init();
 	pty_init();
+	lockstat_init();
 	exec_init();
 
 	kdprintf("Threaded init!\n");
@@ -277,9 +294,12 @@ _start(void)
 	vm_kwired_init();
 	vm_kmap_init();
 	proc_init();
+	futex_init();
 	smp_init();
+	kep_rcu_init();
 	ke_disp_global_init();
 	kmem_postsmp_init();
+	vm_phys_postsmp_init();
 	ke_platform_early_init();
 	global_constructors_init();
 	kern_initlevel = 1;
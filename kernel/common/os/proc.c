@@ -19,6 +19,7 @@
 #include <stdalign.h>
 
 void pmap_activate(vm_map_t *map);
+void pmap_switch(vm_map_t *old, vm_map_t *new);
 
 kmem_cache_t *turnstile_cache, *proc_cache, *thread_cache;
 _Atomic(pid_t) last_pid = 1;
@@ -176,7 +177,7 @@ void
 thread_activate(thread_t *old, thread_t *new)
 {
 	if (thread_vm_map(old) != thread_vm_map(new))
-		pmap_activate(thread_vm_map(new));
+		pmap_switch(thread_vm_map(old), thread_vm_map(new));
 }
 
 struct thread_new_info {
@@ -234,8 +235,11 @@ sys_thread_exit(void)
 	}
 	ke_spinlock_exit(&proc->ktask.threads_lock, ipl);
 
+	/* pmap_switch(), not just activate, to leave the old map's CPU set */
+	ipl = spldisp();
 	curthread->vm_map = proc0.vm_map;
-	pmap_activate(proc0.vm_map);
+	pmap_switch(proc->vm_map, proc0.vm_map);
+	splx(ipl);
 
 	if (proc_exited) {
 #if TRACE_TODO
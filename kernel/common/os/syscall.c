@@ -13,6 +13,7 @@
 #include <sys/krx_cred.h>
 #include <sys/krx_epoll.h>
 #include <sys/krx_file.h>
+#include <sys/krx_futex.h>
 #include <sys/krx_signal.h>
 #include <sys/krx_vfs.h>
 #include <sys/libkern.h>
@@ -26,10 +27,6 @@
 
 int sys_pipe(int upipefd[2], int flags);
 
-int sys_futex_wait(int *u_pointer, int expected,
-    const struct timespec *user_ts);
-int sys_futex_wake(int *u_pointer, int count);
-
 int sys_socket(int domain, int type, int protocol);
 int sys_socketpair(int domain, int type, int protocol, int sv[2]);
 int sys_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
@@ -92,7 +89,8 @@ sys_dispatch(karch_trapframe_t *frame, enum posix_syscall syscall,
     uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t arg4,
     uintptr_t arg5, uintptr_t arg6, uintptr_t *out1)
 {
-	switch (syscall) {
+	/* (int): some numbers are defined outside the enum; see krx_futex.h */
+	switch ((int)syscall) {
 	case SYS_debug_message: {
 		char *msg;
 		int len;
@@ -171,6 +169,18 @@ sys_dispatch(karch_trapframe_t *frame, enum posix_syscall syscall,
 	case SYS_futex_wake:
 		return sys_futex_wake((int *)arg1, (int)arg2);
 
+	case SYS_futex_wait_bitset:
+		return sys_futex_wait_bitset((int *)arg1, (int)arg2,
+		    (const struct timespec *)arg3, (uint32_t)arg4);
+
+	case SYS_futex_wake_bitset:
+		return sys_futex_wake_bitset((int *)arg1, (int)arg2,
+		    (uint32_t)arg3);
+
+	case SYS_futex_requeue:
+		return sys_futex_requeue((int *)arg1, (int)arg2, (int)arg3,
+		    (int *)arg4, (int)arg5);
+
 	case SYS_thread_gettid:
 		return ke_curthread()->tid;
 
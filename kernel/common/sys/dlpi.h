@@ -29,6 +29,12 @@ typedef intptr_t t_scalar_t;
 
 #define DL_CLDLS 0x0200 /* connectionless data link service */
 
+/* offloads a NIC offers (Keyronex extension) */
+#define DL_OFFLOAD_TX_CSUM	0x1 /* completes DB_CKSUM_PARTIAL checksums */
+#define DL_OFFLOAD_RX_CSUM	0x2 /* sets DB_CKSUM_VALID on receive */
+#define DL_OFFLOAD_TSO4		0x4 /* segments TCP/IPv4 per lso_mss */
+#define DL_OFFLOAD_TSO6		0x8 /* segments TCP/IPv6 per lso_mss */
+
 typedef struct dl_bind_req {
 	t_uscalar_t dl_primitive;
 	t_uscalar_t dl_sap;
@@ -59,6 +65,7 @@ typedef struct dl_keyronex_bind_ack {
 	/* interface entry points will go here... */
 	void *nic_data;
 	int (*nic_wput)(void *data, struct msgb *);
+	uint32_t dl_offloads; /* DL_OFFLOAD_* */
 } dl_keyronex_bind_ack_t;
 
 union DL_primitives {
@@ -41,6 +41,21 @@ struct kthread;
 
 typedef TAILQ_HEAD(kthread_tq, kthread) runq_t;
 
+struct kcpu_disp_stats {
+	uint64_t idle_steals;	/* threads stolen on going idle */
+	uint64_t balance_pulls;	/* threads pulled by periodic balancing */
+	uint64_t stolen_from;	/* threads other CPUs took from us */
+	uint64_t nready_max;	/* run queue length high-water mark */
+	uint64_t nready_sum;	/* sum of run queue length sampled per tick */
+	uint64_t ticks;		/* number of samples in nready_sum */
+	uint64_t rt_pushes;	/* RT threads pushed to other CPUs */
+	uint64_t rt_pulls;	/* RT threads pulled from other CPUs */
+	uint64_t rt_lat_count;	/* RT wakeup-to-run samples */
+	uint64_t rt_lat_sum_ns;
+	uint64_t rt_lat_max_ns;
+	uint64_t rt_lat_hist[16]; /* log2(microseconds) buckets */
+};
+
 struct kcpu_dispatcher {
 	kspinlock_t lock;
 	uint32_t bitmap[PRIO_LIMIT / 32];
@@ -48,6 +63,24 @@ struct kcpu_dispatcher {
 	struct kthread *idle_thread;
 	struct kthread *cur_thread;
 	atomic_uint_fast32_t timeslice;
+	bool timeslice_none;		/* cur_thread has KQUANTUM_NONE */
+	atomic_uint_fast32_t nready;	/* non-RT threads queued on rq[] */
+	atomic_uint_fast32_t cur_pri;	/* priority of cur_thread */
+	atomic_uint_fast32_t rt_bitmap;	/* copy of the RT word of bitmap */
+	uint32_t balance_ticks;		/* ticks until next periodic balance */
+	kdpc_t balance_dpc;
+	kdpc_t rt_push_dpc;
+	struct kcpu_disp_stats stats;
+};
+
+/*
+ * Clock state for ports with a one-shot timer. See clock.c.
+ */
+struct kcpu_clock {
+	kabstime_t last_tick;	/* time of the last tick accounted for */
+	kabstime_t next_event;	/* deadline the timer is programmed for */
+	bool tickless;		/* timer is in one-shot mode */
+	bool idle;		/* tick stopped while idle */
 };
 
 struct kcpu_data {
@@ -55,6 +88,7 @@ struct kcpu_data {
 	struct kcpu_data *self;
 	kcpunum_t cpu_num;
 	uint32_t acpi_id;
+	uint8_t vm_domid;	/* memory domain nearest this CPU */
 
 	/* interrupt management */
 	ipl_t ipl;
@@ -62,6 +96,7 @@ struct kcpu_data {
 	kspinlock_t dpc_lock;
 	TAILQ_HEAD(, kdpc) dpc_queue;
 	struct kcpu_callout callout;
+	struct kcpu_clock clock;
 
 	/* xcall handling */
 	void (*func)(void *);
@@ -86,10 +121,74 @@ struct kcpu_data {
 kabstime_t ke_time();
 void kep_arch_ipi_unicast(kcpunum_t cpu_num);
 void kep_arch_ipi_broadcast(void);
+void kep_arch_timer_oneshot(kabstime_t deadline);
 void ke_arch_pause(void);
 
 extern struct kcpu_data ke_bsp_cpu_data;
 extern struct kcpu_data **ke_cpu_data;
 extern size_t ke_ncpu;
+extern katomic_cpumask_t kep_clock_idle_mask;
+
+#define UINTPTR_BITS (sizeof(uintptr_t) * 8)
+
+static inline void
+atomic_cpumask_set(katomic_cpumask_t *set, kcpunum_t cpunum, memory_order order)
+{
+	size_t idx = cpunum / UINTPTR_BITS;
+	size_t bit = cpunum % UINTPTR_BITS;
+
+	atomic_fetch_or_explicit(&set->mask[idx], (uintptr_t)1 << bit, order);
+}
+
+static inline void
+atomic_cpumask_clear(katomic_cpumask_t *set, kcpunum_t cpunum,
+    memory_order order)
+{
+	size_t idx = cpunum / UINTPTR_BITS;
+	size_t bit = cpunum % UINTPTR_BITS;
+
+	atomic_fetch_and_explicit(&set->mask[idx], ~((uintptr_t)1 << bit),
+	    order);
+}
+
+static inline bool
+atomic_cpumask_isset(katomic_cpumask_t *set, kcpunum_t cpunum,
+    memory_order order)
+{
+	size_t idx = cpunum / UINTPTR_BITS;
+	size_t bit = cpunum % UINTPTR_BITS;
+	uintptr_t mask = atomic_load_explicit(&set->mask[idx], order);
+	return (mask & ((uintptr_t)1 << bit)) != 0;
+}
+
+static inline kcpunum_t
+atomic_cpumask_first_set(katomic_cpumask_t *set, memory_order order)
+{
+	size_t width = (ke_ncpu + UINTPTR_BITS - 1) / UINTPTR_BITS;
+	for (size_t i = 0; i < width; i++) {
+		uintptr_t mask = atomic_load_explicit(&set->mask[i], order);
+		if (mask != 0) {
+			kcpunum_t cpu = i * UINTPTR_BITS + __builtin_ctzl(mask);
+			return cpu < ke_ncpu ? cpu : KCPUNUM_NULL;
+		}
+	}
+	return KCPUNUM_NULL;
+}
+
+/*! @brief Take a (non-atomic) snapshot of an atomic cpumask. */
+static inline void
+atomic_cpumask_load(katomic_cpumask_t *set, kcpumask_t *out,
+    memory_order order)
+{
+	for (size_t i = 0; i < CPUMASK_WIDTH; i++)
+		out->mask[i] = atomic_load_explicit(&set->mask[i], order);
+}
+
+static inline bool
+cpumask_isset(const kcpumask_t *set, kcpunum_t cpunum)
+{
+	return (set->mask[cpunum / UINTPTR_BITS] &
+	    ((uintptr_t)1 << (cpunum % UINTPTR_BITS))) != 0;
+}
 
 #endif /* ECX_KERN_CPU_H */
@@ -68,6 +68,11 @@ void ke_raise_disp_int(void);
 
 #define KSPINLOCK_INITIALISER { 0 }
 
+/* kern/lockstat.c */
+extern bool kep_lockstat_enabled;
+void kep_lockstat_spin_acquired(kspinlock_t *lock);
+void kep_lockstat_spin_contended(kspinlock_t *lock);
+
 static inline bool
 ke_spinlock_held(kspinlock_t *lock)
 {
@@ -83,8 +88,13 @@ ke_spinlock_init(kspinlock_t *lock)
 static inline void
 ke_spinlock_enter_nospl(kspinlock_t *lock)
 {
-	while (__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE))
-		;
+	if (likely(!__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE))) {
+		if (unlikely(kep_lockstat_enabled))
+			kep_lockstat_spin_acquired(lock);
+		return;
+	}
+
+	kep_lockstat_spin_contended(lock);
 }
 
 static inline bool
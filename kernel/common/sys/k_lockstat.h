@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file k_lockstat.h
+ * @brief Lock profiling.
+ */
+
+#ifndef ECX_KEYRONEX_K_LOCKSTAT_H
+#define ECX_KEYRONEX_K_LOCKSTAT_H
+
+#include <sys/krx_atomic.h>
+#include <sys/k_types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum klockstat_kind {
+	kLockstatMutex,
+	kLockstatRWRead,
+	kLockstatRWWrite,
+	kLockstatSpin,
+	kLockstatKindMax,
+};
+
+/*
+ * Statistics for one lock acquisition site. Mutex and rwlock sites are
+ * identified by the `reason` string passed to the lock primitive; spinlocks
+ * have no reason, so are identified by the return address of the call that
+ * took them instead.
+ *
+ * Mutex and rwlock contention (spins/blocks) is always counted. Acquisitions
+ * and times, and anything at all about spinlocks, are only counted while
+ * profiling is enabled.
+ */
+struct klockstat_site {
+	const void *_Atomic key;
+	atomic_ulong acquisitions;
+	atomic_ulong contended;
+	atomic_ulong spins;	/* acquired after spinning */
+	atomic_ulong blocks;	/* had to block on the turnstile */
+	atomic_ulong spin_ns;
+	atomic_ulong block_ns;
+};
+
+extern bool kep_lockstat_enabled;
+
+kabstime_t ke_time();
+
+/*! @brief Timestamp for lockstat, or 0 if profiling is disabled. */
+#define KEP_LOCKSTAT_TIME() \
+	(unlikely(kep_lockstat_enabled) ? ke_time() : 0)
+
+void kep_lockstat_record(enum klockstat_kind kind, const void *key,
+    bool spun, bool blocked, kabstime_t spin_ns, kabstime_t block_ns);
+
+void ke_lockstat_enable(bool enable);
+void ke_lockstat_reset(void);
+bool ke_lockstat_format(size_t *cursor, char *buf, size_t size);
+
+void dbg_lockstat_dump(void);
+
+#endif /* ECX_KEYRONEX_K_LOCKSTAT_H */
@@ -17,16 +17,27 @@ typedef struct krcu_entry {
 	void *arg;
 } krcu_entry_t;
 
+struct krcu_node;
+
 struct kep_rcu_per_cpu_data {
 	/* members accessed only at IPL >= DPC and only by one core. */
-	uintptr_t generation;
+	struct krcu_node *leaf;		/* leaf node I report to */
+	uint32_t leaf_bit;		/* my bit in leaf->qsmask */
+	uintptr_t gp_seen;		/* latest GP I've noticed at my leaf */
+	bool qs_pending;		/* GP gp_seen still needs my report */
+	uintptr_t generation;		/* GP current_callbacks waits on */
+	size_t npast, ncurrent, nnext;
 	struct ki_krcu_entry_queue past_callbacks, current_callbacks,
 	    next_callbacks;
 	kdpc_t past_callbacks_dpc;
+	kdpc_t qs_dpc;
+	kdpc_t exp_dpc;
+	uintptr_t exp_seq;		/* last expedited GP I took part in */
 };
 
 void ke_rcu_call(krcu_entry_t *head, krcu_callback_t callback, void *arg);
 void ke_rcu_synchronise(void);
+void ke_rcu_synchronise_expedited(void);
 #define ke_rcu_read_lock() spldisp()
 #define ke_rcu_read_unlock(IPL_) splx(IPL_)
 
@@ -45,9 +45,12 @@ struct ksched_class {
 	void (*did_preempt_thread)(struct kthread *, bool quantum_expired);
 	void (*io_completed)(struct kthread *);
 
+	/* ticks to run before rotation, or KQUANTUM_NONE to run on */
 	uint16_t (*quantum)(struct kthread *);
 };
 
+#define KQUANTUM_NONE 0
+
 typedef struct kturnstile {
 	union {
 		SLIST_HEAD(, kturnstile) freelist;
@@ -102,11 +105,15 @@ typedef struct kthread {
 	} state;
 	kcpunum_t	bound_cpu;	/* CPU affine to */
 	kcpunum_t	last_cpu_num;	/* CPU running on/last ran on */
+	kabstime_t	last_ran;	/* when last switched out */
+	kabstime_t	wakeup_time;	/* when made runnable (RT tracing) */
 	uint8_t		sched_class;	/* scheduling class (SCHED_*) */
 	uint8_t		nice;		/* nice value (currently unused) */
 	uint16_t	base_prio;	/* prio determined by scheduler */
 	uint16_t 	inherited_prio;	/* prio inherited from turnstile */
 	uint16_t	effective_prio;	/* max of prio and inherited_prio */
+	uint16_t	runq_prio;	/* run queue index while TS_READY */
+	bool		runq_rt;	/* counted as realtime while TS_READY */
 	SLIST_HEAD(, kturnstile) pi_head; /* l: turnstiles donating priority */
 
 	kwait_internal_status_t	wait_status;	/* wait status */
@@ -134,6 +141,7 @@ void ke_set_tcb(uintptr_t value);
 void ke_thread_set_affinity(kthread_t *, kcpunum_t);
 void ke_thread_copy_fpu_state(kthread_t *);
 
+bool ke_thread_oncpu(kthread_t *);
 kpri_t ke_thread_epri_locked(kthread_t *);
 void ke_thread_set_ipri_locked(kthread_t *, kpri_t);
 
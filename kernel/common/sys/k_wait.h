@@ -65,18 +65,28 @@ typedef struct ksemaphore {
 	struct kdispatch_header header;
 } ksemaphore_t;
 
+#define CALLOUT_WHEEL_LEVELS 4
+#define CALLOUT_WHEEL_SLOTS 64
+
 typedef struct kcallout {
 	struct kdispatch_header header;
 	TAILQ_ENTRY(kcallout) callout_qlink;
 	_Atomic(kcpunum_t) cpu_num;
 	kabstime_t deadline;
 	kdpc_t *softint;
+	uint16_t wheel_level;
+	uint16_t wheel_slot;
 } kcallout_t;
 
+TAILQ_HEAD(kcallout_queue, kcallout);
+
+/* timing wheel; see callout.c */
 struct kcpu_callout {
 	kdpc_t expiry_dpc;
 	kspinlock_t lock;
-	TAILQ_HEAD(, kcallout) callouts;
+	uint64_t wheel_now;	/* time in level 0 slot units wheel is at */
+	uint64_t wheel_bitmap[CALLOUT_WHEEL_LEVELS]; /* non-empty slots */
+	struct kcallout_queue wheel[CALLOUT_WHEEL_LEVELS][CALLOUT_WHEEL_SLOTS];
 	kabstime_t next_deadline;
 };
 
@@ -91,6 +101,7 @@ void ke_callout_init(kcallout_t *);
 void ke_callout_init_dpc(kcallout_t *, kdpc_t *dpc,
     void (*func)(void *, void *), void *arg1, void *arg2);
 int ke_callout_set(kcallout_t *, kabstime_t deadline);
+int ke_callout_set_slack(kcallout_t *, kabstime_t deadline, kabstime_t slack);
 int ke_callout_stop(kcallout_t *);
 
 void ke_event_init(kevent_t *, bool signalled);
@@ -14,5 +14,7 @@
 
 void ke_xcall_broadcast(void (*func)(void *), void *arg);
 void ke_xcall_unicast(void (*func)(void *), void *arg, kcpunum_t cpu_num);
+unsigned int ke_xcall_multicast(void (*func)(void *), void *arg,
+    const kcpumask_t *targets);
 
 #endif /* ECX_KEYRONEX_XCALL_H */
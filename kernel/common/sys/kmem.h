@@ -20,6 +20,8 @@ typedef struct kmem_cache kmem_cache_t;
 
 void kmem_init(void);
 void kmem_postsmp_init(void);
+void kmem_update_init(void);
+void kmem_reap(void);
 
 kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
     void (*ctor)(void *));
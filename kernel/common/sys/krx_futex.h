@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2026 Cloudarox Solutions.
+ * Created on Sat Oct 17 2026.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*!
+ * @file krx_futex.h
+ * @brief Fast userspace mutexes.
+ */
+
+#ifndef ECX_SYS_KRX_FUTEX_H
+#define ECX_SYS_KRX_FUTEX_H
+
+#include <stdint.h>
+
+struct timespec;
+
+/*
+ * The bitset and requeue calls postdate the syscall numbering shared with
+ * libc in <keyronex/syscall.h>, so their numbers are fixed here, well clear
+ * of that enumeration; libc's sysdeps must use the same.
+ */
+#define SYS_futex_wait_bitset 0x1000
+#define SYS_futex_wake_bitset 0x1001
+#define SYS_futex_requeue 0x1002
+
+/*! Wait or wake regardless of bitset. */
+#define FUTEX_BITSET_MATCH_ANY 0xffffffffU
+
+int sys_futex_wait(int *u_pointer, int expected,
+    const struct timespec *user_ts);
+int sys_futex_wake(int *u_pointer, int count);
+int sys_futex_wait_bitset(int *u_pointer, int expected,
+    const struct timespec *user_ts, uint32_t bitset);
+int sys_futex_wake_bitset(int *u_pointer, int count, uint32_t bitset);
+int sys_futex_requeue(int *u_pointer, int nwake, int nrequeue,
+    int *u_pointer2, int expected);
+
+#endif /* ECX_SYS_KRX_FUTEX_H */
@@ -68,6 +68,12 @@ pmap_pte_soft_anon(pte_t pte)
 	return (struct vm_anon *)((pte.soft.data << 3) + HHDM_BASE);
 }
 
+static inline uintptr_t
+pmap_pte_soft_swap(pte_t pte)
+{
+	return pte.soft.data;
+}
+
 static inline void
 pmap_pte_anon_create(pte_t *ppte, struct vm_anon *anon, bool was_hw)
 {
@@ -94,7 +100,17 @@ void pmap_new_leaf_fork_ptes_created(struct vm_rs *rs,
 /* New valid PTEs were created (where previously they were zero) */
 void pmap_anon_ptes_converted_to_leaf_valid_pte(struct vm_rs *rs,
     struct pte_cursor *cursor, size_t n);
+/* Swap PTEs became transition PTEs (their pages were read in) */
+void pmap_swap_ptes_converted_to_trans(struct vm_rs *rs,
+    struct pte_cursor *cursor, size_t n);
+/* Transition PTEs became valid again */
+void pmap_trans_ptes_converted_to_leaf_valid_pte(struct vm_rs *rs,
+    struct pte_cursor *cursor, size_t n);
 
 void pmap_valid_ptes_zeroed(struct vm_rs *rs, vm_page_t *page, size_t n);
+/* Valid or transition PTEs became swap or fork PTEs */
+void pmap_ptes_became_swappable(struct vm_rs *rs, vm_page_t *page, size_t n);
+
+void pmap_zero_page_nocache(vm_page_t *page);
 
 #endif /* ECX_KEYRONEX_PMAP_H */
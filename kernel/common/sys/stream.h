@@ -53,8 +53,25 @@ typedef struct datab {
 	mtype_t 	type;	/* data type */
 	char		*base;	/* points to first byte */
 	char		*lim;	/* points to after last byte */
+
+	/*
+	 * Checksum and segmentation offload, in the first data block of an
+	 * M_DATA message; offsets are from the first mblk's rptr.
+	 */
+	uint16_t	cksum_flags;	/* DB_CKSUM_* */
+	uint16_t	cksum_start;	/* partial: where summing begins */
+	uint16_t	cksum_stuff;	/* partial: where the sum goes */
+	uint16_t	lso_mss;	/* nonzero: segment to this payload */
 } dblk_t;
 
+/*
+ * Transmit: the checksum field at cksum_stuff holds the pseudo-header sum;
+ * the sum from cksum_start to the end must be folded in and complemented.
+ */
+#define DB_CKSUM_PARTIAL	0x1
+/* receive: the transport checksum has been verified */
+#define DB_CKSUM_VALID		0x2
+
 typedef struct queue {
 	struct qinit	*qinfo;	/* queue configuration */
 	queue_t		*other;	/* other queue of the pair */
@@ -113,6 +130,7 @@ void str_freemsg(mblk_t *);
 size_t str_msgsize(const mblk_t *);
 #define STR_MBLKL(MP) ((MP)->wptr - (MP)->rptr)
 
+mblk_t *str_dupb(mblk_t *);
 mblk_t *str_copymsg(mblk_t *);
 mblk_t *str_dupmsg(mblk_t *);
 
@@ -28,6 +28,7 @@ struct strioctl {
 
 enum str_option_flags {
 	SO_READMODE = 0x01, /* set read mode */
+	SO_HIWAT = 0x02, /* set read queue high watermark */
 };
 
 enum str_read_mode {
@@ -39,6 +40,7 @@ enum str_read_mode {
 struct stroptions {
 	enum str_option_flags flags;	/* option flags */
 	enum str_read_mode readopt;	/* read mode option */
+	unsigned int hiwat;		/* high watermark option */
 };
 
 
@@ -43,6 +43,7 @@ typedef enum vm_alloc_flags {
 	VM_SLEEP,
 	VM_NOFAIL,
 	VM_EXACT,
+	VM_ZERO = 0x4, /* page(s) must be zero-filled */
 } vm_alloc_flags_t;
 
 typedef enum vm_cache_mode vm_cache_mode_t;
@@ -78,6 +79,7 @@ int vm_map_phys(vm_map_t *map, paddr_t paddr, vaddr_t *vaddrp, size_t size,
 int vm_unmap(struct vm_map *map, vaddr_t start, vaddr_t end);
 
 int vm_voaddr_acquire(struct vm_map *, vaddr_t, struct vm_voaddr *out);
+void vm_voaddr_retain(const struct vm_voaddr *, struct vm_voaddr *out);
 void vm_voaddr_release(struct vm_map *, struct vm_voaddr *);
 intptr_t vm_voaddr_cmp(const struct vm_voaddr *a, const struct vm_voaddr *b);
 
@@ -88,6 +90,28 @@ void vm_obj_truncate(vm_object_t *, size_t oldsize, size_t newsize);
 vm_page_t *vm_page_alloc(vm_page_use_t, size_t order, vm_domid_t,
     vm_alloc_flags_t);
 void vm_page_delete(vm_page_t *page, bool unref);
+void vm_page_split(vm_page_t *page);
+void vm_phys_postsmp_init(void);
+bool vm_page_zero_idle(void);
+bool vm_page_wait(void);
+void dbg_vm_pcp_dump(void);
+
+void vm_pageout_init(void);
+void vm_pageout_wakeup(void);
+void dbg_vm_pageout_dump(void);
+
+void vm_readahead_init(void);
+void dbg_vm_readahead_dump(void);
+
+int vm_swap_add(struct vnode *vn);
+void vm_swap_init(void);
+void dbg_vm_swap_dump(void);
+
+void vm_phys_affinity_add(paddr_t base, paddr_t limit, vm_domid_t domid);
+void vm_phys_cpu_affinity_add(uint32_t arch_cpu_id, vm_domid_t domid);
+void vm_phys_distance_set(vm_domid_t from, vm_domid_t to, uint8_t distance);
+vm_domid_t vm_phys_cpu_domain(uint32_t arch_cpu_id);
+void dbg_vm_domains_dump(void);
 
 vaddr_t vm_page_hhdm_addr(vm_page_t *page);
 paddr_t vm_page_paddr(vm_page_t *page);
@@ -152,6 +152,8 @@ void vn_release(vnode_t *);
 int viewcache_io(vnode_t *, uint64_t offset, size_t length, bool write,
     void *buf);
 void viewcache_truncate(vnode_t *, uint64_t newsize);
+size_t viewcache_trim(size_t n);
+void dbg_viewcache_dump(void);
 struct vn_vc_state *viewcache_alloc_vnode_state(vnode_t *vn);
 
 #endif /* ECX_SYS_VNODE_H */
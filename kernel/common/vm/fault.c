@@ -61,6 +61,69 @@ userland_prot(vaddr_t vaddr)
 	return is_userland(vaddr) ? VM_USER : 0;
 }
 
+#ifdef PMAP_SUPERPAGE_LEVEL
+/*
+ * Whether the superpage-sized and -aligned range around the faulting address
+ * lies wholly within a private anonymous mapping, so may be a superpage.
+ */
+static bool
+superpage_eligible(struct fault_info *info)
+{
+	vaddr_t base = rounddown2(info->vaddr, PMAP_SUPERPAGE_SIZE);
+
+	return info->entry != NULL && info->object == NULL &&
+	    !info->entry->is_phys && is_userland(info->vaddr) &&
+	    base >= info->mapping_start &&
+	    base + PMAP_SUPERPAGE_SIZE <= info->mapping_end;
+}
+
+static vm_prot_t
+superpage_prot(struct fault_info *info)
+{
+	return VM_READ | (info->prot & (VM_WRITE | VM_EXEC)) |
+	    userland_prot(info->vaddr);
+}
+#endif
+
+/*
+ * Try to satisfy an anonymous fault by mapping a whole superpage around it.
+ * Map creation and stealing locks held.
+ */
+static bool
+try_superpage_fault(struct fault_info *info)
+{
+#ifdef PMAP_SUPERPAGE_LEVEL
+	vaddr_t base = rounddown2(info->vaddr, PMAP_SUPERPAGE_SIZE);
+
+	if (!superpage_eligible(info) ||
+	    pmap_superpage_enter(info->map, info->rs, base, VM_PAGE_PRIVATE,
+		superpage_prot(info)) == NULL)
+		return false;
+
+	info->rs->private_pages_n += PMAP_SUPERPAGE_PAGES;
+	info->rs->valid_n += PMAP_SUPERPAGE_PAGES;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * After an anonymous fault, try to promote the leaf table it filled in to a
+ * superpage. If that's done, the cursor has been unwired.
+ */
+static bool
+try_superpage_promote(struct fault_info *info)
+{
+#ifdef PMAP_SUPERPAGE_LEVEL
+	return superpage_eligible(info) &&
+	    pmap_superpage_promote(info->map, info->rs, &info->cursor,
+		info->vaddr, superpage_prot(info));
+#else
+	return false;
+#endif
+}
+
 struct pagein_wait *
 allocate_pagein_wait(void)
 {
@@ -142,6 +205,27 @@ max_file_readahead(struct fault_info *info, struct obj_pte_wire_state *cursor)
 	return MIN2(max_pages, proc_zero_n);
 }
 
+/*
+ * Back out of an object fault that couldn't get memory, unwiring the object
+ * and process PTEs. Called with both object locks and the map creation lock
+ * held; drops them all. vm_fault() then waits for pages and retries.
+ */
+static int
+object_fault_backout(struct fault_info *info,
+    struct obj_pte_wire_state *objcursor)
+{
+	obj_unwire_pte(info->object, objcursor);
+	ke_spinlock_exit_nospl(&info->object->stealing_lock);
+	ke_spinlock_exit_nospl(&info->object->creation_lock);
+
+	ke_spinlock_enter_nospl(&info->map->stealing_lock);
+	pmap_unwire_pte(info->map, info->rs, &info->cursor);
+	ke_spinlock_exit_nospl(&info->map->stealing_lock);
+	ke_spinlock_exit_nospl(&info->map->creation_lock);
+
+	return -ENOMEM;
+}
+
 /*
  * Handle a read fault on a VM object mapping.
  *
@@ -205,27 +289,36 @@ do_object_fault(struct fault_info *info,
 		ke_spinlock_exit_nospl(&info->object->stealing_lock);
 
 		pagewait = allocate_pagein_wait();
-		if (pagewait == NULL)
-			kfatal("TODO: Back out\n");
+		if (pagewait == NULL) {
+			ke_spinlock_enter_nospl(&info->object->stealing_lock);
+			return object_fault_backout(info, &objcursor);
+		}
 
 		count = max_file_readahead(info, &objcursor);
 
 		for (size_t i = 0; i < count; i++) {
-			page[i] = vm_page_alloc(VM_PAGE_FILE, 0, VM_DOMID_LOCAL,
-			    0);
-			if (page[i] == NULL)
-				kfatal("TODO: Reduce count, or back out\n");
-
 			/*
-			 * TODO: don't memset here, do it in the read
+			 * TODO: don't ask for a zeroed page, zero in the read
 			 * vop/whatever if there is a short read
 			 */
-			memset((void *)vm_page_hhdm_addr(page[i]), 0, PGSIZE);
+			page[i] = vm_page_alloc(VM_PAGE_FILE, 0, VM_DOMID_LOCAL,
+			    VM_ZERO);
+			if (page[i] == NULL && i > 0) {
+				/* go without the rest of the readahead */
+				count = i;
+				break;
+			} else if (page[i] == NULL) {
+				pagein_wait_release(pagewait);
+				ke_spinlock_enter_nospl(
+				    &info->object->stealing_lock);
+				return object_fault_backout(info, &objcursor);
+			}
 
 			page[i]->pte = objcursor.pte + i;
 			page[i]->owner_obj = info->object;
 			page[i]->shared.offset = obj_pgoff + i;
 			page[i]->shared.share_count = 1;
+			page[i]->shared.readahead = 0;
 			page[i]->pagein_wait = pagewait;
 
 			pmap_pte_soft_create(objcursor.pte + i, kPTEKindBusy,
@@ -238,6 +331,8 @@ do_object_fault(struct fault_info *info,
 			sg_seg[i].length = PGSIZE;
 		}
 
+		vm_readahead_note(info->object, obj_pgoff, count, false);
+
 		ke_spinlock_exit_nospl(&info->object->creation_lock);
 		ke_spinlock_exit_nospl(&info->map->creation_lock);
 
@@ -251,6 +346,7 @@ do_object_fault(struct fault_info *info,
 		    count << PGSHIFT, obj_pgoff << PGSHIFT);
 		iop_send_sync(iop);
 		VOP_PAGING_EXIT(info->object->vnobj.vnode);
+		iop_free(iop);
 
 #if 0
 		kprintf("Did read in object page (%d; tot. %d)\n", obj_pgoff, count);
@@ -320,19 +416,26 @@ do_object_fault(struct fault_info *info,
 		 * Retry the fault if no pages were valid; probably the file was
 		 * truncated and there will be an EFAULT next time.
 		 */
-		if (pages_valid == 0)
+		if (pages_valid == 0) {
+			splx(IPL_0);
+			ke_rwlock_exit_read(&info->map->map_lock);
 			return -EAGAIN;
-		else
+		} else {
 			return count;
+		}
 
 	}
 
 	case kPTEKindHW: {
 		vm_page_t *page = pmap_pte_hwleaf_page(pte, 0);
 		vm_prot_t prot = VM_READ;
+		bool hit = page->shared.readahead;
 
 		if (++page->shared.share_count == 1)
 			vm_page_retain(page);
+		page->shared.readahead = 0;
+		vm_readahead_note(info->object, info->object_offset >> PGSHIFT,
+		    1, hit);
 
 		obj_unwire_pte(info->object, &objcursor);
 		ke_spinlock_exit_nospl(&info->object->stealing_lock);
@@ -425,11 +528,280 @@ do_fork_fault(struct fault_info *info)
 		return 1;
 	}
 
+	case kPTEKindSwap: {
+		uintptr_t slot = pmap_pte_soft_swap(anonpte);
+		struct pagein_wait *pagewait;
+		vm_page_t *page = NULL;
+
+		ke_spinlock_exit_nospl(&anon_stealing_lock);
+		ke_spinlock_exit_nospl(&info->map->stealing_lock);
+
+		pagewait = allocate_pagein_wait();
+		if (pagewait != NULL) {
+			page = vm_page_alloc(VM_PAGE_ANON_FORKED, 0,
+			    VM_DOMID_LOCAL, 0);
+			if (page == NULL)
+				pagein_wait_release(pagewait);
+		}
+
+		if (page == NULL) {
+			ke_spinlock_exit_nospl(&anon_creation_lock);
+			ke_spinlock_enter_nospl(&info->map->stealing_lock);
+			pmap_unwire_pte(info->map, info->rs, &info->cursor);
+			ke_spinlock_exit_nospl(&info->map->stealing_lock);
+			ke_spinlock_exit_nospl(&info->map->creation_lock);
+			return -ENOMEM;
+		}
+
+		/* our fork PTE keeps the anon alive meanwhile */
+		ke_spinlock_enter_nospl(&anon_stealing_lock);
+		page->owner_anon = anon;
+		page->pte = &anon->pte;
+		page->shared.share_count = 1;
+		page->swap_address = slot;
+		page->pagein_wait = pagewait;
+		pmap_pte_soft_create(&anon->pte, kPTEKindBusy,
+		    VM_PAGE_PFN(page), false);
+		ke_spinlock_exit_nospl(&anon_stealing_lock);
+		ke_spinlock_exit_nospl(&anon_creation_lock);
+		ke_spinlock_exit_nospl(&info->map->creation_lock);
+
+		splx(IPL_0);
+		vm_swap_pagein(&page, slot, 1);
+		spldisp();
+
+		ke_spinlock_enter_nospl(&info->map->creation_lock);
+		ke_spinlock_enter_nospl(&info->map->stealing_lock);
+		ke_spinlock_enter_nospl(&anon_creation_lock);
+		ke_spinlock_enter_nospl(&anon_stealing_lock);
+		pmap_pte_hwleaf_create(&anon->pte, VM_PAGE_PFN(page), PMAP_L0,
+		    0, 0);
+		ke_spinlock_exit_nospl(&anon_stealing_lock);
+		ke_spinlock_exit_nospl(&anon_creation_lock);
+
+		pmap_pte_hwleaf_create(info->cursor.pte, VM_PAGE_PFN(page),
+		    PMAP_L0,
+		    VM_READ | (info->prot & VM_EXEC) |
+			userland_prot(info->vaddr),
+		    kCacheModeDefault);
+		info->rs->valid_n += 1;
+		pmap_anon_ptes_converted_to_leaf_valid_pte(info->rs,
+		    &info->cursor, 1);
+		pmap_unwire_pte(info->map, info->rs, &info->cursor);
+		ke_spinlock_exit_nospl(&info->map->stealing_lock);
+		ke_spinlock_exit_nospl(&info->map->creation_lock);
+
+		ke_event_set_signalled(&pagewait->event, true);
+		pagein_wait_release(pagewait);
+
+		return 1;
+	}
+
+	case kPTEKindBusy: {
+		/* another process is reading it in from swap */
+		vm_page_t *page = pmap_pte_soft_page(&anon->pte);
+		struct pagein_wait *pagewait = page->pagein_wait;
+
+		pagein_wait_retain(pagewait);
+		ke_spinlock_exit_nospl(&anon_stealing_lock);
+		ke_spinlock_exit_nospl(&anon_creation_lock);
+
+		pmap_unwire_pte(info->map, info->rs, &info->cursor);
+		ke_spinlock_exit_nospl(&info->map->stealing_lock);
+		ke_spinlock_exit_nospl(&info->map->creation_lock);
+		splx(IPL_0);
+		ke_rwlock_exit_read(&info->map->map_lock);
+
+		ke_wait1(&pagewait->event, "vm_fault_pagein", false,
+		    ABSTIME_FOREVER);
+		pagein_wait_release(pagewait);
+
+		return -EAGAIN;
+	}
+
 	default:
 		kfatal("Implement me: non-valid pages in vm_anon pte\n");
 	}
 }
 
+/*
+ * Map again a private page that was trimmed from the working set but not yet
+ * reclaimed. Map creation and stealing locks held.
+ */
+static int
+do_trans_fault(struct fault_info *info)
+{
+	vm_page_t *page = pmap_pte_soft_page(info->cursor.pte);
+
+	kassert(page->use == VM_PAGE_PRIVATE);
+	/* takes it off the paging queue, unless the pager has it */
+	vm_page_retain(page);
+
+	pmap_pte_hwleaf_create(info->cursor.pte, VM_PAGE_PFN(page), PMAP_L0,
+	    VM_READ | ((info->prot & VM_WRITE) & (info->type & VM_WRITE)) |
+		(info->prot & VM_EXEC) | userland_prot(info->vaddr),
+	    kCacheModeDefault);
+	info->rs->valid_n += 1;
+	pmap_trans_ptes_converted_to_leaf_valid_pte(info->rs, &info->cursor, 1);
+	pmap_unwire_pte(info->map, info->rs, &info->cursor);
+	ke_spinlock_exit_nospl(&info->map->stealing_lock);
+	ke_spinlock_exit_nospl(&info->map->creation_lock);
+
+	return 0;
+}
+
+/*
+ * The run of swap PTEs around the faulting one whose slots are consecutive
+ * with its own, so that they can be read in with it. The run stays within the
+ * faulting PTE's table and the mapping.
+ *
+ * Returns the length of the run, with the faulting PTE's index in it in *first.
+ */
+static size_t
+swap_readaround(struct fault_info *info, uintptr_t slot, size_t *first)
+{
+	pte_t *ppte = info->cursor.pte;
+	size_t max_fwd, max_back, fwd, back;
+
+	max_fwd = MIN2(MAX_CLUSTER,
+	    (info->mapping_end - info->vaddr) >> PGSHIFT);
+	max_back = (info->vaddr - info->mapping_start) >> PGSHIFT;
+
+	for (fwd = 1; fwd < max_fwd; fwd++) {
+		pte_t pte;
+
+		/* stop if we cross a page boundary */
+		if (((uintptr_t)(ppte + fwd) & (PGSIZE - 1)) == 0)
+			break;
+
+		pte = pmap_load_pte(ppte + fwd);
+		if (pmap_pte_characterise(pte) != kPTEKindSwap ||
+		    pmap_pte_soft_swap(pte) != slot + fwd)
+			break;
+	}
+
+	for (back = 0; back < max_back && fwd + back < MAX_CLUSTER; back++) {
+		pte_t pte;
+
+		if (((uintptr_t)(ppte - back) & (PGSIZE - 1)) == 0)
+			break;
+
+		pte = pmap_load_pte(ppte - back - 1);
+		if (pmap_pte_characterise(pte) != kPTEKindSwap ||
+		    pmap_pte_soft_swap(pte) != slot - back - 1)
+			break;
+	}
+
+	*first = back;
+	return back + fwd;
+}
+
+/*
+ * Read a private page in from swap, with whichever neighbours swap_readaround()
+ * finds. The neighbours are left in transition, to be mapped by a cheap fault
+ * if they're touched before they're reclaimed again.
+ */
+static int
+do_swap_fault(struct fault_info *info)
+{
+	uintptr_t slot = pmap_pte_soft_swap(pmap_load_pte(info->cursor.pte));
+	pte_t *run;
+	vm_page_t *page[MAX_CLUSTER];
+	struct pagein_wait *pagewait;
+	size_t first, count, lo = 0;
+
+	count = swap_readaround(info, slot, &first);
+	run = info->cursor.pte - first;
+	slot -= first;
+
+	/*
+	 * With the creation lock held, nothing can change swap PTEs while the
+	 * stealing lock is dropped to allocate.
+	 */
+	ke_spinlock_exit_nospl(&info->map->stealing_lock);
+
+	pagewait = allocate_pagein_wait();
+	if (pagewait != NULL) {
+		page[first] = vm_page_alloc(VM_PAGE_PRIVATE, 0,
+		    VM_DOMID_LOCAL, 0);
+		if (page[first] == NULL)
+			pagein_wait_release(pagewait);
+	}
+
+	if (pagewait == NULL || page[first] == NULL) {
+		ke_spinlock_enter_nospl(&info->map->stealing_lock);
+		pmap_unwire_pte(info->map, info->rs, &info->cursor);
+		ke_spinlock_exit_nospl(&info->map->stealing_lock);
+		ke_spinlock_exit_nospl(&info->map->creation_lock);
+		return -ENOMEM;
+	}
+
+	/* go without whatever read-around we can't get memory for */
+	for (size_t i = first + 1; i < count; i++) {
+		page[i] = vm_page_alloc(VM_PAGE_PRIVATE, 0, VM_DOMID_LOCAL, 0);
+		if (page[i] == NULL) {
+			count = i;
+			break;
+		}
+	}
+
+	for (size_t i = first; i-- > 0;) {
+		page[i] = vm_page_alloc(VM_PAGE_PRIVATE, 0, VM_DOMID_LOCAL, 0);
+		if (page[i] == NULL) {
+			lo = i + 1;
+			break;
+		}
+	}
+
+	ke_spinlock_enter_nospl(&info->map->stealing_lock);
+
+	for (size_t i = lo; i < count; i++) {
+		page[i]->pte = run + i;
+		page[i]->owner_rs = info->rs;
+		page[i]->swap_address = slot + i;
+		page[i]->pagein_wait = pagewait;
+		pmap_pte_soft_create(run + i, kPTEKindBusy,
+		    VM_PAGE_PFN(page[i]), false);
+	}
+
+	ke_spinlock_exit_nospl(&info->map->stealing_lock);
+	ke_spinlock_exit_nospl(&info->map->creation_lock);
+
+	splx(IPL_0);
+	vm_swap_pagein(&page[lo], slot + lo, count - lo);
+	spldisp();
+
+	ke_spinlock_enter_nospl(&info->map->creation_lock);
+	ke_spinlock_enter_nospl(&info->map->stealing_lock);
+
+	for (size_t i = lo; i < count; i++) {
+		if (i == first)
+			continue;
+		pmap_pte_soft_create(run + i, kPTEKindTrans,
+		    VM_PAGE_PFN(page[i]), false);
+		/* clean, since its slot holds it: onto the standby list */
+		vm_page_release(page[i]);
+	}
+	pmap_swap_ptes_converted_to_trans(info->rs, &info->cursor,
+	    count - lo - 1);
+
+	pmap_pte_hwleaf_create(info->cursor.pte, VM_PAGE_PFN(page[first]),
+	    PMAP_L0,
+	    VM_READ | ((info->prot & VM_WRITE) & (info->type & VM_WRITE)) |
+		(info->prot & VM_EXEC) | userland_prot(info->vaddr),
+	    kCacheModeDefault);
+	info->rs->valid_n += 1;
+	pmap_anon_ptes_converted_to_leaf_valid_pte(info->rs, &info->cursor, 1);
+	pmap_unwire_pte(info->map, info->rs, &info->cursor);
+	ke_spinlock_exit_nospl(&info->map->stealing_lock);
+	ke_spinlock_exit_nospl(&info->map->creation_lock);
+
+	ke_event_set_signalled(&pagewait->event, true);
+	pagein_wait_release(pagewait);
+
+	return 0;
+}
+
 static int
 do_dirty_fork_fault(struct fault_info *info, vm_page_t *old_page)
 {
@@ -466,8 +838,15 @@ do_dirty_fork_fault(struct fault_info *info, vm_page_t *old_page)
 		ke_spinlock_exit_nospl(&info->map->stealing_lock);
 
 		new_page = vm_page_alloc(VM_PAGE_PRIVATE, 0, VM_DOMID_LOCAL, 0);
-		if (new_page == NULL)
-			kfatal("TODO: Wait on pages avail\n");
+		if (new_page == NULL) {
+			ke_spinlock_exit_nospl(&anon_creation_lock);
+			vm_page_release(old_page);
+			ke_spinlock_enter_nospl(&info->map->stealing_lock);
+			pmap_unwire_pte(info->map, info->rs, &info->cursor);
+			ke_spinlock_exit_nospl(&info->map->stealing_lock);
+			ke_spinlock_exit_nospl(&info->map->creation_lock);
+			return -ENOMEM;
+		}
 
 		new_page->pte = info->cursor.pte;
 		new_page->owner_rs = info->rs;
@@ -496,7 +875,8 @@ do_dirty_fork_fault(struct fault_info *info, vm_page_t *old_page)
 		pmap_pte_hwleaf_create(info->cursor.pte, VM_PAGE_PFN(new_page),
 		    PMAP_L0, prot, kCacheModeDefault);
 		info->rs->private_pages_n++;
-		pmap_tlb_flush_vaddr_globally(info->vaddr);
+		pmap_tlb_flush_range(info->map, info->vaddr,
+		    info->vaddr + PGSIZE);
 
 		vm_page_release(old_page);
 	}
@@ -565,9 +945,20 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 	if (type & VM_WRITE && (info.prot & VM_WRITE) == 0)
 		kfatal("vm_fault: write access to read-only mapping\n");
 
+	/* in case there's a superpage to demote */
+	pmap_reserve_tables();
+
 	ipl = spldisp();
 	ke_spinlock_enter_nospl(&info.map->creation_lock);
 	ke_spinlock_enter_nospl(&info.map->stealing_lock);
+
+	if (try_superpage_fault(&info)) {
+		ke_spinlock_exit_nospl(&info.map->stealing_lock);
+		ke_spinlock_exit_nospl(&info.map->creation_lock);
+		ret = 0;
+		goto out;
+	}
+
 	pmap_wire_pte(info.map, info.rs, &info.cursor, addr, true);
 
 	pte = pmap_load_pte(info.cursor.pte);
@@ -606,7 +997,9 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 			if (old_page->use == VM_PAGE_ANON_FORKED) {
 				ret = do_dirty_fork_fault(&info, old_page);
 				break;
-			} else if (info.entry_cow) {
+			} else if (info.entry_cow &&
+			    old_page->use != VM_PAGE_PRIVATE) {
+				/* (a private page is already our own copy) */
 				vm_page_t *new_page;
 
 				/* must retain before we drop stealing lock! */
@@ -616,11 +1009,21 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 
 				new_page = vm_page_alloc(VM_PAGE_PRIVATE, 0,
 				    VM_DOMID_LOCAL, 0);
-				if (new_page == NULL)
-					kfatal("TODO: Wait on pages avail\n");
 
 				ke_spinlock_enter_nospl(&info.map->stealing_lock);
 
+				if (new_page == NULL) {
+					pmap_unwire_pte(info.map, info.rs,
+					    &info.cursor);
+					ke_spinlock_exit_nospl(
+					    &info.map->stealing_lock);
+					ke_spinlock_exit_nospl(
+					    &info.map->creation_lock);
+					vm_page_release(old_page);
+					ret = -ENOMEM;
+					break;
+				}
+
 				new_page->pte = info.cursor.pte;
 				new_page->owner_rs = info.rs;
 
@@ -642,7 +1045,8 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 				    kCacheModeDefault);
 
 				info.rs->private_pages_n++;
-				pmap_tlb_flush_vaddr_globally(info.vaddr);
+				pmap_tlb_flush_range(info.map, info.vaddr,
+				    info.vaddr + PGSIZE);
 
 				pmap_unwire_pte(info.map, info.rs,
 				    &info.cursor);
@@ -688,14 +1092,20 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 
 		ke_spinlock_exit_nospl(&info.map->stealing_lock);
 
-		page = vm_page_alloc(VM_PAGE_PRIVATE, 0, VM_DOMID_LOCAL, 0);
-		if (page == NULL)
-			kfatal("TODO: Wait on pages avail event\n");
-
-		memset((void *)vm_page_hhdm_addr(page), 0, PGSIZE);
+		page = vm_page_alloc(VM_PAGE_PRIVATE, 0, VM_DOMID_LOCAL,
+		    VM_ZERO);
 
 		ke_spinlock_enter_nospl(&info.map->stealing_lock);
 
+		if (page == NULL) {
+			info.rs->private_pages_n--;
+			pmap_unwire_pte(info.map, info.rs, &info.cursor);
+			ke_spinlock_exit_nospl(&info.map->stealing_lock);
+			ke_spinlock_exit_nospl(&info.map->creation_lock);
+			ret = -ENOMEM;
+			break;
+		}
+
 		page->pte = info.cursor.pte;
 		page->owner_rs = info.rs;
 
@@ -708,7 +1118,8 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 		pmap_new_leaf_valid_ptes_created(info.rs, &info.cursor, 1);
 		info.rs->valid_n += 1;
 
-		pmap_unwire_pte(info.map, info.rs, &info.cursor);
+		if (!try_superpage_promote(&info))
+			pmap_unwire_pte(info.map, info.rs, &info.cursor);
 		ke_spinlock_exit_nospl(&info.map->stealing_lock);
 		ke_spinlock_exit_nospl(&info.map->creation_lock);
 		ret = 0;
@@ -734,12 +1145,18 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 		return -EAGAIN;
 	}
 
-	case kPTEKindTrans: {
-		kfatal("Handle transition PTE\n");
-	}
+	case kPTEKindTrans:
+		ret = do_trans_fault(&info);
+		break;
+
+	case kPTEKindSwap:
+		ret = do_swap_fault(&info);
+		break;
 
 	case kPTEKindFork: {
 		ret = do_fork_fault(&info);
+		if (ret == -EAGAIN)
+			return -EAGAIN;
 		break;
 	}
 
@@ -747,8 +1164,15 @@ vm_fault(vaddr_t addr, vm_prot_t type)
 		kfatal("Implement me!\n");
 	}
 
+out:
 	splx(ipl);
 	ke_rwlock_exit_read(&info.map->map_lock);
 
+	if (ret == -ENOMEM) {
+		/* we backed out for want of memory; wait for some and retry */
+		vm_page_wait();
+		ret = -EAGAIN;
+	}
+
 	return ret;
 }
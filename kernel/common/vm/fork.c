@@ -150,11 +150,14 @@ convert_private_to_fork(struct fork_state *fork_state, vm_map_t *vmps,
 	}
 
 	case kPTEKindTrans: {
-		vm_page_t *page = pmap_pte_hwleaf_page(pte, 0);
+		vm_page_t *page = pmap_pte_soft_page(ppte);
 		convert_page(page, forkpage);
+		/* mapped nowhere, and it stays on its paging queue */
+		page->shared.share_count = 0;
 		pmap_pte_anon_create(ppte, forkpage, false);
-		/* FIXME: fork replacing trans - we should drop noswap count? */
-		kdprintf("VM: FIXME: fork replacing trans\n");
+		/* a fork PTE doesn't keep the table in, a trans one did */
+		pmap_ptes_became_swappable(&vmps->rs,
+		    VM_PAGE_FOR_HHDM_ADDR((vaddr_t)ppte), 1);
 		break;
 	}
 
@@ -186,6 +189,9 @@ cow_pages(struct fork_state *fork_state, vm_map_t *parent, vm_map_t *child,
 	ipl_t ipl;
 	int r;
 
+	/* wiring the parent's PTEs demotes its superpages */
+	pmap_reserve_tables();
+
 	ipl = ke_spinlock_enter(&parent->rs.map->creation_lock);
 	ke_spinlock_enter_nospl(&parent->rs.map->stealing_lock);
 
@@ -268,6 +274,7 @@ cow_pages(struct fork_state *fork_state, vm_map_t *parent, vm_map_t *child,
 		ke_spinlock_exit(&child->rs.map->creation_lock, ipl);
 
 		/* reacquire parent locks for next round */
+		pmap_reserve_tables();
 		ipl = ke_spinlock_enter(&parent->rs.map->creation_lock);
 		ke_spinlock_enter_nospl(&parent->rs.map->stealing_lock);
 	}
@@ -332,7 +339,7 @@ vm_fork(vm_map_t *src_map, vm_map_t *dst_map)
 
 	src_map->rs.private_pages_n = 0;
 
-	pmap_tlb_flush_all_globally();
+	pmap_tlb_flush_map(src_map);
 
 	ke_rwlock_exit_write(&dst_map->map_lock);
 	ke_rwlock_exit_write(&src_map->map_lock);
@@ -32,6 +32,12 @@ struct vm_phys_span {
 void vmp_region_add(paddr_t base, paddr_t limit);
 void vmp_page_unfree(vm_page_t *page, size_t order);
 void vmp_range_unfree(paddr_t base, paddr_t limit);
+void vmp_domains_order(void);
+
+#if !defined(__m68k__)
+/* devicekit/acpi/numa.c */
+void dk_acpi_numa_init(void);
+#endif
 
 extern char TEXT_SEGMENT_START[];
 extern char TEXT_SEGMENT_END[];
@@ -484,8 +490,7 @@ setup_permanent_tables(void)
 		kassert(pmap_pte_characterise(pmap_load_pte(pte)) == kPTEKindZero);
 
 		page = vm_page_alloc(VM_PAGE_TABLE, 0, VM_DOMID_LOCAL,
-		    VM_NOFAIL);
-		memset((void *)vm_page_hhdm_addr(page), 0, PGSIZE);
+		    VM_NOFAIL | VM_ZERO);
 
 		page->proctable.level = PMAP_MAX_LEVELS - 2;
 		page->proctable.nonzero_ptes = 1;
@@ -506,8 +511,7 @@ setup_permanent_tables(void)
 		kassert(pmap_pte_characterise(pmap_load_pte(pte)) == kPTEKindZero);
 
 		page = vm_page_alloc(VM_PAGE_TABLE, 0, VM_DOMID_LOCAL,
-		    VM_NOFAIL);
-		memset((void *)vm_page_hhdm_addr(page), 0, PGSIZE);
+		    VM_NOFAIL | VM_ZERO);
 
 		page->proctable.level = PMAP_MAX_LEVELS - 2;
 		page->proctable.nonzero_ptes = 1;
@@ -530,6 +534,7 @@ vm_kmap_init(void)
 	kernel_map.rs.map = &kernel_map;
 	kernel_map.rs.private_pages_n = 0;
 	kernel_map.rs.valid_n = 0;
+	kernel_map.rs.superpages_n = 0;
 	TAILQ_INIT(&kernel_map.rs.active_leaf_tables);
 
 	vmem_init(&kernel_map.vmem, "kernel-general-paged", PAGE_HEAP_BASE,
@@ -540,10 +545,15 @@ vm_kmap_init(void)
 void
 vm_phys_init(void)
 {
-	for (size_t j = 0; j < FREELIST_ORDERS; j++) {
-		TAILQ_INIT(&vm_domains[0].free_q[j]);
-		TAILQ_INIT(&vm_domains[0].stby_q);
-		TAILQ_INIT(&vm_domains[0].dirty_q);
+	for (size_t i = 0; i < VM_MAX_DOMAINS; i++) {
+		vm_domain_t *dom = &vm_domains[i];
+
+		ke_spinlock_init(&dom->queues_lock);
+		for (size_t j = 0; j < FREELIST_ORDERS; j++)
+			TAILQ_INIT(&dom->free_q[j]);
+		TAILQ_INIT(&dom->stby_q);
+		TAILQ_INIT(&dom->dirty_q);
+		TAILQ_INIT(&dom->zero_q);
 	}
 
 	map_rpt();
@@ -551,7 +561,12 @@ vm_phys_init(void)
 	map_ksegs();
 	map_arch();
 	pmap_set_kpgtable();
+#if !defined(__m68k__)
+	/* needs the HHDM; must precede adding memory */
+	dk_acpi_numa_init();
+#endif
 	add_phys_segs();
+	vmp_domains_order();
 	unfree_boot();
 	unfree_reserved();
 	setup_permanent_tables();
@@ -6,11 +6,30 @@
  * @file kmem.c
  * @brief kmem_alloc allocator & kmem_cache_alloc(9) slab allocator
  * implementation.
+ *
+ * Caches with the magazine layer enabled keep per-CPU magazines backed by a
+ * depot of full and empty magazines, after Bonwick & Adams. The depot tracks
+ * its working set: the fewest magazines each list held over an update
+ * interval. Every KMEM_UPDATE_INTERVAL the kmem_update thread returns the
+ * magazines that went unused for a whole interval to the slab layer, and then
+ * frees wholly-free slabs back to the VM system.
+ *
+ * If a depot's lock is found to be contended more than KMEM_DEPOT_CONTENTION
+ * times in an interval, its magazine size is raised to the next magazine type
+ * so that CPUs go to the depot less often. The depot is emptied when that
+ * happens; CPUs notice the new type the next time they visit the depot and
+ * exchange their own magazines for new ones.
+ *
+ * Big magazines hold more memory idle in each CPU, so once a depot has gone
+ * KMEM_DEPOT_QUIET_INTERVALS intervals uncontended and visited so rarely that
+ * it couldn't be contended enough to grow again at the smaller size, the reap
+ * pass steps it back down a type, though never below the initial type.
  */
 
 #include <sys/k_cpu.h>
 #include <sys/k_log.h>
 #include <sys/kmem.h>
+#include <sys/proc.h>
 #include <sys/vm.h>
 #include <sys/k_types.h>
 
@@ -25,9 +44,17 @@
 
 #define SMALL_SLAB_MAX 512
 
+#define KMEM_UPDATE_INTERVAL ((kabstime_t)15 * NS_PER_S)
+#define KMEM_DEPOT_CONTENTION 64
+#define KMEM_DEPOT_QUIET_VISITS (KMEM_DEPOT_CONTENTION / 4)
+#define KMEM_DEPOT_QUIET_INTERVALS 8
+#define KMEM_MAGTYPE_INITIAL 1
+
+struct kmem_magtype;
+
 static void *kmem_slablayer_alloc(kmem_cache_t *cache, vm_alloc_flags_t flags);
 static void kmem_slablayer_free(kmem_cache_t *cache, void *ptr);
-static void magazine_layer_init(kmem_cache_t *cp, size_t magsize);
+static void magazine_layer_init(kmem_cache_t *cp, struct kmem_magtype *mt);
 
 struct kmem_bufctl {
 	SLIST_ENTRY(kmem_bufctl) sllink;
@@ -57,21 +84,35 @@ struct kmem_magazine {
 	struct kmem_bufctl *mag_round[1];
 };
 
+STAILQ_HEAD(kmem_magazine_list, kmem_magazine);
+
 struct kmem_cpu_cache {
 	struct kmem_magazine *cc_loaded;
 	struct kmem_magazine *cc_prev;
 	size_t cc_rounds;
 	size_t cc_prev_rounds;
 	size_t cc_magsize;
+	struct kmem_magtype *cc_magtype;
 };
 
+/*
+ * l: kd_lock
+ * a: atomic, written with kd_lock held
+ */
 struct kmem_depot {
 	kspinlock_t kd_lock;
-	STAILQ_HEAD(, kmem_magazine) kd_full;
-	STAILQ_HEAD(, kmem_magazine) kd_empty;
-	size_t kd_full_count;
-	size_t kd_empty_count;
-	size_t kd_magsize;
+	struct kmem_magazine_list kd_full;	/* l */
+	struct kmem_magazine_list kd_empty;	/* l */
+	size_t kd_full_count;			/* l */
+	size_t kd_empty_count;			/* l */
+	size_t kd_full_min;	/* l: fewest full mags this interval */
+	size_t kd_empty_min;	/* l: fewest empty mags this interval */
+	size_t kd_full_reaplimit;	/* l: full_min of the last interval */
+	size_t kd_empty_reaplimit;	/* l: empty_min of the last interval */
+	size_t kd_contention;	/* l: contended acquisitions this interval */
+	size_t kd_visits;	/* l: acquisitions this interval */
+	size_t kd_quiet;	/* l: consecutive quiet intervals */
+	struct kmem_magtype *kd_magtype; /* a: type of mags in the depot */
 };
 
 struct kmem_cache {
@@ -86,14 +127,32 @@ struct kmem_cache {
 
 	struct kmem_cpu_cache *cache_cpu;
 	struct kmem_depot depot;
-	size_t cache_magsize;
 	bool use_magazines;
 };
 
+/*
+ * A magazine size. Magazines of each size come from their own cache, which
+ * doesn't itself use the magazine layer. Sizes are chosen so that a magazine
+ * (with its link) is a power of two in size.
+ */
+struct kmem_magtype {
+	size_t mt_magsize;
+	kmem_cache_t mt_cache;
+};
+
 static TAILQ_HEAD(, kmem_cache) all_caches = TAILQ_HEAD_INITIALIZER(all_caches);
 static kspinlock_t all_caches_lock = KSPINLOCK_INITIALISER;
 static kmem_cache_t kmem_alloc_caches[10], kmem_bufctl_cache, kmem_slab_cache,
     kmem_cache_cache;
+static struct kmem_magtype kmem_magtypes[] = {
+	{ .mt_magsize = 15 },
+	{ .mt_magsize = 31 },
+	{ .mt_magsize = 63 },
+	{ .mt_magsize = 127 },
+	{ .mt_magsize = 255 },
+};
+
+#define KMEM_NMAGTYPES (sizeof(kmem_magtypes) / sizeof(kmem_magtypes[0]))
 
 void
 kmem_cache_init(kmem_cache_t *cache, const char *name, size_t size,
@@ -146,13 +205,23 @@ kmem_init(void)
 	    __alignof(struct kmem_slab), NULL);
 	kmem_cache_init(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t),
 	    __alignof(kmem_cache_t), NULL);
+	for (size_t i = 0; i < KMEM_NMAGTYPES; i++) {
+		struct kmem_magtype *mt = &kmem_magtypes[i];
+		char name[32];
+		ksnprintf(name, sizeof(name), "kmem_magazine_%zu",
+		    mt->mt_magsize);
+		kmem_cache_init(&mt->mt_cache, name,
+		    offsetof(struct kmem_magazine, mag_round[mt->mt_magsize]),
+		    __alignof(struct kmem_magazine), NULL);
+	}
 }
 
 void
 kmem_postsmp_init(void)
 {
 	for (size_t i = 0; i < 10; i++)
-		magazine_layer_init(&kmem_alloc_caches[i], 32);
+		magazine_layer_init(&kmem_alloc_caches[i],
+		    &kmem_magtypes[KMEM_MAGTYPE_INITIAL]);
 	for (size_t i = 0; i < 10; i++)
 		kmem_alloc_caches[i].use_magazines = true;
 }
@@ -286,7 +355,7 @@ small_slab_new(kmem_cache_t *cache, vm_alloc_flags_t flags)
 	struct kmem_slab *slab;
 	vaddr_t base;
 
-	page = vm_page_alloc(VM_PAGE_KWIRED, 0, VM_DOMID_ANY, 0);
+	page = vm_page_alloc(VM_PAGE_KWIRED, 0, VM_DOMID_LOCAL, 0);
 	if (page == NULL)
 		return NULL;
 
@@ -457,15 +526,66 @@ kmem_slablayer_free(kmem_cache_t *cache, void *ptr)
 		/* no longer full; push slab to front of the queue */
 		STAILQ_REMOVE(&cache->slabs, slab, kmem_slab, sqlink);
 		STAILQ_INSERT_HEAD(&cache->slabs, slab, sqlink);
-	} else if (slab->alloced_n == 0) {
-#if 0
-		kprintf("todo: free empty slab?\n");
-#endif
 	}
 
+	/* wholly-free slabs are left for slablayer_reap() */
+
 	ke_spinlock_exit_nospl(&cache->spinlock);
 }
 
+/*!
+ * @brief Free a wholly-free slab, which must be off the cache's slab queue.
+ */
+static void
+slab_free(kmem_cache_t *cache, struct kmem_slab *slab)
+{
+	struct kmem_bufctl *bufctl;
+	void *base = NULL;
+
+	if (cache->size <= SMALL_SLAB_MAX) {
+		/* the slab overlays its page, leaving the PMM state intact */
+		vm_page_t *page = (vm_page_t *)((char *)slab -
+		    offsetof(struct vm_slab_page, slab));
+		vm_page_delete(page, true);
+		return;
+	}
+
+	while ((bufctl = SLIST_FIRST(&slab->free)) != NULL) {
+		SLIST_REMOVE_HEAD(&slab->free, sllink);
+		if (base == NULL || bufctl->base < base)
+			base = bufctl->base;
+		kmem_cache_free(&kmem_bufctl_cache, bufctl);
+	}
+
+	vm_kwired_free(base, slab_size(cache) / PGSIZE);
+	kmem_cache_free(&kmem_slab_cache, slab);
+}
+
+/*!
+ * @brief Free all of a cache's wholly-free slabs.
+ */
+static void
+slablayer_reap(kmem_cache_t *cache)
+{
+	STAILQ_HEAD(, kmem_slab) reap = STAILQ_HEAD_INITIALIZER(reap);
+	struct kmem_slab *slab, *tmp;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_enter(&cache->spinlock);
+	STAILQ_FOREACH_SAFE(slab, &cache->slabs, sqlink, tmp) {
+		if (slab->alloced_n != 0)
+			continue;
+		STAILQ_REMOVE(&cache->slabs, slab, kmem_slab, sqlink);
+		STAILQ_INSERT_TAIL(&reap, slab, sqlink);
+	}
+	ke_spinlock_exit(&cache->spinlock, ipl);
+
+	while ((slab = STAILQ_FIRST(&reap)) != NULL) {
+		STAILQ_REMOVE_HEAD(&reap, sqlink);
+		slab_free(cache, slab);
+	}
+}
+
 /* Malloc-style (bad) wrappers */
 
 void *
@@ -582,11 +702,28 @@ kmem_strfree(char *str)
 }
 
 static struct kmem_magazine *
-magazine_create(size_t magsize)
+magazine_create(struct kmem_magtype *mt)
 {
-	size_t size = offsetof(struct kmem_magazine, mag_round[magsize]);
-	struct kmem_magazine *mag = kmem_xalloc(size, 0);
-	return mag;
+	return kmem_cache_alloc(&mt->mt_cache, 0);
+}
+
+static void
+magazine_destroy(struct kmem_magtype *mt, struct kmem_magazine *mag)
+{
+	kmem_cache_free(&mt->mt_cache, mag);
+}
+
+/*!
+ * @brief Return a magazine's rounds to the slab layer and free it.
+ * Called at IPL_DISP.
+ */
+static void
+magazine_purge(kmem_cache_t *cp, struct kmem_magtype *mt,
+    struct kmem_magazine *mag, size_t rounds)
+{
+	for (size_t i = 0; i < rounds; i++)
+		kmem_slablayer_free(cp, mag->mag_round[i]);
+	magazine_destroy(mt, mag);
 }
 
 static inline void
@@ -600,31 +737,85 @@ swap_magazines(struct kmem_cpu_cache *ccp)
 	ccp->cc_prev_rounds = tmp_rounds;
 }
 
+static inline void
+depot_lock(struct kmem_depot *kd)
+{
+	if (likely(ke_spinlock_tryenter_nospl(&kd->kd_lock))) {
+		kd->kd_visits++;
+		return;
+	}
+	ke_spinlock_enter_nospl(&kd->kd_lock);
+	kd->kd_visits++;
+	kd->kd_contention++;
+}
+
+/*!
+ * @brief Exchange a CPU's magazines for empty ones of the depot's current
+ * magazine type, after the depot's magazine size has been changed.
+ *
+ * Rounds held in the old magazines are returned to the slab layer. If new
+ * magazines can't be had, the old ones are kept; they just won't be exchanged
+ * with the depot.
+ */
+static void
+magazine_cpu_reload(kmem_cache_t *cp, struct kmem_cpu_cache *ccp)
+{
+	struct kmem_magtype *mt, *old_mt = ccp->cc_magtype;
+	struct kmem_magazine *loaded, *prev;
+
+	mt = __atomic_load_n(&cp->depot.kd_magtype, __ATOMIC_RELAXED);
+
+	loaded = magazine_create(mt);
+	if (loaded == NULL)
+		return;
+	prev = magazine_create(mt);
+	if (prev == NULL) {
+		magazine_destroy(mt, loaded);
+		return;
+	}
+
+	magazine_purge(cp, old_mt, ccp->cc_loaded, ccp->cc_rounds);
+	magazine_purge(cp, old_mt, ccp->cc_prev, ccp->cc_prev_rounds);
+
+	ccp->cc_loaded = loaded;
+	ccp->cc_prev = prev;
+	ccp->cc_rounds = 0;
+	ccp->cc_prev_rounds = 0;
+	ccp->cc_magtype = mt;
+	ccp->cc_magsize = mt->mt_magsize;
+}
+
 static void *
 magazine_depot_alloc(kmem_cache_t *cp, struct kmem_cpu_cache *ccp,
     vm_alloc_flags_t flags)
 {
+	struct kmem_depot *kd = &cp->depot;
 	struct kmem_magazine *full_mag;
 	void *obj = NULL;
 
-	ke_spinlock_enter_nospl(&cp->depot.kd_lock);
+	if (unlikely(ccp->cc_magtype != __atomic_load_n(&kd->kd_magtype,
+	    __ATOMIC_RELAXED)))
+		magazine_cpu_reload(cp, ccp);
+
+	depot_lock(kd);
 
-	full_mag = STAILQ_FIRST(&cp->depot.kd_full);
-	if (full_mag != NULL) {
-		STAILQ_REMOVE_HEAD(&cp->depot.kd_full, mag_link);
-		cp->depot.kd_full_count--;
+	full_mag = STAILQ_FIRST(&kd->kd_full);
+	if (full_mag != NULL && ccp->cc_magtype == kd->kd_magtype) {
+		STAILQ_REMOVE_HEAD(&kd->kd_full, mag_link);
+		if (--kd->kd_full_count < kd->kd_full_min)
+			kd->kd_full_min = kd->kd_full_count;
 
-		STAILQ_INSERT_HEAD(&cp->depot.kd_empty, ccp->cc_prev, mag_link);
-		cp->depot.kd_empty_count++;
+		STAILQ_INSERT_HEAD(&kd->kd_empty, ccp->cc_prev, mag_link);
+		kd->kd_empty_count++;
 
 		ccp->cc_prev = ccp->cc_loaded;
 		ccp->cc_prev_rounds = ccp->cc_rounds;
 		ccp->cc_loaded = full_mag;
-		ccp->cc_rounds = cp->depot.kd_magsize;
+		ccp->cc_rounds = ccp->cc_magsize;
 		obj = ccp->cc_loaded->mag_round[--ccp->cc_rounds];
 	}
 
-	ke_spinlock_exit_nospl(&cp->depot.kd_lock);
+	ke_spinlock_exit_nospl(&kd->kd_lock);
 
 	if (obj == NULL)
 		obj = kmem_slablayer_alloc(cp, flags);
@@ -635,18 +826,30 @@ magazine_depot_alloc(kmem_cache_t *cp, struct kmem_cpu_cache *ccp,
 static void
 magazine_depot_free(kmem_cache_t *cp, struct kmem_cpu_cache *ccp, void *buf)
 {
+	struct kmem_depot *kd = &cp->depot;
 	struct kmem_magazine *empty_mag;
 	int freed = 0;
 
-	ke_spinlock_enter_nospl(&cp->depot.kd_lock);
+	if (unlikely(ccp->cc_magtype != __atomic_load_n(&kd->kd_magtype,
+	    __ATOMIC_RELAXED))) {
+		magazine_cpu_reload(cp, ccp);
+		if (ccp->cc_rounds < ccp->cc_magsize) {
+			ccp->cc_loaded->mag_round[ccp->cc_rounds++] = buf;
+			return;
+		}
+	}
 
-	empty_mag = STAILQ_FIRST(&cp->depot.kd_empty);
-	if (empty_mag != NULL) {
-		STAILQ_REMOVE_HEAD(&cp->depot.kd_empty, mag_link);
-		cp->depot.kd_empty_count--;
+	depot_lock(kd);
 
-		STAILQ_INSERT_HEAD(&cp->depot.kd_full, ccp->cc_prev, mag_link);
-		cp->depot.kd_full_count++;
+	if (ccp->cc_magtype != kd->kd_magtype) {
+		/* lost a race with a resize; try again on the next visit */
+	} else if ((empty_mag = STAILQ_FIRST(&kd->kd_empty)) != NULL) {
+		STAILQ_REMOVE_HEAD(&kd->kd_empty, mag_link);
+		if (--kd->kd_empty_count < kd->kd_empty_min)
+			kd->kd_empty_min = kd->kd_empty_count;
+
+		STAILQ_INSERT_HEAD(&kd->kd_full, ccp->cc_prev, mag_link);
+		kd->kd_full_count++;
 
 		ccp->cc_prev = ccp->cc_loaded;
 		ccp->cc_prev_rounds = ccp->cc_rounds;
@@ -654,12 +857,12 @@ magazine_depot_free(kmem_cache_t *cp, struct kmem_cpu_cache *ccp, void *buf)
 		ccp->cc_rounds = 0;
 		ccp->cc_loaded->mag_round[ccp->cc_rounds++] = buf;
 		freed = 1;
-	} else if (cp->depot.kd_empty_count < cp->depot.kd_full_count) {
-		empty_mag = magazine_create(cp->cache_magsize);
+	} else if (kd->kd_empty_count < kd->kd_full_count) {
+		empty_mag = magazine_create(kd->kd_magtype);
 		if (empty_mag != NULL) {
-			STAILQ_INSERT_HEAD(&cp->depot.kd_full, ccp->cc_prev,
+			STAILQ_INSERT_HEAD(&kd->kd_full, ccp->cc_prev,
 			    mag_link);
-			cp->depot.kd_full_count++;
+			kd->kd_full_count++;
 
 			ccp->cc_prev = ccp->cc_loaded;
 			ccp->cc_prev_rounds = ccp->cc_rounds;
@@ -670,7 +873,7 @@ magazine_depot_free(kmem_cache_t *cp, struct kmem_cpu_cache *ccp, void *buf)
 		}
 	}
 
-	ke_spinlock_exit_nospl(&cp->depot.kd_lock);
+	ke_spinlock_exit_nospl(&kd->kd_lock);
 
 	if (!freed)
 		kmem_slablayer_free(cp, buf);
@@ -722,28 +925,273 @@ kmem_magazine_free(kmem_cache_t *cp, void *buf)
 };
 
 static void
-magazine_layer_init(kmem_cache_t *cp, size_t magsize)
+magazine_layer_init(kmem_cache_t *cp, struct kmem_magtype *mt)
 {
 	ke_spinlock_init(&cp->depot.kd_lock);
 	STAILQ_INIT(&cp->depot.kd_full);
 	STAILQ_INIT(&cp->depot.kd_empty);
 	cp->depot.kd_full_count = 0;
 	cp->depot.kd_empty_count = 0;
-	cp->depot.kd_magsize = magsize;
+	cp->depot.kd_full_min = 0;
+	cp->depot.kd_empty_min = 0;
+	cp->depot.kd_full_reaplimit = 0;
+	cp->depot.kd_empty_reaplimit = 0;
+	cp->depot.kd_contention = 0;
+	cp->depot.kd_visits = 0;
+	cp->depot.kd_quiet = 0;
+	cp->depot.kd_magtype = mt;
 
 	cp->cache_cpu = kmem_xalloc(sizeof(struct kmem_cpu_cache) * ke_ncpu, 0);
-	cp->cache_magsize = magsize;
 
 	for (int i = 0; i < ke_ncpu; i++) {
 		struct kmem_cpu_cache *ccp = &cp->cache_cpu[i];
-		ccp->cc_loaded = magazine_create(magsize);
-		ccp->cc_prev = magazine_create(magsize);
-		ccp->cc_magsize = magsize;
+		ccp->cc_loaded = magazine_create(mt);
+		ccp->cc_prev = magazine_create(mt);
+		ccp->cc_magsize = mt->mt_magsize;
+		ccp->cc_magtype = mt;
 		ccp->cc_rounds = 0;
 		ccp->cc_prev_rounds = 0;
 	}
 }
 
+/*!
+ * @brief Free every magazine on a list detached from a depot. Full magazines
+ * have their rounds returned to the slab layer first.
+ */
+static void
+depot_list_purge(kmem_cache_t *cp, struct kmem_magtype *mt,
+    struct kmem_magazine_list *list, size_t rounds)
+{
+	struct kmem_magazine *mag;
+	ipl_t ipl = spldisp();
+
+	while ((mag = STAILQ_FIRST(list)) != NULL) {
+		STAILQ_REMOVE_HEAD(list, mag_link);
+		magazine_purge(cp, mt, mag, rounds);
+	}
+
+	splx(ipl);
+}
+
+/*!
+ * @brief Start a new working-set interval for a depot.
+ *
+ * Magazines that stayed in the depot for the whole of the interval just
+ * ended (i.e. the fewest any list held) are surplus to the working set and
+ * may be reaped.
+ */
+static void
+depot_ws_update(kmem_cache_t *cp)
+{
+	struct kmem_depot *kd = &cp->depot;
+	ipl_t ipl = ke_spinlock_enter(&kd->kd_lock);
+
+	kd->kd_full_reaplimit = kd->kd_full_min;
+	kd->kd_full_min = kd->kd_full_count;
+	kd->kd_empty_reaplimit = kd->kd_empty_min;
+	kd->kd_empty_min = kd->kd_empty_count;
+
+	ke_spinlock_exit(&kd->kd_lock, ipl);
+}
+
+/*!
+ * @brief Free the magazines outside of a depot's working set.
+ */
+static void
+depot_ws_reap(kmem_cache_t *cp)
+{
+	struct kmem_depot *kd = &cp->depot;
+	struct kmem_magazine_list full = STAILQ_HEAD_INITIALIZER(full),
+	    empty = STAILQ_HEAD_INITIALIZER(empty);
+	struct kmem_magtype *mt;
+	size_t nfull, nempty;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_enter(&kd->kd_lock);
+
+	mt = kd->kd_magtype;
+	nfull = MIN2(kd->kd_full_reaplimit, kd->kd_full_min);
+	nempty = MIN2(kd->kd_empty_reaplimit, kd->kd_empty_min);
+
+	for (size_t i = 0; i < nfull; i++) {
+		struct kmem_magazine *mag = STAILQ_FIRST(&kd->kd_full);
+		STAILQ_REMOVE_HEAD(&kd->kd_full, mag_link);
+		STAILQ_INSERT_HEAD(&full, mag, mag_link);
+	}
+	kd->kd_full_count -= nfull;
+	kd->kd_full_min -= nfull;
+	kd->kd_full_reaplimit -= nfull;
+
+	for (size_t i = 0; i < nempty; i++) {
+		struct kmem_magazine *mag = STAILQ_FIRST(&kd->kd_empty);
+		STAILQ_REMOVE_HEAD(&kd->kd_empty, mag_link);
+		STAILQ_INSERT_HEAD(&empty, mag, mag_link);
+	}
+	kd->kd_empty_count -= nempty;
+	kd->kd_empty_min -= nempty;
+	kd->kd_empty_reaplimit -= nempty;
+
+	ke_spinlock_exit(&kd->kd_lock, ipl);
+
+	depot_list_purge(cp, mt, &full, mt->mt_magsize);
+	depot_list_purge(cp, mt, &empty, 0);
+}
+
+/*!
+ * @brief Switch a depot to another magazine type. Depot lock held; released.
+ *
+ * The depot's magazines are all freed, since they're of the old size.
+ */
+static void
+depot_set_magtype(kmem_cache_t *cp, struct kmem_magtype *new_mt, ipl_t ipl)
+{
+	struct kmem_depot *kd = &cp->depot;
+	struct kmem_magazine_list full = STAILQ_HEAD_INITIALIZER(full),
+	    empty = STAILQ_HEAD_INITIALIZER(empty);
+	struct kmem_magtype *mt = kd->kd_magtype;
+
+	__atomic_store_n(&kd->kd_magtype, new_mt, __ATOMIC_RELAXED);
+
+	STAILQ_CONCAT(&full, &kd->kd_full);
+	STAILQ_CONCAT(&empty, &kd->kd_empty);
+	kd->kd_full_count = kd->kd_empty_count = 0;
+	kd->kd_full_min = kd->kd_empty_min = 0;
+	kd->kd_full_reaplimit = kd->kd_empty_reaplimit = 0;
+	kd->kd_quiet = 0;
+
+	ke_spinlock_exit(&kd->kd_lock, ipl);
+
+	depot_list_purge(cp, mt, &full, mt->mt_magsize);
+	depot_list_purge(cp, mt, &empty, 0);
+}
+
+/*!
+ * @brief Move a depot to the next larger magazine type if its lock was
+ * contended too often in the last interval, else note whether it was quiet.
+ */
+static void
+depot_resize(kmem_cache_t *cp)
+{
+	struct kmem_depot *kd = &cp->depot;
+	struct kmem_magtype *mt;
+	size_t contention, visits;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_enter(&kd->kd_lock);
+
+	mt = kd->kd_magtype;
+	contention = kd->kd_contention;
+	visits = kd->kd_visits;
+	kd->kd_contention = 0;
+	kd->kd_visits = 0;
+
+	if (contention <= KMEM_DEPOT_CONTENTION ||
+	    mt == &kmem_magtypes[KMEM_NMAGTYPES - 1]) {
+		if (contention == 0 && visits < KMEM_DEPOT_QUIET_VISITS)
+			kd->kd_quiet++;
+		else
+			kd->kd_quiet = 0;
+		ke_spinlock_exit(&kd->kd_lock, ipl);
+		return;
+	}
+
+	depot_set_magtype(cp, mt + 1, ipl);
+
+	kdprintf("kmem: %s: depot contended %zu times, magazine size now %zu\n",
+	    cp->name, contention, mt[1].mt_magsize);
+}
+
+/*!
+ * @brief Move a depot that's been quiet for long enough back to the next
+ * smaller magazine type, so its CPUs hold fewer idle objects.
+ */
+static void
+depot_shrink(kmem_cache_t *cp)
+{
+	struct kmem_depot *kd = &cp->depot;
+	struct kmem_magtype *mt;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_enter(&kd->kd_lock);
+
+	mt = kd->kd_magtype;
+	if (kd->kd_quiet < KMEM_DEPOT_QUIET_INTERVALS ||
+	    mt <= &kmem_magtypes[KMEM_MAGTYPE_INITIAL]) {
+		ke_spinlock_exit(&kd->kd_lock, ipl);
+		return;
+	}
+
+	depot_set_magtype(cp, mt - 1, ipl);
+
+	kdprintf("kmem: %s: depot quiet, magazine size now %zu\n", cp->name,
+	    mt[-1].mt_magsize);
+}
+
+static kmem_cache_t *
+cache_next(kmem_cache_t *cache)
+{
+	ipl_t ipl = ke_spinlock_enter(&all_caches_lock);
+	/* caches are never destroyed, so the link stays valid */
+	cache = cache == NULL ? TAILQ_FIRST(&all_caches) :
+	    TAILQ_NEXT(cache, qlink);
+	ke_spinlock_exit(&all_caches_lock, ipl);
+	return cache;
+}
+
+/*!
+ * @brief Return memory outside of the caches' working sets to the system.
+ *
+ * Depots give back the magazines they haven't needed over the last update
+ * interval, and long-quiet depots move to smaller magazines; then wholly-free
+ * slabs are freed.
+ */
+void
+kmem_reap(void)
+{
+	for (kmem_cache_t *cp = cache_next(NULL); cp != NULL;
+	    cp = cache_next(cp)) {
+		if (cp->use_magazines) {
+			depot_ws_reap(cp);
+			depot_shrink(cp);
+		}
+		slablayer_reap(cp);
+	}
+}
+
+static void
+kmem_update(void)
+{
+	for (kmem_cache_t *cp = cache_next(NULL); cp != NULL;
+	    cp = cache_next(cp)) {
+		if (!cp->use_magazines)
+			continue;
+		depot_ws_update(cp);
+		depot_resize(cp);
+	}
+
+	kmem_reap();
+}
+
+static void
+kmem_update_thread(void *)
+{
+	kevent_t ev;
+	ke_event_init(&ev, false);
+
+	while (true) {
+		ke_wait1(&ev, "kmem_update_thread", false,
+		    ke_time() + KMEM_UPDATE_INTERVAL);
+		kmem_update();
+	}
+}
+
+void
+kmem_update_init(void)
+{
+	thread_t *thread = proc_new_system_thread(kmem_update_thread, NULL);
+	ke_thread_resume(&thread->kthread, false);
+}
+
 void *
 kmem_cache_alloc(kmem_cache_t *cache, vm_alloc_flags_t flags)
 {
@@ -30,6 +30,30 @@ vm_kwired_init(void)
 	    PIN_HEAP_SIZE, PGSIZE, NULL, NULL, NULL, 0, 0);
 }
 
+/*
+ * Allocations of at least a superpage are aligned so that superpages can map
+ * them.
+ */
+static vmem_size_t
+kwired_align(size_t npages)
+{
+#ifdef PMAP_SUPERPAGE_LEVEL
+	if (npages >= PMAP_SUPERPAGE_PAGES)
+		return PMAP_SUPERPAGE_SIZE;
+#endif
+	return 0;
+}
+
+#ifdef PMAP_SUPERPAGE_LEVEL
+/* Whether page \p i of \p npages at \p addr starts a whole superpage. */
+static bool
+kwired_superpage_fits(vaddr_t addr, size_t i, size_t npages)
+{
+	return ((addr + (i << PGSHIFT)) & (PMAP_SUPERPAGE_SIZE - 1)) == 0 &&
+	    npages - i >= PMAP_SUPERPAGE_PAGES;
+}
+#endif
+
 void *
 vm_kwired_alloc(size_t npages, vm_alloc_flags_t flags)
 {
@@ -53,8 +77,8 @@ vm_kwired_alloc(size_t npages, vm_alloc_flags_t flags)
 	}
 
 	ipl = ke_spinlock_enter(&kwired_lock);
-	r = vmem_xalloc(&kwired_arena, npages << PGSHIFT, 0, 0, 0, 0, 0, flags,
-	    &addr);
+	r = vmem_xalloc(&kwired_arena, npages << PGSHIFT,
+	    kwired_align(npages), 0, 0, 0, 0, flags, &addr);
 	if (r != 0) {
 		/* vmem_xalloc should deal with this for us */
 		kassert_dbg(!(flags & VM_NOFAIL), "");
@@ -68,7 +92,24 @@ vm_kwired_alloc(size_t npages, vm_alloc_flags_t flags)
 	for (size_t i = 0; i < npages; i++) {
 		vm_page_t *page;
 
-		if (i == 0 || ((uintptr_t)(++pte) & (PGSIZE - 1)) == 0) {
+#ifdef PMAP_SUPERPAGE_LEVEL
+		if (kwired_superpage_fits(addr, i, npages)) {
+			if (pte != NULL) {
+				pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs,
+				    &state);
+				pte = NULL;
+			}
+
+			if (pmap_superpage_enter(proc0.vm_map, &vm_kwired_rs,
+				addr + (i << PGSHIFT), VM_PAGE_KWIRED,
+				VM_READ | VM_WRITE) != NULL) {
+				i += PMAP_SUPERPAGE_PAGES - 1;
+				continue;
+			}
+		}
+#endif
+
+		if (pte == NULL || ((uintptr_t)(++pte) & (PGSIZE - 1)) == 0) {
 			if (pte != NULL)
 				pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs,
 				    &state);
@@ -92,7 +133,8 @@ vm_kwired_alloc(size_t npages, vm_alloc_flags_t flags)
 		state.pages[0]->proctable.nonzero_ptes++;
 		state.pages[0]->proctable.noswap_ptes++;
 	}
-	pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs, &state);
+	if (pte != NULL)
+		pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs, &state);
 
 	ke_spinlock_exit_nospl(&proc0.vm_map->stealing_lock);
 	ke_spinlock_exit_nospl(&proc0.vm_map->creation_lock);
@@ -116,17 +158,23 @@ unmap_batch_init(struct unmap_batch *batch)
 }
 
 static void
-unmap_batch_flush(struct unmap_batch *batch)
+kwired_tlb_flush(void)
 {
 	extern int kern_initlevel;
 
-	if (batch->count == 0)
-		return;
-
 	if (kern_initlevel >= 2) /* SMP started */
 		pmap_tlb_flush_all_globally();
 	else
 		pmap_tlb_flush_all(0);
+}
+
+static void
+unmap_batch_flush(struct unmap_batch *batch)
+{
+	if (batch->count == 0)
+		return;
+
+	kwired_tlb_flush();
 
 	for (size_t i = 0; i < batch->count; i++)
 		vm_page_delete(batch->pages[i], true);
@@ -161,6 +209,9 @@ vm_kwired_free(void *ptr, size_t npages)
 
 	unmap_batch_init(&batch);
 
+	/* for superpages across the ends of the range */
+	pmap_reserve_tables();
+
 	ipl = ke_spinlock_enter(&kwired_lock);
 	ke_spinlock_enter_nospl(&proc0.vm_map->creation_lock);
 	ke_spinlock_enter_nospl(&proc0.vm_map->stealing_lock);
@@ -171,7 +222,28 @@ vm_kwired_free(void *ptr, size_t npages)
 		vm_page_t *page;
 		pte_t pte;
 
-		if (i == 0 || ((uintptr_t)(++ppte) & (PGSIZE - 1)) == 0) {
+#ifdef PMAP_SUPERPAGE_LEVEL
+		if (kwired_superpage_fits(addr, i, npages)) {
+			if (ppte != NULL) {
+				pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs,
+				    &state);
+				ppte = NULL;
+			}
+
+			page = pmap_superpage_remove(proc0.vm_map,
+			    &vm_kwired_rs, addr + (i << PGSHIFT));
+			if (page != NULL) {
+				kwired_tlb_flush();
+				/* backwards, so the buddy allocator merges */
+				for (size_t j = PMAP_SUPERPAGE_PAGES; j-- > 0;)
+					vm_page_delete(&page[j], true);
+				i += PMAP_SUPERPAGE_PAGES - 1;
+				continue;
+			}
+		}
+#endif
+
+		if (ppte == NULL || ((uintptr_t)(++ppte) & (PGSIZE - 1)) == 0) {
 			if (ppte != NULL)
 				pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs, &state);
 
@@ -191,7 +263,8 @@ vm_kwired_free(void *ptr, size_t npages)
 
 		unmap_batch_add(&batch, page);
 	}
-	pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs, &state);
+	if (ppte != NULL)
+		pmap_unwire_pte(proc0.vm_map, &vm_kwired_rs, &state);
 
 	ke_spinlock_exit_nospl(&proc0.vm_map->stealing_lock);
 	ke_spinlock_exit_nospl(&proc0.vm_map->creation_lock);
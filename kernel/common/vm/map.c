@@ -12,6 +12,7 @@
 #include <sys/kmem.h>
 
 #include <stdatomic.h>
+#include <libkern/lib.h>
 #include <vm/map.h>
 
 static int map_entry_cmp(struct vm_map_entry *x, struct vm_map_entry *y);
@@ -67,8 +68,15 @@ vm_map_create(void)
 	map->rs.map = map;
 	map->rs.private_pages_n = 0;
 	map->rs.valid_n = 0;
+	map->rs.superpages_n = 0;
 	TAILQ_INIT(&map->rs.active_leaf_tables);
 
+	memset((void *)&map->active_cpus, 0, sizeof(map->active_cpus));
+#if defined(__amd64__)
+	map->pcid_ctx = pmap_new_pcid_ctx();
+	atomic_store_explicit(&map->tlb_gen, 0, memory_order_relaxed);
+#endif
+
 	map->pgtable = pmap_allocate_pgtable(map);
 
 	vmem_init(&map->vmem, "userland", LOWER_HALF, LOWER_HALF_SIZE, PGSIZE,
@@ -260,23 +268,40 @@ struct unmap_deferred {
 };
 
 struct unmap_batch {
+	vm_map_t *map;
+	vaddr_t start, end;	/* range of addresses unmapped so far */
 	struct unmap_deferred entries[UNMAP_BATCH_SIZE];
 	size_t count;
 };
 
 static void
-unmap_batch_init(struct unmap_batch *batch)
+unmap_batch_init(struct unmap_batch *batch, vm_map_t *map)
 {
+	batch->map = map;
+	batch->start = (vaddr_t)-1;
+	batch->end = 0;
 	batch->count = 0;
 }
 
+/*! @brief Note that the PTE for \p vaddr has been zeroed. */
+static void
+unmap_batch_note(struct unmap_batch *batch, vaddr_t vaddr)
+{
+	if (vaddr < batch->start)
+		batch->start = vaddr;
+	if (vaddr + PGSIZE > batch->end)
+		batch->end = vaddr + PGSIZE;
+}
+
 static void
 unmap_batch_flush(struct unmap_batch *batch)
 {
-	if (batch->count == 0)
+	if (batch->count == 0 && batch->start >= batch->end)
 		return;
 
-	pmap_tlb_flush_all_globally();
+	/* one shootdown for the whole batch, to CPUs using the map */
+	if (batch->start < batch->end)
+		pmap_tlb_flush_range(batch->map, batch->start, batch->end);
 
 	for (size_t i = 0; i < batch->count; i++) {
 		struct unmap_deferred *d = &batch->entries[i];
@@ -307,6 +332,10 @@ unmap_batch_flush(struct unmap_batch *batch)
 				vm_page_delete(page, true);
 				kmem_free(anon, sizeof(struct vm_anon));
 			} else {
+				/* last mapping gone; it may go to swap */
+				if (page->shared.share_count == 0)
+					vm_page_release_and_dirty(page,
+					    page->swap_address == 0);
 				ke_spinlock_exit_nospl(&anon_creation_lock);
 			}
 			break;
@@ -315,6 +344,8 @@ unmap_batch_flush(struct unmap_batch *batch)
 	}
 
 	batch->count = 0;
+	batch->start = (vaddr_t)-1;
+	batch->end = 0;
 }
 
 static void
@@ -362,12 +393,15 @@ unmap_ptes(vm_map_t *map, vaddr_t start, vaddr_t end,
 	struct pte_cursor cursor;
 	pte_t *ppte = NULL;
 	ipl_t ipl;
-	size_t n_zeroed = 0;
+	size_t n_zeroed = 0, n_trans = 0;
 	vm_page_t *table_page = NULL;
 	struct unmap_batch batch;
 	int r;
 
-	unmap_batch_init(&batch);
+	unmap_batch_init(&batch, map);
+
+	/* for superpages across the ends of the range */
+	pmap_reserve_tables();
 
 	ipl = spldisp();
 	ke_spinlock_enter_nospl(&map->creation_lock);
@@ -385,18 +419,48 @@ unmap_ptes(vm_map_t *map, vaddr_t start, vaddr_t end,
 					    n_zeroed;
 					if (table_page->proctable
 						.valid_pageable_leaf_ptes ==
-					    0) {
+					    0 && n_zeroed > 0) {
 						TAILQ_REMOVE(
 						    &map->rs.active_leaf_tables,
 						    table_page, qlink);
 					}
 				}
 				pmap_valid_ptes_zeroed(&map->rs, table_page,
-				    n_zeroed);
+				    n_zeroed + n_trans);
 				pmap_unwire_pte(map, &map->rs, &cursor);
 				n_zeroed = 0;
+				n_trans = 0;
+				table_page = NULL;
 			}
 
+#ifdef PMAP_SUPERPAGE_LEVEL
+			/* a superpage wholly within the range goes whole */
+			if (addr % PMAP_SUPERPAGE_SIZE == 0 &&
+			    addr + PMAP_SUPERPAGE_SIZE <= end) {
+				vm_page_t *page = pmap_superpage_remove(map,
+				    &map->rs, addr);
+
+				if (page != NULL) {
+					unmap_batch_note(&batch, addr);
+					unmap_batch_note(&batch, addr +
+					    PMAP_SUPERPAGE_SIZE - PGSIZE);
+					unmap_batch_flush(&batch);
+					/* backwards, so the buddy coalesces */
+					for (size_t j = PMAP_SUPERPAGE_PAGES;
+					    j-- > 0;)
+						vm_page_delete(&page[j], true);
+
+					map->rs.private_pages_n -=
+					    PMAP_SUPERPAGE_PAGES;
+					map->rs.valid_n -= PMAP_SUPERPAGE_PAGES;
+					/* -PGSIZE because loop adds */
+					addr += PMAP_SUPERPAGE_SIZE - PGSIZE;
+					ppte = NULL;
+					continue;
+				}
+			}
+#endif
+
 			r = pmap_wire_pte(map, &map->rs, &cursor, addr, false);
 			if (r < 0) {
 				vaddr_t align = PGSIZE;
@@ -440,6 +504,7 @@ unmap_ptes(vm_map_t *map, vaddr_t start, vaddr_t end,
 			if (entry->is_phys) {
 				/* physical mapping: just zero the PTE */
 				pmap_pte_zeroleaf_create(ppte, PMAP_L0);
+				unmap_batch_note(&batch, addr);
 				n_zeroed++;
 				break;
 			}
@@ -448,6 +513,7 @@ unmap_ptes(vm_map_t *map, vaddr_t start, vaddr_t end,
 			dirty = pmap_pte_hwleaf_writeable(pte);
 
 			pmap_pte_zeroleaf_create(ppte, PMAP_L0);
+			unmap_batch_note(&batch, addr);
 
 			switch (page->use) {
 			case VM_PAGE_PRIVATE:
@@ -480,29 +546,30 @@ unmap_ptes(vm_map_t *map, vaddr_t start, vaddr_t end,
 			break;
 		}
 
-#if 0
 		case kPTEKindTrans: {
-			vm_page_t *page = pmap_pte_soft_page(pte);
+			vm_page_t *page = pmap_pte_soft_page(ppte);
 			/*
 			 * the only trans PTEs to be found are for process
 			 * private memory (be it data or page table pages)
 			 * make sure that's so.
 			 */
 			kassert(page->use == VM_PAGE_PRIVATE);
-			pmap_pte_hw_create_zero(pte);
-			vm_page_delete(page, true);
-			n_zeroed++;
+			pmap_pte_zeroleaf_create(ppte, PMAP_L0);
+			map->rs.private_pages_n--;
+			/* on a paging queue, unless the pager has it */
+			vm_page_delete(page, false);
+			n_trans++;
 			break;
 		}
 
 		case kPTEKindSwap: {
-			/* todo: free swap slot */
-			kfatal("unmap_ptes: swap PTE - implement me\n");
-			pmap_pte_hw_create_zero(pte);
-			n_zeroed++;
+			vm_swap_free(pmap_pte_soft_swap(pte), 1);
+			pmap_pte_zeroleaf_create(ppte, PMAP_L0);
+			map->rs.private_pages_n--;
+			/* swap PTEs are NOT noswap, as with fork PTEs */
+			table_page->proctable.nonzero_ptes--;
 			break;
 		}
-#endif
 
 		case kPTEKindFork: {
 			struct vm_anon *anon = pmap_pte_soft_anon(pte);
@@ -518,11 +585,14 @@ unmap_ptes(vm_map_t *map, vaddr_t start, vaddr_t end,
 					vm_page_t *page =
 					    pmap_pte_hwleaf_page(anonpte,
 					    PMAP_L0);
-					vm_page_delete(page, true);
+					/* unmapped, so on a paging queue */
+					kassert(page->shared.share_count == 0);
+					vm_page_delete(page, false);
 					break;
 				}
 				case kPTEKindSwap:
-					/* TODO: free swap slot */
+					vm_swap_free(pmap_pte_soft_swap(
+					    anonpte), 1);
 					break;
 				default:
 					break;
@@ -558,7 +628,8 @@ unmap_ptes(vm_map_t *map, vaddr_t start, vaddr_t end,
 				    table_page, qlink);
 			}
 		}
-		pmap_valid_ptes_zeroed(&map->rs, table_page, n_zeroed);
+		pmap_valid_ptes_zeroed(&map->rs, table_page,
+		    n_zeroed + n_trans);
 		pmap_unwire_pte(map, &map->rs, &cursor);
 	}
 
@@ -718,6 +789,15 @@ vm_voaddr_acquire(struct vm_map *map, vaddr_t vaddr, struct vm_voaddr *out)
 
 	return 0;
 }
+
+/*! @brief Copy a virtual object address, taking a reference of its own. */
+void
+vm_voaddr_retain(const struct vm_voaddr *voaddr, struct vm_voaddr *out)
+{
+	/* we don't actually ref anything yet */
+	*out = *voaddr;
+}
+
 void
 vm_voaddr_release(struct vm_map *, struct vm_voaddr *)
 {
@@ -43,6 +43,7 @@ typedef struct vm_rs {
 
 	size_t private_pages_n;
 	size_t valid_n;
+	size_t superpages_n;	/* their pages are counted above too */
 
 	/* leaf page tables containing at least 1 valid, pageable PTE */
 	TAILQ_HEAD(, vm_page) active_leaf_tables;
@@ -58,9 +59,36 @@ struct vm_map {
 
 	paddr_t pgtable;
 	struct vm_rs rs;
+
+	/* CPUs which have this map loaded, and so may cache its TLB entries */
+	katomic_cpumask_t active_cpus;
+#if defined(__amd64__)
+	/*
+	 * With PCIDs, CPUs which have had the map loaded may also still cache
+	 * its entries. They check tlb_gen when they next load it.
+	 */
+	uint64_t pcid_ctx;		/* unique ID, 0 for kernel_map */
+	_Atomic(uint64_t) tlb_gen;	/* bumped by every shootdown */
+#endif
 };
 
 
+/*
+ * Sequential access detection for a vnode object. Faults on the object keep
+ * it, under the object's creation lock; see vm/readahead.c.
+ */
+struct vm_readahead {
+	pgoff_t next;		/* where a sequential fault comes next */
+	pgoff_t start, end;	/* the last region read ahead */
+	size_t window;		/* pages; 0 after random access */
+
+	/* a request to the readahead thread (readahead queue lock) */
+	bool queued;
+	pgoff_t q_start;
+	size_t q_n;
+	TAILQ_ENTRY(vm_object) q_link;
+};
+
 typedef struct vm_object {
 	kspinlock_t creation_lock;
 	kspinlock_t stealing_lock;
@@ -74,6 +102,7 @@ typedef struct vm_object {
 			size_t valid_length;	/* both vnode rwlocks + both
 						 * vm_object spinlocks to write;
 						 * any to read! */
+			struct vm_readahead ra;
 		} vnobj;
 	};
 	pte_t direct[6];
@@ -106,18 +135,57 @@ void obj_unwire_pte(vm_object_t *obj, struct obj_pte_wire_state *state);
 
 pte_t *obj_fetch_pte(vm_object_t *obj, vaddr_t offset);
 
+void vm_readahead_note(vm_object_t *obj, pgoff_t pgoff, size_t n, bool hit);
+
 void obj_page_zeroed(vm_object_t *obj, vm_page_t *page);
 void obj_page_swapped(vm_object_t *obj, vm_page_t *page);
 void obj_table_pte_did_become_swap(vm_object_t *obj, vm_page_t *table_page);
 
 void pmap_tlb_flush_vaddr_globally(vaddr_t vaddr);
 void pmap_tlb_flush_all_globally(void);
+void pmap_tlb_flush_range(vm_map_t *map, vaddr_t start, vaddr_t end);
+void pmap_tlb_flush_map(vm_map_t *map);
 
 void pmap_tlb_flush_all(void *unused);
 
+void pmap_activate(vm_map_t *map);
+#if defined(__amd64__)
+uint64_t pmap_new_pcid_ctx(void);
+#endif
+void pmap_switch(vm_map_t *old, vm_map_t *new);
+
+void dbg_pmap_tlb_dump(void);
+
+#ifdef PMAP_SUPERPAGE_LEVEL
+vm_page_t *pmap_superpage_enter(vm_map_t *map, struct vm_rs *rs,
+    vaddr_t vaddr, vm_page_use_t use, vm_prot_t prot);
+vm_page_t *pmap_superpage_remove(vm_map_t *map, struct vm_rs *rs,
+    vaddr_t vaddr);
+bool pmap_superpage_promote(vm_map_t *map, struct vm_rs *rs,
+    struct pte_cursor *cursor, vaddr_t vaddr, vm_prot_t prot);
+int pmap_superpage_trim(vm_map_t *map, struct vm_rs *rs, vaddr_t vaddr,
+    bool force);
+void pmap_reserve_tables(void);
+void dbg_pmap_superpage_dump(void);
+#else
+static inline void
+pmap_reserve_tables(void)
+{
+}
+#endif
+
 void rs_evict_leaf_pte(struct vm_rs *rs, vaddr_t vaddr, vm_page_t *page,
     pte_t *pte);
 
+/* most pages paged out or in by one swap I/O */
+#define SWAP_CLUSTER_MAX 16
+
+bool vm_swap_enabled(void);
+void vm_swap_free(uintptr_t slot, size_t n);
+size_t vm_swap_pageout(vm_page_t **pages, size_t n);
+void vm_swap_pagein(vm_page_t **pages, uintptr_t slot, size_t n);
+bool vm_swap_reclaim(vm_page_t *page);
+
 extern kspinlock_t anon_creation_lock, anon_stealing_lock;
 extern vm_map_t kernel_map;
 
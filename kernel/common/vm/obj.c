@@ -49,6 +49,7 @@ vm_obj_new_vnode(vnode_t *vnode)
 	obj->kind = VM_OBJ_VNODE;
 	obj->vnobj.vnode = vnode;
 	obj->vnobj.valid_length = SIZE_MAX;
+	memset(&obj->vnobj.ra, 0, sizeof(obj->vnobj.ra));
 	ke_spinlock_init(&obj->creation_lock);
 	ke_spinlock_init(&obj->stealing_lock);
 	for (size_t i = 0; i < OBJ_N_DIRECT; i++)
@@ -151,12 +152,10 @@ obj_wire_pte(vm_object_t *obj, struct obj_pte_wire_state *state, vaddr_t offset,
 			ke_spinlock_exit_nospl(&obj->stealing_lock);
 
 			page = vm_page_alloc(VM_PAGE_OBJ_TABLE, 0,
-			    VM_DOMID_LOCAL, 0);
+			    VM_DOMID_LOCAL, VM_ZERO);
 			if (page == NULL)
 				kfatal("TODO: Wait on pages avail event.\n");
 
-			memset((void *)vm_page_hhdm_addr(page), 0, PGSIZE);
-
 			ke_spinlock_enter_nospl(&obj->stealing_lock);
 
 			page->pte = ppte;
@@ -496,7 +495,7 @@ obj_max_readahead(struct obj_pte_wire_state *cursor, pgoff_t pgoff,
 		pte_t *obj_ppte = cursor->pte + i, pte;
 
 		/* stop if we cross a page boundary */
-		if (pgoff < OBJ_N_DIRECT &&
+		if (pgoff >= OBJ_N_DIRECT &&
 		    ((uintptr_t)(obj_ppte) & (PGSIZE - 1)) == 0)
 			break;
 
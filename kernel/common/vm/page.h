@@ -19,6 +19,7 @@
 
 #define FREELIST_ORDERS 16
 #define PAGEABLE_ORDERS 4
+#define PCP_ORDERS 4
 
 typedef TAILQ_HEAD(vm_page_queue, vm_page) vm_page_queue_t;
 typedef struct vm_domain vm_domain_t;
@@ -84,7 +85,8 @@ struct vm_page {
 			uint32_t share_count;
 			uint32_t
 				dirty: 1,
-				spare_1: 31;
+				readahead: 1, /* read ahead, not yet faulted */
+				spare_1: 30;
 			uint64_t
 				spare_2: 12,
 				offset: 52; /* offset in *pages* */
@@ -122,11 +124,37 @@ struct vm_page {
 #endif
 };
 
+/*
+ * A CPU's cache of free pages from one domain, for orders below PCP_ORDERS.
+ * Pages are taken from the buddy freelists and returned to them in batches,
+ * so most allocations needn't take the domain's queues lock.
+ *
+ * Allocations from the cache can't update the domain's counters, so the
+ * changes are accumulated in use_delta/active_delta and folded in whenever
+ * the queues lock is next taken for the cache.
+ *
+ * Only accessed by its CPU, at IPL_DISP.
+ */
+struct vm_pcp {
+	vm_page_queue_t q[PCP_ORDERS];
+	size_t n[PCP_ORDERS];
+	long use_delta[VM_PAGE_USE_N];
+	long active_delta;
+	size_t hits, misses, frees, drains;
+};
+
 struct vm_domain {
 	kspinlock_t queues_lock;
 	vm_page_queue_t free_q[FREELIST_ORDERS], stby_q, dirty_q;
 	size_t free_n[FREELIST_ORDERS], stby_n, dirty_n, active_n;
 	size_t use_n[VM_PAGE_USE_N];
+	size_t total_n;		/* pages in the domain, whatever their use */
+	vm_page_queue_t zero_q;	/* free order-0 pages known to be zeroed */
+	size_t zero_n, zero_hits, zero_misses;
+	struct vm_pcp *pcp;	/* per-CPU caches, by cpu_num; NULL till SMP */
+	uint8_t distance[VM_MAX_DOMAINS]; /* SLIT-style; 10 is local */
+	vm_domid_t fallback[VM_MAX_DOMAINS]; /* this, then others by distance */
+	size_t min_free, low_free, high_free; /* watermarks; see vm/pageout.c */
 };
 
 /*
@@ -161,6 +189,8 @@ struct pagein_wait {
 /*! @brief get the vm_page that describes some HHDM address. */
 #define VM_PAGE_FOR_HHDM_ADDR(addr) (&vm_pages[v2p(addr) >> PGSHIFT])
 
+size_t vm_domain_free_n(vm_domain_t *dom);
+
 void vmp_page_dom_lock_enter(vm_page_t *);
 void vmp_page_dom_lock_exit(vm_page_t *);
 
@@ -168,8 +198,9 @@ void vm_page_retain(vm_page_t *);
 void vm_page_release(vm_page_t *);
 void vm_page_release_and_dirty(vm_page_t *page, bool dirty);
 void vm_page_dirty(vm_page_t *);
+size_t vm_page_reclaim(vm_domain_t *dom, size_t n);
 
-extern vm_domain_t vm_domains[1];
+extern vm_domain_t vm_domains[VM_MAX_DOMAINS];
 extern vm_page_t *vm_pages;
 
 #endif /* ECX_VM_PAGE_H */
@@ -0,0 +1,552 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file vm/pageout.c
+ * @brief Balance set manager.
+ *
+ * Each domain has three watermarks for its free page count. An allocation
+ * which leaves a domain below its low watermark wakes the balance set manager,
+ * which works to bring the domain back up to its high watermark. It tries, in
+ * increasing order of cost:
+ *
+ * 1. reclaiming clean pages from the domain's standby list;
+ * 2. writing back pages on the modified list, which moves them to standby;
+ * 3. trimming working sets, so that more pages go to the standby and modified
+ *    lists: idle views of the viewcache are unmapped, and so are pages mapped
+ *    by processes which haven't accessed them since the last trim (the PTE
+ *    accessed bit is cleared on each trim, as in a clock algorithm.) Below the
+ *    min watermark, pages are unmapped whether accessed or not.
+ *
+ * It also wakes once a second to write back modified pages if too many have
+ * built up.
+ *
+ * Allocations which find nothing free wait in vm_page_wait(), having first
+ * backed out of any spinlocks they held.
+ *
+ * Anonymous memory is only trimmed when there's swap space for it to go to;
+ * modified anonymous pages are written there in clusters (see vm/swap.c.)
+ */
+
+#include <sys/iop.h>
+#include <sys/k_log.h>
+#include <sys/k_wait.h>
+#include <sys/proc.h>
+#include <sys/vnode.h>
+
+#include <libkern/lib.h>
+
+#include "vm/map.h"
+#include "vm/page.h"
+
+/* modified pages written back per domain per pass */
+#define PAGEOUT_WRITE_MAX 64
+/* viewcache views unmapped per pass */
+#define PAGEOUT_VIEWS_MAX 16
+/* address spaces trimmed per pass */
+#define PAGEOUT_MAPS_MAX 32
+
+extern size_t highest_domid;
+extern TAILQ_HEAD(, proc) allproc;
+extern kmutex_t proctree_mutex;
+
+static thread_t *pageout_thread;
+static kevent_t pageout_ev;	/* wakes the balance set manager */
+static kevent_t pages_avail_ev;	/* set when it's freed some pages */
+static bool pageout_kicked;	/* pageout_ev already set */
+static pid_t trim_next_pid;	/* where the next working set trim starts */
+
+static struct pageout_stats {
+	size_t passes, reclaimed, written, views_trimmed, ptes_aged,
+	    ptes_trimmed, superpages_demoted, waits;
+} stats;
+
+/*!
+ * @brief Wake the balance set manager, e.g. because a domain has fallen
+ * below its low watermark. May be called at up to IPL_DISP.
+ */
+void
+vm_pageout_wakeup(void)
+{
+	if (pageout_thread == NULL)
+		return;
+	if (__atomic_exchange_n(&pageout_kicked, true, __ATOMIC_RELAXED))
+		return;
+	ke_event_set_signalled(&pageout_ev, true);
+}
+
+/*!
+ * @brief Wait for pages to be freed, after an allocation found none.
+ *
+ * Reclaims what it can from the local domain's standby list directly, and
+ * failing that wakes the balance set manager and waits (for up to a second)
+ * for it to free some. The caller must hold no spinlocks; it should retry its
+ * allocation afterwards.
+ *
+ * @returns false if there's no hope of pages being freed by waiting, as
+ * before the balance set manager is running, or if called above IPL_0.
+ */
+bool
+vm_page_wait(void)
+{
+	size_t reclaimed;
+	ipl_t ipl;
+
+	if (pageout_thread == NULL)
+		return false;
+
+	ipl = spldisp();
+	reclaimed = vm_page_reclaim(&vm_domains[CPU_LOCAL_LOAD(vm_domid)],
+	    PAGEOUT_WRITE_MAX);
+	splx(ipl);
+
+	if (reclaimed > 0)
+		return true;
+	else if (ipl != IPL_0)
+		return false;
+
+	__atomic_fetch_add(&stats.waits, 1, __ATOMIC_RELAXED);
+	/* it's left signalled after each pass; wait for the end of the next */
+	ke_event_set_signalled(&pages_avail_ev, false);
+	vm_pageout_wakeup();
+	ke_wait1(&pages_avail_ev, "vm_page_wait", false, ke_time() + NS_PER_S);
+
+	return true;
+}
+
+static bool
+is_anon(vm_page_t *page)
+{
+	return page->use == VM_PAGE_PRIVATE ||
+	    page->use == VM_PAGE_ANON_FORKED;
+}
+
+/* Write out a cluster of anonymous pages, then release them. */
+static size_t
+write_anon_cluster(vm_page_t **pages, size_t n)
+{
+	size_t written = vm_swap_pageout(pages, n);
+
+	for (size_t i = 0; i < n; i++)
+		vm_page_release(pages[i]);
+
+	return written;
+}
+
+/*
+ * Write back up to n pages from a domain's modified list. Once written they go
+ * to the standby list (unless dirtied again meanwhile.) File pages are written
+ * one by one to their files; anonymous pages are gathered into clusters and
+ * written to swap. Other kinds of page, and anonymous pages if there's no swap,
+ * are rotated to the tail of the list and passed over.
+ */
+static size_t
+write_modified(vm_domain_t *dom, size_t n)
+{
+	vm_page_t *cluster[SWAP_CLUSTER_MAX];
+	size_t written = 0, scanned = 0, limit, ncluster = 0;
+	bool swap = vm_swap_enabled();
+	ipl_t ipl;
+
+	ipl = spldisp();
+	ke_spinlock_enter_nospl(&dom->queues_lock);
+	limit = MIN2(dom->dirty_n, n * 4);
+
+	while (written + ncluster < n && scanned++ < limit) {
+		vm_page_t *page = TAILQ_FIRST(&dom->dirty_q);
+		vm_object_t *obj;
+		vnode_t *vn;
+		sg_seg_t seg;
+		sg_list_t sgl;
+		iop_t *iop;
+
+		if (page == NULL)
+			break;
+
+		TAILQ_REMOVE(&dom->dirty_q, page, qlink);
+
+		if (page->use != VM_PAGE_FILE && !(swap && is_anon(page))) {
+			TAILQ_INSERT_TAIL(&dom->dirty_q, page, qlink);
+			continue;
+		}
+
+		/* retain it, as in vm_page_reclaim() */
+		page->ref_count = 1;
+		dom->dirty_n--;
+		dom->active_n++;
+
+		if (is_anon(page)) {
+			cluster[ncluster++] = page;
+			if (ncluster < SWAP_CLUSTER_MAX)
+				continue;
+
+			ke_spinlock_exit_nospl(&dom->queues_lock);
+			splx(ipl);
+			written += write_anon_cluster(cluster, ncluster);
+			ncluster = 0;
+			ipl = spldisp();
+			ke_spinlock_enter_nospl(&dom->queues_lock);
+			continue;
+		}
+
+		obj = page->owner_obj;
+
+		ke_spinlock_exit_nospl(&dom->queues_lock);
+
+		ke_spinlock_enter_nospl(&obj->stealing_lock);
+		if (page->use != VM_PAGE_FILE || page->owner_obj != obj) {
+			/* truncated away meanwhile */
+			ke_spinlock_exit_nospl(&obj->stealing_lock);
+			vm_page_release(page);
+			ke_spinlock_enter_nospl(&dom->queues_lock);
+			continue;
+		}
+
+		/* keep the vnode about for the I/O */
+		vn = vn_retain(obj->vnobj.vnode);
+
+		/*
+		 * Clear the dirty status before the I/O, so that dirtying it
+		 * again meanwhile puts it back on the modified list.
+		 */
+		if (page->shared.share_count == 0)
+			page->shared.dirty = 0;
+		ke_spinlock_enter_nospl(&dom->queues_lock);
+		page->dirty = 0;
+		ke_spinlock_exit_nospl(&dom->queues_lock);
+		ke_spinlock_exit_nospl(&obj->stealing_lock);
+
+		splx(ipl);
+
+		seg.paddr = VM_PAGE_PADDR(page);
+		seg.length = PGSIZE;
+		sgl.elems = &seg;
+		sgl.elems_n = 1;
+
+		VOP_PAGING_ENTER(vn);
+		iop = iop_new_write(vn, &sgl, 0, PGSIZE,
+		    (io_off_t)page->shared.offset << PGSHIFT);
+		iop_send_sync(iop);
+		VOP_PAGING_EXIT(vn);
+		iop_free(iop);
+
+		vm_page_release(page);
+		vn_release(vn);
+		written++;
+
+		ipl = spldisp();
+		ke_spinlock_enter_nospl(&dom->queues_lock);
+	}
+
+	ke_spinlock_exit_nospl(&dom->queues_lock);
+	splx(ipl);
+
+	if (ncluster > 0)
+		written += write_anon_cluster(cluster, ncluster);
+
+	return written;
+}
+
+#ifdef PMAP_SUPERPAGE_LEVEL
+/*
+ * Superpages aren't on the active leaf tables, so age them here instead,
+ * demoting those found idle (or all, if forced) so that their pages go onto
+ * the active leaf tables to be trimmed. They're all private anonymous memory,
+ * which is only worth trimming with swap to put it in.
+ */
+static void
+ws_trim_superpages(vm_map_t *map, bool force)
+{
+	vm_rs_t *rs = &map->rs;
+	struct vm_map_entry *entry;
+	size_t n_left = rs->superpages_n;
+
+	RB_FOREACH(entry, vm_map_tree, &map->entries) {
+		vaddr_t vaddr;
+
+		if (entry->is_phys || entry->object != NULL)
+			continue;
+
+		for (vaddr = roundup2(entry->start, PMAP_SUPERPAGE_SIZE);
+		     n_left > 0 && vaddr + PMAP_SUPERPAGE_SIZE <= entry->end;
+		     vaddr += PMAP_SUPERPAGE_SIZE) {
+			int r = pmap_superpage_trim(map, rs, vaddr, force);
+
+			if (r < 0)
+				continue;
+			n_left--;
+			if (r > 0)
+				stats.superpages_demoted++;
+		}
+
+		if (n_left == 0)
+			break;
+	}
+}
+#endif
+
+/*
+ * Trim the pages a process has mapped: those accessed since the last trim have
+ * their accessed bit cleared, and the others are unmapped (as are all of them
+ * if force is set.) Anonymous pages are only trimmed if there's swap. Returns
+ * the number unmapped.
+ */
+static size_t
+ws_trim(vm_map_t *map, bool force)
+{
+	vm_rs_t *rs = &map->rs;
+	vm_page_t *table, *next;
+	size_t n_trimmed = 0;
+	bool swap = vm_swap_enabled();
+	ipl_t ipl;
+
+	ke_rwlock_enter_read(&map->map_lock, "ws_trim");
+	ipl = spldisp();
+	ke_spinlock_enter_nospl(&map->creation_lock);
+	ke_spinlock_enter_nospl(&map->stealing_lock);
+
+#ifdef PMAP_SUPERPAGE_LEVEL
+	/* demoted superpages' tables go on the tail, to be walked below */
+	if (swap && rs->superpages_n > 0)
+		ws_trim_superpages(map, force);
+#endif
+
+	for (table = TAILQ_FIRST(&rs->active_leaf_tables); table != NULL;
+	     table = next) {
+		pte_t *ptes = (pte_t *)vm_page_hhdm_addr(table);
+		vaddr_t base = (vaddr_t)table->proctable.base << PGSHIFT;
+		vaddr_t aged_start = 0, aged_end = 0;
+		struct vm_map_entry *entry = NULL;
+		size_t n = 0, n_zeroed = 0, n_forked = 0;
+
+		/* only ancestors of the table can be freed below */
+		next = TAILQ_NEXT(table, qlink);
+
+		for (size_t i = 0; i < PGSIZE / sizeof(pte_t); i++) {
+			vaddr_t vaddr = base + (i << PGSHIFT);
+			pte_t pte = pmap_load_pte(&ptes[i]);
+			vm_page_t *page;
+
+			if (pmap_pte_characterise(pte) != kPTEKindHW)
+				continue;
+
+			/* don't look up the vm_page of a physical mapping */
+			if (entry == NULL || vaddr >= entry->end)
+				entry = vm_map_lookup(map, vaddr);
+			if (entry == NULL || entry->is_phys)
+				continue;
+
+			page = pmap_pte_hwleaf_page(pte, PMAP_L0);
+			if (page->use != VM_PAGE_FILE &&
+			    !(swap && is_anon(page)))
+				continue;
+
+			if (!force && pmap_pte_hwleaf_accessed(pte)) {
+				pmap_pte_hwleaf_clear_accessed(&ptes[i]);
+				if (aged_end == 0)
+					aged_start = vaddr;
+				aged_end = vaddr + PGSIZE;
+				stats.ptes_aged++;
+				continue;
+			}
+
+			if (page->use == VM_PAGE_FILE)
+				n_zeroed++;
+			else if (page->use == VM_PAGE_ANON_FORKED)
+				n_forked++;
+			rs_evict_leaf_pte(rs, vaddr, page, &ptes[i]);
+			n++;
+		}
+
+		if (aged_end != 0)
+			pmap_tlb_flush_range(map, aged_start, aged_end);
+
+		if (n == 0)
+			continue;
+
+		rs->valid_n -= n;
+		table->proctable.valid_pageable_leaf_ptes -= n;
+		if (table->proctable.valid_pageable_leaf_ptes == 0)
+			TAILQ_REMOVE(&rs->active_leaf_tables, table, qlink);
+		/*
+		 * Transition PTEs count just as valid ones did. Zeroing can
+		 * only free the table if there were no fork PTEs made, which
+		 * are nonzero, so the table is still there for them after.
+		 */
+		if (n_zeroed > 0)
+			pmap_valid_ptes_zeroed(rs, table, n_zeroed);
+		if (n_forked > 0)
+			pmap_ptes_became_swappable(rs, table, n_forked);
+		n_trimmed += n;
+	}
+
+	ke_spinlock_exit_nospl(&map->stealing_lock);
+	ke_spinlock_exit_nospl(&map->creation_lock);
+	splx(ipl);
+	ke_rwlock_exit_read(&map->map_lock);
+
+	return n_trimmed;
+}
+
+/*
+ * Trim the working sets of up to PAGEOUT_MAPS_MAX processes, carrying on from
+ * where the last call left off.
+ */
+static void
+trim_working_sets(bool force)
+{
+	vm_map_t *maps[PAGEOUT_MAPS_MAX];
+	size_t nmaps = 0;
+	proc_t *proc;
+
+	ke_mutex_enter(&proctree_mutex, "trim_working_sets");
+	TAILQ_FOREACH(proc, &allproc, allproc_qlink) {
+		vm_map_t *map = proc->vm_map;
+
+		if (proc == &proc0 || proc->exited || map == NULL ||
+		    proc->pid < trim_next_pid)
+			continue;
+
+		/* maps aren't freed while referenced */
+		atomic_fetch_add_explicit(&map->refcnt, 1,
+		    memory_order_relaxed);
+		maps[nmaps++] = map;
+
+		if (nmaps == PAGEOUT_MAPS_MAX) {
+			trim_next_pid = proc->pid + 1;
+			break;
+		}
+	}
+	if (nmaps < PAGEOUT_MAPS_MAX)
+		trim_next_pid = 0;
+	ke_mutex_exit(&proctree_mutex);
+
+	for (size_t i = 0; i < nmaps; i++) {
+		stats.ptes_trimmed += ws_trim(maps[i], force);
+		vm_map_release(maps[i]);
+	}
+}
+
+/*
+ * One pass of the balance set manager. Returns true if it freed pages but some
+ * domain is still short, i.e. it's worth another pass straight away.
+ */
+static bool
+pageout_pass(void)
+{
+	size_t freed = 0;
+	bool shortage = false, urgent = false;
+	ipl_t ipl;
+
+	stats.passes++;
+
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
+		vm_domain_t *dom = &vm_domains[dom_i];
+		size_t free_n = vm_domain_free_n(dom), want, got;
+
+		/* don't let the modified list grow without bound */
+		if (dom->dirty_n > dom->total_n / 16)
+			stats.written += write_modified(dom, PAGEOUT_WRITE_MAX);
+
+		if (free_n >= dom->high_free)
+			continue;
+
+		want = dom->high_free - free_n;
+
+		ipl = spldisp();
+		got = vm_page_reclaim(dom, want);
+		splx(ipl);
+
+		if (got < want) {
+			stats.written += write_modified(dom,
+			    MIN2(want - got, PAGEOUT_WRITE_MAX));
+			ipl = spldisp();
+			got += vm_page_reclaim(dom, want - got);
+			splx(ipl);
+		}
+
+		freed += got;
+
+		if (got < want) {
+			shortage = true;
+			if (free_n + got < dom->min_free)
+				urgent = true;
+		}
+	}
+
+	/* trimmed pages are reclaimed by the next pass */
+	if (shortage) {
+		stats.views_trimmed += viewcache_trim(PAGEOUT_VIEWS_MAX);
+		trim_working_sets(urgent);
+	}
+
+	stats.reclaimed += freed;
+
+	return freed > 0 && shortage;
+}
+
+static void
+pageout_thread_fn(void *)
+{
+	bool again = false;
+
+	while (true) {
+		if (!again)
+			ke_wait1(&pageout_ev, "pageout_thread", false,
+			    ke_time() + NS_PER_S);
+
+		__atomic_store_n(&pageout_kicked, false, __ATOMIC_RELAXED);
+		ke_event_set_signalled(&pageout_ev, false);
+		ke_event_set_signalled(&pages_avail_ev, false);
+
+		again = pageout_pass();
+
+		ke_event_set_signalled(&pages_avail_ev, true);
+	}
+}
+
+/*!
+ * @brief Set the domains' watermarks and start the balance set manager.
+ *
+ * The min watermark is 1/256 of a domain's memory, but at least 64 pages; the
+ * low and high are twice and thrice that.
+ */
+void
+vm_pageout_init(void)
+{
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
+		vm_domain_t *dom = &vm_domains[dom_i];
+		size_t total = dom->total_n;
+
+		dom->min_free = MIN2(MAX2(total / 256, 64), total / 8);
+		dom->low_free = dom->min_free * 2;
+		dom->high_free = dom->min_free * 3;
+	}
+
+	ke_event_init(&pageout_ev, false);
+	ke_event_init(&pages_avail_ev, false);
+
+	pageout_thread = proc_new_system_thread(pageout_thread_fn, NULL);
+	ke_thread_resume(&pageout_thread->kthread, false);
+}
+
+void
+dbg_vm_pageout_dump(void)
+{
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
+		vm_domain_t *dom = &vm_domains[dom_i];
+
+		kdprintf("dom %zu: %zu free (min %zu, low %zu, high %zu), "
+			 "%zu standby, %zu modified\n",
+		    dom_i, vm_domain_free_n(dom), dom->min_free, dom->low_free,
+		    dom->high_free, dom->stby_n, dom->dirty_n);
+	}
+
+	kdprintf("%zu passes: %zu pages reclaimed, %zu written, "
+		 "%zu views trimmed, %zu PTEs aged, %zu PTEs trimmed, "
+		 "%zu superpages demoted; %zu allocation waits\n",
+	    stats.passes, stats.reclaimed, stats.written, stats.views_trimmed,
+	    stats.ptes_aged, stats.ptes_trimmed, stats.superpages_demoted,
+	    stats.waits);
+}
@@ -5,14 +5,37 @@
 /*!
  * @file phys.c
  * @brief Physical memory management.
+ *
+ * Free pages are kept on per-domain buddy freelists, guarded by the domain's
+ * queues lock. Small orders are also cached per-CPU (see struct vm_pcp): a
+ * CPU's cache is refilled with PCP_LOW pages when empty, and drained back to
+ * PCP_LOW once it holds more than PCP_HIGH.
+ *
+ * Idle CPUs also zero free order-0 pages into a per-domain pool, from which
+ * VM_ZERO allocations are satisfied without zeroing in the fault path.
+ *
+ * Pages which are allocated but not in use (mapped or otherwise referenced)
+ * sit on their domain's standby list if clean or the modified list if dirty,
+ * whence they are reclaimed when free memory runs short; see vm/pageout.c.
+ *
+ * On NUMA machines the firmware tells us (before memory is added) which
+ * domain each range of memory and each CPU belongs to, and how far apart the
+ * domains are. Memory is added to its domain's freelists in blocks that never
+ * straddle domains, so buddies are always of the same domain. Allocations are
+ * by default from the current CPU's domain, falling back to the others
+ * nearest first.
  */
 
+#include <sys/errno.h>
+#include <sys/k_cpu.h>
 #include <sys/k_log.h>
 #include <sys/k_types.h>
+#include <sys/kmem.h>
 #include <sys/pmap.h>
 
 #include <libkern/lib.h>
 
+#include "vm/map.h"
 #include "vm/page.h"
 
 struct vm_affinity {
@@ -23,11 +46,27 @@ struct vm_affinity {
 
 vm_page_t *vm_pages = (vm_page_t *)RPT_BASE;
 
-vm_domain_t vm_domains[1];
+struct vm_cpu_affinity {
+	uint32_t arch_cpu_id;
+	uint8_t domain;
+};
+
+vm_domain_t vm_domains[VM_MAX_DOMAINS];
 size_t highest_domid = 0;
 
-struct vm_affinity affinities[1] = { { 0, UINTPTR_MAX, 0 } };
-size_t naffinities = 1;
+/* memory no affinity covers belongs to domain 0 */
+static struct vm_affinity affinities[VM_MAX_AFFINITIES];
+static size_t naffinities = 0;
+
+/* CPUs no affinity covers also belong to domain 0 */
+static struct vm_cpu_affinity cpu_affinities[256];
+static size_t ncpu_affinities = 0;
+
+#define PCP_LOW(order) MAX2(16 >> (order), 2)
+#define PCP_HIGH(order) MAX2(64 >> (order), 8)
+
+/* how many pre-zeroed pages the idle loop keeps in each domain's pool */
+#define ZERO_TARGET 1024
 
 uint32_t
 log2(uint32_t val)
@@ -64,56 +103,183 @@ vm_page_paddr(vm_page_t *page)
 	return (page - vm_pages) << PGSHIFT;
 }
 
+/*!
+ * @brief Note that physical memory from \p base to \p limit belongs to domain
+ * \p domid. Must be called before vm_phys_init() adds the memory.
+ */
 void
-vmp_region_add(paddr_t base, paddr_t limit)
+vm_phys_affinity_add(paddr_t base, paddr_t limit, vm_domid_t domid)
 {
-	if (base == limit)
+	kassert(domid < VM_MAX_DOMAINS, "bad domain id");
+
+	if (naffinities == elementsof(affinities)) {
+		kdprintf("vm_phys_affinity_add: too many affinities, "
+			 "0x%zx-0x%zx goes in domain 0\n", base, limit);
 		return;
+	}
 
-	for (size_t aff_i = 0; aff_i < naffinities; aff_i++) {
-		struct vm_affinity *aff = &affinities[aff_i];
-		struct vm_domain *dom = &vm_domains[aff->domain];
-		paddr_t region_base, region_limit;
+	affinities[naffinities++] = (struct vm_affinity) {
+		.base = rounddown2(base, PGSIZE),
+		.limit = rounddown2(limit, PGSIZE),
+		.domain = domid,
+	};
+}
 
-		if (limit <= aff->base || base >= aff->limit)
-			continue;
+/*! @brief Note that the CPU with some arch ID belongs to domain \p domid. */
+void
+vm_phys_cpu_affinity_add(uint32_t arch_cpu_id, vm_domid_t domid)
+{
+	kassert(domid < VM_MAX_DOMAINS, "bad domain id");
 
-		if (aff->domain > highest_domid)
-			highest_domid = aff->domain;
+	if (ncpu_affinities == elementsof(cpu_affinities)) {
+		kdprintf("vm_phys_cpu_affinity_add: too many affinities, "
+			 "CPU %u goes in domain 0\n", arch_cpu_id);
+		return;
+	}
+
+	cpu_affinities[ncpu_affinities++] = (struct vm_cpu_affinity) {
+		.arch_cpu_id = arch_cpu_id,
+		.domain = domid,
+	};
+}
+
+/*! @brief Set the relative distance of domain \p to from domain \p from. */
+void
+vm_phys_distance_set(vm_domid_t from, vm_domid_t to, uint8_t distance)
+{
+	kassert(from < VM_MAX_DOMAINS && to < VM_MAX_DOMAINS, "bad domain id");
+	vm_domains[from].distance[to] = distance;
+}
 
-		region_base = MAX2(base, aff->base);
-		region_limit = MIN2(limit, aff->limit);
+/*!
+ * @brief Get the domain a CPU should allocate from by default.
+ *
+ * A CPU in a domain without memory (or none we know of) gets domain 0.
+ */
+vm_domid_t
+vm_phys_cpu_domain(uint32_t arch_cpu_id)
+{
+	for (size_t i = 0; i < ncpu_affinities; i++) {
+		struct vm_cpu_affinity *aff = &cpu_affinities[i];
 
-		kdprintf("vm_region_add: 0x%zx-0x%zx (%zu kib; domid %d)\n",
-		    region_base, region_limit,
-		    (region_limit - region_base) / 1024, aff->domain);
+		if (aff->arch_cpu_id != arch_cpu_id)
+			continue;
+		if (aff->domain > highest_domid)
+			return 0;
+		return aff->domain;
+	}
 
-		for (paddr_t i = region_base; i < region_limit; i += PGSIZE) {
-			pfn_t pfn = i >> PGSHIFT;
-			vm_page_t *page = &vm_pages[pfn];
-			size_t order = MIN2(FREELIST_ORDERS - 1,
-			    __builtin_ctz(pfn));
+	return 0;
+}
 
-			while ((i + (1 << order) * PGSIZE) > region_limit)
-				order--;
+/*!
+ * @brief Find the domain of the memory at \p addr, and where the run of memory
+ * in that domain starting there ends.
+ */
+static vm_domid_t
+affinity_lookup(paddr_t addr, paddr_t *limit)
+{
+	paddr_t next = UINTPTR_MAX;
 
-			page->domain = aff->domain;
-			page->order = order;
-			page->on_freelist = false;
-		}
+	for (size_t i = 0; i < naffinities; i++) {
+		struct vm_affinity *aff = &affinities[i];
 
-		for (paddr_t i = region_base; i < region_limit;) {
-			vm_page_t *page = &vm_pages[i >> PGSHIFT];
-			TAILQ_INSERT_HEAD(&dom->free_q[page->order], page,
-			    qlink);
-			dom->free_n[page->order]++;
-			i += (1 << page->order) * PGSIZE;
-			page->on_freelist = true;
-			page->max_order = page->order;
+		if (addr >= aff->base && addr < aff->limit) {
+			*limit = aff->limit;
+			return aff->domain;
 		}
 
-		dom->use_n[VM_PAGE_FREE] += (region_limit - region_base) /
-		    PGSIZE;
+		if (aff->base > addr && aff->base < next)
+			next = aff->base;
+	}
+
+	*limit = next;
+	return 0;
+}
+
+static void
+region_add(paddr_t base, paddr_t limit, vm_domid_t domid)
+{
+	struct vm_domain *dom = &vm_domains[domid];
+
+	if (domid > highest_domid)
+		highest_domid = domid;
+
+	kdprintf("vm_region_add: 0x%zx-0x%zx (%zu kib; domid %d)\n", base,
+	    limit, (limit - base) / 1024, domid);
+
+	for (paddr_t i = base; i < limit; i += PGSIZE) {
+		pfn_t pfn = i >> PGSHIFT;
+		vm_page_t *page = &vm_pages[pfn];
+		size_t order = MIN2(FREELIST_ORDERS - 1, __builtin_ctz(pfn));
+
+		while ((i + (1 << order) * PGSIZE) > limit)
+			order--;
+
+		/* so split blocks can coalesce again when freed */
+		page->domain = domid;
+		page->order = order;
+		page->max_order = order;
+		page->on_freelist = false;
+	}
+
+	for (paddr_t i = base; i < limit;) {
+		vm_page_t *page = &vm_pages[i >> PGSHIFT];
+		TAILQ_INSERT_HEAD(&dom->free_q[page->order], page, qlink);
+		dom->free_n[page->order]++;
+		i += (1 << page->order) * PGSIZE;
+		page->on_freelist = true;
+	}
+
+	dom->use_n[VM_PAGE_FREE] += (limit - base) / PGSIZE;
+	dom->total_n += (limit - base) / PGSIZE;
+}
+
+void
+vmp_region_add(paddr_t base, paddr_t limit)
+{
+	while (base < limit) {
+		paddr_t run_limit;
+		vm_domid_t domid = affinity_lookup(base, &run_limit);
+
+		run_limit = MIN2(run_limit, limit);
+		region_add(base, run_limit, domid);
+		base = run_limit;
+	}
+}
+
+/*!
+ * @brief Work out each domain's fallback order: itself, then the others
+ * nearest first. Distances the firmware didn't give are taken as 10 for
+ * local and 20 for remote, as in the SLIT.
+ */
+void
+vmp_domains_order(void)
+{
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
+		vm_domain_t *dom = &vm_domains[dom_i];
+		size_t n = 0;
+
+		for (size_t i = 0; i <= highest_domid; i++)
+			if (dom->distance[i] == 0)
+				dom->distance[i] = i == dom_i ? 10 : 20;
+
+		dom->fallback[n++] = dom_i;
+		for (size_t i = 0; i <= highest_domid; i++) {
+			size_t j;
+
+			if (i == dom_i)
+				continue;
+
+			/* insertion sort; ties stay in domain order */
+			for (j = n; j > 1 &&
+			     dom->distance[dom->fallback[j - 1]] >
+				 dom->distance[i];
+			     j--)
+				dom->fallback[j] = dom->fallback[j - 1];
+			dom->fallback[j] = i;
+			n++;
+		}
 	}
 }
 
@@ -177,35 +343,33 @@ vmp_range_unfree(paddr_t base, paddr_t limit)
 	base = rounddown2(base, PGSIZE);
 	limit = roundup2(limit, PGSIZE);
 
-	for (size_t aff_i = 0; aff_i < naffinities; aff_i++) {
-		struct vm_affinity *aff = &affinities[aff_i];
-		paddr_t region_base, region_limit;
+	/* free blocks never straddle domains, so neither may these */
+	while (base < limit) {
+		paddr_t run_limit;
 
-		if (limit <= aff->base || base >= aff->limit)
-			continue;
+		(void)affinity_lookup(base, &run_limit);
+		run_limit = MIN2(run_limit, limit);
 
-		region_base = MAX2(base, aff->base);
-		region_limit = MIN2(limit, aff->limit);
-
-		for (paddr_t i = region_base; i < region_limit;) {
+		for (paddr_t i = base; i < run_limit;) {
 			vm_page_t *page = VM_PAGE_FOR_PADDR(i);
 			size_t order = MIN2(FREELIST_ORDERS - 1,
 			    __builtin_ctz(i / PGSIZE));
 
-			while ((i + (1 << order) * PGSIZE) > region_limit)
+			while ((i + (1 << order) * PGSIZE) > run_limit)
 				order--;
 
 			vmp_page_unfree(page, order);
 			i += (1 << order) * PGSIZE;
 		}
+
+		base = run_limit;
 	}
 }
 
-static int
-dom_page_alloc(vm_domain_t *dom, vm_page_t **out, size_t order,
-    enum vm_page_use use, enum vm_alloc_flags flags)
+/*! @brief Take a block off the buddy freelists. Queues lock held. */
+static vm_page_t *
+buddy_alloc(vm_domain_t *dom, size_t order)
 {
-	size_t npages = 1 << order;
 	size_t desired_order = order;
 	vm_page_t *page;
 
@@ -214,7 +378,7 @@ dom_page_alloc(vm_domain_t *dom, vm_page_t **out, size_t order,
 	while (TAILQ_EMPTY(&dom->free_q[order])) {
 		kassert(dom->free_n[order] == 0, "domain freelist mismatch");
 		if (++order == FREELIST_ORDERS)
-			kfatal("dom_page_alloc: out of pages\n");
+			return NULL;
 	}
 
 	while (order != desired_order) {
@@ -243,6 +407,39 @@ dom_page_alloc(vm_domain_t *dom, vm_page_t **out, size_t order,
 	page->on_freelist = false;
 	dom->free_n[order]--;
 
+	return page;
+}
+
+/*!
+ * @brief Take a page from the domain's pool of pre-zeroed pages, if there is
+ * one. Queues lock held.
+ */
+static vm_page_t *
+zero_q_alloc(vm_domain_t *dom)
+{
+	vm_page_t *page = TAILQ_FIRST(&dom->zero_q);
+
+	if (page != NULL) {
+		TAILQ_REMOVE(&dom->zero_q, page, qlink);
+		dom->zero_n--;
+	}
+
+	return page;
+}
+
+static int
+dom_page_alloc(vm_domain_t *dom, vm_page_t **out, size_t order,
+    enum vm_page_use use, enum vm_alloc_flags flags)
+{
+	size_t npages = 1 << order;
+	vm_page_t *page;
+
+	page = buddy_alloc(dom, order);
+	if (page == NULL && order == 0)
+		page = zero_q_alloc(dom);
+	if (page == NULL)
+		return -ENOMEM;
+
 	page->ref_count = 1;
 	page->use = use;
 	page->dirty = 0;
@@ -255,54 +452,226 @@ dom_page_alloc(vm_domain_t *dom, vm_page_t **out, size_t order,
 	return 0;
 }
 
+/*! @brief Fold a CPU cache's counter changes into its domain's. */
+static void
+pcp_fold(vm_domain_t *dom, struct vm_pcp *pcp)
+{
+	kassert(ke_spinlock_held(&dom->queues_lock));
+
+	for (size_t i = 0; i < VM_PAGE_USE_N; i++) {
+		dom->use_n[i] += pcp->use_delta[i];
+		pcp->use_delta[i] = 0;
+	}
+	dom->active_n += pcp->active_delta;
+	pcp->active_delta = 0;
+}
+
+/*!
+ * @brief Count a domain's free pages, including those in per-CPU caches.
+ * No lock is needed for an estimate.
+ */
+size_t
+vm_domain_free_n(vm_domain_t *dom)
+{
+	struct vm_pcp *pcp = __atomic_load_n(&dom->pcp, __ATOMIC_ACQUIRE);
+	size_t n = __atomic_load_n(&dom->zero_n, __ATOMIC_RELAXED);
+
+	for (size_t i = 0; i < FREELIST_ORDERS; i++)
+		n += __atomic_load_n(&dom->free_n[i], __ATOMIC_RELAXED) << i;
+
+	if (pcp == NULL)
+		return n;
+
+	for (size_t cpu = 0; cpu < ke_ncpu; cpu++)
+		for (size_t i = 0; i < PCP_ORDERS; i++)
+			n += __atomic_load_n(&pcp[cpu].n[i],
+			    __ATOMIC_RELAXED) << i;
+
+	return n;
+}
+
+/*! @brief Wake the balance set manager if a domain is short of free pages. */
+static inline void
+low_check(vm_domain_t *dom)
+{
+	if (unlikely(vm_domain_free_n(dom) < dom->low_free))
+		vm_pageout_wakeup();
+}
+
+/*!
+ * @brief Allocate a page from the current CPU's cache, refilling it from the
+ * buddy freelists if it's empty. Called at IPL_DISP.
+ */
+static vm_page_t *
+pcp_alloc(vm_domain_t *dom, size_t order, enum vm_page_use use)
+{
+	struct vm_pcp *pcp = &dom->pcp[CPU_LOCAL_LOAD(cpu_num)];
+	vm_page_t *page;
+
+	page = TAILQ_FIRST(&pcp->q[order]);
+	if (likely(page != NULL)) {
+		pcp->hits++;
+	} else {
+		pcp->misses++;
+
+		ke_spinlock_enter_nospl(&dom->queues_lock);
+		pcp_fold(dom, pcp);
+		for (size_t i = 0; i < PCP_LOW(order); i++) {
+			vm_page_t *fill = buddy_alloc(dom, order);
+			if (fill == NULL)
+				break;
+			TAILQ_INSERT_TAIL(&pcp->q[order], fill, qlink);
+			pcp->n[order]++;
+		}
+		ke_spinlock_exit_nospl(&dom->queues_lock);
+		low_check(dom);
+
+		page = TAILQ_FIRST(&pcp->q[order]);
+		if (page == NULL)
+			return NULL;
+	}
+
+	TAILQ_REMOVE(&pcp->q[order], page, qlink);
+	pcp->n[order]--;
+
+	page->ref_count = 1;
+	page->use = use;
+	page->dirty = 0;
+
+	pcp->use_delta[use] += 1 << order;
+	pcp->active_delta += 1 << order;
+
+	return page;
+}
+
+/*
+ * Take a page from the domain's pool of pre-zeroed pages, if there is one.
+ * The pool is often dry, so peek at it before taking the lock.
+ */
+static vm_page_t *
+zero_alloc(vm_domain_t *dom, vm_page_use_t use)
+{
+	vm_page_t *page;
+	ipl_t ipl;
+
+	if (__atomic_load_n(&dom->zero_n, __ATOMIC_RELAXED) == 0) {
+		__atomic_fetch_add(&dom->zero_misses, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	ipl = ke_spinlock_enter(&dom->queues_lock);
+	page = zero_q_alloc(dom);
+	if (page == NULL) {
+		ke_spinlock_exit(&dom->queues_lock, ipl);
+		__atomic_fetch_add(&dom->zero_misses, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	dom->zero_hits++;
+	page->ref_count = 1;
+	page->use = use;
+	page->dirty = 0;
+	dom->use_n[use]++;
+	dom->active_n++;
+	ke_spinlock_exit(&dom->queues_lock, ipl);
+
+	return page;
+}
+
 vm_page_t *
 vm_page_alloc(vm_page_use_t use, size_t order, vm_domid_t domid,
     vm_alloc_flags_t flags)
 {
 	vm_domain_t *dom;
 	ipl_t ipl;
-	vm_page_t *page;
+	vm_page_t *page = NULL;
 	int r;
 
 	if (domid == VM_DOMID_ANY || domid == VM_DOMID_LOCAL)
-		domid = 0;
+		domid = CPU_LOCAL_LOAD(vm_domid);
 
+retry:
 	dom = &vm_domains[domid];
 
-	ipl = ke_spinlock_enter(&dom->queues_lock);
-	r = dom_page_alloc(dom, &page, order, use, 0);
-	ke_spinlock_exit(&dom->queues_lock, ipl);
+	if ((flags & VM_ZERO) && order == 0) {
+		page = zero_alloc(dom, use);
+		if (page != NULL)
+			return page;
+	}
 
-	if (r == 0) {
-#if 1 /* detect forgetting to initialise */
-		memset((void *)vm_page_hhdm_addr(page), 0x99,
-		    (1 << page->order) << PGSHIFT);
-#endif
+	if (likely(order < PCP_ORDERS && dom->pcp != NULL)) {
+		ipl = spldisp();
+		page = pcp_alloc(dom, order, use);
+		splx(ipl);
+	}
 
-		return page;
-	} else
-		for (size_t i = 0; i < VM_MAX_DOMAINS; i++) {
-			size_t idx = (domid + i) % VM_MAX_DOMAINS;
-			dom = &vm_domains[idx];
+	if (likely(page != NULL)) {
+		r = 0;
+	} else {
+		ipl = ke_spinlock_enter(&dom->queues_lock);
+		r = dom_page_alloc(dom, &page, order, use, 0);
+		ke_spinlock_exit(&dom->queues_lock, ipl);
+		low_check(dom);
+	}
 
-			ipl = ke_spinlock_enter(&dom->queues_lock);
-			r = dom_page_alloc(dom, &page, order, use, flags);
-			ke_spinlock_exit(&dom->queues_lock, ipl);
+	if (r == 0)
+		goto found;
 
-			if (r == 0) {
-#if 1 /* detect forgetting to initialise */
-				memset((void *)vm_page_hhdm_addr(page), 0x99,
-				    (1 << page->order) << PGSHIFT);
-#endif
+	for (size_t i = 0; i <= highest_domid; i++) {
+		dom = &vm_domains[vm_domains[domid].fallback[i]];
 
-				return page;
-			}
-		}
+		ipl = ke_spinlock_enter(&dom->queues_lock);
+		r = dom_page_alloc(dom, &page, order, use, flags);
+		ke_spinlock_exit(&dom->queues_lock, ipl);
+		low_check(dom);
+
+		if (r == 0)
+			goto found;
+	}
+
+	/*
+	 * Nothing free anywhere. If we hold no spinlocks, we can wait for
+	 * pages to be reclaimed; otherwise the caller must back out and call
+	 * vm_page_wait() itself once it's dropped its locks.
+	 */
+	if (ke_ipl() == IPL_0 && vm_page_wait())
+		goto retry;
 
 	if (flags & VM_NOFAIL)
 		kfatal("out of pages\n");
 
 	return NULL;
+
+found:
+	if (flags & VM_ZERO)
+		memset((void *)vm_page_hhdm_addr(page), 0,
+		    (1 << page->order) << PGSHIFT);
+#if 1 /* detect forgetting to initialise */
+	else
+		memset((void *)vm_page_hhdm_addr(page), 0x99,
+		    (1 << page->order) << PGSHIFT);
+#endif
+
+	return page;
+}
+
+/*!
+ * @brief Split an allocated block into independent order-0 pages.
+ *
+ * Each page can then be freed on its own. They all take the head's use.
+ */
+void
+vm_page_split(vm_page_t *page)
+{
+	size_t npages = 1 << page->order;
+
+	for (size_t i = 0; i < npages; i++) {
+		page[i].order = 0;
+		page[i].on_freelist = false;
+		page[i].use = page->use;
+		page[i].dirty = 0;
+		page[i].ref_count = 1;
+	}
 }
 
 static vm_page_t *
@@ -312,8 +681,9 @@ page_buddy(vm_page_t *page)
 	return VM_PAGE_FOR_PADDR(paddr);
 }
 
+/*! @brief Return a block to the buddy freelists. Queues lock held. */
 static void
-dom_page_free(vm_domain_t *dom, vm_page_t *page)
+buddy_free(vm_domain_t *dom, vm_page_t *page)
 {
 	memset((void *)vm_page_hhdm_addr(page), 0,
 	    (1 << page->order) << PGSHIFT);
@@ -351,12 +721,172 @@ dom_page_free(vm_domain_t *dom, vm_page_t *page)
 #endif
 }
 
+/*!
+ * @brief Free a page. Small orders go to the current CPU's cache, which is
+ * drained back to the buddy freelists if it's grown too big.
+ *
+ * The queues lock is held (our callers need it anyway, to manage the page's
+ * reference count and queues.)
+ *
+ * @returns The page's swap slot, if it had one. Its copy in swap dies with it,
+ * but the caller must free the slot only once it's dropped the queues lock,
+ * since freeing a slot may allocate memory.
+ */
+static uintptr_t
+dom_page_free(vm_domain_t *dom, vm_page_t *page)
+{
+	struct vm_pcp *pcp;
+	size_t order = page->order;
+	uintptr_t slot = page->swap_address;
+
+	page->swap_address = 0;
+
+	if (order >= PCP_ORDERS || dom->pcp == NULL) {
+		buddy_free(dom, page);
+		return slot;
+	}
+
+	pcp = &dom->pcp[CPU_LOCAL_LOAD(cpu_num)];
+
+#if 1 /* try to detect use-after-free */
+	memset((void *)vm_page_hhdm_addr(page), 0x66, (1 << order) << PGSHIFT);
+#endif
+
+	/* LIFO, so the next allocation gets a cache-warm page */
+	TAILQ_INSERT_HEAD(&pcp->q[order], page, qlink);
+	pcp->n[order]++;
+	pcp->frees++;
+
+	if (pcp->n[order] <= PCP_HIGH(order))
+		return slot;
+
+	pcp->drains++;
+	pcp_fold(dom, pcp);
+	while (pcp->n[order] > PCP_LOW(order)) {
+		page = TAILQ_LAST(&pcp->q[order], vm_page_queue);
+		TAILQ_REMOVE(&pcp->q[order], page, qlink);
+		pcp->n[order]--;
+		buddy_free(dom, page);
+	}
+
+	return slot;
+}
+
+void
+vm_phys_postsmp_init(void)
+{
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
+		vm_domain_t *dom = &vm_domains[dom_i];
+		struct vm_pcp *pcp;
+
+		pcp = kmem_xzalloc(sizeof(struct vm_pcp) * ke_ncpu, 0);
+		for (size_t cpu = 0; cpu < ke_ncpu; cpu++)
+			for (size_t i = 0; i < PCP_ORDERS; i++)
+				TAILQ_INIT(&pcp[cpu].q[i]);
+
+		__atomic_store_n(&dom->pcp, pcp, __ATOMIC_RELEASE);
+	}
+}
+
+/*!
+ * @brief Zero a free page for the pre-zeroed pool, if it wants one.
+ *
+ * Called by the idle loop, so pages are zeroed on otherwise idle CPUs rather
+ * than in the fault path. A CPU only fills its own domain's pool; zeroing
+ * remote memory would cost interconnect bandwidth for little gain.
+ *
+ * @returns true if a page was zeroed, i.e. it's worth calling again.
+ */
+bool
+vm_page_zero_idle(void)
+{
+	vm_domain_t *dom = &vm_domains[CPU_LOCAL_LOAD(vm_domid)];
+	vm_page_t *page;
+	ipl_t ipl;
+
+	if (__atomic_load_n(&dom->zero_n, __ATOMIC_RELAXED) >= ZERO_TARGET)
+		return false;
+
+	ipl = ke_spinlock_enter(&dom->queues_lock);
+	page = buddy_alloc(dom, 0);
+	ke_spinlock_exit(&dom->queues_lock, ipl);
+
+	if (page == NULL)
+		return false;
+
+	pmap_zero_page_nocache(page);
+
+	ipl = ke_spinlock_enter(&dom->queues_lock);
+	TAILQ_INSERT_TAIL(&dom->zero_q, page, qlink);
+	dom->zero_n++;
+	ke_spinlock_exit(&dom->queues_lock, ipl);
+
+	return true;
+}
+
+void
+dbg_vm_pcp_dump(void)
+{
+	kdprintf("%-4s %-3s %10s %10s %10s %8s %s\n", "cpu", "dom", "hits",
+	    "misses", "frees", "drains", "cached (by order)");
+
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
+		vm_domain_t *dom = &vm_domains[dom_i];
+
+		kdprintf("dom %zu: %zu pre-zeroed, %zu hits, %zu misses\n",
+		    dom_i, dom->zero_n, dom->zero_hits, dom->zero_misses);
+
+		if (dom->pcp == NULL)
+			continue;
+
+		for (size_t cpu = 0; cpu < ke_ncpu; cpu++) {
+			struct vm_pcp *pcp = &dom->pcp[cpu];
+
+			kdprintf("%-4zu %-3zu %10zu %10zu %10zu %8zu", cpu,
+			    dom_i, pcp->hits, pcp->misses, pcp->frees,
+			    pcp->drains);
+			for (size_t i = 0; i < PCP_ORDERS; i++)
+				kdprintf(" %zu", pcp->n[i]);
+			kdprintf("\n");
+		}
+	}
+}
+
+void
+dbg_vm_domains_dump(void)
+{
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
+		vm_domain_t *dom = &vm_domains[dom_i];
+		size_t free_n = 0;
+
+		for (size_t i = 0; i < FREELIST_ORDERS; i++)
+			free_n += dom->free_n[i] << i;
+
+		kdprintf("dom %zu: %zu free, %zu active, %zu standby, "
+			 "%zu dirty\n", dom_i, free_n, dom->active_n,
+		    dom->stby_n, dom->dirty_n);
+
+		kdprintf("  distances:");
+		for (size_t i = 0; i <= highest_domid; i++)
+			kdprintf(" %u", dom->distance[i]);
+		kdprintf("\n  fallback:");
+		for (size_t i = 0; i <= highest_domid; i++)
+			kdprintf(" %u", dom->fallback[i]);
+		kdprintf("\n  cpus:");
+		for (size_t cpu = 0; cpu < ke_ncpu; cpu++)
+			if (ke_cpu_data[cpu]->vm_domid == dom_i)
+				kdprintf(" %zu", cpu);
+		kdprintf("\n");
+	}
+}
+
 /* page owner lock (if there is one) should be held */
 void
 vm_page_delete(vm_page_t *page, bool unref)
 {
 	vm_domain_t *dom = &vm_domains[page->domain];
 	size_t npages = 1 << page->order;
+	uintptr_t slot = 0;
 	ipl_t ipl;
 	uint32_t refcnt;
 
@@ -386,12 +916,17 @@ vm_page_delete(vm_page_t *page, bool unref)
 			dom->active_n -= npages;
 		}
 
-		dom_page_free(dom, page);
+		slot = dom_page_free(dom, page);
 	} else {
+		/* freed when the last reference is released */
+		page->use = VM_PAGE_DELETED;
 		dom->use_n[VM_PAGE_DELETED] += 1 << page->order;
 	}
 
 	ke_spinlock_exit(&dom->queues_lock, ipl);
+
+	if (slot != 0)
+		vm_swap_free(slot, 1);
 }
 
 /* page owner lock (if there is one) should be held */
@@ -425,7 +960,8 @@ vm_page_retain(vm_page_t *page)
 	ke_spinlock_exit(&dom->queues_lock, ipl);
 }
 
-void
+/* returns a swap slot to free once the queues lock is dropped, or 0 */
+static uintptr_t
 vm_page_release_dom_locked(vm_page_t *page)
 {
 	vm_domain_t *dom = &vm_domains[page->domain];
@@ -440,8 +976,7 @@ vm_page_release_dom_locked(vm_page_t *page)
 		case VM_PAGE_KWIRED:
 			dom->active_n -= npages;
 			dom->use_n[page->use] -= npages;
-			dom_page_free(dom, page);
-			break;
+			return dom_page_free(dom, page);
 
 		case VM_PAGE_PRIVATE:
 		case VM_PAGE_ANON_SHARED:
@@ -466,6 +1001,8 @@ vm_page_release_dom_locked(vm_page_t *page)
 			    page->use);
 		}
 	}
+
+	return 0;
 }
 
 void
@@ -473,8 +1010,10 @@ vm_page_release(vm_page_t *page)
 {
 	vm_domain_t *dom = &vm_domains[page->domain];
 	ipl_t ipl = ke_spinlock_enter(&dom->queues_lock);
-	vm_page_release_dom_locked(page);
+	uintptr_t slot = vm_page_release_dom_locked(page);
 	ke_spinlock_exit(&dom->queues_lock, ipl);
+	if (slot != 0)
+		vm_swap_free(slot, 1);
 }
 
 void
@@ -482,6 +1021,8 @@ vm_page_release_and_dirty(vm_page_t *page, bool dirty)
 {
 	vm_domain_t *dom = &vm_domains[page->domain];
 	ipl_t ipl = ke_spinlock_enter(&dom->queues_lock);
+	uintptr_t slot;
+
 	if (dirty) {
 #if 0
 		if (!page->dirty && page->use == VM_PAGE_FILE)
@@ -490,8 +1031,10 @@ vm_page_release_and_dirty(vm_page_t *page, bool dirty)
 
 		page->dirty = 1;
 	}
-	vm_page_release_dom_locked(page);
+	slot = vm_page_release_dom_locked(page);
 	ke_spinlock_exit(&dom->queues_lock, ipl);
+	if (slot != 0)
+		vm_swap_free(slot, 1);
 }
 
 void
@@ -515,158 +1058,95 @@ vm_page_dirty(vm_page_t *page)
 	ke_spinlock_exit(&dom->queues_lock, ipl);
 }
 
-static vm_page_t *
-vm_page_steal(vm_page_use_t use, vm_domain_t *dom)
+/*!
+ * @brief Reclaim up to n pages from a domain's standby list, returning them to
+ * the freelists.
+ *
+ * File pages can always be read back in. Anonymous pages on the standby list
+ * have been written to swap, and are reclaimed by vm_swap_reclaim(). The
+ * others are rotated to the tail of the list and passed over.
+ *
+ * Called at IPL_DISP, holding no VM object's or map's locks.
+ *
+ * @returns the number of pages reclaimed.
+ */
+size_t
+vm_page_reclaim(vm_domain_t *dom, size_t n)
 {
-#if 0 /* not ready */
-	vm_page_t *page;
-	kspinlock_t *owner_lock;
-	pte_t *ppte;
-	union {
-		struct vm_rs *rs;
-		struct vm_object *obj;
-	} owner;
-	enum vm_page_use old_use;
+	size_t reclaimed = 0, scanned = 0, limit;
 
-	kassert(ke_spinlock_held(&dom->queues_lock),
-	    "domain queues lock must be held");
+	kassert(ke_ipl() == IPL_DISP);
 
-retry:
-	page = TAILQ_FIRST(&dom->stby_q);
-	if (page == NULL)
-		return NULL;
+	ke_spinlock_enter_nospl(&dom->queues_lock);
+	limit = dom->stby_n;
 
-	TAILQ_REMOVE(&dom->stby_q, page, qlink);
+	while (reclaimed < n && scanned++ < limit) {
+		vm_page_t *page = TAILQ_FIRST(&dom->stby_q);
+		vm_object_t *obj;
 
-	kassert_dbg(page->ref_count == 0, "page refcount not 0");
-	kassert_dbg(page->order == 0, "page order not 0");
-	kassert_dbg(!page->dirty, "page dirty");
+		if (page == NULL)
+			break;
 
-	switch (page->use) {
-#if 0
-	case VM_PAGE_TABLE:
-	case VM_PAGE_PRIVATE:
-		owner.rs = page->owner_rs;
-		owner_lock = &owner.rs->map->stealing_lock;
-		break;
-
-	case VM_PAGE_OBJ_TABLE:
-	case VM_PAGE_ANON_SHARED:
-	case VM_PAGE_FILE:
-		owner.obj = page->owner_obj;
-		owner_lock = &owner.obj->stealing_lock;
-		break;
-#endif
+		kassert_dbg(page->ref_count == 0, "page refcount not 0");
+		kassert_dbg(!page->dirty, "page dirty");
 
-	default:
-		kfatal("Pages of kind %d should not be on standby queue\n",
-		    page->use);
-	}
-	old_use = page->use;
+		TAILQ_REMOVE(&dom->stby_q, page, qlink);
 
-	page->ref_count++;
-	ppte = page->pte;
+		if (page->use != VM_PAGE_FILE &&
+		    page->use != VM_PAGE_PRIVATE &&
+		    page->use != VM_PAGE_ANON_FORKED) {
+			TAILQ_INSERT_TAIL(&dom->stby_q, page, qlink);
+			continue;
+		}
 
-	dom->stby_n -= 1 << page->order;
-	dom->active_n += 1 << page->order;
+		/* retain it, so it stays ours while we drop the queues lock */
+		page->ref_count = 1;
+		dom->stby_n--;
+		dom->active_n++;
 
-	ke_spinlock_exit_nospl(&dom->queues_lock);
-
-	/*
-	 * We can safely acquire the owner's lock, because VM objects and RS
-	 * structures are RCU type-stable.
-	 */
+		if (page->use != VM_PAGE_FILE) {
+			ke_spinlock_exit_nospl(&dom->queues_lock);
+			if (vm_swap_reclaim(page))
+				reclaimed++;
+			ke_spinlock_enter_nospl(&dom->queues_lock);
+			continue;
+		}
 
-	ke_spinlock_enter_nospl(owner_lock);
-	ke_spinlock_enter_nospl(&dom->queues_lock);
+		obj = page->owner_obj;
 
-	if (page->ref_count != 1 || page->pte != ppte || page->use != old_use) {
-		kdprintf("note: page changed before it could be stolen\n");
-		vm_page_release_dom_locked(page);
-		ke_spinlock_exit_nospl(owner_lock);
-		goto retry;
-	}
+		ke_spinlock_exit_nospl(&dom->queues_lock);
 
-	switch (old_use) {
-	case VM_PAGE_TABLE:
-		kfatal("vm_page_steal: page table page being stolen!\n");
-	case VM_PAGE_PRIVATE: {
-		vm_page_t *table_page = VM_PAGE_FOR_HHDM_ADDR((vaddr_t)ppte);
-		pte_t pte = pmap_load_pte(ppte);
-		kassert(pmap_pte_characterise(pte) == kPTEKindTrans, "page use not transitional");
-		pmap_pte_soft_create(pte, kPTEKindSwap, page->swap_address,
-		    false);
 		/*
-		 * TODO: Figure out if it's fine to drop the queues lock - I
-		 * think it is!
-		 *
-		 * We drop it because the did-become-zero/swap cases sometimes
-		 * delete table pages.
+		 * The object can't go away while it owns a page. Once we hold
+		 * its lock, the page can't be mapped again, and if it's still
+		 * the object's and not mapped, only we reference it.
 		 */
-		ke_spinlock_exit_nospl(&dom->queues_lock);
-		pmap_table_pte_did_become_swap(table_page);
-		break;
-	}
-
-	case VM_PAGE_OBJ_TABLE: {
-		vm_page_t *table_page = VM_PAGE_FOR_HHDM_ADDR((vaddr_t)pte);
-		kassert(pmap_pte_characterise(pte) == kPTEKindTrans);
-		pmap_pte_soft_create(pte, kPTEKindSwap, page->swap_address,
-		    false);
-		ke_spinlock_exit_nospl(&dom->queues_lock);
-		obj_table_pte_did_become_swap(owner.obj, table_page);
-		break;
-	}
-
-	case VM_PAGE_ANON_SHARED: {
-		kassert(pmap_pte_characterise(pte) == kPTEKindHW);
-		pmap_pte_soft_create(page->pte, kPTEKindSwap,
-		    page->swap_address, false);
-		ke_spinlock_exit_nospl(&dom->queues_lock);
-		obj_page_swapped(owner.obj, page);
-		break;
-	}
-
-	case VM_PAGE_FILE: {
-		kassert(pmap_pte_characterise(pte) == kPTEKindHW);
-		pmap_pte_hw_create_zero(pte);
-		ke_spinlock_exit_nospl(&dom->queues_lock);
-		obj_page_zeroed(owner.obj, page);
-		break;
-	}
+		ke_spinlock_enter_nospl(&obj->stealing_lock);
+
+		if (page->use == VM_PAGE_FILE && page->owner_obj == obj &&
+		    page->shared.share_count == 0 && !page->dirty) {
+			pmap_pte_zeroleaf_create(page->pte, PMAP_L0);
+			obj_page_zeroed(obj, page);
+			vm_page_delete(page, true);
+			reclaimed++;
+		} else {
+			vm_page_release(page);
+		}
 
-	default:
-		kfatal("Handle these\n");
+		ke_spinlock_exit_nospl(&obj->stealing_lock);
+		ke_spinlock_enter_nospl(&dom->queues_lock);
 	}
 
-	ke_spinlock_exit_nospl(owner_lock);
-	ke_spinlock_enter_nospl(&dom->queues_lock);
-
-	dom->use_n[old_use] -= 1 << page->order;
-	dom->use_n[use] += 1 << page->order;
-
-	page->use = use;
-	page->dirty = 0;
+	ke_spinlock_exit_nospl(&dom->queues_lock);
 
-	return page;
-#endif
-	kfatal("vm_page_steal: needs to be adapted");
+	return reclaimed;
 }
 
 void
 vm_purge_standby(void)
 {
 	ipl_t ipl = spldisp();
-	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++) {
-		vm_domain_t *dom = &vm_domains[dom_i];
-		ke_spinlock_enter_nospl(&dom->queues_lock);
-		vm_page_t *page;
-		while ((page = vm_page_steal(VM_PAGE_KWIRED, dom)) != NULL) {
-			ke_spinlock_exit_nospl(&dom->queues_lock);
-			vm_page_delete(page, false);
-			ke_spinlock_enter_nospl(&dom->queues_lock);
-		}
-		ke_spinlock_exit_nospl(&dom->queues_lock);
-	}
+	for (size_t dom_i = 0; dom_i <= highest_domid; dom_i++)
+		vm_page_reclaim(&vm_domains[dom_i], SIZE_MAX);
 	splx(ipl);
 }
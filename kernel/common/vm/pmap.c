@@ -7,6 +7,7 @@
  * @brief Physical mapping code.
  */
 
+#include <sys/k_cpu.h>
 #include <sys/k_intr.h>
 #include <sys/k_log.h>
 #include <sys/k_xcall.h>
@@ -16,9 +17,20 @@
 #include <vm/map.h>
 #include <vm/page.h>
 
-int
-pmap_wire_pte(vm_map_t *map, struct vm_rs *rs, struct pte_cursor *state,
-    vaddr_t vaddr, bool create)
+#ifdef PMAP_SUPERPAGE_LEVEL
+static void superpage_demote(vm_map_t *map, struct vm_rs *rs, pte_t *ppte,
+    vaddr_t vaddr, vm_page_t *table_page);
+#endif
+
+/*!
+ * @brief Walk to, and wire, the PTE mapping \p vaddr at \p leaf_level.
+ *
+ * Any superpage found on the way to a lower level is demoted, so that callers
+ * wanting an L0 PTE always get one.
+ */
+static int
+wire_pte(vm_map_t *map, struct vm_rs *rs, struct pte_cursor *state,
+    vaddr_t vaddr, bool create, pmap_level_t leaf_level)
 {
 	size_t indexes[PMAP_MAX_LEVELS];
 	pte_t *table;
@@ -43,13 +55,21 @@ pmap_wire_pte(vm_map_t *map, struct vm_rs *rs, struct pte_cursor *state,
 		pte_t *ppte = &table[indexes[level]], pte;
 		vm_page_t *next_page;
 
-		if (level == 0) {
+		if (level == leaf_level) {
 			state->pte = ppte;
 			return 0;
 		}
 
 		pte = pmap_load_pte(ppte);
 
+#ifdef PMAP_SUPERPAGE_LEVEL
+		if (pmap_pte_hw_is_large(pte, level)) {
+			kassert(level == PMAP_SUPERPAGE_LEVEL);
+			superpage_demote(map, rs, ppte, vaddr, NULL);
+			pte = pmap_load_pte(ppte);
+		}
+#endif
+
 		switch (pmap_pte_characterise(pte)) {
 		case kPTEKindZero: {
 			if (!create)
@@ -65,12 +85,10 @@ pmap_wire_pte(vm_map_t *map, struct vm_rs *rs, struct pte_cursor *state,
 			ke_spinlock_exit_nospl(&map->stealing_lock);
 
 			next_page = vm_page_alloc(VM_PAGE_TABLE, 0, VM_DOMID_LOCAL,
-			    0);
+			    VM_ZERO);
 			if (next_page == NULL)
 				kfatal("TODO: Wait on pages avail event.\n");
 
-			memset((void *)vm_page_hhdm_addr(next_page), 0, PGSIZE);
-
 			ke_spinlock_enter_nospl(&map->stealing_lock);
 
 			next_page->pte = ppte;
@@ -180,14 +198,14 @@ pmap_wire_pte(vm_map_t *map, struct vm_rs *rs, struct pte_cursor *state,
 	return 0;
 }
 
-void
-pmap_unwire_pte(struct vm_map *map, struct vm_rs *rs,
-    struct pte_cursor *state)
+static void
+unwire_pte(struct vm_map *map, struct vm_rs *rs, struct pte_cursor *state,
+    pmap_level_t leaf_level)
 {
 	kassert(ke_spinlock_held(&map->creation_lock), "");
 	kassert(ke_spinlock_held(&map->stealing_lock), "");
 
-	for (size_t i = 0; i < PMAP_LEVELS - 1; i++) {
+	for (size_t i = leaf_level; i < PMAP_LEVELS - 1; i++) {
 		vm_page_t *page = state->pages[i];
 		kassert(page->use == VM_PAGE_TABLE, "");
 		kassert(page->proctable.level == i, "");
@@ -195,14 +213,29 @@ pmap_unwire_pte(struct vm_map *map, struct vm_rs *rs,
 	}
 }
 
+int
+pmap_wire_pte(vm_map_t *map, struct vm_rs *rs, struct pte_cursor *state,
+    vaddr_t vaddr, bool create)
+{
+	return wire_pte(map, rs, state, vaddr, create, PMAP_L0);
+}
+
+void
+pmap_unwire_pte(struct vm_map *map, struct vm_rs *rs,
+    struct pte_cursor *state)
+{
+	unwire_pte(map, rs, state, PMAP_L0);
+}
+
 /*
- * @brief Quickly fetch pointer to a PTE, if it can be reached.
+ * Walk to the leaf PTE mapping some address, be it an L0 PTE or a superpage.
  */
-pte_t *
-pmap_fetch_pte(vm_map_t *map, vm_page_t **out_table_page, vaddr_t vaddr)
+static pte_t *
+fetch_leaf_pte(vm_map_t *map, vm_page_t **out_table_page, vaddr_t vaddr,
+    pmap_level_t *out_level)
 {
 	size_t indexes[PMAP_MAX_LEVELS];
-	vm_page_t *table_page;
+	vm_page_t *table_page = VM_PAGE_FOR_PADDR(map->pgtable);
 	pte_t *table;
 
 	kassert(ke_spinlock_held(&map->stealing_lock));
@@ -212,13 +245,14 @@ pmap_fetch_pte(vm_map_t *map, vm_page_t **out_table_page, vaddr_t vaddr)
 
 	table = (pte_t *)p2v(map->pgtable);
 
-	for (size_t level = PMAP_LEVELS - 1;; level--) {
+	for (pmap_level_t level = PMAP_LEVELS - 1;; level--) {
 		pte_t *ppte = &table[indexes[level]];
 		pte_t pte = pmap_load_pte(ppte);
 
-		if (level == 0) {
+		if (level == 0 || pmap_pte_hw_is_large(pte, level)) {
 			if (out_table_page != NULL)
 				*out_table_page = table_page;
+			*out_level = level;
 			return ppte;
 		}
 
@@ -231,21 +265,40 @@ pmap_fetch_pte(vm_map_t *map, vm_page_t **out_table_page, vaddr_t vaddr)
 	}
 }
 
+/*
+ * @brief Quickly fetch pointer to a PTE, if it can be reached.
+ *
+ * Addresses mapped by a superpage have no L0 PTE, so yield NULL.
+ */
+pte_t *
+pmap_fetch_pte(vm_map_t *map, vm_page_t **out_table_page, vaddr_t vaddr)
+{
+	pmap_level_t level;
+	pte_t *ppte = fetch_leaf_pte(map, out_table_page, vaddr, &level);
+
+	return ppte != NULL && level == PMAP_L0 ? ppte : NULL;
+}
+
 paddr_t
 vm_translate(vaddr_t addr)
 {
 	pte_t *pte;
 	ipl_t ipl;
 	paddr_t paddr;
+	pmap_level_t level;
+	size_t size = PGSIZE;
+
 	ipl = ke_spinlock_enter(&kernel_map.stealing_lock);
-	pte = pmap_fetch_pte(&kernel_map, NULL, addr);
+	pte = fetch_leaf_pte(&kernel_map, NULL, addr, &level);
 	if (pte == NULL)
 		kfatal("Address %p not mapped\n", (void *)addr);
 	if (!pmap_pte_is_hw(pmap_load_pte(pte)))
 		kfatal("Address %p not valid\n", (void *)addr);
-	paddr = pmap_pte_hwleaf_paddr(pmap_load_pte(pte), PMAP_L0);
+	paddr = pmap_pte_hwleaf_paddr(pmap_load_pte(pte), level);
 	ke_spinlock_exit(&kernel_map.stealing_lock, ipl);
-	return paddr + (addr & (PGSIZE - 1));
+	for (pmap_level_t i = PMAP_L0; i < level; i++)
+		size *= PMAP_L0_SKIP;
+	return paddr + (addr & (size - 1));
 }
 
 void
@@ -282,7 +335,20 @@ pmap_anon_ptes_converted_to_leaf_valid_pte(struct vm_rs *rs,
     struct pte_cursor *cursor, size_t n)
 {
 	cursor->pages[0]->proctable.noswap_ptes += n;
+	pmap_trans_ptes_converted_to_leaf_valid_pte(rs, cursor, n);
+}
 
+void
+pmap_swap_ptes_converted_to_trans(struct vm_rs *rs, struct pte_cursor *cursor,
+    size_t n)
+{
+	cursor->pages[0]->proctable.noswap_ptes += n;
+}
+
+void
+pmap_trans_ptes_converted_to_leaf_valid_pte(struct vm_rs *rs,
+    struct pte_cursor *cursor, size_t n)
+{
 	cursor->pages[0]->proctable.valid_pageable_leaf_ptes += n;
 	if (cursor->pages[0]->proctable.valid_pageable_leaf_ptes == n) {
 		/* first valid PTEs on this page */
@@ -311,18 +377,423 @@ pmap_valid_ptes_zeroed(vm_rs_t *rs, vm_page_t *page, size_t n)
 		vm_page_delete(page, true);
 		pmap_valid_ptes_zeroed(rs, dir_page, 1);
 	} else {
-		page->proctable.noswap_ptes -= n;
-		if (page->proctable.noswap_ptes == 0 &&
-		    !page->proctable.is_root) {
-		#if 1 /* Enabling this breaks m68k - why? */
-			pmap_pte_softdir_create(page->pte,
-			    page->proctable.level + 1, kPTEKindTrans,
-			    VM_PAGE_PFN(page), true);
-			vm_page_release_and_dirty(page, true);
-		#endif
+		pmap_ptes_became_swappable(rs, page, n);
+	}
+}
+
+void
+pmap_ptes_became_swappable(vm_rs_t *rs, vm_page_t *page, size_t n)
+{
+	kassert(page->use == VM_PAGE_TABLE, "");
+
+	page->proctable.noswap_ptes -= n;
+	if (page->proctable.noswap_ptes == 0 && !page->proctable.is_root) {
+	#if 1 /* Enabling this breaks m68k - why? */
+		pmap_pte_softdir_create(page->pte, page->proctable.level + 1,
+		    kPTEKindTrans, VM_PAGE_PFN(page), true);
+		vm_page_release_and_dirty(page, true);
+	#endif
+	}
+}
+
+#ifdef PMAP_SUPERPAGE_LEVEL
+/*
+ * Superpages
+ *
+ * A superpage is a PMAP_SUPERPAGE_SIZE block of aligned, physically contiguous
+ * memory mapped by one leaf PTE at PMAP_SUPERPAGE_LEVEL. The block is split by
+ * vm_page_split() as soon as it's allocated, so its pages can be freed one by
+ * one after a demotion.
+ *
+ * They're used for the kernel wired heap and for private anonymous memory.
+ * Having no leaf table, they aren't on the resident set's active leaf tables
+ * and so aren't paged; they're mapped writeable from the outset if the
+ * mapping allows, so all their pages count as dirty. Anything wanting 4 KiB
+ * PTEs (a partial unmap, a protection change, fork) gets them from
+ * pmap_wire_pte(), which demotes a superpage in its way to a leaf table
+ * mapping the same pages.
+ *
+ * Demotion needs a page for the leaf table, and happens with the map's
+ * spinlocks held, where there's no waiting for one. So a few table pages are
+ * kept in reserve, topped up by pmap_reserve_tables() before the locks are
+ * taken by anything that may demote. Nothing demotes more than
+ * PMAP_TABLE_RESERVE superpages without dropping its locks in between: an
+ * unmap removes superpages wholly within its range without demoting them,
+ * so demotes at most the two at its ends.
+ */
+
+#define PMAP_TABLE_RESERVE 4
+
+static atomic_ulong pmap_superpages_entered, pmap_superpage_promotions,
+    pmap_superpage_demotions, pmap_superpages_removed;
+
+static kspinlock_t table_reserve_lock = KSPINLOCK_INITIALISER;
+static vm_page_t *table_reserve[PMAP_TABLE_RESERVE];
+static size_t table_reserve_n;
+
+/*!
+ * @brief Top up the reserve of page table pages for demotions.
+ *
+ * Call with no spinlocks held before taking a map's locks to do anything
+ * that may demote a superpage. At IPL_0 this waits for pages if need be.
+ */
+void
+pmap_reserve_tables(void)
+{
+	while (__atomic_load_n(&table_reserve_n, __ATOMIC_RELAXED) <
+	    PMAP_TABLE_RESERVE) {
+		vm_page_t *page;
+		ipl_t ipl;
+
+		page = vm_page_alloc(VM_PAGE_TABLE, 0, VM_DOMID_LOCAL, 0);
+		if (page == NULL)
+			return;
+
+		ipl = ke_spinlock_enter(&table_reserve_lock);
+		if (table_reserve_n < PMAP_TABLE_RESERVE) {
+			table_reserve[table_reserve_n++] = page;
+			page = NULL;
+		}
+		ke_spinlock_exit(&table_reserve_lock, ipl);
+
+		if (page != NULL)
+			vm_page_delete(page, true);
+	}
+}
+
+/* a page for a leaf table, from the reserve if there's none free */
+static vm_page_t *
+table_page_alloc(void)
+{
+	vm_page_t *page;
+
+	page = vm_page_alloc(VM_PAGE_TABLE, 0, VM_DOMID_LOCAL, 0);
+	if (page != NULL)
+		return page;
+
+	ke_spinlock_enter_nospl(&table_reserve_lock);
+	kassert(table_reserve_n > 0, "superpage_demote: no reserve left; "
+	    "a caller didn't call pmap_reserve_tables()");
+	page = table_reserve[--table_reserve_n];
+	ke_spinlock_exit_nospl(&table_reserve_lock);
+
+	return page;
+}
+
+static void
+superpage_pages_init(vm_page_t *page, struct vm_rs *rs, pte_t *ppte)
+{
+	for (size_t i = 0; i < PMAP_SUPERPAGE_PAGES; i++) {
+		page[i].owner_rs = rs;
+		page[i].pte = ppte;
+	}
+}
+
+/*!
+ * @brief Replace the superpage at \p ppte with a leaf table mapping the same
+ * pages with the same protection.
+ *
+ * The table is \p table_page if given, else allocated, dropping the stealing
+ * lock to do so.
+ */
+static void
+superpage_demote(vm_map_t *map, struct vm_rs *rs, pte_t *ppte, vaddr_t vaddr,
+    vm_page_t *table_page)
+{
+	vaddr_t base = rounddown2(vaddr, PMAP_SUPERPAGE_SIZE);
+	pte_t pte = pmap_load_pte(ppte), *table;
+	vm_page_t *page;
+	vm_prot_t prot = VM_READ;
+
+	page = pmap_pte_hwleaf_page(pte, PMAP_SUPERPAGE_LEVEL);
+	if (pmap_pte_hwleaf_writeable(pte))
+		prot |= VM_WRITE;
+	if (pmap_pte_hwleaf_executable(pte))
+		prot |= VM_EXEC;
+	if (base < HIGHER_HALF)
+		prot |= VM_USER;
+
+	if (table_page == NULL) {
+		ke_spinlock_exit_nospl(&map->stealing_lock);
+		table_page = table_page_alloc();
+		ke_spinlock_enter_nospl(&map->stealing_lock);
+	}
+
+	table = (pte_t *)vm_page_hhdm_addr(table_page);
+	for (size_t i = 0; i < PMAP_SUPERPAGE_PAGES; i++) {
+		pmap_pte_hwleaf_create(&table[i], VM_PAGE_PFN(page) + i,
+		    PMAP_L0, prot, kCacheModeDefault);
+		page[i].pte = &table[i];
+	}
+
+	table_page->pte = ppte;
+	table_page->owner_rs = rs;
+	table_page->proctable.level = PMAP_L0;
+	table_page->proctable.base = base >> PGSHIFT;
+	table_page->proctable.is_root = false;
+	table_page->proctable.nonzero_ptes = PMAP_SUPERPAGE_PAGES;
+	table_page->proctable.noswap_ptes = PMAP_SUPERPAGE_PAGES;
+	table_page->proctable.valid_pageable_leaf_ptes = 0;
+	if (page->use == VM_PAGE_PRIVATE) {
+		table_page->proctable.valid_pageable_leaf_ptes =
+		    PMAP_SUPERPAGE_PAGES;
+		TAILQ_INSERT_TAIL(&rs->active_leaf_tables, table_page, qlink);
+	}
+
+	/* the directory PTE counts towards its table just as the leaf did */
+	pmap_pte_hwdir_create(ppte, VM_PAGE_PADDR(table_page),
+	    PMAP_SUPERPAGE_LEVEL);
+	pmap_tlb_flush_range(map, base, base + PMAP_SUPERPAGE_SIZE);
+
+	rs->superpages_n--;
+	atomic_fetch_add_explicit(&pmap_superpage_demotions, 1,
+	    memory_order_relaxed);
+}
+
+/*!
+ * @brief Map a freshly allocated superpage at \p vaddr, if nothing is mapped
+ * in the superpage-sized range there yet and a block can be had.
+ *
+ * Creation and stealing locks held. The stealing lock is dropped to allocate.
+ *
+ * @returns The first of the superpage's pages, or NULL if not possible.
+ */
+vm_page_t *
+pmap_superpage_enter(vm_map_t *map, struct vm_rs *rs, vaddr_t vaddr,
+    vm_page_use_t use, vm_prot_t prot)
+{
+	struct pte_cursor cursor;
+	vm_page_t *page;
+
+	kassert(vaddr % PMAP_SUPERPAGE_SIZE == 0);
+
+	wire_pte(map, rs, &cursor, vaddr, true, PMAP_SUPERPAGE_LEVEL);
+	if (pmap_pte_characterise(pmap_load_pte(cursor.pte)) != kPTEKindZero) {
+		unwire_pte(map, rs, &cursor, PMAP_SUPERPAGE_LEVEL);
+		return NULL;
+	}
+
+	ke_spinlock_exit_nospl(&map->stealing_lock);
+	page = vm_page_alloc(use, PMAP_SUPERPAGE_ORDER, VM_DOMID_LOCAL,
+	    VM_ZERO);
+	ke_spinlock_enter_nospl(&map->stealing_lock);
+
+	if (page == NULL) {
+		unwire_pte(map, rs, &cursor, PMAP_SUPERPAGE_LEVEL);
+		return NULL;
+	}
+
+	vm_page_split(page);
+	superpage_pages_init(page, rs, cursor.pte);
+
+	pmap_pte_hwleaf_create(cursor.pte, VM_PAGE_PFN(page),
+	    PMAP_SUPERPAGE_LEVEL, prot, kCacheModeDefault);
+	cursor.pages[PMAP_SUPERPAGE_LEVEL]->proctable.nonzero_ptes++;
+	cursor.pages[PMAP_SUPERPAGE_LEVEL]->proctable.noswap_ptes++;
+	unwire_pte(map, rs, &cursor, PMAP_SUPERPAGE_LEVEL);
+
+	rs->superpages_n++;
+	atomic_fetch_add_explicit(&pmap_superpages_entered, 1,
+	    memory_order_relaxed);
+
+	return page;
+}
+
+/*!
+ * @brief Unmap the superpage at \p vaddr, if there is one.
+ *
+ * The caller must shoot down the TLB entries for the range before freeing the
+ * pages.
+ *
+ * @returns The first of the superpage's pages, or NULL if there wasn't one.
+ */
+vm_page_t *
+pmap_superpage_remove(vm_map_t *map, struct vm_rs *rs, vaddr_t vaddr)
+{
+	struct pte_cursor cursor;
+	vm_page_t *page;
+	pte_t pte;
+
+	kassert(vaddr % PMAP_SUPERPAGE_SIZE == 0);
+
+	if (wire_pte(map, rs, &cursor, vaddr, false, PMAP_SUPERPAGE_LEVEL) != 0)
+		return NULL;
+
+	pte = pmap_load_pte(cursor.pte);
+	if (!pmap_pte_hw_is_large(pte, PMAP_SUPERPAGE_LEVEL)) {
+		unwire_pte(map, rs, &cursor, PMAP_SUPERPAGE_LEVEL);
+		return NULL;
+	}
+
+	page = pmap_pte_hwleaf_page(pte, PMAP_SUPERPAGE_LEVEL);
+	pmap_pte_zeroleaf_create(cursor.pte, PMAP_SUPERPAGE_LEVEL);
+	pmap_valid_ptes_zeroed(rs, cursor.pages[PMAP_SUPERPAGE_LEVEL], 1);
+	unwire_pte(map, rs, &cursor, PMAP_SUPERPAGE_LEVEL);
+
+	rs->superpages_n--;
+	atomic_fetch_add_explicit(&pmap_superpages_removed, 1,
+	    memory_order_relaxed);
+
+	return page;
+}
+
+/*!
+ * @brief Age the superpage at \p vaddr, if there is one, for working set
+ * trimming.
+ *
+ * If it's been accessed since it was last aged, its accessed bit is cleared
+ * and it's left be. Otherwise, or if \p force, it's demoted, so that its pages
+ * can be aged and trimmed one by one like any others. Trimming must not eat
+ * into the table reserve, so if no page can be had for the leaf table the
+ * superpage is left as it is for now.
+ *
+ * Creation and stealing locks held. The stealing lock is dropped to allocate.
+ *
+ * @returns -1 if there's no superpage there, 1 if it was demoted, else 0.
+ */
+int
+pmap_superpage_trim(vm_map_t *map, struct vm_rs *rs, vaddr_t vaddr, bool force)
+{
+	pmap_level_t level;
+	vm_page_t *table_page;
+	pte_t *ppte;
+
+	kassert(ke_spinlock_held(&map->creation_lock));
+	kassert(vaddr % PMAP_SUPERPAGE_SIZE == 0);
+
+	ppte = fetch_leaf_pte(map, NULL, vaddr, &level);
+	if (ppte == NULL || level != PMAP_SUPERPAGE_LEVEL)
+		return -1;
+
+	if (!force && pmap_pte_hwleaf_accessed(pmap_load_pte(ppte))) {
+		pmap_pte_hwleaf_clear_accessed(ppte);
+		pmap_tlb_flush_range(map, vaddr, vaddr + PMAP_SUPERPAGE_SIZE);
+		return 0;
+	}
+
+	/* the creation lock keeps the superpage there meanwhile */
+	ke_spinlock_exit_nospl(&map->stealing_lock);
+	table_page = vm_page_alloc(VM_PAGE_TABLE, 0, VM_DOMID_LOCAL, 0);
+	ke_spinlock_enter_nospl(&map->stealing_lock);
+	if (table_page == NULL)
+		return 0;
+
+	superpage_demote(map, rs, ppte, vaddr, table_page);
+	return 1;
+}
+
+/*!
+ * @brief Try to replace a fully populated leaf table of private pages with a
+ * superpage.
+ *
+ * If the pages are already aligned and contiguous they're mapped in place;
+ * otherwise they're copied into a new block, with the old PTEs made read-only
+ * meanwhile so that no write is lost.
+ *
+ * The cursor is wired to one of the table's PTEs. On success it's unwired and
+ * the table freed; otherwise it's left as it was.
+ */
+bool
+pmap_superpage_promote(vm_map_t *map, struct vm_rs *rs,
+    struct pte_cursor *cursor, vaddr_t vaddr, vm_prot_t prot)
+{
+	vaddr_t base = rounddown2(vaddr, PMAP_SUPERPAGE_SIZE);
+	vm_page_t *table_page = cursor->pages[0], *first = NULL, *page;
+	pte_t *table = (pte_t *)rounddown2((vaddr_t)cursor->pte, PGSIZE);
+	pte_t *pde = table_page->pte;
+	bool in_place = true;
+
+	/* all valid and pageable, and no other PTEs; 1 is the cursor's wire */
+	if (table_page->proctable.valid_pageable_leaf_ptes !=
+		PMAP_SUPERPAGE_PAGES ||
+	    table_page->proctable.nonzero_ptes != PMAP_SUPERPAGE_PAGES + 1)
+		return false;
+
+	for (size_t i = 0; i < PMAP_SUPERPAGE_PAGES; i++) {
+		pte_t pte = pmap_load_pte(&table[i]);
+
+		if (pmap_pte_characterise(pte) != kPTEKindHW)
+			return false;
+		page = pmap_pte_hwleaf_page(pte, PMAP_L0);
+		if (page->use != VM_PAGE_PRIVATE || page->owner_rs != rs)
+			return false;
+
+		if (i == 0)
+			first = page;
+		else if (page != first + i)
+			in_place = false;
+	}
+	if (VM_PAGE_PFN(first) % PMAP_SUPERPAGE_PAGES != 0)
+		in_place = false;
+
+	if (in_place) {
+		page = first;
+	} else {
+		for (size_t i = 0; i < PMAP_SUPERPAGE_PAGES; i++)
+			pmap_pte_hwleaf_clear_writeable(&table[i]);
+		pmap_tlb_flush_range(map, base, base + PMAP_SUPERPAGE_SIZE);
+
+		ke_spinlock_exit_nospl(&map->stealing_lock);
+		page = vm_page_alloc(VM_PAGE_PRIVATE, PMAP_SUPERPAGE_ORDER,
+		    VM_DOMID_LOCAL, 0);
+		ke_spinlock_enter_nospl(&map->stealing_lock);
+		if (page == NULL)
+			return false;
+
+		/* the PTEs may have been stolen while unlocked */
+		for (size_t i = 0; i < PMAP_SUPERPAGE_PAGES; i++) {
+			pte_t pte = pmap_load_pte(&table[i]);
+
+			if (pmap_pte_characterise(pte) != kPTEKindHW) {
+				vm_page_delete(page, true);
+				return false;
+			}
+			memcpy((void *)vm_page_hhdm_addr(page + i),
+			    (void *)vm_page_hhdm_addr(
+				pmap_pte_hwleaf_page(pte, PMAP_L0)),
+			    PGSIZE);
 		}
 	}
+
+	pmap_pte_hwleaf_create(pde, VM_PAGE_PFN(page), PMAP_SUPERPAGE_LEVEL,
+	    prot, kCacheModeDefault);
+	pmap_tlb_flush_range(map, base, base + PMAP_SUPERPAGE_SIZE);
+
+	if (!in_place) {
+		/* backwards, so the buddy allocator can coalesce them */
+		for (size_t i = PMAP_SUPERPAGE_PAGES; i-- > 0;)
+			vm_page_delete(pmap_pte_hwleaf_page(
+			    pmap_load_pte(&table[i]), PMAP_L0), true);
+		vm_page_split(page);
+	}
+	superpage_pages_init(page, rs, pde);
+
+	TAILQ_REMOVE(&rs->active_leaf_tables, table_page, qlink);
+	unwire_pte(map, rs, cursor, PMAP_SUPERPAGE_LEVEL);
+	vm_page_delete(table_page, true);
+
+	rs->superpages_n++;
+	atomic_fetch_add_explicit(&pmap_superpage_promotions, 1,
+	    memory_order_relaxed);
+
+	return true;
+}
+
+void
+dbg_pmap_superpage_dump(void)
+{
+	kdprintf("Superpages: %lu entered, %lu promoted, %lu demoted, "
+		 "%lu removed\n",
+	    atomic_load_explicit(&pmap_superpages_entered,
+		memory_order_relaxed),
+	    atomic_load_explicit(&pmap_superpage_promotions,
+		memory_order_relaxed),
+	    atomic_load_explicit(&pmap_superpage_demotions,
+		memory_order_relaxed),
+	    atomic_load_explicit(&pmap_superpages_removed,
+		memory_order_relaxed));
 }
+#endif /* PMAP_SUPERPAGE_LEVEL */
 
 void
 pmap_tlb_flush_vaddr(void *arg)
@@ -341,14 +812,21 @@ pmap_tlb_flush_vaddr(void *arg)
 #endif
 }
 
+/*!
+ * @brief Flush the whole TLB, kernel entries included.
+ */
 void
 pmap_tlb_flush_all(void *)
 {
 #if defined(__amd64__)
-	unsigned long cr3;
-	asm volatile("mov %%cr3, %0\n\t"
-		     "mov %0, %%cr3\n\t"
-	    : "=r"(cr3)
+	/* toggling CR4.PGE flushes global entries and every PCID */
+	unsigned long cr4;
+	asm volatile("mov %%cr4, %0\n\t"
+		     "xor $0x80, %0\n\t"
+		     "mov %0, %%cr4\n\t"
+		     "xor $0x80, %0\n\t"
+		     "mov %0, %%cr4"
+	    : "=&r"(cr4)
 	    :
 	    : "memory");
 #elif defined(__riscv)
@@ -360,6 +838,161 @@ pmap_tlb_flush_all(void *)
 #endif
 }
 
+/*!
+ * @brief Zero a page that won't be touched again soon.
+ *
+ * On amd64 this uses non-temporal stores, so that zeroing pages in the
+ * background doesn't evict useful lines from the cache.
+ */
+void
+pmap_zero_page_nocache(vm_page_t *page)
+{
+#if defined(__amd64__)
+	uint64_t *p = (uint64_t *)vm_page_hhdm_addr(page);
+
+	for (size_t i = 0; i < PGSIZE / sizeof(uint64_t); i += 4) {
+		asm volatile("movnti %1, 0(%0)\n\t"
+			     "movnti %1, 8(%0)\n\t"
+			     "movnti %1, 16(%0)\n\t"
+			     "movnti %1, 24(%0)"
+		    :
+		    : "r"(&p[i]), "r"((uint64_t)0)
+		    : "memory");
+	}
+	/* NT stores are weakly ordered; fence before the page is handed out */
+	asm volatile("sfence" ::: "memory");
+#else
+	memset((void *)vm_page_hhdm_addr(page), 0, PGSIZE);
+#endif
+}
+
+/*
+ * Beyond this many pages, a range shootdown flushes the whole TLB rather than
+ * invalidating page by page.
+ */
+#define TLB_RANGE_MAX 32
+
+struct tlb_range {
+	vaddr_t start, end;
+	bool kernel;
+};
+
+/* IPIs sent for, and avoided by, map-targeted shootdowns */
+static atomic_ulong pmap_tlb_ipis_sent, pmap_tlb_ipis_avoided;
+
+/*!
+ * @brief Flush the non-global TLB entries of the current address space.
+ */
+static void
+tlb_flush_current(void)
+{
+#if defined(__amd64__)
+	/* with PCIDs, this flushes only the current one's */
+	unsigned long cr3;
+	asm volatile("mov %%cr3, %0\n\t"
+		     "mov %0, %%cr3\n\t"
+	    : "=r"(cr3)
+	    :
+	    : "memory");
+#else
+	pmap_tlb_flush_all(NULL);
+#endif
+}
+
+static void
+tlb_flush_range(void *arg)
+{
+	struct tlb_range *range = arg;
+
+	if ((range->end - range->start) / PGSIZE > TLB_RANGE_MAX) {
+		if (range->kernel)
+			pmap_tlb_flush_all(NULL);
+		else
+			tlb_flush_current();
+		return;
+	}
+
+	for (vaddr_t va = range->start; va < range->end; va += PGSIZE)
+		pmap_tlb_flush_vaddr((void *)va);
+}
+
+/*!
+ * @brief Load a map on the current CPU, noting which CPUs have it loaded.
+ *
+ * The CPU leaves the old map's active set once the new map is loaded. Without
+ * PCIDs that flushes the old map's (non-global) TLB entries; with them the
+ * entries stay, but tlb_gen sees to them, so the CPU needn't be interrupted
+ * by shootdowns of the old map either way.
+ */
+void
+pmap_switch(vm_map_t *old, vm_map_t *new)
+{
+	kcpunum_t cpu = CPU_LOCAL_LOAD(cpu_num);
+
+	/* a fully ordered RMW: seen by anyone who misses our PTE reads. */
+	atomic_cpumask_set(&new->active_cpus, cpu, memory_order_seq_cst);
+	pmap_activate(new);
+	if (old != NULL && old != new)
+		atomic_cpumask_clear(&old->active_cpus, cpu,
+		    memory_order_release);
+}
+
+/*!
+ * @brief Shoot down TLB entries for a range of addresses in a map.
+ *
+ * Only CPUs which have the map loaded are interrupted, and the whole range is
+ * dealt with in one cross-call. Kernel map ranges are visible in every
+ * address space and so go to every CPU.
+ */
+void
+pmap_tlb_flush_range(vm_map_t *map, vaddr_t start, vaddr_t end)
+{
+	struct tlb_range range = { .start = start, .end = end,
+		.kernel = map == &kernel_map };
+	kcpumask_t targets;
+	unsigned int sent;
+	ipl_t ipl;
+
+	if (map == &kernel_map) {
+		ke_xcall_broadcast(tlb_flush_range, &range);
+		tlb_flush_range(&range);
+		atomic_fetch_add_explicit(&pmap_tlb_ipis_sent, ke_ncpu - 1,
+		    memory_order_relaxed);
+		return;
+	}
+
+	/* stay on this CPU so that it's correctly treated as local */
+	ipl = spldisp();
+
+#if defined(__amd64__)
+	/* CPUs not interrupted flush the map's PCID when they next load it */
+	atomic_fetch_add_explicit(&map->tlb_gen, 1, memory_order_seq_cst);
+#endif
+
+	/* the caller's PTE updates must be ordered before the mask read */
+	atomic_thread_fence(memory_order_seq_cst);
+	atomic_cpumask_load(&map->active_cpus, &targets, memory_order_relaxed);
+
+	sent = ke_ncpu > 1 ?
+	    ke_xcall_multicast(tlb_flush_range, &range, &targets) : 0;
+	if (cpumask_isset(&targets, CPU_LOCAL_LOAD(cpu_num)))
+		tlb_flush_range(&range);
+
+	splx(ipl);
+
+	atomic_fetch_add_explicit(&pmap_tlb_ipis_sent, sent,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&pmap_tlb_ipis_avoided,
+	    ke_ncpu - 1 - sent, memory_order_relaxed);
+}
+
+/*! @brief Flush all of a map's TLB entries on the CPUs using it. */
+void
+pmap_tlb_flush_map(vm_map_t *map)
+{
+	pmap_tlb_flush_range(map, 0, (vaddr_t)-1 & ~(PGSIZE - 1));
+}
+
 void
 pmap_tlb_flush_vaddr_globally(vaddr_t vaddr)
 {
@@ -373,3 +1006,12 @@ pmap_tlb_flush_all_globally(void)
 	ke_xcall_broadcast(pmap_tlb_flush_all, NULL);
 	pmap_tlb_flush_all(NULL);
 }
+
+void
+dbg_pmap_tlb_dump(void)
+{
+	kdprintf("TLB shootdown IPIs: %lu sent, %lu avoided\n",
+	    atomic_load_explicit(&pmap_tlb_ipis_sent, memory_order_relaxed),
+	    atomic_load_explicit(&pmap_tlb_ipis_avoided,
+		memory_order_relaxed));
+}
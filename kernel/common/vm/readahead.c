@@ -0,0 +1,356 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file vm/readahead.c
+ * @brief Sequential readahead for vnode objects.
+ *
+ * Faults on a vnode object, whether on a user mapping or a viewcache view,
+ * are reported to vm_readahead_note(). A fault that carries on where the last
+ * one finished, or that lands in the region last read ahead, is sequential;
+ * anything else is random and closes the readahead window.
+ *
+ * Sequential faults keep a region ahead of the faulting position being read
+ * in. When a fault first touches the region last read ahead, the next region
+ * is requested, twice as long as the last, up to READAHEAD_MAX pages. Reading
+ * of one region thus overlaps consumption of the one before.
+ *
+ * The requests are carried out by the readahead thread, so faults never wait
+ * for them. It reads each region in clusters through IOPs, the pages' object
+ * PTEs being busy meanwhile as with a fault's pagein, and leaves the pages on
+ * the standby list, unmapped. Readahead is skipped while memory is short.
+ */
+
+#include <sys/iop.h>
+#include <sys/k_log.h>
+#include <sys/k_wait.h>
+#include <sys/proc.h>
+#include <sys/vnode.h>
+
+#include <libkern/lib.h>
+
+#include "vm/map.h"
+#include "vm/page.h"
+
+/* first and largest readahead windows, in pages */
+#define READAHEAD_MIN 16
+#define READAHEAD_MAX 256
+/* pages per IOP */
+#define READAHEAD_CLUSTER 32
+
+/* fault.c */
+struct pagein_wait *allocate_pagein_wait(void);
+void pagein_wait_release(struct pagein_wait *wait);
+
+/* obj.c */
+size_t obj_max_readahead(struct obj_pte_wire_state *cursor, pgoff_t pgoff,
+    size_t max_pages);
+void obj_new_ptes_created(struct obj_pte_wire_state *cursor, size_t n);
+
+static thread_t *readahead_thread;
+static kevent_t readahead_ev;
+static kspinlock_t readahead_lock = KSPINLOCK_INITIALISER;
+static TAILQ_HEAD(, vm_object) readahead_queue =
+    TAILQ_HEAD_INITIALIZER(readahead_queue); /* (readahead_lock) */
+
+static struct readahead_stats {
+	size_t hits, misses, backoffs, requests, pages, skipped;
+} stats;
+
+/* pages of the object within the file; valid_length may be SIZE_MAX */
+static pgoff_t
+valid_pages(vm_object_t *obj)
+{
+	size_t length = obj->vnobj.valid_length;
+
+	return (length >> PGSHIFT) + ((length & (PGSIZE - 1)) != 0);
+}
+
+static bool
+memory_short(void)
+{
+	vm_domain_t *dom = &vm_domains[CPU_LOCAL_LOAD(vm_domid)];
+
+	return vm_domain_free_n(dom) < dom->low_free;
+}
+
+/* Hand a region to the readahead thread. Object creation lock held. */
+static void
+readahead_request(vm_object_t *obj, pgoff_t start, size_t n)
+{
+	struct vm_readahead *ra = &obj->vnobj.ra;
+
+	ke_spinlock_enter_nospl(&readahead_lock);
+	if (!ra->queued) {
+		ra->queued = true;
+		ra->q_start = start;
+		ra->q_n = n;
+		vn_retain(obj->vnobj.vnode);
+		TAILQ_INSERT_TAIL(&readahead_queue, obj, vnobj.ra.q_link);
+		ke_event_set_signalled(&readahead_ev, true);
+	} else if (ra->q_start + ra->q_n == start) {
+		/* not begun yet; extend it */
+		ra->q_n += n;
+	} else {
+		/* the faulter has moved on; the old request is stale */
+		ra->q_start = start;
+		ra->q_n = n;
+	}
+	ke_spinlock_exit_nospl(&readahead_lock);
+
+	__atomic_fetch_add(&stats.requests, 1, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief Note a fault on a vnode object, and read ahead if it's sequential.
+ *
+ * Called with the object's creation lock held.
+ *
+ * @param pgoff Page offset faulted on.
+ * @param n Number of pages the fault made resident or mapped from there.
+ * @param hit Whether the page faulted on was brought in by readahead.
+ */
+void
+vm_readahead_note(vm_object_t *obj, pgoff_t pgoff, size_t n, bool hit)
+{
+	struct vm_readahead *ra = &obj->vnobj.ra;
+	pgoff_t start, limit;
+
+	kassert(ke_spinlock_held(&obj->creation_lock));
+
+	if (obj->kind != VM_OBJ_VNODE || readahead_thread == NULL)
+		return;
+
+	if (hit)
+		__atomic_fetch_add(&stats.hits, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&stats.misses, 1, __ATOMIC_RELAXED);
+
+	if (pgoff != ra->next && (pgoff < ra->start || pgoff >= ra->end)) {
+		/* random access */
+		if (ra->window != 0)
+			__atomic_fetch_add(&stats.backoffs, 1,
+			    __ATOMIC_RELAXED);
+		ra->window = 0;
+		ra->start = ra->end = 0;
+		ra->next = pgoff + n;
+		return;
+	}
+
+	ra->next = MAX2(ra->next, pgoff + n);
+
+	/* still in the region before the last one read ahead? */
+	if (ra->window != 0 && ra->next <= ra->start)
+		return;
+
+	if (memory_short()) {
+		__atomic_fetch_add(&stats.skipped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	start = MAX2(ra->end, ra->next);
+	ra->window = ra->window == 0 ? READAHEAD_MIN :
+	    MIN2(ra->window * 2, READAHEAD_MAX);
+
+	limit = valid_pages(obj);
+	if (start >= limit)
+		return;
+
+	ra->start = start;
+	ra->end = MIN2(start + ra->window, limit);
+	readahead_request(obj, ra->start, ra->end - ra->start);
+}
+
+/*
+ * Read in a cluster of pages from start, as far as the object PTEs are zero
+ * and at most max pages. Called at IPL_0.
+ * Returns the number of pages it covered, whether it read them or found them
+ * already there, or 0 if it must give up.
+ */
+static size_t
+readahead_cluster(vm_object_t *obj, pgoff_t start, size_t max)
+{
+	vnode_t *vn = obj->vnobj.vnode;
+	struct table_lock_state lock_state = {
+		.lock = &obj->creation_lock,
+		.did_unlock = false,
+	};
+	struct obj_pte_wire_state cursor;
+	vm_page_t *page[READAHEAD_CLUSTER];
+	sg_seg_t sg_seg[READAHEAD_CLUSTER];
+	struct pagein_wait *pagewait;
+	size_t count, pages_valid;
+	pgoff_t limit;
+	sg_list_t sgl;
+	iop_t *iop;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_enter(&obj->creation_lock);
+	ke_spinlock_enter_nospl(&obj->stealing_lock);
+
+	limit = valid_pages(obj);
+	if (start >= limit) {
+		ke_spinlock_exit_nospl(&obj->stealing_lock);
+		ke_spinlock_exit(&obj->creation_lock, ipl);
+		return 0;
+	}
+	max = MIN2(max, limit - start);
+
+	obj_wire_pte(obj, &cursor, start << PGSHIFT, true, &lock_state);
+
+	if (pmap_pte_characterise(pmap_load_pte(cursor.pte)) != kPTEKindZero) {
+		/* already resident, or being read in */
+		obj_unwire_pte(obj, &cursor);
+		ke_spinlock_exit_nospl(&obj->stealing_lock);
+		ke_spinlock_exit(&obj->creation_lock, ipl);
+		return 1;
+	}
+
+	count = obj_max_readahead(&cursor, start, max);
+
+	ke_spinlock_exit_nospl(&obj->stealing_lock);
+
+	pagewait = allocate_pagein_wait();
+	if (pagewait == NULL)
+		count = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		page[i] = vm_page_alloc(VM_PAGE_FILE, 0, VM_DOMID_LOCAL,
+		    VM_ZERO);
+		if (page[i] == NULL) {
+			count = i;
+			break;
+		}
+
+		page[i]->pte = cursor.pte + i;
+		page[i]->owner_obj = obj;
+		page[i]->shared.offset = start + i;
+		page[i]->shared.share_count = 0;
+		page[i]->shared.readahead = 1;
+		page[i]->pagein_wait = pagewait;
+
+		pmap_pte_soft_create(cursor.pte + i, kPTEKindBusy,
+		    VM_PAGE_PFN(page[i]), false);
+
+		sg_seg[i].paddr = VM_PAGE_PADDR(page[i]);
+		sg_seg[i].length = PGSIZE;
+	}
+
+	if (count == 0) {
+		if (pagewait != NULL)
+			pagein_wait_release(pagewait);
+		ke_spinlock_enter_nospl(&obj->stealing_lock);
+		obj_unwire_pte(obj, &cursor);
+		ke_spinlock_exit_nospl(&obj->stealing_lock);
+		ke_spinlock_exit(&obj->creation_lock, ipl);
+		return 0;
+	}
+
+	ke_spinlock_exit(&obj->creation_lock, ipl);
+
+	sgl.elems = sg_seg;
+	sgl.elems_n = count;
+
+	VOP_PAGING_ENTER(vn);
+	iop = iop_new_read(vn, &sgl, 0, count << PGSHIFT, start << PGSHIFT);
+	iop_send_sync(iop);
+	VOP_PAGING_EXIT(vn);
+	iop_free(iop);
+
+	ipl = ke_spinlock_enter(&obj->creation_lock);
+	ke_spinlock_enter_nospl(&obj->stealing_lock);
+
+	/* the file may have been truncated meanwhile; see do_object_fault() */
+	limit = valid_pages(obj);
+	pages_valid = start < limit ? MIN2(count, limit - start) : 0;
+
+	for (size_t i = 0; i < pages_valid; i++) {
+		pmap_pte_hwleaf_create(cursor.pte + i, VM_PAGE_PFN(page[i]),
+		    PMAP_L0, 0, kCacheModeDefault);
+		/* clean and unmapped: onto the standby list */
+		vm_page_release(page[i]);
+	}
+
+	for (size_t i = pages_valid; i < count; i++) {
+		pmap_pte_zeroleaf_create(cursor.pte + i, PMAP_L0);
+		vm_page_delete(page[i], true);
+	}
+
+	obj_new_ptes_created(&cursor, pages_valid);
+	obj_unwire_pte(obj, &cursor);
+	ke_spinlock_exit_nospl(&obj->stealing_lock);
+	ke_spinlock_exit(&obj->creation_lock, ipl);
+
+	ke_event_set_signalled(&pagewait->event, true);
+	pagein_wait_release(pagewait);
+
+	__atomic_fetch_add(&stats.pages, pages_valid, __ATOMIC_RELAXED);
+
+	return pages_valid == count ? count : 0;
+}
+
+static void
+readahead_thread_fn(void *)
+{
+	while (true) {
+		vm_object_t *obj;
+		pgoff_t start;
+		size_t n;
+		ipl_t ipl;
+
+		ipl = ke_spinlock_enter(&readahead_lock);
+		obj = TAILQ_FIRST(&readahead_queue);
+		if (obj == NULL) {
+			ke_event_set_signalled(&readahead_ev, false);
+			ke_spinlock_exit(&readahead_lock, ipl);
+			ke_wait1(&readahead_ev, "readahead_thread", false,
+			    ABSTIME_FOREVER);
+			continue;
+		}
+		TAILQ_REMOVE(&readahead_queue, obj, vnobj.ra.q_link);
+		obj->vnobj.ra.queued = false;
+		start = obj->vnobj.ra.q_start;
+		n = obj->vnobj.ra.q_n;
+		ke_spinlock_exit(&readahead_lock, ipl);
+
+		while (n > 0) {
+			size_t done;
+
+			if (memory_short()) {
+				__atomic_fetch_add(&stats.skipped, 1,
+				    __ATOMIC_RELAXED);
+				break;
+			}
+
+			done = readahead_cluster(obj, start,
+			    MIN2(n, READAHEAD_CLUSTER));
+			if (done == 0)
+				break;
+
+			start += done;
+			n -= done;
+		}
+
+		vn_release(obj->vnobj.vnode);
+	}
+}
+
+/*! @brief Start the readahead thread. */
+void
+vm_readahead_init(void)
+{
+	ke_event_init(&readahead_ev, false);
+
+	readahead_thread = proc_new_system_thread(readahead_thread_fn, NULL);
+	ke_thread_resume(&readahead_thread->kthread, false);
+}
+
+void
+dbg_vm_readahead_dump(void)
+{
+	kdprintf("readahead: %zu hits, %zu misses, %zu backoffs; "
+		 "%zu requests, %zu pages read, %zu skipped\n",
+	    stats.hits, stats.misses, stats.backoffs, stats.requests,
+	    stats.pages, stats.skipped);
+}
@@ -11,6 +11,14 @@
 
 #include <vm/map.h>
 
+/*
+ * Unmap a page from a leaf PTE of the resident set. A private page's PTE
+ * becomes a transition PTE and a forked page's a fork PTE once more, the page
+ * being left to swap; a file page's is zeroed. The caller adjusts the leaf
+ * table's counts.
+ *
+ * Map stealing lock held.
+ */
 void
 rs_evict_leaf_pte(vm_rs_t *rs, vaddr_t vaddr, vm_page_t *page, pte_t *ppte)
 {
@@ -18,21 +26,37 @@ rs_evict_leaf_pte(vm_rs_t *rs, vaddr_t vaddr, vm_page_t *page, pte_t *ppte)
 	bool dirty = pmap_pte_hwleaf_writeable(pte);
 
 	switch (page->use) {
-#if 0
 	case VM_PAGE_PRIVATE: {
-		pmap_pte_soft_create(pte, kPTEKindTrans, VM_PAGE_PFN(page),
+		pmap_pte_soft_create(ppte, kPTEKindTrans, VM_PAGE_PFN(page),
 		    true);
-		pmap_tlb_flush_vaddr_globally(vaddr);
+		pmap_tlb_flush_range(rs->map, vaddr, vaddr + PGSIZE);
 		// dcache flush?
-		vm_page_release_and_dirty(page, dirty);
+		/* not in swap yet, or modified since it was read in */
+		vm_page_release_and_dirty(page,
+		    dirty || page->swap_address == 0);
+		break;
+	}
+
+	case VM_PAGE_ANON_FORKED: {
+		/* always mapped read-only, so only dirty if never in swap */
+		pmap_pte_anon_create(ppte, page->owner_anon, true);
+		pmap_tlb_flush_range(rs->map, vaddr, vaddr + PGSIZE);
+
+		ke_spinlock_enter_nospl(&anon_creation_lock);
+		if (--page->shared.share_count == 0)
+			vm_page_release_and_dirty(page,
+			    page->swap_address == 0);
+		ke_spinlock_exit_nospl(&anon_creation_lock);
+
 		break;
 	}
 
+#if 0
 	case VM_PAGE_ANON_SHARED:
 #endif
 	case VM_PAGE_FILE: {
 		pmap_pte_zeroleaf_create(ppte, PMAP_L0);
-		pmap_tlb_flush_vaddr_globally(vaddr);
+		pmap_tlb_flush_range(rs->map, vaddr, vaddr + PGSIZE);
 		// dcache flush?
 		/* factor: share count drop */
 
@@ -0,0 +1,407 @@
+/*
+ * SPDX-License-Identifier: MPL-2.0
+ * Copyright (c) 2026 Cloudarox Solutions.
+ */
+/*!
+ * @file vm/swap.c
+ * @brief Swap space for anonymous memory.
+ *
+ * Private and forked anonymous pages are paged out to a swap file or block
+ * device, whose space is divided into page-sized slots allocated from a vmem
+ * arena. Slot n lies at offset (n - 1) * PGSIZE, so that 0 can mean "none".
+ *
+ * An anonymous page goes through these states on its way out and back:
+ *
+ * - Trimming a working set unmaps it. A private page's PTE becomes a
+ *   transition PTE, and a forked page's process PTE goes back to being a fork
+ *   PTE. Once it's not mapped anywhere, the page goes onto the modified list,
+ *   or onto the standby list if its slot already holds its contents.
+ * - The modified page writer writes pages out in clusters, each cluster to a
+ *   run of contiguous slots, moving them to the standby list.
+ * - Reclaiming a standby page turns the PTE that owns it (the process's for a
+ *   private page, the vm_anon's for a forked one) into a swap PTE naming its
+ *   slot.
+ * - A fault on a transition PTE maps the page again. A fault on a swap PTE
+ *   reads the page back in, along with the neighbouring private pages whose
+ *   swap PTEs name the adjacent slots (see fault.c.)
+ *
+ * A page keeps its slot when read back in, so that it needn't be written again
+ * unless it's modified; the slot is given up when the page is freed or written
+ * to a new one.
+ *
+ * The owner's lock guards a page's swap_address: the map's stealing lock for a
+ * private page, the anon locks for a forked one.
+ */
+
+#include <sys/errno.h>
+#include <sys/iop.h>
+#include <sys/k_log.h>
+#include <sys/krx_vfs.h>
+#include <sys/vmem.h>
+#include <sys/vnode.h>
+
+#include <libkern/lib.h>
+
+#include "vm/map.h"
+#include "vm/page.h"
+
+/* swapped to at boot, if it exists */
+#define SWAP_FILE_PATH "/swapfile"
+/* slots must fit in a soft PTE, which has 27 bits of data on m68k */
+#define SWAP_SLOTS_MAX 0x7ffffff
+
+static kspinlock_t swap_lock = KSPINLOCK_INITIALISER;
+static vmem_t swap_arena;		/* (swap_lock) */
+static size_t swap_total, swap_used;	/* in slots (swap_lock) */
+static vnode_t *swap_vn;
+
+static struct swap_stats {
+	size_t pageouts, pageins, clusters_out, clusters_in, out_of_slots;
+} stats;
+
+/*!
+ * @brief Start paging anonymous memory out to a file or block device.
+ *
+ * Its size is fixed from now on. Only one swap area is supported.
+ */
+int
+vm_swap_add(vnode_t *vn)
+{
+	vattr_t attr;
+	size_t slots;
+	int r;
+
+	if (swap_vn != NULL)
+		return -EBUSY;
+
+	r = VOP_GETATTR(vn, &attr);
+	if (r != 0)
+		return r;
+
+	slots = MIN2(attr.size >> PGSHIFT, SWAP_SLOTS_MAX);
+	if (slots == 0)
+		return -EINVAL;
+
+	vmem_init(&swap_arena, "swap", 1, slots, 1, NULL, NULL, NULL, 0, 0);
+	swap_total = slots;
+	__atomic_store_n(&swap_vn, vn_retain(vn), __ATOMIC_RELEASE);
+
+	kdprintf("vm_swap_add: %zu KiB of swap\n", slots * (PGSIZE / 1024));
+
+	return 0;
+}
+
+/*!
+ * @brief Swap to SWAP_FILE_PATH, if there is such a file.
+ */
+void
+vm_swap_init(void)
+{
+	namecache_handle_t nch;
+	int r;
+
+	r = vfs_lookup_simple(root_nch, &nch, SWAP_FILE_PATH, 0);
+	if (r != 0) {
+		kdprintf("vm_swap_init: no %s, not swapping\n", SWAP_FILE_PATH);
+		return;
+	}
+
+	r = vm_swap_add(nch.nc->vp);
+	if (r != 0)
+		kdprintf("vm_swap_init: can't swap to %s: %d\n",
+		    SWAP_FILE_PATH, r);
+
+	nchandle_release(nch);
+}
+
+/*! @brief Whether there's any swap space to page anonymous memory out to. */
+bool
+vm_swap_enabled(void)
+{
+	return __atomic_load_n(&swap_vn, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Allocate a run of n slots. Returns 0 if there's no such run free. */
+static uintptr_t
+swap_alloc(size_t n)
+{
+	vmem_addr_t slot;
+	ipl_t ipl;
+	int r;
+
+	ipl = ke_spinlock_enter(&swap_lock);
+	r = vmem_xalloc(&swap_arena, n, 0, 0, 0, 0, 0, 0, &slot);
+	if (r == 0)
+		swap_used += n;
+	ke_spinlock_exit(&swap_lock, ipl);
+
+	return r == 0 ? slot : 0;
+}
+
+/*!
+ * @brief Free a run of n slots. May be called at up to IPL_DISP, but not with
+ * a domain queues lock held: the arena may allocate or free boundary tags, and
+ * so pages.
+ */
+void
+vm_swap_free(uintptr_t slot, size_t n)
+{
+	ipl_t ipl;
+	int r;
+
+	ipl = ke_spinlock_enter(&swap_lock);
+	r = vmem_xfree(&swap_arena, slot, n, 0);
+	kassert(r == (int)n, "freeing unallocated swap");
+	swap_used -= n;
+	ke_spinlock_exit(&swap_lock, ipl);
+}
+
+static void
+swap_io(vm_page_t **pages, uintptr_t slot, size_t n, bool write)
+{
+	sg_seg_t segs[SWAP_CLUSTER_MAX];
+	sg_list_t sgl;
+	io_off_t offset = (io_off_t)(slot - 1) << PGSHIFT;
+	iop_t *iop;
+
+	kassert(n <= SWAP_CLUSTER_MAX);
+
+	for (size_t i = 0; i < n; i++) {
+		segs[i].paddr = VM_PAGE_PADDR(pages[i]);
+		segs[i].length = PGSIZE;
+	}
+	sgl.elems = segs;
+	sgl.elems_n = n;
+
+	VOP_PAGING_ENTER(swap_vn);
+	if (write)
+		iop = iop_new_write(swap_vn, &sgl, 0, n << PGSHIFT, offset);
+	else
+		iop = iop_new_read(swap_vn, &sgl, 0, n << PGSHIFT, offset);
+	iop_send_sync(iop);
+	VOP_PAGING_EXIT(swap_vn);
+	iop_free(iop);
+}
+
+/*
+ * Lock the owner of an anonymous page, if it's still anonymous. The use and
+ * owner change together under the queues lock, so they're read under it first
+ * to find which lock to take, then checked again once it's held.
+ *
+ * Returns the use of the page as locked, or VM_PAGE_FREE if nothing was.
+ * Called at IPL_DISP.
+ */
+static vm_page_use_t
+anon_owner_lock(vm_page_t *page, vm_rs_t **out_rs)
+{
+	vm_domain_t *dom = &vm_domains[page->domain];
+	vm_page_use_t use;
+	vm_rs_t *rs = NULL;
+
+	ke_spinlock_enter_nospl(&dom->queues_lock);
+	use = page->use;
+	if (use == VM_PAGE_PRIVATE)
+		rs = page->owner_rs;
+	ke_spinlock_exit_nospl(&dom->queues_lock);
+
+	switch (use) {
+	case VM_PAGE_PRIVATE:
+		/* maps are never freed, so this is safe even if it's stale */
+		ke_spinlock_enter_nospl(&rs->map->stealing_lock);
+		if (page->use == VM_PAGE_PRIVATE && page->owner_rs == rs) {
+			*out_rs = rs;
+			return VM_PAGE_PRIVATE;
+		}
+		ke_spinlock_exit_nospl(&rs->map->stealing_lock);
+		return VM_PAGE_FREE;
+
+	case VM_PAGE_ANON_FORKED:
+		ke_spinlock_enter_nospl(&anon_creation_lock);
+		ke_spinlock_enter_nospl(&anon_stealing_lock);
+		if (page->use == VM_PAGE_ANON_FORKED)
+			return VM_PAGE_ANON_FORKED;
+		ke_spinlock_exit_nospl(&anon_stealing_lock);
+		ke_spinlock_exit_nospl(&anon_creation_lock);
+		return VM_PAGE_FREE;
+
+	default:
+		return VM_PAGE_FREE;
+	}
+}
+
+static void
+anon_owner_unlock(vm_page_use_t use, vm_rs_t *rs)
+{
+	if (use == VM_PAGE_PRIVATE) {
+		ke_spinlock_exit_nospl(&rs->map->stealing_lock);
+	} else {
+		ke_spinlock_exit_nospl(&anon_stealing_lock);
+		ke_spinlock_exit_nospl(&anon_creation_lock);
+	}
+}
+
+/*
+ * Give a page about to be written out its new slot, if it's still anonymous
+ * memory (it may have been freed, or a private page forked, since it was taken
+ * from the modified list.) Any old slot is stale now, so is freed. The page is
+ * marked clean before the I/O, so that dirtying it meanwhile is noticed.
+ */
+static bool
+page_assign_slot(vm_page_t *page, uintptr_t slot)
+{
+	vm_domain_t *dom = &vm_domains[page->domain];
+	vm_page_use_t use;
+	vm_rs_t *rs = NULL;
+
+	use = anon_owner_lock(page, &rs);
+	if (use == VM_PAGE_FREE)
+		return false;
+
+	if (page->swap_address != 0)
+		vm_swap_free(page->swap_address, 1);
+	page->swap_address = slot;
+
+	ke_spinlock_enter_nospl(&dom->queues_lock);
+	page->dirty = 0;
+	ke_spinlock_exit_nospl(&dom->queues_lock);
+
+	anon_owner_unlock(use, rs);
+
+	return true;
+}
+
+/*!
+ * @brief Write out a cluster of anonymous pages taken from the modified list.
+ *
+ * The pages are written to a run of contiguous slots, as long a one as can be
+ * had. Those written are marked clean, so go to the standby list when the
+ * caller releases them; the rest stay modified.
+ *
+ * Called at IPL_0 with the pages retained.
+ *
+ * @returns the number of pages written.
+ */
+size_t
+vm_swap_pageout(vm_page_t **pages, size_t n)
+{
+	vm_page_t *out[SWAP_CLUSTER_MAX];
+	uintptr_t slot = 0;
+	size_t nslots = n, nout = 0;
+	ipl_t ipl;
+
+	kassert(n <= SWAP_CLUSTER_MAX);
+
+	while (nslots > 0 && (slot = swap_alloc(nslots)) == 0)
+		nslots /= 2;
+
+	if (slot == 0) {
+		__atomic_fetch_add(&stats.out_of_slots, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	ipl = spldisp();
+	for (size_t i = 0; i < n && nout < nslots; i++)
+		if (page_assign_slot(pages[i], slot + nout))
+			out[nout++] = pages[i];
+	splx(ipl);
+
+	if (nout < nslots)
+		vm_swap_free(slot + nout, nslots - nout);
+	if (nout == 0)
+		return 0;
+
+	swap_io(out, slot, nout, true);
+
+	__atomic_fetch_add(&stats.pageouts, nout, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.clusters_out, 1, __ATOMIC_RELAXED);
+
+	return nout;
+}
+
+/*!
+ * @brief Read n pages in from the run of slots starting at \p slot.
+ *
+ * Called at IPL_0 with the pages' PTEs busy.
+ */
+void
+vm_swap_pagein(vm_page_t **pages, uintptr_t slot, size_t n)
+{
+	swap_io(pages, slot, n, false);
+
+	__atomic_fetch_add(&stats.pageins, n, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.clusters_in, 1, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief Reclaim an anonymous page from the standby list.
+ *
+ * If it's still unmapped and clean, the PTE owning it becomes a swap PTE and
+ * it's freed; otherwise it's released.
+ *
+ * Called at IPL_DISP with the page retained by the caller.
+ *
+ * @returns true if the page was freed.
+ */
+bool
+vm_swap_reclaim(vm_page_t *page)
+{
+	vm_page_use_t use;
+	vm_rs_t *rs = NULL;
+	bool freed = false;
+
+	use = anon_owner_lock(page, &rs);
+	if (use == VM_PAGE_FREE) {
+		vm_page_release(page);
+		return false;
+	}
+
+	if (page->dirty || page->swap_address == 0) {
+		/* dirtied again meanwhile */
+	} else if (use == VM_PAGE_PRIVATE) {
+		pte_t *ppte = page->pte;
+
+		/* unless it was faulted on meanwhile, its PTE is transition */
+		if (pmap_pte_characterise(pmap_load_pte(ppte)) ==
+		    kPTEKindTrans) {
+			kassert(pmap_pte_soft_page(ppte) == page);
+			pmap_pte_soft_create(ppte, kPTEKindSwap,
+			    page->swap_address, false);
+			pmap_ptes_became_swappable(rs,
+			    VM_PAGE_FOR_HHDM_ADDR((vaddr_t)ppte), 1);
+			freed = true;
+		}
+	} else if (page->shared.share_count == 0) {
+		kassert(page->pte == &page->owner_anon->pte);
+		pmap_pte_soft_create(page->pte, kPTEKindSwap,
+		    page->swap_address, false);
+		freed = true;
+	}
+
+	if (freed) {
+		/* the swap PTE has the slot now */
+		page->swap_address = 0;
+		vm_page_delete(page, true);
+	} else {
+		vm_page_release(page);
+	}
+
+	anon_owner_unlock(use, rs);
+
+	return freed;
+}
+
+void
+dbg_vm_swap_dump(void)
+{
+	if (!vm_swap_enabled()) {
+		kdprintf("no swap\n");
+		return;
+	}
+
+	kdprintf("swap: %zu/%zu KiB used\n", swap_used * (PGSIZE / 1024),
+	    swap_total * (PGSIZE / 1024));
+	kdprintf("%zu pages out in %zu clusters, %zu in in %zu clusters; "
+		 "%zu times out of slots\n",
+	    stats.pageouts, stats.clusters_out, stats.pageins,
+	    stats.clusters_in, stats.out_of_slots);
+}
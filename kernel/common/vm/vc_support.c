@@ -35,7 +35,7 @@ vm_vc_unmap(vaddr_t addr, size_t size)
 	ppte = pmap_fetch_pte(proc0.vm_map, &table_page, addr);
 
 	if (ppte == NULL)
-		return;
+		goto out;
 
 	for (size_t i = 0; i < size / PGSIZE; i++) {
 		pte_t pte = pmap_load_pte(&ppte[i]);
@@ -49,6 +49,9 @@ vm_vc_unmap(vaddr_t addr, size_t size)
 		n_unmapped++;
 	}
 
+	if (n_unmapped == 0)
+		goto out;
+
 	/* x-ref valid_pageable_leaf_ptes */
 	table_page->proctable.valid_pageable_leaf_ptes -= (n_unmapped);
 
@@ -60,6 +63,7 @@ vm_vc_unmap(vaddr_t addr, size_t size)
 	}
 	pmap_valid_ptes_zeroed(&proc0.vm_map->rs, table_page, n_unmapped);
 
+out:
 	ke_spinlock_exit_nospl(&proc0.vm_map->stealing_lock);
 	ke_spinlock_exit_nospl(&proc0.vm_map->creation_lock);
 }
@@ -324,6 +324,7 @@ vmem_xalloc(vmem_t *vmem, vmem_size_t size, vmem_size_t align,
 	vmem_seg_t *freeseg, *newlseg, *newrseg;
 	vmem_addr_t addr;
 	bool tried_import = false;
+	int r;
 
 	// kassert(align == 0 && "not supported yet\n");
 	kassert(phase == 0, "not supported yet\n");
@@ -335,18 +336,22 @@ vmem_xalloc(vmem_t *vmem, vmem_size_t size, vmem_size_t align,
 	/* preallocate new segments, they will be freed if necessary */
 	newlseg = seg_alloc(vmem, flags);
 	newrseg = seg_alloc(vmem, flags);
+	if (newlseg == NULL || newrseg == NULL) {
+		r = -ENOMEM;
+		goto fail;
+	}
 
 search:
 	/* TODO: strategies other than this one... */
 	if (++freelist_idx >= elementsof(vmem->freelist)) {
 		if (tried_import) {
-			return -ENOMEM;
+			r = -ENOMEM;
+			goto fail;
 		} else {
-			int r;
 			tried_import = true;
 			r = try_import(vmem, size, flags, &freeseg);
 			if (r < 0)
-				return r;
+				goto fail;
 			addr = freeseg->base;
 			goto split_seg;
 		}
@@ -381,6 +386,13 @@ split_seg:
 
 	*out = addr;
 	return 0;
+
+fail:
+	if (newlseg != NULL)
+		seg_free(vmem, newlseg);
+	if (newrseg != NULL)
+		seg_free(vmem, newrseg);
+	return r;
 }
 
 static void
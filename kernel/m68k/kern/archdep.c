@@ -32,3 +32,9 @@ kep_arch_ipi_unicast(kcpunum_t)
 {
 	/* epsilon */
 }
+
+void
+kep_arch_timer_oneshot(kabstime_t)
+{
+	/* epsilon - the RTC ticks periodically, so never tickless */
+}
@@ -179,6 +179,21 @@ pmap_pte_hwleaf_clear_writeable(pte_t *ppte)
 	pmap_store_pte(ppte, pte);
 }
 
+static inline bool
+pmap_pte_hwleaf_accessed(pte_t pte)
+{
+	return pte.hw_pml0_040.used;
+}
+
+/* the caller must flush the ATC entry for the MMU to set the bit again */
+static inline void
+pmap_pte_hwleaf_clear_accessed(pte_t *ppte)
+{
+	pte_t pte = pmap_load_pte(ppte);
+	pte.hw_pml0_040.used = 0;
+	pmap_store_pte(ppte, pte);
+}
+
 static inline void
 pmap_pte_soft_create(pte_t *ppte, int kind, uintptr_t data, bool was_hw)
 {